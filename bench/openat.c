@@ -0,0 +1,143 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Compares opening files by their full path (what the traversal did before
+ * dosfsOpenAt) against opening them relative to their parent directory fd,
+ * on a deep synthetic tree.
+ *
+ * Usage: bench-openat [DIR [DEPTH [FILES]]]
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define PATH_SIZE 4096
+#define NAME_SIZE 32
+#define ROUNDS 20
+
+
+/**
+ * Returns the monotonic time in nanoseconds.
+ */
+double nowNs(void);
+/**
+ * Create 'depth' nested directories under 'root', each one with 'files'
+ * empty files.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int createTree(const char *root, int depth, int files);
+
+
+double nowNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int createTree(const char *root, int depth, int files)
+{
+	char path[PATH_SIZE];
+	snprintf(path, PATH_SIZE, "%s", root);
+	for (int d = 0; d < depth; d++) {
+		size_t len = strlen(path);
+		snprintf(path + len, PATH_SIZE - len, "/level%02d", d);
+		if (mkdir(path, 0755) != 0) {
+			perror(path);
+			return 1;
+		}
+		for (int f = 0; f < files; f++) {
+			char file[PATH_SIZE + NAME_SIZE];
+			snprintf(file, sizeof(file), "%s/file%04d.txt", path, f);
+			int fd = open(file, O_CREAT | O_WRONLY, 0644);
+			if (fd == -1) {
+				perror(file);
+				return 1;
+			}
+			close(fd);
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char root[PATH_SIZE];
+	int depth = argc > 2 ? atoi(argv[2]) : 48;
+	int files = argc > 3 ? atoi(argv[3]) : 32;
+	if (argc > 1) {
+		snprintf(root, PATH_SIZE, "%s/fatattr-bench-XXXXXX", argv[1]);
+	} else {
+		snprintf(root, PATH_SIZE, "/tmp/fatattr-bench-XXXXXX");
+	}
+	if (mkdtemp(root) == NULL) {
+		perror(root);
+		return 1;
+	}
+	if (createTree(root, depth, files)) {
+		return 1;
+	}
+	printf("depth,path_ns_per_open,openat_ns_per_open\n");
+	char path[PATH_SIZE];
+	snprintf(path, PATH_SIZE, "%s", root);
+	int parentFd = open(root, O_RDONLY | O_DIRECTORY);
+	for (int d = 0; d < depth; d++) {
+		char level[NAME_SIZE];
+		snprintf(level, NAME_SIZE, "level%02d", d);
+		size_t len = strlen(path);
+		snprintf(path + len, PATH_SIZE - len, "/%s", level);
+		int dirFd = openat(parentFd, level, O_RDONLY | O_DIRECTORY);
+		close(parentFd);
+		parentFd = dirFd;
+		double pathNs = 0;
+		double atNs = 0;
+		for (int r = 0; r < ROUNDS; r++) {
+			double start = nowNs();
+			for (int f = 0; f < files; f++) {
+				char file[PATH_SIZE + NAME_SIZE];
+				snprintf(file, sizeof(file), "%s/file%04d.txt", path, f);
+				close(open(file, O_RDONLY));
+			}
+			pathNs += nowNs() - start;
+			start = nowNs();
+			for (int f = 0; f < files; f++) {
+				char name[NAME_SIZE];
+				snprintf(name, NAME_SIZE, "file%04d.txt", f);
+				close(openat(dirFd, name, O_RDONLY));
+			}
+			atNs += nowNs() - start;
+		}
+		if (d % 8 == 0 || d == depth - 1) {
+			printf("%d,%.0f,%.0f\n", d + 1,
+			       pathNs / (ROUNDS * files), atNs / (ROUNDS * files));
+		}
+	}
+	close(parentFd);
+	char command[PATH_SIZE + NAME_SIZE];
+	snprintf(command, sizeof(command), "rm -rf '%s'", root);
+	return system(command);
+}
@@ -0,0 +1,147 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Compares the entries per second of enumerating a directory with one
+ * VFAT_IOCTL_READDIR_BOTH call per entry (the old dosfsReadDir loop) against
+ * bulk getdents64 calls (the dosfsDir iterator).
+ * DIR must be in a mounted vfat file system for the ioctl loop, on other
+ * file systems only the getdents64 numbers are reported.
+ *
+ * Usage: bench-readdir DIR [ROUNDS]
+ */
+
+#define _GNU_SOURCE
+
+#include <linux/msdos_fs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#define DIR_BUFFER_SIZE 32768
+
+
+/**
+ * Returns the monotonic time in nanoseconds.
+ */
+double nowNs(void);
+/**
+ * Enumerate 'dir' with VFAT_IOCTL_READDIR_BOTH, counting the entries and
+ * the system calls.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int readDirBoth(const char *dir, long *entries, long *calls);
+/**
+ * Enumerate 'dir' with getdents64, counting the entries and the system
+ * calls.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int readDirBulk(const char *dir, long *entries, long *calls);
+
+
+double nowNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int readDirBoth(const char *dir, long *entries, long *calls)
+{
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		return 1;
+	}
+	struct __fat_dirent dirEnt[2];
+	int ret = 0;
+	while ((ret = ioctl(fd, VFAT_IOCTL_READDIR_BOTH, dirEnt)) > 0) {
+		/* The same work the old loop did for every entry. */
+		char name[256];
+		int real = strlen(dirEnt[1].d_name) == 0 ? 0 : 1;
+		strncpy(name, dirEnt[real].d_name, sizeof(name) - 1);
+		(*entries)++;
+		(*calls)++;
+	}
+	(*calls)++;
+	close(fd);
+	return ret < 0;
+}
+
+int readDirBulk(const char *dir, long *entries, long *calls)
+{
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		return 1;
+	}
+	static char buffer[DIR_BUFFER_SIZE];
+	long size = 0;
+	while ((size = syscall(SYS_getdents64, fd, buffer, DIR_BUFFER_SIZE)) > 0) {
+		(*calls)++;
+		for (long pos = 0; pos < size;) {
+			unsigned short reclen = 0;
+			/* d_reclen follows d_ino and d_off. */
+			memcpy(&reclen, buffer + pos + 16, sizeof(reclen));
+			(*entries)++;
+			pos += reclen;
+		}
+	}
+	(*calls)++;
+	close(fd);
+	return size < 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s DIR [ROUNDS]\n", argv[0]);
+		return 1;
+	}
+	int rounds = argc > 2 ? atoi(argv[2]) : 10;
+	printf("method,entries,syscalls,entries_per_sec\n");
+	long entries = 0;
+	long calls = 0;
+	double start = nowNs();
+	int ret = 0;
+	for (int r = 0; r < rounds && ret == 0; r++) {
+		ret = readDirBoth(argv[1], &entries, &calls);
+	}
+	if (ret == 0) {
+		printf("readdir_both,%ld,%ld,%.0f\n", entries / rounds, calls / rounds,
+		       entries / ((nowNs() - start) / 1e9));
+	} else {
+		perror("VFAT_IOCTL_READDIR_BOTH");
+	}
+	entries = 0;
+	calls = 0;
+	start = nowNs();
+	for (int r = 0; r < rounds; r++) {
+		if (readDirBulk(argv[1], &entries, &calls)) {
+			perror("getdents64");
+			return 1;
+		}
+	}
+	printf("getdents64,%ld,%ld,%.0f\n", entries / rounds, calls / rounds,
+	       entries / ((nowNs() - start) / 1e9));
+	return 0;
+}
@@ -0,0 +1,474 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Runs the fatattr binary on synthetic trees (--mock specifications) or FAT
+ * images (--image, no root needed) through the print, modify and recursive
+ * scenarios, and writes one JSON object per tree and scenario with the
+ * files per second, system calls per file and peak RSS, so the results of
+ * two versions can be compared.
+ *
+ * Every scenario is timed 'rounds' times (the best round is reported) and
+ * run once more under ptrace to count the system calls of all its threads.
+ * The files of the list scenarios are the entries found by a recursive run,
+ * the images are copied first so the modify scenarios don't change them.
+ *
+ * Usage: bench-suite [--fatattr BIN] [--mock SPEC]... [--image IMAGE]...
+ *                    [--rounds N] [--jobs N] [--engine ENGINE]
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define TREES_MAX 32
+#define ARGS_MAX 16
+#define VERSION_SIZE 64
+#define ROUNDS 5
+
+/* A scenario: the fatattr options added after the tree options. */
+struct scenario {
+	const char *name;
+	/* Processes the file list instead of the root recursively. */
+	int useList;
+	/* Changes the attributes, so it's not counted by its own output. */
+	int modify;
+	/* Extra fatattr option, or NULL. */
+	const char *option;
+};
+
+/* A tree: the fatattr options that select it. */
+struct tree {
+	const char *option;
+	const char *value;
+};
+
+/* Measures of one run. */
+struct runResult {
+	double seconds;
+	long syscalls;
+	long maxRssKb;
+};
+
+static const struct scenario scenarios[] = {
+	{"print", 1, 0, NULL},
+	{"modify", 1, 1, NULL},
+	{"recursive-print", 0, 0, NULL},
+	{"recursive-modify", 0, 1, NULL},
+	{"recursive-modify-plan", 0, 1, "--plan"}
+};
+/* Trees used when none is given: a balanced one, a deep one with short
+   names, a flat one with long names and a balanced one where changing
+   directory between two changes costs a seek. */
+static const struct tree defaultTrees[] = {
+	{"--mock", "width=4,depth=3,files=16,namelen=32,longnames=50"},
+	{"--mock", "width=2,depth=8,files=4,namelen=12,longnames=0"},
+	{"--mock", "width=16,depth=1,files=512,namelen=64,longnames=100"},
+	{"--mock", "width=4,depth=3,files=16,namelen=32,longnames=50,"
+	 "seeklatency=200"}
+};
+
+
+/**
+ * Returns the monotonic time in nanoseconds.
+ */
+double nowNs(void);
+/**
+ * Run 'argv' with its standard output in 'outFile' and, if 'listFile' is
+ * not NULL, its standard input from 'listFile'. If 'trace' is !0 the
+ * system calls are counted instead of timed.
+ * Returns 0 on success, !0 if the command can't be run or fails.
+ */
+int runCommand(char *const *argv, const char *listFile, const char *outFile,
+               int trace, struct runResult *result);
+/**
+ * Count the system calls of the traced process 'pid' and its threads until
+ * it exits.
+ * Returns its wait status.
+ */
+int traceSyscalls(pid_t pid, long *syscalls);
+/**
+ * Convert the text output 'outFile' of a recursive print into the file
+ * list 'listFile', without the "." and ".." entries.
+ * Returns the number of files, -1 if an error happens.
+ */
+long writeFileList(const char *outFile, const char *listFile);
+/**
+ * Copy the file 'src' to 'dst'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int copyFile(const char *src, const char *dst);
+/**
+ * Returns the number of lines of 'file', -1 if it can't be read.
+ */
+long countLines(const char *file);
+/**
+ * Write 'value' as a JSON string.
+ */
+void printJsonString(const char *value);
+/**
+ * Read the version of the fatattr binary 'bin' into 'version'.
+ */
+void readVersion(const char *bin, const char *outFile, char *version);
+
+
+double nowNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int runCommand(char *const *argv, const char *listFile, const char *outFile,
+               int trace, struct runResult *result)
+{
+	double start = nowNs();
+	pid_t pid = fork();
+	if (pid == -1) {
+		return 1;
+	}
+	if (pid == 0) {
+		int out = open(outFile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		int in = open(listFile != NULL ? listFile : "/dev/null", O_RDONLY);
+		if (out == -1 || in == -1 || dup2(out, STDOUT_FILENO) == -1 ||
+		        dup2(in, STDIN_FILENO) == -1) {
+			_exit(127);
+		}
+		if (trace) {
+			ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+			raise(SIGSTOP);
+		}
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	int status = 0;
+	struct rusage usage;
+	memset(&usage, 0, sizeof(usage));
+	if (trace) {
+		status = traceSyscalls(pid, &result->syscalls);
+	} else if (wait4(pid, &status, 0, &usage) == -1) {
+		return 1;
+	}
+	if (!trace) {
+		result->seconds = (nowNs() - start) / 1e9;
+		result->maxRssKb = usage.ru_maxrss;
+	}
+	/* The exit status of fatattr is the last error, print errors are not
+	   fatal for a benchmark but a missing binary is. */
+	return !WIFEXITED(status) || WEXITSTATUS(status) == 127;
+}
+
+int traceSyscalls(pid_t pid, long *syscalls)
+{
+	int status = 0;
+	*syscalls = 0;
+	/* The child stops itself before the exec. */
+	if (waitpid(pid, &status, 0) == -1) {
+		return status;
+	}
+	ptrace(PTRACE_SETOPTIONS, pid, NULL,
+	       PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+	ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+	long stops = 0;
+	while (1) {
+		pid_t tid = waitpid(-1, &status, __WALL);
+		if (tid == -1) {
+			break;
+		}
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			if (tid == pid) {
+				break;
+			}
+			continue;
+		}
+		int signum = 0;
+		if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+			/* Every system call stops at its entry and at its exit. */
+			stops++;
+		} else if (WSTOPSIG(status) != SIGTRAP &&
+		           WSTOPSIG(status) != SIGSTOP) {
+			signum = WSTOPSIG(status);
+		}
+		ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)signum);
+	}
+	*syscalls = (stops + 1) / 2;
+	return status;
+}
+
+long writeFileList(const char *outFile, const char *listFile)
+{
+	FILE *out = fopen(outFile, "r");
+	FILE *list = fopen(listFile, "w");
+	if (out == NULL || list == NULL) {
+		if (out != NULL) {
+			fclose(out);
+		}
+		if (list != NULL) {
+			fclose(list);
+		}
+		return -1;
+	}
+	char *line = NULL;
+	size_t lineSize = 0;
+	ssize_t lineLen = 0;
+	long files = 0;
+	while ((lineLen = getline(&line, &lineSize, out)) != -1) {
+		/* "RHSADV  path" */
+		if (lineLen < 9) {
+			continue;
+		}
+		line[--lineLen] = '\0';
+		const char *name = strrchr(line, '/');
+		if (name != NULL && (strcmp(name, "/.") == 0 ||
+		                     strcmp(name, "/..") == 0)) {
+			continue;
+		}
+		fprintf(list, "%s\n", line + 8);
+		files++;
+	}
+	free(line);
+	fclose(out);
+	return fclose(list) == 0 ? files : -1;
+}
+
+int copyFile(const char *src, const char *dst)
+{
+	int in = open(src, O_RDONLY);
+	int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	char buffer[65536];
+	ssize_t size = in == -1 || out == -1 ? -1 : 0;
+	while (size != -1 &&
+	        (size = read(in, buffer, sizeof(buffer))) > 0) {
+		if (write(out, buffer, size) != size) {
+			size = -1;
+		}
+	}
+	if (in != -1) {
+		close(in);
+	}
+	if (out != -1 && close(out) == -1) {
+		size = -1;
+	}
+	return size == -1;
+}
+
+long countLines(const char *file)
+{
+	FILE *in = fopen(file, "r");
+	if (in == NULL) {
+		return -1;
+	}
+	long lines = 0;
+	int c = 0;
+	while ((c = getc(in)) != EOF) {
+		lines += c == '\n';
+	}
+	fclose(in);
+	return lines;
+}
+
+void printJsonString(const char *value)
+{
+	putchar('"');
+	for (; *value != '\0'; value++) {
+		if (*value == '"' || *value == '\\') {
+			putchar('\\');
+		}
+		putchar(*value);
+	}
+	putchar('"');
+}
+
+void readVersion(const char *bin, const char *outFile, char *version)
+{
+	char *argv[] = {(char *)bin, "--version", NULL};
+	struct runResult result;
+	strcpy(version, "unknown");
+	if (runCommand(argv, NULL, outFile, 0, &result)) {
+		return;
+	}
+	FILE *out = fopen(outFile, "r");
+	if (out == NULL) {
+		return;
+	}
+	char line[256];
+	/* "FAT attributes utility, version X.Y.Z" */
+	if (fgets(line, sizeof(line), out) != NULL) {
+		const char *last = strrchr(line, ' ');
+		if (last != NULL && strlen(last + 1) < VERSION_SIZE) {
+			strcpy(version, last + 1);
+			version[strcspn(version, "\n")] = '\0';
+		}
+	}
+	fclose(out);
+}
+
+int main(int argc, char **argv)
+{
+	const char *bin = "bin/fatattr";
+	const char *jobs = "1";
+	const char *engine = "sync";
+	int rounds = ROUNDS;
+	struct tree trees[TREES_MAX];
+	size_t treesSize = 0;
+	for (int i = 1; i < argc; i++) {
+		if (i + 1 >= argc) {
+			fprintf(stderr, "Missing value for option '%s'\n", argv[i]);
+			return 1;
+		}
+		if (strcmp(argv[i], "--fatattr") == 0) {
+			bin = argv[++i];
+		} else if ((strcmp(argv[i], "--mock") == 0 ||
+		            strcmp(argv[i], "--image") == 0) &&
+		           treesSize < TREES_MAX) {
+			trees[treesSize].option = argv[i];
+			trees[treesSize++].value = argv[++i];
+		} else if (strcmp(argv[i], "--rounds") == 0) {
+			rounds = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--jobs") == 0) {
+			jobs = argv[++i];
+		} else if (strcmp(argv[i], "--engine") == 0) {
+			engine = argv[++i];
+		} else {
+			fprintf(stderr, "Usage: %s [--fatattr BIN] [--mock SPEC]... "
+			        "[--image IMAGE]... [--rounds N] [--jobs N] "
+			        "[--engine ENGINE]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (treesSize == 0) {
+		treesSize = sizeof(defaultTrees) / sizeof(defaultTrees[0]);
+		memcpy(trees, defaultTrees, sizeof(defaultTrees));
+	}
+	if (rounds < 1) {
+		rounds = 1;
+	}
+	char outFile[] = "/tmp/bench-suite-out-XXXXXX";
+	char listFile[] = "/tmp/bench-suite-list-XXXXXX";
+	char imageFile[] = "/tmp/bench-suite-image-XXXXXX";
+	int outFd = mkstemp(outFile);
+	int listFd = mkstemp(listFile);
+	int imageFd = mkstemp(imageFile);
+	if (outFd == -1 || listFd == -1 || imageFd == -1) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(outFd);
+	close(listFd);
+	close(imageFd);
+	char version[VERSION_SIZE];
+	readVersion(bin, outFile, version);
+	int ret = 0;
+	for (size_t t = 0; t < treesSize && ret == 0; t++) {
+		const char *treeValue = trees[t].value;
+		if (strcmp(trees[t].option, "--image") == 0) {
+			if (copyFile(trees[t].value, imageFile)) {
+				fprintf(stderr, "Error copying '%s'\n", trees[t].value);
+				ret = 1;
+				break;
+			}
+			treeValue = imageFile;
+		}
+		char *baseArgv[ARGS_MAX] = {
+			(char *)bin, (char *)trees[t].option, (char *)treeValue,
+			"--jobs", (char *)jobs, "--engine", (char *)engine,
+			"--recursive", "/", NULL
+		};
+		struct runResult result;
+		/* The recursive print gives the entries of the tree. */
+		if (runCommand(baseArgv, NULL, outFile, 0, &result)) {
+			fprintf(stderr, "Error running '%s'\n", bin);
+			ret = 1;
+			break;
+		}
+		long treeFiles = countLines(outFile);
+		long listFiles = writeFileList(outFile, listFile);
+		for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++) {
+			const struct scenario *scenario = &scenarios[s];
+			char *scenarioArgv[ARGS_MAX];
+			size_t argvSize = 7;
+			memcpy(scenarioArgv, baseArgv, sizeof(char *) * argvSize);
+			if (scenario->modify) {
+				scenarioArgv[argvSize++] = "^A";
+			}
+			if (scenario->option != NULL) {
+				scenarioArgv[argvSize++] = (char *)scenario->option;
+			}
+			if (scenario->useList) {
+				scenarioArgv[argvSize++] = "--files-from";
+				scenarioArgv[argvSize++] = "-";
+			} else {
+				scenarioArgv[argvSize++] = "--recursive";
+				scenarioArgv[argvSize++] = "/";
+			}
+			scenarioArgv[argvSize] = NULL;
+			const char *input = scenario->useList ? listFile : NULL;
+			long files = scenario->useList ? listFiles : treeFiles;
+			double best = 0;
+			long maxRssKb = 0;
+			for (int r = 0; r < rounds && ret == 0; r++) {
+				ret = runCommand(scenarioArgv, input, outFile, 0, &result);
+				if (r == 0 || result.seconds < best) {
+					best = result.seconds;
+				}
+				if (result.maxRssKb > maxRssKb) {
+					maxRssKb = result.maxRssKb;
+				}
+			}
+			if (ret == 0) {
+				ret = runCommand(scenarioArgv, input, outFile, 1, &result);
+			}
+			if (ret) {
+				fprintf(stderr, "Error running the scenario '%s'\n",
+				        scenario->name);
+				break;
+			}
+			printf("{\"fatattr\":");
+			printJsonString(version);
+			printf(",\"tree\":");
+			printJsonString(trees[t].option + 2);
+			printf(",\"spec\":");
+			printJsonString(trees[t].value);
+			printf(",\"scenario\":\"%s\",\"jobs\":%d,\"engine\":",
+			       scenario->name, atoi(jobs));
+			printJsonString(engine);
+			printf(",\"rounds\":%d,\"files\":%ld,\"seconds\":%.6f,"
+			       "\"files_per_sec\":%.0f,\"syscalls_per_file\":%.3f,"
+			       "\"peak_rss_kb\":%ld}\n",
+			       rounds, files, best, best > 0 ? files / best : 0.0,
+			       files > 0 ? (double)result.syscalls / files : 0.0,
+			       maxRssKb);
+			fflush(stdout);
+		}
+	}
+	unlink(outFile);
+	unlink(listFile);
+	unlink(imageFile);
+	return ret;
+}
@@ -0,0 +1,449 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "cache.h"
+#include "bool.h"
+#include "path.h"
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ERRMSG_MAX 1025
+#define CACHE_MAGIC "FATATTRC"
+#define CACHE_VERSION 2
+/* Entries of a new cache, a power of 2. */
+#define CACHE_INITIAL_CAPACITY 4096
+/* Runs an entry is kept without being used once the table is full. */
+#define CACHE_KEEP_RUNS 8
+/* Identifier of the current boot, it ends with a newline. */
+#define CACHE_BOOT_ID "/proc/sys/kernel/random/boot_id"
+#define CACHE_BOOT_ID_MAX 40
+
+enum {
+    ENOERR = 0,
+    EOPEN,
+    ELOCKED,
+    EMAP,
+    EGROW,
+    ESYNC
+};
+
+/* Start of the file. */
+struct cacheHeader {
+	char magic[8];
+	uint32_t version;
+	/* FALSE while the cache is open, a cache found that way is reset. */
+	uint32_t clean;
+	/* Slots of the table, a power of 2, and slots used. */
+	uint64_t capacity;
+	uint64_t size;
+	/* Runs that opened the cache, the entries keep the last that used them. */
+	uint64_t run;
+	/* Boot that wrote the entries, the inode and mount numbers of another
+	   boot don't identify the same files. */
+	char bootId[CACHE_BOOT_ID_MAX];
+};
+
+/* Slot of the table, keyed by the hash of the path, empty if 'path' is 0.
+   The file of the path must still have the same identity and ctime. */
+struct cacheEntry {
+	uint64_t path;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t mount;
+	int64_t ctimeSec;
+	uint32_t ctimeNsec;
+	uint32_t attrs;
+	uint64_t run;
+};
+
+struct cache {
+	int fd;
+	/* Mapping of the whole file: the header and then the table. */
+	struct cacheHeader *header;
+	struct cacheEntry *entries;
+	size_t mapSize;
+	/* Set when the cache couldn't grow, it doesn't save entries anymore. */
+	int failed;
+	uint64_t hits;
+	uint64_t misses;
+	/* Protects the table and the counters. */
+	pthread_mutex_t lock;
+};
+
+/* Boot of this run, read once by cacheOpen. */
+static char bootId[CACHE_BOOT_ID_MAX] = {0};
+
+static _Thread_local char errmsg[ERRMSG_MAX] = {0};
+
+/**
+ * Returns the size of a cache file with 'capacity' slots.
+ */
+size_t cacheFileSize(uint64_t capacity);
+/**
+ * Map the file of 'cache', of 'size' bytes.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int cacheMap(struct cache *cache, size_t size);
+/**
+ * Empty the file of 'cache' and map it with an empty table.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int cacheReset(struct cache *cache);
+/**
+ * Save the identifier of the current boot in 'bootId', empty if unknown.
+ */
+void cacheReadBootId(void);
+/**
+ * Returns the key of the file 'path', never 0.
+ */
+uint64_t cacheKey(const char *path);
+/**
+ * Returns the slot of the key 'key' in 'entries': the one with the key, or
+ * the empty slot where it goes.
+ */
+struct cacheEntry *cacheFind(struct cacheEntry *entries, uint64_t capacity,
+                             uint64_t key);
+/**
+ * Make room in the table of 'cache': drop the entries not used in the last
+ * CACHE_KEEP_RUNS runs, and double its capacity if it's still over half
+ * full.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int cacheGrow(struct cache *cache);
+
+
+size_t cacheFileSize(uint64_t capacity)
+{
+	return sizeof(struct cacheHeader) + capacity * sizeof(struct cacheEntry);
+}
+
+int cacheMap(struct cache *cache, size_t size)
+{
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	                 cache->fd, 0);
+	if (map == MAP_FAILED) {
+		return EMAP;
+	}
+	cache->header = map;
+	cache->entries = (struct cacheEntry *)(cache->header + 1);
+	cache->mapSize = size;
+	return ENOERR;
+}
+
+int cacheReset(struct cache *cache)
+{
+	size_t size = cacheFileSize(CACHE_INITIAL_CAPACITY);
+	if (ftruncate(cache->fd, 0) == -1 ||
+	        ftruncate(cache->fd, (off_t)size) == -1) {
+		return EGROW;
+	}
+	int cacheErrno = cacheMap(cache, size);
+	if (cacheErrno) {
+		return cacheErrno;
+	}
+	memcpy(cache->header->magic, CACHE_MAGIC, sizeof(cache->header->magic));
+	cache->header->version = CACHE_VERSION;
+	cache->header->capacity = CACHE_INITIAL_CAPACITY;
+	cache->header->size = 0;
+	cache->header->run = 0;
+	memcpy(cache->header->bootId, bootId, sizeof(bootId));
+	return ENOERR;
+}
+
+void cacheReadBootId(void)
+{
+	memset(bootId, 0, sizeof(bootId));
+	FILE *file = fopen(CACHE_BOOT_ID, "re");
+	if (file == NULL) {
+		return;
+	}
+	if (fgets(bootId, sizeof(bootId), file) == NULL) {
+		memset(bootId, 0, sizeof(bootId));
+	}
+	fclose(file);
+}
+
+uint64_t cacheKey(const char *path)
+{
+	uint64_t key = pathHash(path, strlen(path));
+	return key != 0 ? key : 1;
+}
+
+struct cacheEntry *cacheFind(struct cacheEntry *entries, uint64_t capacity,
+                             uint64_t key)
+{
+	/* splitmix64 finalizer, FNV-1a leaves the low bits of similar paths
+	   close. */
+	uint64_t hash = key;
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+	hash ^= hash >> 31;
+	uint64_t mask = capacity - 1;
+	for (uint64_t slot = hash & mask; ; slot = (slot + 1) & mask) {
+		struct cacheEntry *entry = &entries[slot];
+		if (entry->path == 0 || entry->path == key) {
+			return entry;
+		}
+	}
+}
+
+int cacheGrow(struct cache *cache)
+{
+	uint64_t capacity = cache->header->capacity;
+	uint64_t run = cache->header->run;
+	struct cacheEntry *old = malloc(capacity * sizeof(struct cacheEntry));
+	if (old == NULL) {
+		return EGROW;
+	}
+	memcpy(old, cache->entries, capacity * sizeof(struct cacheEntry));
+	uint64_t size = 0;
+	for (uint64_t i = 0; i < capacity; i++) {
+		if (old[i].path != 0 && run - old[i].run >= CACHE_KEEP_RUNS) {
+			old[i].path = 0;
+		}
+		size += old[i].path != 0;
+	}
+	uint64_t newCapacity = size * 2 > capacity ? capacity * 2 : capacity;
+	if (newCapacity != capacity) {
+		size_t newSize = cacheFileSize(newCapacity);
+		void *map = MAP_FAILED;
+		if (ftruncate(cache->fd, (off_t)newSize) == 0) {
+			map = mremap(cache->header, cache->mapSize, newSize,
+			             MREMAP_MAYMOVE);
+		}
+		if (map == MAP_FAILED) {
+			free(old);
+			return EGROW;
+		}
+		cache->header = map;
+		cache->entries = (struct cacheEntry *)(cache->header + 1);
+		cache->mapSize = newSize;
+	}
+	memset(cache->entries, 0, newCapacity * sizeof(struct cacheEntry));
+	for (uint64_t i = 0; i < capacity; i++) {
+		if (old[i].path != 0) {
+			*cacheFind(cache->entries, newCapacity, old[i].path) = old[i];
+		}
+	}
+	cache->header->capacity = newCapacity;
+	cache->header->size = size;
+	free(old);
+	return ENOERR;
+}
+
+
+const char *cacheGetError(int err)
+{
+	switch (err) {
+	case ENOERR:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "No error occurred");
+		break;
+	case EOPEN:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error opening file: %s",
+		         strerror(errno));
+		break;
+	case ELOCKED:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "The file is in use by another process");
+		break;
+	case EMAP:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error mapping file: %s",
+		         strerror(errno));
+		break;
+	case EGROW:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error growing file: %s",
+		         strerror(errno));
+		break;
+	case ESYNC:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error writing file: %s",
+		         strerror(errno));
+		break;
+	default:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Unknown error");
+	}
+	return errmsg;
+}
+
+int cacheOpen(const char *path, struct cache **cache)
+{
+	assert(path != NULL);
+	assert(cache != NULL);
+	struct cache *newCache = calloc(1, sizeof(struct cache));
+	if (newCache == NULL) {
+		return EOPEN;
+	}
+	cacheReadBootId();
+	newCache->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (newCache->fd == -1) {
+		free(newCache);
+		return EOPEN;
+	}
+	if (flock(newCache->fd, LOCK_EX | LOCK_NB) == -1) {
+		int cacheErrno = errno == EWOULDBLOCK ? ELOCKED : EOPEN;
+		close(newCache->fd);
+		free(newCache);
+		return cacheErrno;
+	}
+	struct stat st;
+	int cacheErrno = fstat(newCache->fd, &st) == -1 ? EOPEN : ENOERR;
+	const struct cacheHeader *header = NULL;
+	if (!cacheErrno && (size_t)st.st_size >= sizeof(struct cacheHeader)) {
+		cacheErrno = cacheMap(newCache, (size_t)st.st_size);
+		header = newCache->header;
+	}
+	/* Anything but a cache closed properly is started again. */
+	int valid = header != NULL &&
+	            memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+	            header->version == CACHE_VERSION && header->clean &&
+	            memcmp(header->bootId, bootId, sizeof(bootId)) == 0 &&
+	            header->capacity > 0 &&
+	            (header->capacity & (header->capacity - 1)) == 0 &&
+	            header->size < header->capacity &&
+	            cacheFileSize(header->capacity) == (size_t)st.st_size;
+	if (!cacheErrno && !valid) {
+		if (header != NULL) {
+			munmap(newCache->header, newCache->mapSize);
+		}
+		cacheErrno = cacheReset(newCache);
+	}
+	/* The mark must reach the disk before any entry changes. */
+	if (!cacheErrno) {
+		newCache->header->clean = FALSE;
+		newCache->header->run++;
+		if (msync(newCache->header, sizeof(struct cacheHeader), MS_SYNC) == -1) {
+			cacheErrno = ESYNC;
+		}
+	}
+	if (cacheErrno) {
+		if (newCache->header != NULL) {
+			munmap(newCache->header, newCache->mapSize);
+		}
+		close(newCache->fd);
+		free(newCache);
+		return cacheErrno;
+	}
+	pthread_mutex_init(&newCache->lock, NULL);
+	*cache = newCache;
+	return ENOERR;
+}
+
+int cacheClose(struct cache *cache)
+{
+	if (cache == NULL) {
+		return ENOERR;
+	}
+	/* The entries must reach the disk before the mark. */
+	int cacheErrno = msync(cache->header, cache->mapSize, MS_SYNC) == -1 ?
+	                 ESYNC : ENOERR;
+	if (!cacheErrno) {
+		cache->header->clean = TRUE;
+	}
+	munmap(cache->header, cache->mapSize);
+	close(cache->fd);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+	return cacheErrno;
+}
+
+int cacheLookup(struct cache *cache, const char *path,
+                const struct dosfsStat *st, uint32_t *attrs)
+{
+	assert(cache != NULL);
+	assert(path != NULL);
+	assert(st != NULL);
+	assert(attrs != NULL);
+	pthread_mutex_lock(&cache->lock);
+	struct cacheEntry *entry = cacheFind(cache->entries,
+	                                     cache->header->capacity,
+	                                     cacheKey(path));
+	int hit = entry->path != 0 && entry->dev == st->dev &&
+	          entry->ino == st->ino && entry->mount == st->mount &&
+	          entry->ctimeSec == st->ctimeSec &&
+	          entry->ctimeNsec == st->ctimeNsec;
+	if (hit) {
+		*attrs = entry->attrs;
+		entry->run = cache->header->run;
+		cache->hits++;
+	} else {
+		cache->misses++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return hit;
+}
+
+int cacheStore(struct cache *cache, const char *path,
+               const struct dosfsStat *st, uint32_t attrs)
+{
+	assert(cache != NULL);
+	assert(path != NULL);
+	assert(st != NULL);
+	int cacheErrno = ENOERR;
+	uint64_t key = cacheKey(path);
+	pthread_mutex_lock(&cache->lock);
+	struct cacheEntry *entry = cacheFind(cache->entries,
+	                                     cache->header->capacity, key);
+	/* The table is kept at most 3/4 full. */
+	if (entry->path == 0 && !cache->failed &&
+	        (cache->header->size + 1) * 4 > cache->header->capacity * 3) {
+		cacheErrno = cacheGrow(cache);
+		cache->failed = cacheErrno != ENOERR;
+		entry = cacheFind(cache->entries, cache->header->capacity, key);
+	}
+	/* A file seen through another mount or with another inode replaces
+	   the entry of its path. */
+	if (entry->path != 0 || !cache->failed) {
+		cache->header->size += entry->path == 0;
+		entry->path = key;
+		entry->dev = st->dev;
+		entry->ino = st->ino;
+		entry->mount = st->mount;
+		entry->ctimeSec = st->ctimeSec;
+		entry->ctimeNsec = st->ctimeNsec;
+		entry->attrs = attrs;
+		entry->run = cache->header->run;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return cacheErrno;
+}
+
+void cacheGetCounts(struct cache *cache, uint64_t *hits, uint64_t *misses)
+{
+	assert(cache != NULL);
+	pthread_mutex_lock(&cache->lock);
+	*hits = cache->hits;
+	*misses = cache->misses;
+	pthread_mutex_unlock(&cache->lock);
+}
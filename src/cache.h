@@ -0,0 +1,79 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "dosfs.h"
+#include <stdint.h>
+
+/**
+ * Persistent cache of the attributes of the files, so a repeated scan of a
+ * tree that didn't change answers from it instead of opening every file.
+ *
+ * The entries are keyed by the path of the file, and keep the device,
+ * inode number, mount and change time (ctime) the file had when its
+ * attributes were read: an entry is only used while the file at that path
+ * still has all of them, checked with a stat of the file. File systems like
+ * vfat number the inodes as they are loaded, so the inode alone doesn't
+ * identify a file once it's evicted or mounted again. The cache is a file
+ * with an open addressing hash table, mapped in memory; when it fills up
+ * the entries not used in the last runs are dropped, and it grows if that
+ * isn't enough. It's locked while open, and reset if it wasn't closed
+ * properly or was written in another boot, so a crash or a reboot never
+ * leaves wrong entries behind.
+ */
+struct cache;
+
+/**
+ * Returns a descriptive message associated with an error code.
+ */
+const char *cacheGetError(int err);
+/**
+ * Open the cache file 'path', creating it if it doesn't exist.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int cacheOpen(const char *path, struct cache **cache);
+/**
+ * Write the cache back to its file and close it.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int cacheClose(struct cache *cache);
+/**
+ * Look up the attributes of the file 'path', whose status is 'st', and save
+ * them in 'attrs'.
+ * Returns !0 if they were found for the same file with the same change time
+ * (a hit), 0 otherwise (a miss).
+ */
+int cacheLookup(struct cache *cache, const char *path,
+                const struct dosfsStat *st, uint32_t *attrs);
+/**
+ * Save the attributes 'attrs' of the file 'path', read after its status
+ * 'st'.
+ * Returns 0 on success, !0 the first time the cache can't grow, after which
+ * it stops saving entries.
+ */
+int cacheStore(struct cache *cache, const char *path,
+               const struct dosfsStat *st, uint32_t attrs);
+/**
+ * Save in 'hits' and 'misses' the results of cacheLookup so far.
+ */
+void cacheGetCounts(struct cache *cache, uint64_t *hits, uint64_t *misses);
+
+#endif /* __CACHE_H__ */
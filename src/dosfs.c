@@ -17,8 +17,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include "dosfs.h"
 #include "bool.h"
+#include "uring.h"
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
@@ -26,10 +29,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
 #define ERRMSG_MAX 1025
 #define DIRENT_SIZE 2
+/* Enough for hundreds of entries per getdents64 call. */
+#define DIR_BUFFER_SIZE 32768
+/* Enough for any FAT name: 255 UCS-2 characters encoded as UTF-8. */
+#define NAME_SIZE 1024
 
 enum {
     ENOERR = 0,
@@ -37,98 +49,740 @@ enum {
     EIOCTL_GET_ATTRIBUTES,
     EIOCTL_SET_ATTRIBUTES,
     EIOCTL_READDIR_BOTH,
-    EBUFFER
+    EBUFFER,
+    EGETDENTS,
+    EALLOC,
+    EURING,
+    EENGINE,
+    ESEEKDIR,
+    ESTAT,
+    ESYNC
 };
 
-typedef enum {
-    MADD,
-    MREMOVE
-} tDosfsModifyType;
+/* Layout of the records returned by getdents64. */
+struct linuxDirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
 
-static char errmsg[ERRMSG_MAX] = {0};
+/* struct dosfsOpStats of a thread: only the thread writes them, but
+   dosfsGetStats may read them at the same time. */
+struct dosfsThreadOpStats {
+	_Atomic uint64_t count;
+	_Atomic uint64_t errors;
+	_Atomic uint64_t totalNs;
+	_Atomic uint64_t maxNs;
+	_Atomic uint64_t buckets[DOSFS_STATS_BUCKETS];
+};
+
+/* Statistics of a thread, linked in the list of all the threads. */
+struct dosfsThreadStats {
+	struct dosfsThreadOpStats ops[DOSFS_OP_COUNT];
+	struct dosfsThreadStats *next;
+};
 
+struct dosfsDir {
+	int fd;
+	/* getdents64 records, only for backends with bulk reads. */
+	char *buffer;
+	size_t pos;
+	size_t end;
+	/* Single entry, for backends without bulk reads. */
+	char name[NAME_SIZE];
+	/* Position after the last entry returned. */
+	uint64_t index;
+	int64_t offset;
+};
+
+/**
+ * Operations of the ioctl backend.
+ */
+int dosfsIoctlOpenAt(void *data, int dirFd, const char *name);
+int dosfsIoctlClose(void *data, int fd);
+int dosfsIoctlGetAttributes(void *data, int fd, uint32_t *attrs);
+int dosfsIoctlSetAttributes(void *data, int fd, uint32_t attrs);
+int dosfsIoctlReadDir(void *data, int fd, char *name, size_t nameSize);
+ssize_t dosfsIoctlGetDents(void *data, int fd, void *buffer, size_t size);
+int dosfsIoctlSeekDir(void *data, int fd, int64_t offset);
+int dosfsIoctlStat(void *data, int dirFd, const char *name,
+                   struct dosfsStat *st);
+int dosfsIoctlSync(void *data, int fd, int scope);
+/**
+ * Returns the io_uring ring of the current thread, creating it the first
+ * time, or NULL if it can't be created or failed before.
+ */
+struct uring *dosfsGetRing(void);
+/**
+ * Destroy the ring of the current thread after a failed batch: it may still
+ * complete entries of that batch. The thread goes on without io_uring.
+ */
+void dosfsDropRing(void);
+/**
+ * Create the key used to free the rings when their threads exit.
+ */
+void dosfsCreateRingKey(void);
+/**
+ * Destructor of the rings of the threads.
+ */
+void dosfsFreeRing(void *threadRing);
+/**
+ * Returns !0 if the batches must go through io_uring.
+ */
+int dosfsUseRing(void);
+/**
+ * Record the failure 'code' of the current call with the errno 'errnum' as
+ * the last error of the thread.
+ * Returns 'code'.
+ */
+int dosfsFail(int code, int errnum);
+/**
+ * Open the 'size' files 'names' of the directory 'dirFd' like
+ * dosfsOpenAtBatch, 'errnums' receives the errno of the files that can't be
+ * opened.
+ */
+void dosfsOpenAtBatchErrno(int dirFd, const char *const *names, size_t size,
+                           int *fds, int *errnums);
+/**
+ * Returns the start time of an operation, 0 if the statistics are disabled.
+ */
+uint64_t dosfsStatsStart(void);
+/**
+ * Account 'count' operations 'op' started at 'start' (if not 0), 'errors'
+ * of them failed.
+ */
+void dosfsStatsEnd(int op, uint64_t start, size_t count, size_t errors);
+/**
+ * Wait for the gate before an attribute operation.
+ * Returns the start time of the operation, 0 if there isn't any gate.
+ */
+uint64_t dosfsGateEnter(void);
+/**
+ * Report the end of an attribute operation started at 'start' to the gate.
+ * errno is preserved.
+ */
+void dosfsGateLeave(uint64_t start);
+/**
+ * Returns the statistics of the current thread, creating them the first
+ * time, or NULL if they can't be created.
+ */
+struct dosfsThreadStats *dosfsGetThreadStats(void);
+/**
+ * Add 'value' to the counter 'counter' of the current thread.
+ */
+void dosfsStatsAdd(_Atomic uint64_t *counter, uint64_t value);
 /**
- * Modify the attributes of a file descriptor, 'modifyType' specifies if the
- * attributes are added (MADD) or removed (MREMOVE).
- * Returns 0 on success, !0 if an error happens.
+ * Add the statistics of a thread 'src' to 'dst'.
  */
-int dosfsModifyAttributes(int fd, uint32_t attrs,
-                          tDosfsModifyType modifyType);
+void dosfsAddStats(struct dosfsOpStats *dst,
+                   struct dosfsThreadOpStats *src);
+/**
+ * Create the key used to retire the statistics of the threads that exit.
+ */
+void dosfsCreateStatsKey(void);
+/**
+ * Destructor of the statistics of the threads, they are added to the ones
+ * of the threads that already exited.
+ */
+void dosfsRetireStats(void *data);
 
+static _Thread_local char errmsg[ERRMSG_MAX] = {0};
+/* Last error of the thread, with the errno of its failure point. */
+static _Thread_local struct dosfsError lastError = {ENOERR, 0};
+static const struct dosfsBackend ioctlBackend = {
+	"ioctl",
+	NULL,
+	dosfsIoctlOpenAt,
+	dosfsIoctlClose,
+	dosfsIoctlGetAttributes,
+	dosfsIoctlSetAttributes,
+	dosfsIoctlReadDir,
+	dosfsIoctlGetDents,
+	dosfsIoctlSeekDir,
+	dosfsIoctlStat,
+	dosfsIoctlSync
+};
+static const struct dosfsBackend *backend = &ioctlBackend;
+static int engine = DOSFS_ENGINE_SYNC;
+/* Each thread submits its batches to its own ring. */
+static _Thread_local struct uring *ring = NULL;
+static _Thread_local int ringFailed = FALSE;
+static pthread_key_t ringKey;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+static const struct dosfsGate *gate = NULL;
+static int statsEnabled = FALSE;
+static _Thread_local struct dosfsThreadStats *threadStats = NULL;
+/* Statistics of the live threads and of the ones that exited. */
+static struct dosfsThreadStats *statsList = NULL;
+static struct dosfsOpStats retiredStats[DOSFS_OP_COUNT];
+static pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t statsKey;
+static pthread_once_t statsKeyOnce = PTHREAD_ONCE_INIT;
 
-int dosfsModifyAttributes(int fd, uint32_t attrs,
-                          tDosfsModifyType modifyType)
+
+int dosfsIoctlOpenAt(void *data, int dirFd, const char *name)
 {
-	assert(fd != -1);
-	uint32_t currentAttrs = 0;
-	int ioctlRet = ioctl(fd, FAT_IOCTL_GET_ATTRIBUTES, &currentAttrs);
-	if (ioctlRet < 0) {
-		return EIOCTL_GET_ATTRIBUTES;
-	}
-	uint32_t newAttrs = 0;
-	switch (modifyType) {
-	case MADD:
-		newAttrs = currentAttrs | attrs;
-		break;
-	case MREMOVE:
-		newAttrs = (~attrs) & currentAttrs;
-		break;
+	(void)data;
+	/* O_RDONLY works with files and directories (write doesn't) and let us
+	   modify FAT attributes. */
+	return openat(dirFd, name, O_RDONLY);
+}
+
+int dosfsIoctlClose(void *data, int fd)
+{
+	(void)data;
+	return close(fd);
+}
+
+int dosfsIoctlGetAttributes(void *data, int fd, uint32_t *attrs)
+{
+	(void)data;
+	return ioctl(fd, FAT_IOCTL_GET_ATTRIBUTES, attrs);
+}
+
+int dosfsIoctlSetAttributes(void *data, int fd, uint32_t attrs)
+{
+	(void)data;
+	return ioctl(fd, FAT_IOCTL_SET_ATTRIBUTES, &attrs);
+}
+
+int dosfsIoctlReadDir(void *data, int fd, char *name, size_t nameSize)
+{
+	(void)data;
+	/* VFAT_IOCTL_READDIR_BOTH expects 2 __fat_dirent objects, one for the
+	   short name entry an one for the long name entry. */
+	struct __fat_dirent dirEnt[DIRENT_SIZE];
+	int ioctlRet = ioctl(fd, VFAT_IOCTL_READDIR_BOTH, dirEnt);
+	if (ioctlRet <= 0) {
+		return ioctlRet;
 	}
-	ioctlRet = ioctl(fd, FAT_IOCTL_SET_ATTRIBUTES, &newAttrs);
-	if (ioctlRet < 0) {
-		return EIOCTL_SET_ATTRIBUTES;
+	/* If the *real* file name have 8 characters or less, the long name entry
+	   will have d_name empty. */
+	int dirEntRealName = strlen(dirEnt[1].d_name) == 0 ? 0 : 1;
+	if (strlen(dirEnt[dirEntRealName].d_name) >= nameSize) {
+		errno = ENAMETOOLONG;
+		return -1;
 	}
-	return ENOERR;
+	strncpy(name, dirEnt[dirEntRealName].d_name, nameSize - 1);
+	name[nameSize - 1] = '\0';
+	return 1;
+}
+
+ssize_t dosfsIoctlGetDents(void *data, int fd, void *buffer, size_t size)
+{
+	(void)data;
+	/* The vfat driver returns the long name of each entry, or its short
+	   name when it doesn't have one, the same as VFAT_IOCTL_READDIR_BOTH. */
+	return syscall(SYS_getdents64, fd, buffer, size);
+}
+
+int dosfsIoctlSeekDir(void *data, int fd, int64_t offset)
+{
+	(void)data;
+	return lseek(fd, (off_t)offset, SEEK_SET) == (off_t) -1 ? -1 : 0;
+}
+
+int dosfsIoctlStat(void *data, int dirFd, const char *name,
+                   struct dosfsStat *st)
+{
+	(void)data;
+	/* Only the fields needed, so the file system can skip the rest. */
+	unsigned int mask = STATX_TYPE | STATX_INO | STATX_CTIME;
+#ifdef STATX_MNT_ID
+	mask |= STATX_MNT_ID;
+#endif
+	struct statx stx;
+	int statRet = statx(dirFd, name != NULL ? name : "",
+	                    name != NULL ? AT_SYMLINK_NOFOLLOW : AT_EMPTY_PATH,
+	                    mask, &stx);
+	if (statRet < 0) {
+		return statRet;
+	}
+	st->dev = ((uint64_t)stx.stx_dev_major << 32) | stx.stx_dev_minor;
+	st->ino = stx.stx_ino;
+	st->mount = 0;
+#ifdef STATX_MNT_ID
+	/* Since Linux 5.8. */
+	if (stx.stx_mask & STATX_MNT_ID) {
+		st->mount = stx.stx_mnt_id;
+	}
+#endif
+	st->ctimeSec = stx.stx_ctime.tv_sec;
+	st->ctimeNsec = stx.stx_ctime.tv_nsec;
+	st->isDir = S_ISDIR(stx.stx_mode);
+	return 0;
+}
+
+int dosfsIoctlSync(void *data, int fd, int scope)
+{
+	(void)data;
+	/* vfat keeps the attributes in the entry of each file, written with the
+	   inode of the file, not with its directory: an fsync of the directory
+	   doesn't write the entries changed in it. syncfs writes every dirty
+	   inode and flushes the device once. */
+	return scope == DOSFS_SYNC_FILE ? fsync(fd) : syncfs(fd);
+}
+
+struct uring *dosfsGetRing(void)
+{
+	if (ring == NULL && !ringFailed) {
+		pthread_once(&ringKeyOnce, dosfsCreateRingKey);
+		if (uringCreate(&ring)) {
+			/* Not retried: the limits that made it fail, like
+			   RLIMIT_MEMLOCK, don't change during the run. */
+			ring = NULL;
+			ringFailed = TRUE;
+			return NULL;
+		}
+		pthread_setspecific(ringKey, ring);
+	}
+	return ring;
+}
+
+void dosfsDropRing(void)
+{
+	uringDestroy(ring);
+	ring = NULL;
+	ringFailed = TRUE;
+	pthread_setspecific(ringKey, NULL);
+}
+
+void dosfsCreateRingKey(void)
+{
+	pthread_key_create(&ringKey, dosfsFreeRing);
+}
+
+void dosfsFreeRing(void *threadRing)
+{
+	uringDestroy(threadRing);
+}
+
+int dosfsFail(int code, int errnum)
+{
+	lastError.code = code;
+	lastError.errnum = errnum;
+	return code;
+}
+
+int dosfsUseRing(void)
+{
+	return engine == DOSFS_ENGINE_URING && backend == &ioctlBackend;
+}
+
+uint64_t dosfsStatsStart(void)
+{
+	if (!statsEnabled) {
+		return 0;
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	/* Never 0, which means disabled. */
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec + 1;
+}
+
+void dosfsStatsEnd(int op, uint64_t start, size_t count, size_t errors)
+{
+	if (start == 0 || count == 0) {
+		return;
+	}
+	/* The errors of the operation are reported after this. */
+	int savedErrno = errno;
+	struct dosfsThreadStats *stats = dosfsGetThreadStats();
+	errno = savedErrno;
+	if (stats == NULL) {
+		return;
+	}
+	uint64_t elapsed = dosfsStatsStart() - start;
+	uint64_t latency = elapsed / count;
+	struct dosfsThreadOpStats *opStats = &stats->ops[op];
+	dosfsStatsAdd(&opStats->count, count);
+	dosfsStatsAdd(&opStats->errors, errors);
+	dosfsStatsAdd(&opStats->totalNs, elapsed);
+	if (latency > atomic_load_explicit(&opStats->maxNs,
+	                                   memory_order_relaxed)) {
+		atomic_store_explicit(&opStats->maxNs, latency,
+		                      memory_order_relaxed);
+	}
+	size_t bucket = 0;
+	while (latency >> bucket != 0 && bucket < DOSFS_STATS_BUCKETS - 1) {
+		bucket++;
+	}
+	dosfsStatsAdd(&opStats->buckets[bucket], count);
+}
+
+void dosfsStatsAdd(_Atomic uint64_t *counter, uint64_t value)
+{
+	/* The thread is the only writer, a locked addition isn't needed. */
+	atomic_store_explicit(counter,
+	                      atomic_load_explicit(counter, memory_order_relaxed) +
+	                      value, memory_order_relaxed);
+}
+
+uint64_t dosfsGateEnter(void)
+{
+	if (gate == NULL) {
+		return 0;
+	}
+	gate->enter(gate->data);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec + 1;
+}
+
+void dosfsGateLeave(uint64_t start)
+{
+	if (start == 0) {
+		return;
+	}
+	int savedErrno = errno;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t end = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec + 1;
+	gate->leave(gate->data, end - start);
+	errno = savedErrno;
+}
+
+struct dosfsThreadStats *dosfsGetThreadStats(void)
+{
+	if (threadStats == NULL) {
+		pthread_once(&statsKeyOnce, dosfsCreateStatsKey);
+		threadStats = calloc(1, sizeof(struct dosfsThreadStats));
+		if (threadStats == NULL) {
+			return NULL;
+		}
+		pthread_mutex_lock(&statsMutex);
+		threadStats->next = statsList;
+		statsList = threadStats;
+		pthread_mutex_unlock(&statsMutex);
+		pthread_setspecific(statsKey, threadStats);
+	}
+	return threadStats;
+}
+
+void dosfsAddStats(struct dosfsOpStats *dst,
+                   struct dosfsThreadOpStats *src)
+{
+	dst->count += atomic_load_explicit(&src->count, memory_order_relaxed);
+	dst->errors += atomic_load_explicit(&src->errors, memory_order_relaxed);
+	dst->totalNs += atomic_load_explicit(&src->totalNs,
+	                                     memory_order_relaxed);
+	uint64_t maxNs = atomic_load_explicit(&src->maxNs, memory_order_relaxed);
+	if (maxNs > dst->maxNs) {
+		dst->maxNs = maxNs;
+	}
+	for (size_t i = 0; i < DOSFS_STATS_BUCKETS; i++) {
+		dst->buckets[i] += atomic_load_explicit(&src->buckets[i],
+		                                        memory_order_relaxed);
+	}
+}
+
+void dosfsCreateStatsKey(void)
+{
+	pthread_key_create(&statsKey, dosfsRetireStats);
+}
+
+void dosfsRetireStats(void *data)
+{
+	struct dosfsThreadStats *stats = data;
+	pthread_mutex_lock(&statsMutex);
+	struct dosfsThreadStats **link = &statsList;
+	while (*link != stats) {
+		link = &(*link)->next;
+	}
+	*link = stats->next;
+	for (size_t op = 0; op < DOSFS_OP_COUNT; op++) {
+		dosfsAddStats(&retiredStats[op], &stats->ops[op]);
+	}
+	pthread_mutex_unlock(&statsMutex);
+	free(stats);
 }
 
 
 const char *dosfsGetError(int err)
 {
-	switch (err) {
+	/* The errno of the failure point if it's the last error, the current
+	   one otherwise. */
+	struct dosfsError error = {err, err == lastError.code ?
+	                                lastError.errnum : errno};
+	return dosfsFormatError(&error, errmsg, ERRMSG_MAX);
+}
+
+void dosfsGetLastError(struct dosfsError *err)
+{
+	assert(err != NULL);
+	*err = lastError;
+}
+
+const char *dosfsFormatError(const struct dosfsError *err, char *buf,
+                             size_t size)
+{
+	assert(err != NULL);
+	assert(buf != NULL);
+	char sysmsg[256];
+	switch (err->code) {
 	case ENOERR:
-		snprintf(errmsg, ERRMSG_MAX,
+		snprintf(buf, size,
 		         "No error occurred");
 		break;
 	case EOPEN:
-		snprintf(errmsg, ERRMSG_MAX,
+		snprintf(buf, size,
 		         "Error opening file: %s",
-		         strerror(errno));
+		         strerror_r(err->errnum, sysmsg, sizeof(sysmsg)));
 		break;
 	case EIOCTL_GET_ATTRIBUTES:
-		snprintf(errmsg, ERRMSG_MAX,
+		snprintf(buf, size,
 		         "Error in ioctl call 'FAT_IOCTL_GET_ATTRIBUTES': %s",
-		         strerror(errno));
+		         strerror_r(err->errnum, sysmsg, sizeof(sysmsg)));
 		break;
 	case EIOCTL_SET_ATTRIBUTES:
-		snprintf(errmsg, ERRMSG_MAX,
+		snprintf(buf, size,
 		         "Error in ioctl call 'FAT_IOCTL_SET_ATTRIBUTES': %s",
-		         strerror(errno));
+		         strerror_r(err->errnum, sysmsg, sizeof(sysmsg)));
 		break;
 	case EIOCTL_READDIR_BOTH:
-		snprintf(errmsg, ERRMSG_MAX,
+		snprintf(buf, size,
 		         "Error in ioctl call 'VFAT_IOCTL_READDIR_BOTH': %s",
-		         strerror(errno));
+		         strerror_r(err->errnum, sysmsg, sizeof(sysmsg)));
 		break;
 	case EBUFFER:
-		snprintf(errmsg, ERRMSG_MAX,
+		snprintf(buf, size,
 		         "The entry name is bigger than the read buffer");
 		break;
+	case EGETDENTS:
+		snprintf(buf, size,
+		         "Error in call 'getdents64': %s",
+		         strerror_r(err->errnum, sysmsg, sizeof(sysmsg)));
+		break;
+	case EALLOC:
+		snprintf(buf, size,
+		         "Error allocating memory: %s",
+		         strerror_r(err->errnum, sysmsg, sizeof(sysmsg)));
+		break;
+	case EURING:
+		snprintf(buf, size,
+		         "io_uring is not available: %s",
+		         strerror_r(err->errnum, sysmsg, sizeof(sysmsg)));
+		break;
+	case EENGINE:
+		snprintf(buf, size,
+		         "Unknown engine");
+		break;
+	case ESEEKDIR:
+		snprintf(buf, size,
+		         "Error seeking directory: %s",
+		         strerror_r(err->errnum, sysmsg, sizeof(sysmsg)));
+		break;
+	case ESTAT:
+		snprintf(buf, size,
+		         "Error getting the file status: %s",
+		         strerror_r(err->errnum, sysmsg, sizeof(sysmsg)));
+		break;
+	case ESYNC:
+		snprintf(buf, size,
+		         "Error flushing the changes: %s",
+		         strerror_r(err->errnum, sysmsg, sizeof(sysmsg)));
+		break;
 	default:
-		snprintf(errmsg, ERRMSG_MAX,
+		snprintf(buf, size,
 		         "Unknown error");
 	}
-	return errmsg;
+	return buf;
+}
+
+uint32_t dosfsParseAttr(char letter)
+{
+	switch (letter) {
+	case 'R':
+		return DOSFS_ATTR_RO;
+	case 'H':
+		return DOSFS_ATTR_HIDDEN;
+	case 'S':
+		return DOSFS_ATTR_SYS;
+	case 'A':
+		return DOSFS_ATTR_ARCH;
+	case 'D':
+		return DOSFS_ATTR_DIR;
+	case 'V':
+		return DOSFS_ATTR_VOLUME;
+	default:
+		return 0;
+	}
+}
+
+const struct dosfsBackend *dosfsIoctlBackend(void)
+{
+	return &ioctlBackend;
+}
+
+void dosfsSetBackend(const struct dosfsBackend *newBackend)
+{
+	backend = newBackend != NULL ? newBackend : &ioctlBackend;
+}
+
+int dosfsSetEngine(int newEngine)
+{
+	if (newEngine == DOSFS_ENGINE_URING) {
+		/* Creating the ring of this thread checks the kernel support. */
+		if (dosfsGetRing() == NULL) {
+			return dosfsFail(EURING, errno);
+		}
+	} else if (newEngine != DOSFS_ENGINE_SYNC) {
+		return dosfsFail(EENGINE, 0);
+	}
+	engine = newEngine;
+	return ENOERR;
+}
+
+int dosfsGetEngine(void)
+{
+	return engine;
+}
+
+void dosfsSetStats(int enabled)
+{
+	statsEnabled = enabled;
+}
+
+void dosfsSetGate(const struct dosfsGate *newGate)
+{
+	gate = newGate;
+}
+
+void dosfsGetStats(struct dosfsOpStats stats[DOSFS_OP_COUNT])
+{
+	assert(stats != NULL);
+	pthread_mutex_lock(&statsMutex);
+	memcpy(stats, retiredStats, sizeof(retiredStats));
+	for (struct dosfsThreadStats *thread = statsList; thread != NULL;
+	        thread = thread->next) {
+		for (size_t op = 0; op < DOSFS_OP_COUNT; op++) {
+			dosfsAddStats(&stats[op], &thread->ops[op]);
+		}
+	}
+	pthread_mutex_unlock(&statsMutex);
+}
+
+const char *dosfsOpName(int op)
+{
+	static const char *const names[DOSFS_OP_COUNT] = {
+		"open", "close", "get_attributes", "set_attributes", "readdir",
+		"stat", "sync"
+	};
+	return op >= 0 && op < DOSFS_OP_COUNT ? names[op] : "unknown";
+}
+
+uint64_t dosfsStatsPercentile(const struct dosfsOpStats *stats,
+                              double percent)
+{
+	assert(stats != NULL);
+	uint64_t target = (uint64_t)(stats->count * percent / 100.0);
+	uint64_t seen = 0;
+	for (size_t bucket = 0; bucket < DOSFS_STATS_BUCKETS; bucket++) {
+		seen += stats->buckets[bucket];
+		if (seen > target || seen == stats->count) {
+			uint64_t bound = bucket == 0 ? 0 : (uint64_t)1 << bucket;
+			return bound < stats->maxNs ? bound : stats->maxNs;
+		}
+	}
+	return stats->maxNs;
 }
 
 int dosfsOpen(const char *file, int *fd)
 {
-	assert(file != NULL);
+	return dosfsOpenAt(DOSFS_AT_CWD, file, fd);
+}
+
+int dosfsOpenAt(int dirFd, const char *name, int *fd)
+{
+	assert(name != NULL);
 	assert(fd != NULL);
-	/* O_RDONLY works with files and directories (write doesn't) and let us
-	   modify FAT attributes. */
-	*fd = open(file, O_RDONLY);
+	uint64_t start = dosfsStatsStart();
+	*fd = backend->openAt(backend->data, dirFd, name);
+	dosfsStatsEnd(DOSFS_OP_OPEN, start, 1, *fd == -1);
 	if (*fd == -1) {
-		return EOPEN;
+		return dosfsFail(EOPEN, errno);
+	}
+	return ENOERR;
+}
+
+void dosfsOpenAtBatch(int dirFd, const char *const *names, size_t size,
+                      int *fds)
+{
+	int errnums[DOSFS_BATCH_MAX];
+	dosfsOpenAtBatchErrno(dirFd, names, size, fds, errnums);
+}
+
+void dosfsOpenAtBatchErrno(int dirFd, const char *const *names, size_t size,
+                           int *fds, int *errnums)
+{
+	assert(names != NULL);
+	assert(fds != NULL);
+	assert(size <= DOSFS_BATCH_MAX);
+	uint64_t start = dosfsStatsStart();
+	size_t errors = 0;
+	struct uring *threadRing = dosfsUseRing() ? dosfsGetRing() : NULL;
+	if (threadRing != NULL) {
+		int results[DOSFS_BATCH_MAX];
+		if (uringOpenAtBatch(threadRing, dirFd, names, O_RDONLY, results,
+		                     size)) {
+			dosfsDropRing();
+		}
+		for (size_t i = 0; i < size; i++) {
+			/* Never submitted, it's safe to open it here. */
+			if (results[i] == URING_NOT_SUBMITTED) {
+				results[i] = backend->openAt(backend->data, dirFd,
+				                             names[i]);
+				results[i] = results[i] == -1 ? -errno : results[i];
+			}
+			fds[i] = results[i] >= 0 ? results[i] : -1;
+			errnums[i] = results[i] >= 0 ? 0 : -results[i];
+			errors += fds[i] == -1;
+		}
+		dosfsStatsEnd(DOSFS_OP_OPEN, start, size, errors);
+		return;
+	}
+	for (size_t i = 0; i < size; i++) {
+		fds[i] = backend->openAt(backend->data, dirFd, names[i]);
+		errnums[i] = fds[i] == -1 ? errno : 0;
+		errors += fds[i] == -1;
+	}
+	dosfsStatsEnd(DOSFS_OP_OPEN, start, size, errors);
+}
+
+int dosfsStatAt(int dirFd, const char *name, struct dosfsStat *st)
+{
+	assert(st != NULL);
+	if (backend->stat == NULL) {
+		return dosfsFail(ESTAT, ENOTSUP);
+	}
+	uint64_t start = dosfsStatsStart();
+	int statRet = backend->stat(backend->data, dirFd, name, st);
+	dosfsStatsEnd(DOSFS_OP_STAT, start, 1, statRet < 0);
+	if (statRet < 0) {
+		return dosfsFail(ESTAT, errno);
+	}
+	return ENOERR;
+}
+
+int dosfsStat(int fd, struct dosfsStat *st)
+{
+	assert(fd != -1);
+	return dosfsStatAt(fd, NULL, st);
+}
+
+int dosfsSync(int fd, int scope)
+{
+	assert(fd != -1);
+	if (backend->sync == NULL) {
+		return dosfsFail(ESYNC, ENOTSUP);
+	}
+	uint64_t start = dosfsStatsStart();
+	int syncRet = backend->sync(backend->data, fd, scope);
+	dosfsStatsEnd(DOSFS_OP_SYNC, start, 1, syncRet < 0);
+	if (syncRet < 0) {
+		return dosfsFail(ESYNC, errno);
 	}
 	return ENOERR;
 }
@@ -136,52 +790,283 @@ int dosfsOpen(const char *file, int *fd)
 int dosfsClose(int fd)
 {
 	assert(fd != -1);
-	close(fd);
+	uint64_t start = dosfsStatsStart();
+	int closeRet = backend->close(backend->data, fd);
+	dosfsStatsEnd(DOSFS_OP_CLOSE, start, 1, closeRet == -1);
 	return ENOERR;
 }
 
+void dosfsCloseBatch(const int *fds, size_t size)
+{
+	assert(fds != NULL);
+	assert(size <= DOSFS_BATCH_MAX);
+	uint64_t start = dosfsStatsStart();
+	size_t count = 0;
+	size_t errors = 0;
+	for (size_t i = 0; i < size; i++) {
+		count += fds[i] != -1;
+	}
+	struct uring *threadRing = dosfsUseRing() ? dosfsGetRing() : NULL;
+	if (threadRing != NULL) {
+		int results[DOSFS_BATCH_MAX];
+		if (uringCloseBatch(threadRing, fds, results, size)) {
+			dosfsDropRing();
+		}
+		/* A descriptor submitted may be closed already, and its number
+		   reused by another thread: only the others are closed here. */
+		for (size_t i = 0; i < size; i++) {
+			if (fds[i] == -1) {
+				continue;
+			}
+			if (results[i] == URING_NOT_SUBMITTED) {
+				results[i] = backend->close(backend->data, fds[i]);
+			}
+			errors += results[i] < 0;
+		}
+		dosfsStatsEnd(DOSFS_OP_CLOSE, start, count, errors);
+		return;
+	}
+	for (size_t i = 0; i < size; i++) {
+		if (fds[i] != -1) {
+			errors += backend->close(backend->data, fds[i]) == -1;
+		}
+	}
+	dosfsStatsEnd(DOSFS_OP_CLOSE, start, count, errors);
+}
+
 int dosfsGetAttributes(int fd, uint32_t *attrs)
 {
 	assert(attrs != NULL);
-	int ioctlRet = ioctl(fd, FAT_IOCTL_GET_ATTRIBUTES, attrs);
-	if (ioctlRet < 0) {
-		return EIOCTL_GET_ATTRIBUTES;
+	uint64_t gateStart = dosfsGateEnter();
+	uint64_t start = dosfsStatsStart();
+	int getRet = backend->getAttributes(backend->data, fd, attrs);
+	dosfsStatsEnd(DOSFS_OP_GET_ATTRIBUTES, start, 1, getRet < 0);
+	dosfsGateLeave(gateStart);
+	if (getRet < 0) {
+		return dosfsFail(EIOCTL_GET_ATTRIBUTES, errno);
 	}
 	return ENOERR;
 }
 
+int dosfsApplyMask(int fd, uint32_t set, uint32_t clear, uint32_t toggle,
+                   uint32_t *before, uint32_t *after)
+{
+	return dosfsApplyMaskIf(fd, NULL, NULL, set, clear, toggle, before, after);
+}
+
+int dosfsApplyMaskIf(int fd, tDosfsFilterFn filter, void *filterData,
+                     uint32_t set, uint32_t clear, uint32_t toggle,
+                     uint32_t *before, uint32_t *after)
+{
+	assert(fd != -1);
+	uint32_t currentAttrs = 0;
+	int dosfsErrno = dosfsGetAttributes(fd, &currentAttrs);
+	if (dosfsErrno) {
+		return dosfsErrno;
+	}
+	uint32_t newAttrs = currentAttrs;
+	if (filter == NULL || filter(currentAttrs, filterData)) {
+		newAttrs = ((currentAttrs | set) & ~clear) ^ toggle;
+	}
+	if (newAttrs != currentAttrs) {
+		uint64_t gateStart = dosfsGateEnter();
+		uint64_t start = dosfsStatsStart();
+		int setRet = backend->setAttributes(backend->data, fd, newAttrs);
+		dosfsStatsEnd(DOSFS_OP_SET_ATTRIBUTES, start, 1, setRet < 0);
+		dosfsGateLeave(gateStart);
+		if (setRet < 0) {
+			return dosfsFail(EIOCTL_SET_ATTRIBUTES, errno);
+		}
+	}
+	if (before != NULL) {
+		*before = currentAttrs;
+	}
+	if (after != NULL) {
+		*after = newAttrs;
+	}
+	return ENOERR;
+}
+
+size_t dosfsApplyBatch(int dirFd, const struct dosfsBatchOp *ops,
+                       size_t size, struct dosfsBatchResult *results)
+{
+	assert(ops != NULL || size == 0);
+	assert(results != NULL || size == 0);
+	size_t failed = 0;
+	for (size_t base = 0; base < size; base += DOSFS_BATCH_MAX) {
+		size_t batchSize = size - base < DOSFS_BATCH_MAX ?
+		                   size - base : DOSFS_BATCH_MAX;
+		const char *names[DOSFS_BATCH_MAX];
+		int fds[DOSFS_BATCH_MAX];
+		int errnums[DOSFS_BATCH_MAX];
+		for (size_t i = 0; i < batchSize; i++) {
+			names[i] = ops[base + i].path;
+		}
+		dosfsOpenAtBatchErrno(dirFd, names, batchSize, fds, errnums);
+		for (size_t i = 0; i < batchSize; i++) {
+			const struct dosfsBatchOp *op = &ops[base + i];
+			struct dosfsBatchResult *result = &results[base + i];
+			result->before = 0;
+			result->after = 0;
+			result->error.code = ENOERR;
+			result->error.errnum = 0;
+			if (fds[i] == -1) {
+				result->error.code = dosfsFail(EOPEN, errnums[i]);
+				result->error.errnum = errnums[i];
+				failed++;
+				continue;
+			}
+			if (dosfsApplyMask(fds[i], op->set, op->clear, 0, &result->before,
+			                   &result->after) ||
+			        (op->sync && result->after != result->before &&
+			         dosfsSync(fds[i], DOSFS_SYNC_FILE))) {
+				dosfsGetLastError(&result->error);
+				failed++;
+			}
+		}
+		dosfsCloseBatch(fds, batchSize);
+	}
+	return failed;
+}
+
 int dosfsAddAttributes(int fd, uint32_t attrs)
 {
-	return dosfsModifyAttributes(fd, attrs, MADD);
+	return dosfsApplyMask(fd, attrs, 0, 0, NULL, NULL);
 }
 
 int dosfsRemoveAttributes(int fd, uint32_t attrs)
 {
-	return dosfsModifyAttributes(fd, attrs, MREMOVE);
+	return dosfsApplyMask(fd, 0, attrs, 0, NULL, NULL);
 }
 
 int dosfsReadDir(int fd, char *entry, size_t pathSize)
 {
 	assert(entry != NULL);
 	assert(fd != -1);
-	/* VFAT_IOCTL_READDIR_BOTH expects 2 __fat_dirent objects, one for the
-	   short name entry an one for the long name entry. */
-	struct __fat_dirent dirEnt[DIRENT_SIZE];
-	int ioctlRet = ioctl(fd, VFAT_IOCTL_READDIR_BOTH, dirEnt);
-	if (ioctlRet < 0) {
-		close(fd);
-		return EIOCTL_READDIR_BOTH;
-	} else if (ioctlRet == 0) {
+	uint64_t start = dosfsStatsStart();
+	int readRet = backend->readDir(backend->data, fd, entry, pathSize);
+	dosfsStatsEnd(DOSFS_OP_READDIR, start, 1, readRet < 0);
+	if (readRet < 0) {
+		return errno == ENAMETOOLONG ? dosfsFail(EBUFFER, 0) :
+		       dosfsFail(EIOCTL_READDIR_BOTH, errno);
+	} else if (readRet == 0) {
 		memset(entry, '\0', pathSize);
+	}
+	return ENOERR;
+}
+
+int dosfsDirOpen(int fd, struct dosfsDir **dir)
+{
+	assert(fd != -1);
+	assert(dir != NULL);
+	struct dosfsDir *newDir = malloc(sizeof(struct dosfsDir));
+	if (newDir == NULL) {
+		return dosfsFail(EALLOC, errno);
+	}
+	newDir->fd = fd;
+	newDir->buffer = NULL;
+	newDir->pos = 0;
+	newDir->end = 0;
+	newDir->index = 0;
+	newDir->offset = 0;
+	if (backend->getDents != NULL) {
+		newDir->buffer = malloc(DIR_BUFFER_SIZE);
+		if (newDir->buffer == NULL) {
+			free(newDir);
+			return dosfsFail(EALLOC, ENOMEM);
+		}
+	}
+	*dir = newDir;
+	return ENOERR;
+}
+
+int dosfsDirNext(struct dosfsDir *dir, const char **name)
+{
+	assert(dir != NULL);
+	assert(name != NULL);
+	if (dir->buffer == NULL) {
+		int dosfsErrno = dosfsReadDir(dir->fd, dir->name, NAME_SIZE);
+		if (dosfsErrno) {
+			return dosfsErrno;
+		}
+		*name = dir->name[0] != '\0' ? dir->name : NULL;
+		if (*name != NULL) {
+			dir->index++;
+			dir->offset = (int64_t)dir->index;
+		}
 		return ENOERR;
 	}
-	/* If the *real* file name have 8 characters or less, the long name entry
-	   will have d_name empty. */
-	int dirEntRealName = strlen(dirEnt[1].d_name) == 0 ? 0 : 1;
-	if (strlen(dirEnt[dirEntRealName].d_name) >= pathSize) {
-		return EBUFFER;
+	if (dir->pos >= dir->end) {
+		uint64_t start = dosfsStatsStart();
+		ssize_t readSize = backend->getDents(backend->data, dir->fd,
+		                                     dir->buffer, DIR_BUFFER_SIZE);
+		dosfsStatsEnd(DOSFS_OP_READDIR, start, 1, readSize < 0);
+		if (readSize < 0) {
+			return dosfsFail(EGETDENTS, errno);
+		}
+		dir->pos = 0;
+		dir->end = (size_t)readSize;
+		if (readSize == 0) {
+			*name = NULL;
+			return ENOERR;
+		}
 	}
-	strncpy(entry, dirEnt[dirEntRealName].d_name, pathSize - 1);
+	struct linuxDirent64 *entry = (struct linuxDirent64 *)
+	                              (dir->buffer + dir->pos);
+	dir->pos += entry->d_reclen;
+	dir->index++;
+	dir->offset = entry->d_off;
+	*name = entry->d_name;
 	return ENOERR;
 }
 
+void dosfsDirTell(const struct dosfsDir *dir, struct dosfsDirPos *pos)
+{
+	assert(dir != NULL);
+	assert(pos != NULL);
+	pos->index = dir->index;
+	pos->offset = dir->offset;
+}
+
+int dosfsDirSeek(struct dosfsDir *dir, const struct dosfsDirPos *pos)
+{
+	assert(dir != NULL);
+	assert(pos != NULL);
+	if (pos->index == 0) {
+		return ENOERR;
+	}
+	if (backend->seekDir != NULL) {
+		uint64_t start = dosfsStatsStart();
+		int seekRet = backend->seekDir(backend->data, dir->fd, pos->offset);
+		dosfsStatsEnd(DOSFS_OP_READDIR, start, 1, seekRet == -1);
+		if (seekRet == -1) {
+			return dosfsFail(ESEEKDIR, errno);
+		}
+		dir->pos = 0;
+		dir->end = 0;
+		dir->index = pos->index;
+		dir->offset = pos->offset;
+		return ENOERR;
+	}
+	const char *name = NULL;
+	while (dir->index < pos->index) {
+		int dosfsErrno = dosfsDirNext(dir, &name);
+		if (dosfsErrno) {
+			return dosfsErrno;
+		}
+		if (name == NULL) {
+			/* The directory lost entries while it was closed. */
+			break;
+		}
+	}
+	return ENOERR;
+}
+
+void dosfsDirClose(struct dosfsDir *dir)
+{
+	if (dir == NULL) {
+		return;
+	}
+	free(dir->buffer);
+	free(dir);
+}
@@ -21,8 +21,10 @@
 #define __DOSFS_H__
 
 #include <linux/msdos_fs.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 /* Redefinition of attribute macros, so we don't depend on msdos_fs.h macros. */
 enum {
@@ -42,26 +44,340 @@ enum {
 #define DOSFS_HAS_ATTR_DIR(x)       DOSFS_HAS_ATTR(x, DOSFS_ATTR_DIR)
 #define DOSFS_HAS_ATTR_ARCH(x)      DOSFS_HAS_ATTR(x, DOSFS_ATTR_ARCH)
 
+/* Directory descriptor meaning "the current working directory" for
+   dosfsOpenAt. fcntl.h only has AT_FDCWD with POSIX 2008, the library users
+   compiled as strict C get the Linux value. */
+#ifdef AT_FDCWD
+#define DOSFS_AT_CWD AT_FDCWD
+#else
+#define DOSFS_AT_CWD (-100)
+#endif
+
+/* Engines to open and close the files (see dosfsSetEngine). */
+enum {
+	/* One openat/close system call per file. */
+	DOSFS_ENGINE_SYNC = 0,
+	/* Batches of files opened and closed with io_uring. */
+	DOSFS_ENGINE_URING
+};
+/* Maximum files of dosfsOpenAtBatch and dosfsCloseBatch. */
+#define DOSFS_BATCH_MAX 32
+
+/* Backend operations counted by the statistics (see dosfsSetStats). */
+enum {
+	DOSFS_OP_OPEN = 0,
+	DOSFS_OP_CLOSE,
+	DOSFS_OP_GET_ATTRIBUTES,
+	DOSFS_OP_SET_ATTRIBUTES,
+	/* Each readDir or getDents call, not each entry. */
+	DOSFS_OP_READDIR,
+	DOSFS_OP_STAT,
+	DOSFS_OP_SYNC,
+	DOSFS_OP_COUNT
+};
+/* What dosfsSync flushes to the medium. */
+enum {
+	/* The changes of a file, its directory entry included. */
+	DOSFS_SYNC_FILE = 0,
+	/* The changes of the entries of a directory. */
+	DOSFS_SYNC_DIR,
+	/* All the changes of the file system of a file. */
+	DOSFS_SYNC_FS
+};
+/* Latency buckets of the statistics: bucket 0 counts the operations of 0
+   ns and bucket N the ones in [2^(N-1), 2^N) ns. */
+#define DOSFS_STATS_BUCKETS 64
 
 /**
- * Returns a descriptive message associated with an error code.
+ * Statistics of an operation.
+ */
+struct dosfsOpStats {
+	uint64_t count;
+	uint64_t errors;
+	/* Time spent in the operation, adding all the threads. */
+	uint64_t totalNs;
+	uint64_t maxNs;
+	uint64_t buckets[DOSFS_STATS_BUCKETS];
+};
+
+/**
+ * Identity and change time of a file (see dosfsStatAt).
+ */
+struct dosfsStat {
+	uint64_t dev;
+	uint64_t ino;
+	/* Identifier of the mount the file was reached through, unique while
+	   the system is up, or 0 if unknown. */
+	uint64_t mount;
+	/* Time of the last change of the file (ctime). */
+	int64_t ctimeSec;
+	uint32_t ctimeNsec;
+	int isDir;
+};
+
+/**
+ * Operations of a dosfs backend, the dosfs functions work on the files of
+ * the current backend.
+ * The operations follow the conventions of the system calls they replace:
+ * they return -1 and set errno if an error happens, and the file
+ * descriptors are whatever integer (>= 0) the backend uses to identify its
+ * open files. 'data' is passed as the first argument of every operation.
+ */
+struct dosfsBackend {
+	const char *name;
+	void *data;
+	/* Open 'name' relative to 'dirFd', returns the new file descriptor. */
+	int (*openAt)(void *data, int dirFd, const char *name);
+	int (*close)(void *data, int fd);
+	int (*getAttributes)(void *data, int fd, uint32_t *attrs);
+	int (*setAttributes)(void *data, int fd, uint32_t attrs);
+	/* Read the next entry name of a directory, returns 1 if an entry was
+	   read, 0 at the end of the directory or -1 with errno ENAMETOOLONG if
+	   the name doesn't fit in 'name'. */
+	int (*readDir)(void *data, int fd, char *name, size_t nameSize);
+	/* Optional, NULL if not supported: fill 'buffer' with as many
+	   directory entries as fit, in the format of getdents64 (struct
+	   linux_dirent64). Returns the bytes written, 0 at the end of the
+	   directory. */
+	ssize_t (*getDents)(void *data, int fd, void *buffer, size_t size);
+	/* Optional, NULL if not supported: move the read position of a
+	   directory to 'offset', the d_off of an entry returned by getDents or,
+	   without getDents, the number of entries read. Returns 0 on success,
+	   -1 if an error happens. */
+	int (*seekDir)(void *data, int fd, int64_t offset);
+	/* Optional, NULL if not supported: fill 'st' with the identity and
+	   change time of 'name' relative to 'dirFd', without following
+	   symbolic links, or of 'dirFd' itself if 'name' is NULL. Returns 0 on
+	   success, -1 if an error happens. */
+	int (*stat)(void *data, int dirFd, const char *name,
+	            struct dosfsStat *st);
+	/* Optional, NULL if not supported: flush the changes 'scope'
+	   (DOSFS_SYNC_*) of the file 'fd' to the medium. Returns 0 on success,
+	   -1 if an error happens. */
+	int (*sync)(void *data, int fd, int scope);
+};
+
+/**
+ * Gate of the attribute operations (see dosfsSetGate), to limit how many
+ * of them are in flight. 'enter' is called before every getAttributes and
+ * setAttributes call of the backend, it may block until the operation can
+ * start, and 'leave' after it with the latency of the call, in ns, without
+ * the wait of 'enter'. 'data' is passed as the first argument of both.
+ */
+struct dosfsGate {
+	void *data;
+	void (*enter)(void *data);
+	void (*leave)(void *data, uint64_t latencyNs);
+};
+
+/**
+ * Error of a call, captured where it failed.
+ */
+struct dosfsError {
+	/* Error code, the value returned by the call, 0 if it succeeded. */
+	int code;
+	/* errno of the failure, 0 if it doesn't come from a system call. */
+	int errnum;
+};
+
+/**
+ * Operation of dosfsApplyBatch: the attributes of 'path' become
+ * (current | set) & ~clear, with 'set' and 'clear' 0 they are only read.
+ */
+struct dosfsBatchOp {
+	const char *path;
+	uint32_t set;
+	uint32_t clear;
+	/* !0 to flush the change with dosfsSync (DOSFS_SYNC_FILE) before the
+	   file is closed, if the attributes changed. */
+	int sync;
+};
+
+/**
+ * Result of a dosfsApplyBatch operation.
+ */
+struct dosfsBatchResult {
+	uint32_t before;
+	uint32_t after;
+	struct dosfsError error;
+};
+
+/**
+ * Filter of dosfsApplyMaskIf, returns !0 if the attributes 'attrs' must be
+ * changed. 'data' is the pointer passed to dosfsApplyMaskIf.
+ */
+typedef int (*tDosfsFilterFn)(uint32_t attrs, void *data);
+
+/**
+ * Iterator over the entries of a directory (see dosfsDirOpen).
+ */
+struct dosfsDir;
+
+/**
+ * Position of a directory iterator (see dosfsDirTell).
+ */
+struct dosfsDirPos {
+	/* Entries read. */
+	uint64_t index;
+	/* Backend offset of the next entry. */
+	int64_t offset;
+};
+
+
+/**
+ * Returns a descriptive message associated with an error code, with the
+ * errno of the failure point if it's the last error of the thread. The
+ * message is valid until the next call in the same thread.
  */
 const char *dosfsGetError(int err);
+/**
+ * Fill 'err' with the last error of the current thread.
+ */
+void dosfsGetLastError(struct dosfsError *err);
+/**
+ * Write the message of the error 'err' in 'buf', of 'size' bytes.
+ * Returns 'buf'.
+ */
+const char *dosfsFormatError(const struct dosfsError *err, char *buf,
+                             size_t size);
+/**
+ * Returns the attribute of the letter 'letter' (R, H, S, A, D or V), 0 if
+ * it isn't an attribute letter.
+ */
+uint32_t dosfsParseAttr(char letter);
+/**
+ * Returns the backend that works on the mounted vfat file systems through
+ * the FAT ioctl calls, the default one.
+ */
+const struct dosfsBackend *dosfsIoctlBackend(void);
+/**
+ * Make all the dosfs functions work with 'backend', NULL goes back to the
+ * ioctl backend. 'backend' must be valid until it is replaced.
+ * This must be called before any file is open.
+ */
+void dosfsSetBackend(const struct dosfsBackend *backend);
+/**
+ * Select the engine used by dosfsOpenAtBatch and dosfsCloseBatch.
+ * DOSFS_ENGINE_URING only applies to the ioctl backend, the other backends
+ * always open their files one by one.
+ * Returns 0 on success, !0 if the engine isn't available, then the engine
+ * doesn't change.
+ */
+int dosfsSetEngine(int engine);
+/**
+ * Returns the current engine.
+ */
+int dosfsGetEngine(void);
+/**
+ * Enable (!0) or disable (0) the statistics of the backend operations.
+ * While they are disabled the operations only pay a test of a flag.
+ * The operations of the io_uring batches are counted by file, each one
+ * with the average latency of its batch.
+ */
+void dosfsSetStats(int enabled);
+/**
+ * Pass the attribute operations through 'gate', NULL to remove it. 'gate'
+ * must be valid until it is replaced.
+ * This must be called before any file is open.
+ */
+void dosfsSetGate(const struct dosfsGate *gate);
+/**
+ * Fill 'stats' with the statistics of every operation (DOSFS_OP_*), adding
+ * the ones of all the threads. It can be called while other threads work:
+ * each counter is read atomically, but the counters of an operation that
+ * is ending may not be updated together yet.
+ */
+void dosfsGetStats(struct dosfsOpStats stats[DOSFS_OP_COUNT]);
+/**
+ * Returns the name of the operation 'op'.
+ */
+const char *dosfsOpName(int op);
+/**
+ * Returns an upper bound of the latency, in ns, below which 'percent' % of
+ * the operations of 'stats' are, never more than its maximum latency.
+ */
+uint64_t dosfsStatsPercentile(const struct dosfsOpStats *stats,
+                              double percent);
 /**
  * Open a file and save its file descriptor in fd.
  * Returns 0 on success, !0 if an error happens.
  */
 int dosfsOpen(const char *file, int *fd);
+/**
+ * Open the file 'name' relative to the directory descriptor 'dirFd' and save
+ * its file descriptor in fd.
+ * Only 'name' is resolved, so the cost doesn't depend on the depth of 'dirFd'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int dosfsOpenAt(int dirFd, const char *name, int *fd);
+/**
+ * Open 'size' (at most DOSFS_BATCH_MAX) files relative to the directory
+ * descriptor 'dirFd' and save their file descriptors in 'fds', -1 for the
+ * files that couldn't be opened. With the io_uring engine the whole batch
+ * costs a single system call.
+ */
+void dosfsOpenAtBatch(int dirFd, const char *const *names, size_t size,
+                      int *fds);
+/**
+ * Fill 'st' with the identity and change time of the file 'name' relative
+ * to the directory descriptor 'dirFd', without opening it.
+ * Returns 0 on success, !0 if an error happens or the backend can't do it.
+ */
+int dosfsStatAt(int dirFd, const char *name, struct dosfsStat *st);
+/**
+ * Same as dosfsStatAt, for the open file descriptor 'fd'.
+ * Returns 0 on success, !0 if an error happens or the backend can't do it.
+ */
+int dosfsStat(int fd, struct dosfsStat *st);
+/**
+ * Flush the changes 'scope' (DOSFS_SYNC_*) of the file descriptor 'fd' to
+ * the medium.
+ * Returns 0 on success, !0 if an error happens or the backend can't do it.
+ */
+int dosfsSync(int fd, int scope);
 /**
  * Close a file descriptor.
  * Returns 0 on success, !0 if an error happens.
  */
 int dosfsClose(int fd);
+/**
+ * Close 'size' (at most DOSFS_BATCH_MAX) file descriptors, skipping the ones
+ * that are -1.
+ */
+void dosfsCloseBatch(const int *fds, size_t size);
 /**
  * Get the FAT attributes from a file descriptor and save them in 'attrs'.
  * Returns 0 on success, !0 if an error happens.
  */
 int dosfsGetAttributes(int fd, uint32_t *attrs);
+/**
+ * Apply a set of attribute changes to a file descriptor in one transaction:
+ * the new attributes are ((current | set) & ~clear) ^ toggle.
+ * The attributes are read once and written only if they change.
+ * If not NULL, 'before' and 'after' receive the attributes before and after
+ * the change.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int dosfsApplyMask(int fd, uint32_t set, uint32_t clear, uint32_t toggle,
+                   uint32_t *before, uint32_t *after);
+/**
+ * Same as dosfsApplyMask, but the change is only applied if 'filter'
+ * accepts the current attributes, otherwise 'after' receives the same
+ * attributes as 'before'. A NULL filter accepts everything.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int dosfsApplyMaskIf(int fd, tDosfsFilterFn filter, void *filterData,
+                     uint32_t set, uint32_t clear, uint32_t toggle,
+                     uint32_t *before, uint32_t *after);
+/**
+ * Apply the 'size' operations 'ops' to their files, relative to the
+ * directory 'dirFd' (DOSFS_AT_CWD for the working directory), and fill the
+ * same number of 'results'. The files are opened and closed in batches with
+ * the current engine.
+ * Returns the number of operations that failed.
+ */
+size_t dosfsApplyBatch(int dirFd, const struct dosfsBatchOp *ops,
+                       size_t size, struct dosfsBatchResult *results);
 /**
  * Add FAT attributes to a file descriptor.
  * Returns 0 on success, !0 if an error happens.
@@ -80,5 +396,38 @@ int dosfsRemoveAttributes(int fd, uint32_t attrs);
  * doesn't fit in 'entry'.
  */
 int dosfsReadDir(int fd, char *entry, size_t pathSize);
+/**
+ * Start iterating the entries of the directory associated with a file
+ * descriptor. When the backend supports it the entries are read in bulk,
+ * many of them per system call, instead of one VFAT_IOCTL_READDIR_BOTH call
+ * per entry; dosfsReadDir is still available when the short name logic of
+ * VFAT_IOCTL_READDIR_BOTH is needed.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int dosfsDirOpen(int fd, struct dosfsDir **dir);
+/**
+ * Get the name of the next entry of a directory iterator in 'name', or NULL
+ * at the end of the directory. The name points inside the iterator buffer,
+ * it's valid until the next call with the same iterator.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int dosfsDirNext(struct dosfsDir *dir, const char **name);
+/**
+ * Get the position of a directory iterator, after the last entry read, in
+ * 'pos'.
+ */
+void dosfsDirTell(const struct dosfsDir *dir, struct dosfsDirPos *pos);
+/**
+ * Move a new iterator to the position 'pos' of a previous iterator of the
+ * same directory, e.g. to resume the iteration after closing it. Without the
+ * seekDir operation of the backend the entries before the position are read
+ * again and skipped.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int dosfsDirSeek(struct dosfsDir *dir, const struct dosfsDirPos *pos);
+/**
+ * Free a directory iterator. The file descriptor is not closed.
+ */
+void dosfsDirClose(struct dosfsDir *dir);
 
 #endif /* __DOSFS_H__ */
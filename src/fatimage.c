@@ -0,0 +1,1021 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "fatimage.h"
+#include "bool.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ERRMSG_MAX 1025
+#define SECTOR_SIZE 512
+#define DIRENT_SIZE 32
+/* A long name has at most 20 LFN entries of 13 UCS-2 characters. */
+#define LFN_ENTRIES_MAX 20
+#define LFN_CHARS_PER_ENTRY 13
+#define LFN_CHARS_MAX (LFN_ENTRIES_MAX * LFN_CHARS_PER_ENTRY)
+/* Enough for 255 UCS-2 characters encoded as UTF-8. */
+#define NAME_MAX_SIZE 1024
+#define SHORT_NAME_SIZE 13
+#define HANDLES_INITIAL_SIZE 64
+
+/* Directory entry fields. */
+#define DIRENT_ATTR 11
+#define DIRENT_CASE 12
+#define DIRENT_CLUSTER_HI 20
+#define DIRENT_CLUSTER_LO 26
+#define DIRENT_FREE 0xE5
+#define DIRENT_END 0x00
+#define DIRENT_CASE_LOWER_BASE 0x08
+#define DIRENT_CASE_LOWER_EXT 0x10
+#define ATTR_LFN 0x0F
+#define ATTR_RO_BIT 0x01
+#define ATTR_HIDDEN_BIT 0x02
+#define ATTR_SYS_BIT 0x04
+#define ATTR_VOLUME_BIT 0x08
+#define ATTR_DIR_BIT 0x10
+#define ATTR_ARCH_BIT 0x20
+#define ATTR_MASK 0x3F
+#define ATTR_CHANGEABLE (ATTR_RO_BIT | ATTR_HIDDEN_BIT | ATTR_SYS_BIT | \
+                         ATTR_ARCH_BIT)
+#define LFN_LAST 0x40
+#define LFN_SEQ_MASK 0x1F
+
+enum {
+    ENOERR = 0,
+    EOPEN,
+    EMAP,
+    EPARTITION,
+    EBPB,
+    EALLOC,
+    ESYNC
+};
+
+/* A file inside the image: its directory entry and, for directories, where
+   its entries are. The root directory doesn't have an entry. */
+struct fatNode {
+	int isRoot;
+	size_t entryOffset;
+	uint32_t firstCluster;
+};
+
+/* Position while walking the entries of a directory. */
+struct fatDirCursor {
+	int fixedRoot;
+	uint32_t cluster;
+	size_t index;
+	size_t clustersWalked;
+	/* Fake "." and ".." entries already returned (only for the root). */
+	int fakeEntries;
+};
+
+struct fatHandle {
+	struct fatNode node;
+	struct fatDirCursor cursor;
+	/* Where the next lookup of an entry of the directory starts: after the
+	   last one found, as the entries are usually opened in order. */
+	struct fatDirCursor lookup;
+};
+
+struct fatImage {
+	int fd;
+	int writable;
+	uint8_t *map;
+	size_t mapSize;
+	/* File system inside the map, may be a partition of the image. */
+	uint8_t *fs;
+	size_t fsSize;
+	int fatType;
+	uint32_t bytesPerSector;
+	uint32_t clusterSize;
+	uint32_t clusterCount;
+	size_t fatOffset;
+	size_t rootOffset;
+	uint32_t rootEntries;
+	uint32_t rootCluster;
+	size_t dataOffset;
+	/* Protects 'handles' and 'handlesSize', the handles themselves are only
+	   used by the thread that opened them. */
+	pthread_mutex_t lock;
+	struct fatHandle **handles;
+	size_t handlesSize;
+};
+
+static _Thread_local char errmsg[ERRMSG_MAX] = {0};
+
+/**
+ * Little endian reads.
+ */
+uint16_t fatImageRead16(const uint8_t *p);
+uint32_t fatImageRead32(const uint8_t *p);
+/**
+ * Parse the boot sector of the file system mapped in 'image->fs'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int fatImageParseBpb(struct fatImage *image);
+/**
+ * Returns the cluster following 'cluster' in its chain, or 0 if it's the
+ * last one or the chain is broken.
+ */
+uint32_t fatImageNextCluster(struct fatImage *image, uint32_t cluster);
+/**
+ * Initialize a cursor to walk the directory that starts in 'firstCluster'
+ * (0 for the root directory).
+ */
+void fatImageCursorInit(struct fatImage *image, struct fatDirCursor *cursor,
+                        uint32_t firstCluster);
+/**
+ * Returns the next raw directory entry of a cursor, or NULL at the end.
+ */
+uint8_t *fatImageCursorNext(struct fatImage *image,
+                            struct fatDirCursor *cursor);
+/**
+ * Returns the next file entry of a cursor, skipping free, LFN and volume
+ * label entries, or NULL at the end of the directory.
+ * Its long name (or its short name if it doesn't have one) is written in
+ * 'name', of size NAME_MAX_SIZE, and if not NULL its short name is written
+ * in 'shortName', of size SHORT_NAME_SIZE.
+ */
+uint8_t *fatImageNextFile(struct fatImage *image, struct fatDirCursor *cursor,
+                          char *name, char *shortName);
+/**
+ * Write the readable 8.3 name of a short entry, applying the lower case
+ * flags used by Windows NT and the vfat driver.
+ */
+void fatImageShortName(const uint8_t *entry, char *name);
+/**
+ * Returns the checksum of a short name, stored in its LFN entries.
+ */
+uint8_t fatImageLfnChecksum(const uint8_t *entry);
+/**
+ * Encode 'size' UCS-2 characters as UTF-8 in 'name', of size NAME_MAX_SIZE.
+ */
+void fatImageUcs2ToUtf8(const uint16_t *ucs, size_t size, char *name);
+/**
+ * Returns the first cluster of a directory entry.
+ */
+uint32_t fatImageEntryCluster(struct fatImage *image, const uint8_t *entry);
+/**
+ * Fill 'node' with the directory that starts at 'cluster', looking for its
+ * entry in its parent directory.
+ * Returns 0 on success, -1 and sets errno if an error happens.
+ */
+int fatImageLocateDir(struct fatImage *image, uint32_t cluster,
+                      struct fatNode *node);
+/**
+ * Replace 'node' with the entry 'name' of the directory 'node'. If 'hint'
+ * isn't NULL, it's a cursor of the directory where the search starts,
+ * wrapping around to the first entry, and it's left after the entry found:
+ * looking up the entries in directory order is linear instead of
+ * quadratic.
+ * Returns 0 on success, -1 and sets errno if an error happens.
+ */
+int fatImageLookup(struct fatImage *image, struct fatNode *node,
+                   const char *name, struct fatDirCursor *hint);
+/**
+ * Returns the handle structure of 'handle', or NULL and sets errno if it
+ * isn't a valid handle.
+ */
+struct fatHandle *fatImageGetHandle(struct fatImage *image, int handle);
+/**
+ * Returns !0 if 'node' is a directory.
+ */
+int fatImageIsDir(struct fatImage *image, const struct fatNode *node);
+/**
+ * Operations of the dosfs backend.
+ */
+int fatImageBackendOpenAt(void *data, int dirFd, const char *name);
+int fatImageBackendClose(void *data, int fd);
+int fatImageBackendGetAttributes(void *data, int fd, uint32_t *attrs);
+int fatImageBackendSetAttributes(void *data, int fd, uint32_t attrs);
+int fatImageBackendReadDir(void *data, int fd, char *name, size_t nameSize);
+int fatImageBackendSync(void *data, int fd, int scope);
+
+
+uint16_t fatImageRead16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+uint32_t fatImageRead32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	       ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int fatImageParseBpb(struct fatImage *image)
+{
+	const uint8_t *bpb = image->fs;
+	if (image->fsSize < SECTOR_SIZE ||
+	        bpb[510] != 0x55 || bpb[511] != 0xAA) {
+		return EBPB;
+	}
+	uint32_t bytesPerSector = fatImageRead16(bpb + 11);
+	uint32_t sectorsPerCluster = bpb[13];
+	uint32_t reservedSectors = fatImageRead16(bpb + 14);
+	uint32_t fatsSize = bpb[16];
+	uint32_t rootEntries = fatImageRead16(bpb + 17);
+	uint32_t totalSectors = fatImageRead16(bpb + 19);
+	uint32_t fatSectors = fatImageRead16(bpb + 22);
+	if (totalSectors == 0) {
+		totalSectors = fatImageRead32(bpb + 32);
+	}
+	if (fatSectors == 0) {
+		fatSectors = fatImageRead32(bpb + 36);
+	}
+	if ((bytesPerSector != 512 && bytesPerSector != 1024 &&
+	        bytesPerSector != 2048 && bytesPerSector != 4096) ||
+	        sectorsPerCluster == 0 ||
+	        (sectorsPerCluster & (sectorsPerCluster - 1)) != 0 ||
+	        reservedSectors == 0 || fatsSize == 0 || fatSectors == 0) {
+		return EBPB;
+	}
+	uint32_t rootSectors = (rootEntries * DIRENT_SIZE + bytesPerSector - 1) /
+	                       bytesPerSector;
+	uint64_t metaSectors = reservedSectors + (uint64_t)fatsSize * fatSectors +
+	                       rootSectors;
+	if (metaSectors >= totalSectors ||
+	        metaSectors * bytesPerSector > image->fsSize) {
+		return EBPB;
+	}
+	image->bytesPerSector = bytesPerSector;
+	image->clusterSize = bytesPerSector * sectorsPerCluster;
+	image->clusterCount = (uint32_t)((totalSectors - metaSectors) /
+	                                 sectorsPerCluster);
+	image->fatOffset = (size_t)reservedSectors * bytesPerSector;
+	image->rootOffset = image->fatOffset +
+	                    (size_t)fatsSize * fatSectors * bytesPerSector;
+	image->rootEntries = rootEntries;
+	image->dataOffset = image->rootOffset + (size_t)rootSectors * bytesPerSector;
+	/* The FAT type is defined only by the number of clusters. */
+	if (image->clusterCount < 4085) {
+		image->fatType = 12;
+	} else if (image->clusterCount < 65525) {
+		image->fatType = 16;
+	} else {
+		image->fatType = 32;
+		image->rootCluster = fatImageRead32(bpb + 44);
+		if (image->rootCluster < 2) {
+			return EBPB;
+		}
+	}
+	if (image->fatType != 32 && rootEntries == 0) {
+		return EBPB;
+	}
+	return ENOERR;
+}
+
+uint32_t fatImageNextCluster(struct fatImage *image, uint32_t cluster)
+{
+	size_t offset = 0;
+	uint32_t next = 0;
+	uint32_t endOfChain = 0;
+	switch (image->fatType) {
+	case 12:
+		offset = image->fatOffset + cluster + cluster / 2;
+		if (offset + 2 > image->fsSize) {
+			return 0;
+		}
+		next = fatImageRead16(image->fs + offset);
+		next = (cluster & 1) ? next >> 4 : next & 0x0FFF;
+		endOfChain = 0x0FF7;
+		break;
+	case 16:
+		offset = image->fatOffset + (size_t)cluster * 2;
+		if (offset + 2 > image->fsSize) {
+			return 0;
+		}
+		next = fatImageRead16(image->fs + offset);
+		endOfChain = 0xFFF7;
+		break;
+	default:
+		offset = image->fatOffset + (size_t)cluster * 4;
+		if (offset + 4 > image->fsSize) {
+			return 0;
+		}
+		next = fatImageRead32(image->fs + offset) & 0x0FFFFFFF;
+		endOfChain = 0x0FFFFFF7;
+	}
+	/* Bad clusters (endOfChain itself) and end of chain marks. */
+	if (next < 2 || next >= endOfChain || next > image->clusterCount + 1) {
+		return 0;
+	}
+	return next;
+}
+
+void fatImageCursorInit(struct fatImage *image, struct fatDirCursor *cursor,
+                        uint32_t firstCluster)
+{
+	memset(cursor, 0, sizeof(struct fatDirCursor));
+	if (firstCluster == 0 && image->fatType != 32) {
+		cursor->fixedRoot = TRUE;
+	} else {
+		cursor->cluster = firstCluster == 0 ? image->rootCluster : firstCluster;
+	}
+}
+
+uint8_t *fatImageCursorNext(struct fatImage *image,
+                            struct fatDirCursor *cursor)
+{
+	if (cursor->fixedRoot) {
+		if (cursor->index >= image->rootEntries) {
+			return NULL;
+		}
+		return image->fs + image->rootOffset +
+		       cursor->index++ * DIRENT_SIZE;
+	}
+	if (cursor->cluster < 2 || cursor->cluster > image->clusterCount + 1) {
+		return NULL;
+	}
+	if (cursor->index == image->clusterSize / DIRENT_SIZE) {
+		cursor->cluster = fatImageNextCluster(image, cursor->cluster);
+		cursor->index = 0;
+		/* A chain longer than the file system is a loop. */
+		if (cursor->cluster == 0 ||
+		        ++cursor->clustersWalked > image->clusterCount) {
+			cursor->cluster = 0;
+			return NULL;
+		}
+	}
+	size_t offset = image->dataOffset +
+	                (size_t)(cursor->cluster - 2) * image->clusterSize +
+	                cursor->index * DIRENT_SIZE;
+	if (offset + DIRENT_SIZE > image->fsSize) {
+		return NULL;
+	}
+	cursor->index++;
+	return image->fs + offset;
+}
+
+uint8_t *fatImageNextFile(struct fatImage *image, struct fatDirCursor *cursor,
+                          char *name, char *shortName)
+{
+	uint16_t lfn[LFN_CHARS_MAX];
+	int lfnValid = FALSE;
+	int lfnSeq = 0;
+	int lfnEntries = 0;
+	uint8_t lfnChecksum = 0;
+	uint8_t *entry = NULL;
+	while ((entry = fatImageCursorNext(image, cursor)) != NULL) {
+		if (entry[0] == DIRENT_END) {
+			/* Nothing is stored after the end mark, don't read past it the
+			   next time either. */
+			cursor->index--;
+			return NULL;
+		}
+		if (entry[0] == DIRENT_FREE) {
+			lfnValid = FALSE;
+			continue;
+		}
+		if ((entry[DIRENT_ATTR] & ATTR_MASK) == ATTR_LFN) {
+			int seq = entry[0] & LFN_SEQ_MASK;
+			if (entry[0] & LFN_LAST) {
+				lfnValid = seq >= 1 && seq <= LFN_ENTRIES_MAX;
+				lfnEntries = seq;
+				lfnChecksum = entry[13];
+			} else if (!lfnValid || seq != lfnSeq - 1 ||
+			           entry[13] != lfnChecksum) {
+				lfnValid = FALSE;
+			}
+			lfnSeq = seq;
+			if (lfnValid) {
+				static const int charOffsets[LFN_CHARS_PER_ENTRY] = {
+					1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30
+				};
+				for (int i = 0; i < LFN_CHARS_PER_ENTRY; i++) {
+					lfn[(seq - 1) * LFN_CHARS_PER_ENTRY + i] =
+					    fatImageRead16(entry + charOffsets[i]);
+				}
+			}
+			continue;
+		}
+		if (entry[DIRENT_ATTR] & ATTR_VOLUME_BIT) {
+			lfnValid = FALSE;
+			continue;
+		}
+		char entryShortName[SHORT_NAME_SIZE];
+		fatImageShortName(entry, entryShortName);
+		if (lfnValid && lfnSeq == 1 &&
+		        fatImageLfnChecksum(entry) == lfnChecksum) {
+			size_t size = 0;
+			while (size < (size_t)lfnEntries * LFN_CHARS_PER_ENTRY &&
+			        lfn[size] != 0x0000 && lfn[size] != 0xFFFF) {
+				size++;
+			}
+			fatImageUcs2ToUtf8(lfn, size, name);
+		} else {
+			strcpy(name, entryShortName);
+		}
+		if (shortName != NULL) {
+			strcpy(shortName, entryShortName);
+		}
+		return entry;
+	}
+	return NULL;
+}
+
+void fatImageShortName(const uint8_t *entry, char *name)
+{
+	size_t len = 0;
+	size_t baseEnd = 8;
+	while (baseEnd > 0 && entry[baseEnd - 1] == ' ') {
+		baseEnd--;
+	}
+	for (size_t i = 0; i < baseEnd; i++) {
+		char c = (char)entry[i];
+		if (i == 0 && entry[0] == 0x05) {
+			c = (char)DIRENT_FREE;
+		}
+		if ((entry[DIRENT_CASE] & DIRENT_CASE_LOWER_BASE) &&
+		        c >= 'A' && c <= 'Z') {
+			c = (char)(c - 'A' + 'a');
+		}
+		name[len++] = c;
+	}
+	size_t extEnd = 11;
+	while (extEnd > 8 && entry[extEnd - 1] == ' ') {
+		extEnd--;
+	}
+	if (extEnd > 8) {
+		name[len++] = '.';
+	}
+	for (size_t i = 8; i < extEnd; i++) {
+		char c = (char)entry[i];
+		if ((entry[DIRENT_CASE] & DIRENT_CASE_LOWER_EXT) &&
+		        c >= 'A' && c <= 'Z') {
+			c = (char)(c - 'A' + 'a');
+		}
+		name[len++] = c;
+	}
+	name[len] = '\0';
+}
+
+uint8_t fatImageLfnChecksum(const uint8_t *entry)
+{
+	uint8_t sum = 0;
+	for (int i = 0; i < 11; i++) {
+		sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + entry[i]);
+	}
+	return sum;
+}
+
+void fatImageUcs2ToUtf8(const uint16_t *ucs, size_t size, char *name)
+{
+	size_t len = 0;
+	for (size_t i = 0; i < size && len + 5 < NAME_MAX_SIZE; i++) {
+		uint32_t c = ucs[i];
+		if (c >= 0xD800 && c < 0xDC00 && i + 1 < size &&
+		        ucs[i + 1] >= 0xDC00 && ucs[i + 1] < 0xE000) {
+			c = 0x10000 + ((c - 0xD800) << 10) + (ucs[i + 1] - 0xDC00);
+			i++;
+		}
+		if (c < 0x80) {
+			name[len++] = (char)c;
+		} else if (c < 0x800) {
+			name[len++] = (char)(0xC0 | (c >> 6));
+			name[len++] = (char)(0x80 | (c & 0x3F));
+		} else if (c < 0x10000) {
+			name[len++] = (char)(0xE0 | (c >> 12));
+			name[len++] = (char)(0x80 | ((c >> 6) & 0x3F));
+			name[len++] = (char)(0x80 | (c & 0x3F));
+		} else {
+			name[len++] = (char)(0xF0 | (c >> 18));
+			name[len++] = (char)(0x80 | ((c >> 12) & 0x3F));
+			name[len++] = (char)(0x80 | ((c >> 6) & 0x3F));
+			name[len++] = (char)(0x80 | (c & 0x3F));
+		}
+	}
+	name[len] = '\0';
+}
+
+uint32_t fatImageEntryCluster(struct fatImage *image, const uint8_t *entry)
+{
+	uint32_t cluster = fatImageRead16(entry + DIRENT_CLUSTER_LO);
+	if (image->fatType == 32) {
+		cluster |= (uint32_t)fatImageRead16(entry + DIRENT_CLUSTER_HI) << 16;
+	}
+	return cluster;
+}
+
+int fatImageLocateDir(struct fatImage *image, uint32_t cluster,
+                      struct fatNode *node)
+{
+	if (cluster == 0 || (image->fatType == 32 &&
+	                     cluster == image->rootCluster)) {
+		node->isRoot = TRUE;
+		node->entryOffset = 0;
+		node->firstCluster = 0;
+		return 0;
+	}
+	/* The ".." entry of the directory tells where its parent is, then the
+	   directory entry is the one in the parent pointing to 'cluster'. */
+	char name[NAME_MAX_SIZE];
+	struct fatDirCursor cursor;
+	fatImageCursorInit(image, &cursor, cluster);
+	uint8_t *entry = NULL;
+	uint32_t parentCluster = 0;
+	int found = FALSE;
+	while (!found &&
+	        (entry = fatImageNextFile(image, &cursor, name, NULL)) != NULL) {
+		if (strcmp(name, "..") == 0) {
+			parentCluster = fatImageEntryCluster(image, entry);
+			found = TRUE;
+		}
+	}
+	if (!found) {
+		errno = EIO;
+		return -1;
+	}
+	fatImageCursorInit(image, &cursor, parentCluster);
+	while ((entry = fatImageNextFile(image, &cursor, name, NULL)) != NULL) {
+		if ((entry[DIRENT_ATTR] & ATTR_DIR_BIT) &&
+		        fatImageEntryCluster(image, entry) == cluster &&
+		        strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+			node->isRoot = FALSE;
+			node->entryOffset = (size_t)(entry - image->fs);
+			node->firstCluster = cluster;
+			return 0;
+		}
+	}
+	errno = EIO;
+	return -1;
+}
+
+int fatImageIsDir(struct fatImage *image, const struct fatNode *node)
+{
+	return node->isRoot ||
+	       (image->fs[node->entryOffset + DIRENT_ATTR] & ATTR_DIR_BIT);
+}
+
+int fatImageLookup(struct fatImage *image, struct fatNode *node,
+                   const char *name, struct fatDirCursor *hint)
+{
+	if (!fatImageIsDir(image, node)) {
+		errno = ENOTDIR;
+		return -1;
+	}
+	if (strcmp(name, ".") == 0) {
+		return 0;
+	}
+	if (strcmp(name, "..") == 0) {
+		if (node->isRoot) {
+			return 0;
+		}
+		struct fatDirCursor cursor;
+		fatImageCursorInit(image, &cursor, node->firstCluster);
+		char entryName[NAME_MAX_SIZE];
+		uint8_t *entry = NULL;
+		while ((entry = fatImageNextFile(image, &cursor,
+		                                 entryName, NULL)) != NULL) {
+			if (strcmp(entryName, "..") == 0) {
+				return fatImageLocateDir(image,
+				                         fatImageEntryCluster(image, entry),
+				                         node);
+			}
+		}
+		errno = EIO;
+		return -1;
+	}
+	struct fatDirCursor cursor;
+	char longName[NAME_MAX_SIZE];
+	char shortName[SHORT_NAME_SIZE];
+	uint8_t *entry = NULL;
+	/* From the hint to the end, then from the start. */
+	for (int pass = hint != NULL ? 0 : 1; pass < 2; pass++) {
+		if (pass == 0) {
+			cursor = *hint;
+		} else {
+			fatImageCursorInit(image, &cursor, node->firstCluster);
+		}
+		while ((entry = fatImageNextFile(image, &cursor,
+		                                 longName, shortName)) != NULL) {
+			if (strcasecmp(name, longName) == 0 ||
+			        strcasecmp(name, shortName) == 0) {
+				if (hint != NULL) {
+					*hint = cursor;
+				}
+				node->isRoot = FALSE;
+				node->entryOffset = (size_t)(entry - image->fs);
+				node->firstCluster = fatImageEntryCluster(image, entry);
+				return 0;
+			}
+		}
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+struct fatHandle *fatImageGetHandle(struct fatImage *image, int handle)
+{
+	struct fatHandle *result = NULL;
+	pthread_mutex_lock(&image->lock);
+	if (handle >= 0 && (size_t)handle < image->handlesSize) {
+		result = image->handles[handle];
+	}
+	pthread_mutex_unlock(&image->lock);
+	if (result == NULL) {
+		errno = EBADF;
+	}
+	return result;
+}
+
+int fatImageBackendOpenAt(void *data, int dirFd, const char *name)
+{
+	return fatImageOpenAt(data, dirFd, name);
+}
+
+int fatImageBackendClose(void *data, int fd)
+{
+	return fatImageCloseHandle(data, fd);
+}
+
+int fatImageBackendGetAttributes(void *data, int fd, uint32_t *attrs)
+{
+	return fatImageGetAttributes(data, fd, attrs);
+}
+
+int fatImageBackendSetAttributes(void *data, int fd, uint32_t attrs)
+{
+	return fatImageSetAttributes(data, fd, attrs);
+}
+
+int fatImageBackendReadDir(void *data, int fd, char *name, size_t nameSize)
+{
+	return fatImageReadDir(data, fd, name, nameSize);
+}
+
+int fatImageBackendSync(void *data, int fd, int scope)
+{
+	return fatImageSync(data, fd, scope);
+}
+
+
+const char *fatImageGetError(int err)
+{
+	switch (err) {
+	case ENOERR:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "No error occurred");
+		break;
+	case EOPEN:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error opening image: %s",
+		         strerror(errno));
+		break;
+	case EMAP:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error mapping image: %s",
+		         strerror(errno));
+		break;
+	case EPARTITION:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "The partition doesn't exist in the image's MBR");
+		break;
+	case EBPB:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "The image doesn't contain a valid FAT file system");
+		break;
+	case EALLOC:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error allocating memory: %s",
+		         strerror(errno));
+		break;
+	case ESYNC:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error writing image changes: %s",
+		         strerror(errno));
+		break;
+	default:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Unknown error");
+	}
+	return errmsg;
+}
+
+int fatImageOpen(const char *file, unsigned int partition,
+                 struct fatImage **image)
+{
+	assert(file != NULL);
+	assert(image != NULL);
+	struct fatImage *newImage = calloc(1, sizeof(struct fatImage));
+	if (newImage == NULL) {
+		return EALLOC;
+	}
+	/* Images without write permission can still be printed. */
+	newImage->writable = TRUE;
+	newImage->fd = open(file, O_RDWR);
+	if (newImage->fd == -1 && (errno == EACCES || errno == EROFS)) {
+		newImage->writable = FALSE;
+		newImage->fd = open(file, O_RDONLY);
+	}
+	if (newImage->fd == -1) {
+		free(newImage);
+		return EOPEN;
+	}
+	struct stat st;
+	if (fstat(newImage->fd, &st) != 0) {
+		close(newImage->fd);
+		free(newImage);
+		return EOPEN;
+	}
+	newImage->mapSize = (size_t)st.st_size;
+	if (newImage->mapSize < SECTOR_SIZE) {
+		close(newImage->fd);
+		free(newImage);
+		return EBPB;
+	}
+	newImage->map = mmap(NULL, newImage->mapSize,
+	                     PROT_READ | (newImage->writable ? PROT_WRITE : 0),
+	                     MAP_SHARED, newImage->fd, 0);
+	if (newImage->map == MAP_FAILED) {
+		close(newImage->fd);
+		free(newImage);
+		return EMAP;
+	}
+	newImage->fs = newImage->map;
+	newImage->fsSize = newImage->mapSize;
+	int imageErrno = ENOERR;
+	if (partition > 0) {
+		const uint8_t *mbr = newImage->map;
+		const uint8_t *part = mbr + 446 + 16 * (partition - 1);
+		uint64_t start = (uint64_t)fatImageRead32(part + 8) * SECTOR_SIZE;
+		uint64_t size = (uint64_t)fatImageRead32(part + 12) * SECTOR_SIZE;
+		if (partition > 4 || mbr[510] != 0x55 || mbr[511] != 0xAA ||
+		        part[4] == 0 || size == 0 || start >= newImage->mapSize) {
+			imageErrno = EPARTITION;
+		} else {
+			newImage->fs = newImage->map + start;
+			newImage->fsSize = newImage->mapSize - start;
+			if (size < newImage->fsSize) {
+				newImage->fsSize = size;
+			}
+		}
+	}
+	if (!imageErrno) {
+		imageErrno = fatImageParseBpb(newImage);
+	}
+	if (!imageErrno) {
+		newImage->handles = calloc(HANDLES_INITIAL_SIZE,
+		                           sizeof(struct fatHandle *));
+		if (newImage->handles == NULL) {
+			imageErrno = EALLOC;
+		}
+		newImage->handlesSize = HANDLES_INITIAL_SIZE;
+	}
+	if (imageErrno) {
+		munmap(newImage->map, newImage->mapSize);
+		close(newImage->fd);
+		free(newImage);
+		return imageErrno;
+	}
+	pthread_mutex_init(&newImage->lock, NULL);
+	*image = newImage;
+	return ENOERR;
+}
+
+int fatImageClose(struct fatImage *image)
+{
+	assert(image != NULL);
+	int imageErrno = ENOERR;
+	if (image->writable && msync(image->map, image->mapSize, MS_SYNC) != 0) {
+		imageErrno = ESYNC;
+	}
+	munmap(image->map, image->mapSize);
+	close(image->fd);
+	for (size_t i = 0; i < image->handlesSize; i++) {
+		free(image->handles[i]);
+	}
+	free(image->handles);
+	pthread_mutex_destroy(&image->lock);
+	free(image);
+	return imageErrno;
+}
+
+void fatImageGetBackend(struct fatImage *image, struct dosfsBackend *backend)
+{
+	assert(image != NULL);
+	assert(backend != NULL);
+	backend->name = "image";
+	backend->data = image;
+	backend->openAt = fatImageBackendOpenAt;
+	backend->close = fatImageBackendClose;
+	backend->getAttributes = fatImageBackendGetAttributes;
+	backend->setAttributes = fatImageBackendSetAttributes;
+	backend->readDir = fatImageBackendReadDir;
+	backend->getDents = NULL;
+	backend->seekDir = NULL;
+	/* FAT has no inode numbers, nor a time changed with the attributes. */
+	backend->stat = NULL;
+	backend->sync = fatImageBackendSync;
+}
+
+int fatImageOpenAt(struct fatImage *image, int dirHandle, const char *name)
+{
+	assert(image != NULL);
+	assert(name != NULL);
+	struct fatHandle *handle = calloc(1, sizeof(struct fatHandle));
+	if (handle == NULL) {
+		return -1;
+	}
+	handle->node.isRoot = TRUE;
+	/* Only the first component is looked up in the directory 'dirHandle'. */
+	struct fatDirCursor *hint = NULL;
+	if (dirHandle >= 0 && name[0] != '/') {
+		struct fatHandle *dir = fatImageGetHandle(image, dirHandle);
+		if (dir == NULL) {
+			free(handle);
+			return -1;
+		}
+		handle->node = dir->node;
+		hint = &dir->lookup;
+	}
+	char component[NAME_MAX_SIZE];
+	const char *next = name;
+	while (*next != '\0') {
+		while (*next == '/') {
+			next++;
+		}
+		size_t len = strcspn(next, "/");
+		if (len == 0) {
+			break;
+		}
+		if (len >= NAME_MAX_SIZE) {
+			free(handle);
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memcpy(component, next, len);
+		component[len] = '\0';
+		next += len;
+		if (fatImageLookup(image, &handle->node, component, hint) != 0) {
+			free(handle);
+			return -1;
+		}
+		hint = NULL;
+	}
+	fatImageCursorInit(image, &handle->cursor, handle->node.firstCluster);
+	handle->lookup = handle->cursor;
+	pthread_mutex_lock(&image->lock);
+	size_t index = 0;
+	while (index < image->handlesSize && image->handles[index] != NULL) {
+		index++;
+	}
+	if (index == image->handlesSize) {
+		struct fatHandle **newHandles = realloc(image->handles,
+		                                        sizeof(struct fatHandle *) *
+		                                        image->handlesSize * 2);
+		if (newHandles == NULL) {
+			pthread_mutex_unlock(&image->lock);
+			free(handle);
+			return -1;
+		}
+		memset(newHandles + image->handlesSize, 0,
+		       sizeof(struct fatHandle *) * image->handlesSize);
+		image->handles = newHandles;
+		image->handlesSize *= 2;
+	}
+	image->handles[index] = handle;
+	pthread_mutex_unlock(&image->lock);
+	return (int)index;
+}
+
+int fatImageCloseHandle(struct fatImage *image, int handle)
+{
+	assert(image != NULL);
+	struct fatHandle *result = NULL;
+	pthread_mutex_lock(&image->lock);
+	if (handle >= 0 && (size_t)handle < image->handlesSize) {
+		result = image->handles[handle];
+		image->handles[handle] = NULL;
+	}
+	pthread_mutex_unlock(&image->lock);
+	if (result == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	free(result);
+	return 0;
+}
+
+int fatImageGetAttributes(struct fatImage *image, int handle,
+                          uint32_t *attrs)
+{
+	assert(image != NULL);
+	assert(attrs != NULL);
+	struct fatHandle *h = fatImageGetHandle(image, handle);
+	if (h == NULL) {
+		return -1;
+	}
+	if (h->node.isRoot) {
+		*attrs = ATTR_DIR_BIT;
+	} else {
+		*attrs = image->fs[h->node.entryOffset + DIRENT_ATTR] & ATTR_MASK;
+	}
+	return 0;
+}
+
+int fatImageSetAttributes(struct fatImage *image, int handle,
+                          uint32_t attrs)
+{
+	assert(image != NULL);
+	struct fatHandle *h = fatImageGetHandle(image, handle);
+	if (h == NULL) {
+		return -1;
+	}
+	/* The root directory doesn't have an entry to store its attributes, the
+	   vfat driver ignores the changes too. */
+	if (h->node.isRoot) {
+		return 0;
+	}
+	uint8_t *attrByte = image->fs + h->node.entryOffset + DIRENT_ATTR;
+	uint8_t newAttrs = (uint8_t)((attrs & ATTR_CHANGEABLE) |
+	                             (*attrByte & ~ATTR_CHANGEABLE));
+	/* Writing the same value would dirty the page anyway. */
+	if (newAttrs != *attrByte) {
+		if (!image->writable) {
+			errno = EROFS;
+			return -1;
+		}
+		*attrByte = newAttrs;
+	}
+	return 0;
+}
+
+int fatImageReadDir(struct fatImage *image, int handle,
+                    char *name, size_t nameSize)
+{
+	assert(image != NULL);
+	assert(name != NULL);
+	struct fatHandle *h = fatImageGetHandle(image, handle);
+	if (h == NULL) {
+		return -1;
+	}
+	if (!fatImageIsDir(image, &h->node)) {
+		errno = ENOTDIR;
+		return -1;
+	}
+	char entryName[NAME_MAX_SIZE];
+	if (h->node.isRoot && h->cursor.fakeEntries < 2) {
+		strcpy(entryName, h->cursor.fakeEntries == 0 ? "." : "..");
+		h->cursor.fakeEntries++;
+	} else if (fatImageNextFile(image, &h->cursor, entryName, NULL) == NULL) {
+		return 0;
+	}
+	if (strlen(entryName) >= nameSize) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(name, entryName);
+	return 1;
+}
+
+int fatImageSync(struct fatImage *image, int handle, int scope)
+{
+	assert(image != NULL);
+	struct fatHandle *h = fatImageGetHandle(image, handle);
+	if (h == NULL) {
+		return -1;
+	}
+	if (!image->writable) {
+		return 0;
+	}
+	if (scope != DOSFS_SYNC_FILE) {
+		return msync(image->map, image->mapSize, MS_SYNC);
+	}
+	if (h->node.isRoot) {
+		return 0;
+	}
+	/* The entries are 32 byte aligned, so one never crosses a page. */
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	size_t offset = (size_t)(image->fs - image->map) + h->node.entryOffset;
+	size_t start = offset - offset % pageSize;
+	size_t size = image->mapSize - start < pageSize ?
+	              image->mapSize - start : pageSize;
+	return msync(image->map + start, size, MS_SYNC);
+}
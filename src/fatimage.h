@@ -0,0 +1,110 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FATIMAGE_H__
+#define __FATIMAGE_H__
+
+#include "dosfs.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Access to the files of a FAT12/16/32 file system stored in a raw image,
+ * without mounting it.
+ * The image is memory mapped and the attribute changes are written in place
+ * in the attribute byte of the 32 byte directory entries, so only the pages
+ * holding the touched entries get dirty.
+ *
+ * Files are accessed through handles that behave like file descriptors: the
+ * functions that work with them return -1 and set errno on error, like the
+ * system calls they replace.
+ */
+struct fatImage;
+
+/* Handle meaning "the root directory" for fatImageOpenAt. */
+#define FATIMAGE_ROOT (-1)
+
+/**
+ * Returns a descriptive message associated with an error code returned by
+ * fatImageOpen.
+ */
+const char *fatImageGetError(int err);
+/**
+ * Map the image 'file' and parse its FAT file system.
+ * If 'partition' is 0 the file system starts at the beginning of the image,
+ * otherwise it's read from the primary partition 'partition' (1-4) of the
+ * image's MBR.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int fatImageOpen(const char *file, unsigned int partition,
+                 struct fatImage **image);
+/**
+ * Write back the changes and unmap the image.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int fatImageClose(struct fatImage *image);
+/**
+ * Fill 'backend' with the dosfs backend that works on the files of 'image'.
+ */
+void fatImageGetBackend(struct fatImage *image, struct dosfsBackend *backend);
+/**
+ * Open the file 'name' relative to the directory handle 'dirHandle'.
+ * Absolute names and FATIMAGE_ROOT (or any negative handle) start at the
+ * root directory. Names are matched case insensitively against both the
+ * long and the short name, like the vfat driver does.
+ * Returns the new handle, or -1 if an error happens.
+ */
+int fatImageOpenAt(struct fatImage *image, int dirHandle, const char *name);
+/**
+ * Close a handle.
+ * Returns 0 on success, -1 if an error happens.
+ */
+int fatImageCloseHandle(struct fatImage *image, int handle);
+/**
+ * Get the attributes of the file of a handle.
+ * Returns 0 on success, -1 if an error happens.
+ */
+int fatImageGetAttributes(struct fatImage *image, int handle,
+                          uint32_t *attrs);
+/**
+ * Set the attributes of the file of a handle. As with the vfat driver, the
+ * directory and volume label attributes can't be changed and the changes to
+ * the root directory are ignored.
+ * Returns 0 on success, -1 if an error happens.
+ */
+int fatImageSetAttributes(struct fatImage *image, int handle,
+                          uint32_t attrs);
+/**
+ * Read the next entry of the directory of a handle, writing at most
+ * 'nameSize' - 1 characters of its name in 'name'.
+ * The root directory returns "." and ".." first, like the vfat driver.
+ * Returns 1 if an entry was read, 0 at the end of the directory or -1 if an
+ * error happens; errno is ENAMETOOLONG if the name doesn't fit in 'name'.
+ */
+int fatImageReadDir(struct fatImage *image, int handle,
+                    char *name, size_t nameSize);
+/**
+ * Write back to the image file the changes 'scope' (DOSFS_SYNC_*) of the
+ * file of a handle: the page of its directory entry with DOSFS_SYNC_FILE,
+ * every change of the image otherwise.
+ * Returns 0 on success, -1 if an error happens.
+ */
+int fatImageSync(struct fatImage *image, int handle, int scope);
+
+#endif /* __FATIMAGE_H__ */
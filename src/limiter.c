@@ -0,0 +1,285 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "limiter.h"
+#include "bool.h"
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <assert.h>
+
+#define ERRMSG_MAX 1025
+/* Minimum duration of a window, in ns. */
+#define WINDOW_MIN_NS 10000000
+/* Without a latency target, a window is congested when its average latency
+   is over this many times the lowest one. */
+#define LATENCY_TOLERANCE 2
+/* Fraction of the previous throughput below which an increase is undone. */
+#define THROUGHPUT_DROP 0.9
+
+enum {
+    ENOERR = 0,
+    EALLOC
+};
+
+struct limiter {
+	/* Protects everything below. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t maxLimit;
+	uint64_t targetNs;
+	size_t limit;
+	size_t inFlight;
+	/* Doubling the limit, until the first congested window. */
+	int slowStart;
+	/* The last window increased the limit. */
+	int increased;
+	/* Current window. */
+	uint64_t windowStart;
+	uint64_t windowOps;
+	uint64_t windowLatencyNs;
+	/* Most operations in flight at once in the current window. */
+	size_t windowPeak;
+	/* Throughput of the previous window, operations per second. */
+	double lastThroughput;
+	/* Lowest average latency of a window. */
+	uint64_t minLatencyNs;
+	/* Totals for the report. */
+	uint64_t firstNs;
+	uint64_t lastNs;
+	uint64_t operations;
+	uint64_t latencyNs;
+	/* Sum of 'inFlight' multiplied by the time it lasted, up to
+	   'inFlightNs'. */
+	double inFlightTime;
+	uint64_t inFlightNs;
+	size_t peakInFlight;
+	size_t minLimit;
+	size_t reachedLimit;
+	size_t increases;
+	size_t decreases;
+};
+
+static _Thread_local char errmsg[ERRMSG_MAX] = {0};
+
+/**
+ * Returns the time of the monotonic clock, in ns.
+ */
+uint64_t limiterNow(void);
+/**
+ * Add the operations in flight since the last change of 'inFlight' to
+ * 'inFlightTime', before changing it at 'now'.
+ */
+void limiterCount(struct limiter *limiter, uint64_t now);
+/**
+ * Close the window that ends at 'now' and adjust the limit.
+ */
+void limiterAdjust(struct limiter *limiter, uint64_t now);
+
+
+uint64_t limiterNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void limiterCount(struct limiter *limiter, uint64_t now)
+{
+	if (limiter->inFlightNs > 0 && now > limiter->inFlightNs) {
+		limiter->inFlightTime += (double)limiter->inFlight *
+		                         (double)(now - limiter->inFlightNs);
+	}
+	limiter->inFlightNs = now;
+}
+
+void limiterAdjust(struct limiter *limiter, uint64_t now)
+{
+	uint64_t duration = now - limiter->windowStart;
+	uint64_t latency = limiter->windowLatencyNs / limiter->windowOps;
+	double throughput = limiter->windowOps * 1e9 / (double)duration;
+	int congested;
+	if (limiter->targetNs > 0) {
+		congested = latency > limiter->targetNs;
+	} else {
+		if (limiter->minLatencyNs == 0 || latency < limiter->minLatencyNs) {
+			limiter->minLatencyNs = latency;
+		}
+		congested = latency > limiter->minLatencyNs * LATENCY_TOLERANCE ||
+		            (limiter->increased &&
+		             throughput < limiter->lastThroughput * THROUGHPUT_DROP);
+	}
+	limiter->increased = FALSE;
+	/* A limit the operations didn't reach isn't raised, there aren't
+	   enough of them ready to use a higher one. */
+	if (congested && limiter->limit > 1) {
+		limiter->limit /= 2;
+		limiter->slowStart = FALSE;
+		limiter->decreases++;
+	} else if (!congested && limiter->limit < limiter->maxLimit &&
+	           limiter->windowPeak >= limiter->limit) {
+		limiter->limit = limiter->slowStart ? limiter->limit * 2 :
+		                 limiter->limit + 1;
+		if (limiter->limit > limiter->maxLimit) {
+			limiter->limit = limiter->maxLimit;
+		}
+		limiter->increased = TRUE;
+		limiter->increases++;
+		pthread_cond_broadcast(&limiter->cond);
+	}
+	if (limiter->limit < limiter->minLimit) {
+		limiter->minLimit = limiter->limit;
+	}
+	if (limiter->limit > limiter->reachedLimit) {
+		limiter->reachedLimit = limiter->limit;
+	}
+	limiter->lastThroughput = throughput;
+	limiter->windowStart = now;
+	limiter->windowOps = 0;
+	limiter->windowLatencyNs = 0;
+	limiter->windowPeak = limiter->inFlight;
+}
+
+const char *limiterGetError(int err)
+{
+	switch (err) {
+	case ENOERR:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "No error occurred");
+		break;
+	case EALLOC:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error allocating memory: %s",
+		         strerror(errno));
+		break;
+	default:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Unknown error");
+	}
+	return errmsg;
+}
+
+int limiterCreate(struct limiter **limiter, size_t maxLimit,
+                  uint64_t targetNs)
+{
+	assert(limiter != NULL);
+	assert(maxLimit > 0);
+	struct limiter *newLimiter = calloc(1, sizeof(struct limiter));
+	if (newLimiter == NULL) {
+		return EALLOC;
+	}
+	pthread_mutex_init(&newLimiter->lock, NULL);
+	pthread_cond_init(&newLimiter->cond, NULL);
+	newLimiter->maxLimit = maxLimit;
+	newLimiter->targetNs = targetNs;
+	newLimiter->limit = 1;
+	newLimiter->slowStart = TRUE;
+	newLimiter->minLimit = 1;
+	newLimiter->reachedLimit = 1;
+	*limiter = newLimiter;
+	return ENOERR;
+}
+
+void limiterDestroy(struct limiter *limiter)
+{
+	if (limiter == NULL) {
+		return;
+	}
+	assert(limiter->inFlight == 0);
+	pthread_mutex_destroy(&limiter->lock);
+	pthread_cond_destroy(&limiter->cond);
+	free(limiter);
+}
+
+void limiterEnter(struct limiter *limiter)
+{
+	assert(limiter != NULL);
+	pthread_mutex_lock(&limiter->lock);
+	while (limiter->inFlight >= limiter->limit) {
+		pthread_cond_wait(&limiter->cond, &limiter->lock);
+	}
+	uint64_t now = limiterNow();
+	if (limiter->firstNs == 0) {
+		limiter->firstNs = now;
+		limiter->windowStart = now;
+	}
+	limiterCount(limiter, now);
+	limiter->inFlight++;
+	if (limiter->inFlight > limiter->windowPeak) {
+		limiter->windowPeak = limiter->inFlight;
+	}
+	if (limiter->inFlight > limiter->peakInFlight) {
+		limiter->peakInFlight = limiter->inFlight;
+	}
+	pthread_mutex_unlock(&limiter->lock);
+}
+
+void limiterLeave(struct limiter *limiter, uint64_t latencyNs)
+{
+	assert(limiter != NULL);
+	uint64_t now = limiterNow();
+	pthread_mutex_lock(&limiter->lock);
+	assert(limiter->inFlight > 0);
+	limiterCount(limiter, now);
+	limiter->inFlight--;
+	limiter->lastNs = now;
+	limiter->operations++;
+	limiter->latencyNs += latencyNs;
+	limiter->windowOps++;
+	limiter->windowLatencyNs += latencyNs;
+	if (limiter->windowOps >= 2 * limiter->limit &&
+	        now - limiter->windowStart >= WINDOW_MIN_NS) {
+		limiterAdjust(limiter, now);
+	}
+	if (limiter->inFlight < limiter->limit) {
+		pthread_cond_signal(&limiter->cond);
+	}
+	pthread_mutex_unlock(&limiter->lock);
+}
+
+void limiterGetReport(struct limiter *limiter, struct limiterReport *report)
+{
+	assert(limiter != NULL);
+	assert(report != NULL);
+	pthread_mutex_lock(&limiter->lock);
+	report->limit = limiter->limit;
+	report->minLimit = limiter->minLimit;
+	report->maxLimit = limiter->reachedLimit;
+	report->increases = limiter->increases;
+	report->decreases = limiter->decreases;
+	report->operations = limiter->operations;
+	report->averageInFlight = 0;
+	report->peakInFlight = limiter->peakInFlight;
+	report->throughput = 0;
+	report->averageLatencyNs = 0;
+	if (limiter->operations > 0 && limiter->lastNs > limiter->firstNs) {
+		uint64_t elapsed = limiter->lastNs - limiter->firstNs;
+		report->averageInFlight = limiter->inFlightTime / (double)elapsed;
+		report->throughput = limiter->operations * 1e9 / (double)elapsed;
+	}
+	if (limiter->operations > 0) {
+		report->averageLatencyNs = limiter->latencyNs / limiter->operations;
+	}
+	pthread_mutex_unlock(&limiter->lock);
+}
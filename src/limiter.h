@@ -0,0 +1,95 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __LIMITER_H__
+#define __LIMITER_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Adaptive limit of the operations in flight, tuned from their latency with
+ * an AIMD controller.
+ *
+ * The completed operations are measured in windows of at least 10 ms and
+ * twice the current limit. At the end of every window the limit grows by
+ * one, or doubles until the first decrease (slow start), unless the window
+ * was congested, then it's halved:
+ * - With a latency target, a window is congested when its average latency
+ *   is over the target.
+ * - Without it the limit looks for the maximum throughput: a window is
+ *   congested when its average latency is more than twice the lowest one
+ *   seen, the operations are queuing instead of running in parallel, or
+ *   when the throughput fell more than 10% after an increase.
+ * The limit only grows after windows that reached it: with fewer operations
+ * ready to run, a higher limit wouldn't be used.
+ */
+struct limiter;
+
+/**
+ * Summary of a limiter (see limiterGetReport).
+ */
+struct limiterReport {
+	/* Limit at the time of the report, and the range it went through. */
+	size_t limit;
+	size_t minLimit;
+	size_t maxLimit;
+	/* Operations in flight averaged over the time, from the first
+	   operation to the last one, and the most of them at once. */
+	double averageInFlight;
+	size_t peakInFlight;
+	size_t increases;
+	size_t decreases;
+	uint64_t operations;
+	/* Operations per second, from the first operation to the last one. */
+	double throughput;
+	uint64_t averageLatencyNs;
+};
+
+/**
+ * Returns a descriptive message associated with an error code.
+ */
+const char *limiterGetError(int err);
+/**
+ * Create a limiter that allows between 1 and 'maxLimit' operations in
+ * flight, starting with 1. 'targetNs' is the latency target, in ns, 0 to
+ * look for the maximum throughput.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int limiterCreate(struct limiter **limiter, size_t maxLimit,
+                  uint64_t targetNs);
+/**
+ * Free a limiter, it can't have operations in flight.
+ */
+void limiterDestroy(struct limiter *limiter);
+/**
+ * Wait until an operation can start and count it as in flight.
+ */
+void limiterEnter(struct limiter *limiter);
+/**
+ * End an operation started with limiterEnter, that took 'latencyNs' ns.
+ */
+void limiterLeave(struct limiter *limiter, uint64_t latencyNs);
+/**
+ * Fill 'report' with the summary of 'limiter'.
+ */
+void limiterGetReport(struct limiter *limiter, struct limiterReport *report);
+
+#endif /* __LIMITER_H__ */
@@ -17,46 +17,381 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 
 #include "dosfs.h"
 #include "bool.h"
 #include "version.h"
+#include "workpool.h"
+#include "fatimage.h"
+#include "mockfs.h"
+#include "output.h"
+#include "match.h"
+#include "manifest.h"
+#include "server.h"
+#include "watch.h"
+#include "path.h"
+#include "plan.h"
+#include "cache.h"
+#include "limiter.h"
+#include "summary.h"
+#include "rules.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <pthread.h>
 
-#ifndef DIR_ENTRY_SIZE
-#define DIR_ENTRY_SIZE 256
-#endif
-#ifndef REAL_DIR_ENTRY_SIZE
-#define REAL_DIR_ENTRY_SIZE 1025
-#endif
 #define ERRMSG_MAX 1025
+#define FILE_LIST_INITIAL_CAPACITY 16
+#define STACK_INITIAL_CAPACITY 16
+/* Descriptors needed by a traversal: the first directory, the current one,
+   its parent while it's opened again and an entry. */
+#define MIN_FDS 4
+/* Descriptors of a traversal without RLIMIT_NOFILE. */
+#define DEFAULT_MAX_FDS 512
+/* Device of the files that can't be stat'ed, they fail when processed. */
+#define UNKNOWN_DEVICE UINT64_MAX
+/* Worker threads of --adaptive without --jobs, the most attribute operations
+   in flight. */
+#define ADAPTIVE_JOBS 32
+/* Entries of the first directory of a pool task processed by the task
+   itself, the next ones are handed to other tasks in chunks of
+   SPLIT_CHUNK, a batch of the io_uring engine. */
+#define SPLIT_ENTRIES 64
+#define SPLIT_CHUNK DOSFS_BATCH_MAX
+/* Lines of --files-from queued in the pool at a time. */
+#define FILES_FROM_BATCH 1024
 
 
 enum {
     ENOERR = 0,
-    EALLOC
+    EALLOC,
+    EFILES_FROM,
+    EDIFFERENT
+};
+
+/* Manifest operations. */
+enum {
+    MANIFEST_NONE = 0,
+    MANIFEST_SAVE,
+    MANIFEST_DIFF,
+    MANIFEST_RESTORE
 };
 
 enum {
     FLAG_VERBOSE = 0x01,
     FLAG_RECURSIVE = 0x02,
     FLAG_HELP = 0x04,
-    FLAG_VERSION = 0x08
+    FLAG_VERSION = 0x08,
+    FLAG_EXACT = 0x10,
+    FLAG_NUL_DELIM = 0x20,
+    FLAG_WATCH = 0x40,
+    FLAG_STATS = 0x80,
+    FLAG_PLAN = 0x100,
+    FLAG_DRY_RUN = 0x200,
+    FLAG_ADAPTIVE = 0x400,
+    FLAG_SUMMARY = 0x800
+};
+
+/* When the attribute changes are flushed to the medium (--durability). */
+enum {
+    /* Left to the kernel writeback. */
+    DURABILITY_NONE = 0,
+    /* Once per touched file system, after all the changes. */
+    DURABILITY_END,
+    /* Once per directory, after the changes of its entries. */
+    DURABILITY_PER_DIR,
+    /* After every change. */
+    DURABILITY_PER_FILE
 };
 
+/* Attributes cleared by an exact assignment ('=') when not listed in it.
+   The directory and volume label attributes are never cleared implicitly. */
+#define EXACT_ATTRS (DOSFS_ATTR_RO | DOSFS_ATTR_HIDDEN | DOSFS_ATTR_SYS | \
+                     DOSFS_ATTR_ARCH)
+
 struct programArgs {
 	char **fileList;
 	size_t fileListSize;
+	size_t fileListCapacity;
+	/* File with more files to process, one per line (or NUL separated
+	   with FLAG_NUL_DELIM), "-" for the standard input, or NULL. */
+	char *filesFrom;
 	uint32_t attrsToAdd;
 	uint32_t attrsToRemove;
+	uint32_t attrsToToggle;
+	/* Attributes of the '=' options, only meaningful with FLAG_EXACT. */
+	uint32_t attrsExact;
 	unsigned int flags;
+	/* Number of worker threads, 1 to process everything in the main
+	   thread. */
+	size_t jobs;
+	/* Descriptors a traversal can keep open, 0 for half the RLIMIT_NOFILE
+	   soft limit. */
+	size_t maxFds;
+	/* FAT image to work on instead of the mounted file systems, or NULL. */
+	char *image;
+	/* Partition of 'image' holding the file system, 0 for the whole image. */
+	unsigned int partition;
+	/* Specification of the in-memory mock tree to work on, or NULL. */
+	char *mock;
+	/* Engine to open and close the files, DOSFS_ENGINE_*. */
+	int engine;
+	/* Format of the output, OUTPUT_FORMAT_*. */
+	int format;
+	/* --match and --prune rules, NULL to process every entry. */
+	struct matcher *matcher;
+	/* Manifest file and operation, MANIFEST_*. */
+	char *manifest;
+	int manifestOp;
+	/* Socket to serve requests on (--serve), or NULL. */
+	char *serve;
+	/* Socket of the server to send the requests to (--client), or NULL. */
+	char *client;
+	/* Attribute cache file (--cache) and the cache opened from it, or
+	   NULL. */
+	char *cacheFile;
+	struct cache *cache;
+	/* Latency target of --adaptive, in ns, 0 to look for the maximum
+	   throughput. */
+	uint64_t latencyTarget;
+	/* Limit of the attribute operations in flight with --adaptive, or
+	   NULL. */
+	struct limiter *limiter;
+	/* When the changes are flushed, DURABILITY_*. */
+	int durability;
+	/* File systems with changes, flushed at the end with DURABILITY_END,
+	   or NULL. */
+	struct touchedList *touched;
+	/* Deepest directories below FILE with their own row in --summary, 0
+	   for the FILE directories only. */
+	size_t summaryDepth;
+	/* Rules file (--rules) and the rules loaded from it, applied instead of
+	   the attribute changes, or NULL. */
+	char *rulesFile;
+	struct rules *rules;
+};
+
+/* Directory of the traversal stack of processTraverse. */
+struct traverseFrame {
+	/* Descriptor of the directory, -1 while it's closed to stay within the
+	   descriptor budget. */
+	int fd;
+	/* Iterator of the directory, NULL while it's closed or once all the
+	   entries have been read ('done'). */
+	struct dosfsDir *dir;
+	int done;
+	/* Position where the iterator is resumed after closing it. */
+	struct dosfsDirPos pos;
+	/* Length of the context path without the name of the directory. */
+	size_t pathMark;
+	/* Use of the names arena before the entries of the directory. */
+	size_t namesMark;
+	/* Entries read and not processed yet, from 'next' to 'size': their
+	   names are in the arena and, with a batch engine, they can be already
+	   opened in 'fds' (-1 if not). */
+	size_t offsets[DOSFS_BATCH_MAX];
+	int fds[DOSFS_BATCH_MAX];
+	/* Pending entries answered by the attribute cache, with their
+	   attributes, they aren't opened. */
+	int cached[DOSFS_BATCH_MAX];
+	uint32_t attrs[DOSFS_BATCH_MAX];
+	size_t next;
+	size_t size;
+	/* Some entry of the directory changed, it's flushed when popped with
+	   DURABILITY_PER_DIR or DURABILITY_END. */
+	int changed;
+	/* Summary row where the entries are counted with FLAG_SUMMARY: the one
+	   of the directory, or of its ancestor at programArgs.summaryDepth, and
+	   the length of the path of that directory. */
+	size_t row;
+	size_t rowLength;
+	/* States of the directory in processContext.rules with --rules. */
+	size_t rulesMark;
+	size_t rulesCount;
+};
+
+/* Explicit stack of the directories being traversed, the last one is the
+   directory whose entries are being processed. */
+struct traverseStack {
+	struct traverseFrame *frames;
+	size_t size;
+	size_t capacity;
+	/* Descriptors kept open by the frames, directories and entries. */
+	size_t openFds;
+	/* Set by processDirectory with the entry being processed when it's a
+	   directory to traverse. */
+	int descend;
+	int descendFd;
+	/* Descriptors the frames can keep open. */
+	size_t maxFds;
+};
+
+/* Per thread state of a traversal. */
+struct processContext {
+	/* Output where the attributes are printed. */
+	struct output *out;
+	/* Pool where the directories are queued when using several jobs, NULL to
+	   process them recursively in the current thread. */
+	struct workPool *pool;
+	/* Connection where the files are sent as requests instead of being
+	   processed, NULL to process them. */
+	struct serverClient *client;
+	/* Path of the entry being processed by a traversal, empty outside of
+	   them. */
+	struct pathBuilder path;
+	/* Names of the entries read and not processed yet. */
+	struct pathArena names;
+	/* Directories being traversed. */
+	struct traverseStack stack;
+	/* Plan where the changes are collected with FLAG_PLAN, NULL to apply
+	   them as they are found. */
+	struct plan *plan;
+	/* Output shared with other threads where 'out' is merged after every
+	   directory, NULL to keep everything in 'out'. */
+	struct output *shared;
+	/* Summary where the entries are counted with FLAG_SUMMARY instead of
+	   being printed, NULL to print them. */
+	struct summary *summary;
+	/* Depth below FILE of the first directory of the traversals and, when
+	   it's deeper than programArgs.summaryDepth, the length of the path of
+	   its ancestor with the summary row. */
+	size_t depth;
+	size_t rowLength;
+	/* Length of the path of the FILE directory of the traversals, where
+	   the paths of the --rules start. */
+	size_t rootLength;
+	/* States of the directories being traversed with --rules. */
+	struct rulesStates rules;
+	/* Entries of the first directory of a pool task kept by the task, and
+	   the names of the next ones, handed to another task every SPLIT_CHUNK
+	   names (see processSplitEntry). */
+	size_t position;
+	struct pathArena split;
+	size_t splitSize;
+	/* Names of the entries of the first directory left to process, one
+	   after the other, when the task has a chunk of a split directory,
+	   NULL to read them from the directory. */
+	const char *taskNames;
+	size_t taskNamesLeft;
+};
+
+/* File system with changes and a file of it, opened again to flush it. */
+struct touchedFs {
+	uint64_t dev;
+	char *path;
+};
+
+/* File systems with changes, shared by all the threads. */
+struct touchedList {
+	pthread_mutex_t lock;
+	struct touchedFs *items;
+	size_t size;
+	size_t capacity;
+};
+
+/* Data of processMatchFilter. */
+struct matchFilter {
+	const struct matcher *matcher;
+	/* Entry name, without its directory. */
+	const char *name;
+	/* Set by processMatchFilter if the entry matched. */
+	int matched;
+};
+
+/* State of a merge walk between a manifest and a live tree. */
+struct manifestMerge {
+	const struct programArgs *args;
+	struct processContext *ctx;
+	struct manifestReader *reader;
+	/* Current manifest entry, NULL at the end. */
+	const char *path;
+	uint32_t attrs;
+	/* Entries that differ. */
+	size_t differences;
+};
+
+/* Data of processWatchEvent. */
+struct watchData {
+	const struct programArgs *args;
+	struct processContext *ctx;
+};
+
+/* Directory or FILE queued in the worker pool. */
+struct dirTask {
+	/* processContext.depth, processContext.rowLength and
+	   processContext.rootLength of its traversal. */
+	size_t depth;
+	size_t rowLength;
+	size_t rootLength;
+	/* Entries of a chunk of a split directory, their names follow 'path',
+	   0 to process the whole directory. */
+	size_t names;
+	/* Where the result of processFile is saved when 'path' is a FILE given
+	   to the program, NULL when it's a directory to traverse. */
+	int *result;
+	char path[];
+};
+
+/* Data shared by all the workers of the pool. */
+struct poolData {
+	const struct programArgs *args;
+	struct workPool *pool;
+	/* Output where the output of each directory is merged. */
+	struct output *out;
+	/* Plan where the changes of each directory are merged, NULL without
+	   FLAG_PLAN. */
+	struct plan *plan;
+	/* Summary where the counts of each directory are merged, NULL without
+	   FLAG_SUMMARY. */
+	struct summary *summary;
+};
+
+/* File of the file list and its device. */
+struct deviceFile {
+	uint64_t dev;
+	size_t index;
+};
+
+/* Files of a device, processed by a task of the device pool. */
+struct deviceTask {
+	/* Range of the files in deviceData.files. */
+	size_t first;
+	size_t last;
+};
+
+/* Data shared by the tasks of the device pool. */
+struct deviceData {
+	const struct programArgs *args;
+	/* Output and plan (NULL without FLAG_PLAN) where the ones of each
+	   device are merged. */
+	struct output *out;
+	struct plan *plan;
+	/* Summary where the counts of each device are merged, NULL without
+	   FLAG_SUMMARY. */
+	struct summary *summary;
+	/* Files of the file list sorted by device, and the result of each
+	   file, by its index in the file list. */
+	struct deviceFile *files;
+	int *results;
+	/* Descriptors each device can keep open. */
+	size_t maxFds;
+	/* The output of each file, by its index, is written to 'out' in the
+	   order of the file list: 'next' is the first file not written yet,
+	   and the files after it keep their output in 'outs' until it's done. */
+	struct output **outs;
+	int *done;
+	size_t next;
+	size_t size;
+	pthread_mutex_t lock;
 };
 
-static char errmsg[ERRMSG_MAX] = {0};
+static _Thread_local char errmsg[ERRMSG_MAX] = {0};
 
 /**
  * Returns a descriptive message associated with an error code.
@@ -64,10 +399,6 @@ static char errmsg[ERRMSG_MAX] = {0};
  * like a memory alloc error.
  */
 const char *mainGetError(int err);
-/**
- * Print FAT attributes in a readable format.
- */
-void printAttrs(uint32_t attrs);
 /**
  * Prints the program name, version and copyright/license notices.
  */
@@ -81,19 +412,189 @@ void showHelp(void);
  * Returns 0 on success, !0 if an error happens.
  */
 int appendFileToList(struct programArgs *args, char *file);
+/**
+ * Print or modify the attributes of a file given by the user, reporting the
+ * errors.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int processFile(const struct programArgs *const args,
+                struct processContext *ctx,
+                char *file);
+/**
+ * Process the files of args->fileList. With the workers pool every file is
+ * a task of the pool, run before returning. Otherwise, when they are in
+ * several devices each device is processed by its own thread, its files in
+ * order, so the devices work at the same time without seeking between files
+ * of the same device. The output is still written in the order of the list,
+ * and the files whose device is unknown are processed by this thread.
+ * Returns the result of processFile for the last file.
+ */
+int processFileList(const struct programArgs *const args,
+                    struct processContext *ctx);
+/**
+ * qsort comparison of two struct deviceFile, by device and then by index.
+ */
+int compareDeviceFiles(const void *a, const void *b);
+/**
+ * Pool task that processes the files of a device (struct deviceTask).
+ */
+void processDeviceTask(void *task, void *userData);
+/**
+ * Save 'out', the output of the file 'index' of the device pool, and write
+ * the outputs that are next in the file list order.
+ */
+void processDeviceOutput(struct deviceData *data, size_t index,
+                         struct output *out);
+/**
+ * Process the files listed in args->filesFrom as they are read, so the
+ * memory used doesn't depend on the size of the list. With the workers pool
+ * they are queued as tasks and run in batches of FILES_FROM_BATCH.
+ * Returns 0 on success, the error of the last file that failed or
+ * EFILES_FROM if the list can't be read.
+ */
+int processFilesFrom(const struct programArgs *const args,
+                     struct processContext *ctx);
+/**
+ * Run the pool until the 'count' files of a --files-from batch, queued
+ * with processSubmitFile, and the tasks they queued are done, and save in
+ * 'lastErrno' the error of the last one that failed.
+ * Returns 0 on success, !0 if the pool can't run (already reported), then
+ * the tasks left still use 'results'.
+ */
+int processFilesFromBatch(struct processContext *ctx, const int *results,
+                          size_t count, int *lastErrno);
+/**
+ * Run the manifest operation of 'args' on the tree args->fileList[0].
+ * Returns 0 on success, EDIFFERENT if a diff finds differences or !0 if an
+ * error happens (already reported).
+ */
+int processManifest(const struct programArgs *const args,
+                    struct processContext *ctx);
+/**
+ * manifestWalk function that saves every entry in a manifest writer.
+ */
+int processManifestSave(const char *path, int fd, uint32_t attrs,
+                        void *data);
+/**
+ * manifestWalk function that merges every entry of the tree with the
+ * manifest of a struct manifestMerge, reporting or restoring the
+ * differences.
+ */
+int processManifestMerge(const char *path, int fd, uint32_t attrs,
+                         void *data);
+/**
+ * Advance a merge to the next manifest entry.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int processManifestNext(struct manifestMerge *merge);
+/**
+ * Report a difference found by a merge: 'mark' is '~' for different
+ * attributes, '-' for entries only in the manifest and '+' for entries
+ * only in the tree.
+ */
+void processManifestReport(struct manifestMerge *merge, char mark,
+                           const char *path, uint32_t before, uint32_t after);
+/**
+ * Watch the directories of the file list and process the entries created,
+ * moved into or written in them until the program is interrupted.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int processWatch(const struct programArgs *const args,
+                 struct processContext *ctx);
+/**
+ * tWatchFn that processes an entry notified by the watcher.
+ */
+void processWatchEvent(const char *path, int isDir, void *data);
+/**
+ * Returns !0 if the directory of 'file' exists.
+ */
+int processParentExists(const char *file);
+/**
+ * Returns !0 if 'args' contains any attribute change.
+ */
+int hasAttributeChanges(const struct programArgs *const args);
+/**
+ * Fill 'add', 'remove' and 'toggle' with the attribute changes of 'file':
+ * the ones of the arguments, or with --rules the ones of the rules that
+ * match it in the current directory.
+ */
+void processEntryChanges(const struct programArgs *const args,
+                         struct processContext *ctx,
+                         const char *file,
+                         uint32_t *add,
+                         uint32_t *remove,
+                         uint32_t *toggle);
 /**
  * Print a file's attributes with the configuration saved in 'args'.
  * If 'processDir' != 0 and 'file' is a directory, process the files inside it.
  * Returns 0 on success, !0 if an error happens.
  */
 int processPrintAttributes(const struct programArgs *const args,
+                           struct processContext *ctx,
                            char *file,
                            int processDir);
+/**
+ * Same as processPrintAttributes, but the file is opened as 'name' relative
+ * to the directory descriptor 'dirFd'; 'file' is only used for the output.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int processPrintAttributesAt(const struct programArgs *const args,
+                             struct processContext *ctx,
+                             int dirFd,
+                             const char *name,
+                             char *file,
+                             int processDir);
+/**
+ * Look up the attributes of the entry 'name' relative to 'dirFd', the file
+ * 'file', in the attribute cache, saving them in 'attrs', without opening
+ * the entry. Directories aren't looked up if 'processDir' != 0, they are
+ * opened anyway. Only when printing attributes.
+ * Returns !0 if they were found.
+ */
+int processCacheLookup(const struct programArgs *const args,
+                       int dirFd,
+                       const char *name,
+                       const char *file,
+                       int processDir,
+                       uint32_t *attrs);
+/**
+ * Save the attributes 'attrs' of 'file', whose status is 'st', in the
+ * attribute cache, printing the errors.
+ */
+void processCacheStore(const struct programArgs *const args,
+                       const char *file,
+                       const struct dosfsStat *st,
+                       uint32_t attrs);
+/**
+ * Get the attributes of 'file', open as 'fd', saving them in the attribute
+ * cache if there is one.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int processGetAttributes(const struct programArgs *const args,
+                         const char *file,
+                         int fd,
+                         uint32_t *attrs);
+/**
+ * Print the attributes 'attrs' of 'file' if it matches the --match rules.
+ */
+void processShowAttributes(const struct programArgs *const args,
+                           struct processContext *ctx,
+                           const char *file,
+                           uint32_t attrs);
+/**
+ * Count the attributes 'attrs' of 'file' in the summary row of the current
+ * directory, or in the total outside of a traversal. The "." and ".."
+ * entries aren't counted.
+ */
+void processSummaryCount(struct processContext *ctx,
+                         const char *file,
+                         uint32_t attrs);
 /**
  * Internal function, sub of processPrintAttributes.
  * Returns 0 on success, !0 if an error happens.
  */
 int processPrintAttributesFd(const struct programArgs *const args,
+                             struct processContext *ctx,
                              char *file,
                              int fd,
                              int processDir);
@@ -103,16 +604,324 @@ int processPrintAttributesFd(const struct programArgs *const args,
  * Returns 0 on success, !0 if an error happens.
  */
 int processModifyAttributes(const struct programArgs *const args,
+                            struct processContext *ctx,
                             char *file,
                             int processDir);
+/**
+ * Same as processModifyAttributes, but the file is opened as 'name' relative
+ * to the directory descriptor 'dirFd'; 'file' is only used for the output.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int processModifyAttributesAt(const struct programArgs *const args,
+                              struct processContext *ctx,
+                              int dirFd,
+                              const char *name,
+                              char *file,
+                              int processDir);
 /**
  * Internal function, sub of processModifyAttributes.
  * Returns 0 on success, !0 if an error happens.
  */
 int processModifyAttributesFd(const struct programArgs *const args,
+                              struct processContext *ctx,
                               char *file,
                               int fd,
                               int processDir);
+/**
+ * Flush the change of the file 'fd', or record it to be flushed later,
+ * according to --durability. 'file' is its path.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int processSyncChange(const struct programArgs *const args,
+                      struct processContext *ctx,
+                      const char *file,
+                      int fd);
+/**
+ * Flush the changes of the entries of the directory 'fd' (-1 to open
+ * 'dir' again) with DURABILITY_PER_DIR, or record its file system with
+ * DURABILITY_END. 'dir' is its path.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int processSyncDirectory(const struct programArgs *const args,
+                         const char *dir,
+                         int fd);
+/**
+ * Record the file system of the file 'fd', of path 'file', in the touched
+ * list of 'args' if it isn't there yet. The backends without stat have a
+ * single file system. The errors are printed.
+ */
+void processTouch(const struct programArgs *const args,
+                 const char *file,
+                 int fd);
+/**
+ * Flush every file system of the touched list of 'args'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int processSyncTouched(const struct programArgs *const args);
+/**
+ * Returns the name of the entry 'file', its last path component.
+ */
+const char *entryName(const char *file);
+/**
+ * dosfsApplyMaskIf filter that only accepts the entries that match the
+ * rules of a struct matchFilter.
+ */
+int processMatchFilter(uint32_t attrs, void *data);
+/**
+ * Add the change of the attributes 'fileAttrs' of the file 'file' to the
+ * plan of 'ctx', if it changes anything. The new attributes are saved in
+ * 'newAttrs'.
+ * Returns 0 on success, the planAdd error if the change can't be added.
+ */
+int processPlanChange(const struct programArgs *const args,
+                      struct processContext *ctx,
+                      char *file,
+                      uint32_t fileAttrs,
+                      uint32_t *newAttrs);
+/**
+ * Sort the plan of 'ctx' and apply it, one directory after the other, or
+ * only print it with FLAG_DRY_RUN.
+ * Returns 0 on success, !0 if an error happens or a change couldn't be
+ * added to the plan.
+ */
+int processPlan(const struct programArgs *const args,
+                struct processContext *ctx);
+/**
+ * Apply the changes 'first' to 'last' (excluded) of the plan of 'ctx',
+ * which have the same parent directory.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int processPlanDirectory(const struct programArgs *const args,
+                         struct processContext *ctx,
+                         size_t first,
+                         size_t last);
+/**
+ * Returns !0 if the directory entry 'name' must be processed recursively
+ * when it's a directory.
+ */
+int processRecursesInto(const struct programArgs *const args,
+                        const char *name);
+/**
+ * Returns !0 if the directory entry 'name' can be skipped without opening
+ * it, because it's pruned or because it can't match and won't be
+ * descended.
+ */
+int processSkipEntry(const struct programArgs *const args,
+                     const char *name);
+/**
+ * Process the files inside the directory 'dir', already opened in 'fd'.
+ * If the context has a pool the directory is queued as a task and processed
+ * later by a worker.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int processDirectory(const struct programArgs *const args,
+                     struct processContext *ctx,
+                     char *dir,
+                     int fd);
+/**
+ * Allocate a pool task for 'path' with 'extra' bytes after it, and all its
+ * fields to 0 or NULL.
+ * Returns the task, or NULL if it can't be allocated (already reported).
+ */
+struct dirTask *processNewTask(const char *path, size_t extra);
+/**
+ * Queue 'task' in the pool of 'ctx', or report the error and free it.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int processSubmitTask(struct processContext *ctx, struct dirTask *task);
+/**
+ * Queue a pool task that processes the FILE 'file' and saves the result of
+ * processFile in 'result', set to the error if it can't be queued.
+ */
+void processSubmitFile(struct processContext *ctx, const char *file,
+                       int *result);
+/**
+ * Start the pool of 'ctx' and wait until all its tasks are done.
+ * Returns 0 on success, !0 if the pool can't run (already reported).
+ */
+int processRunPool(struct processContext *ctx);
+/**
+ * Internal function, sub of processDirectory, process every entry of the
+ * directory of the context path, opened in 'fd', and of its subdirectories
+ * when the context has no pool, in the current thread.
+ * The subdirectories are kept in an explicit stack, with at most
+ * --max-fds descriptors open: the directories nearest to the root are
+ * closed when the limit is reached, and resumed from the same position when
+ * the traversal gets back to them.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int processTraverse(const struct programArgs *const args,
+                    struct processContext *ctx,
+                    int fd);
+/**
+ * Make room for one more frame in the traversal stack.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int processStackReserve(struct processContext *ctx);
+/**
+ * Push the directory of the context path, opened in 'fd', to the traversal
+ * stack, which must have room for it. The descriptor is owned by the stack
+ * after this call, unless it's the first directory. 'pathMark' is the
+ * length of the path of its parent.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int processFramePush(const struct programArgs *const args,
+                     struct processContext *ctx,
+                     int fd,
+                     size_t pathMark);
+/**
+ * Set the summary row of the frame being pushed to the traversal stack,
+ * whose path is the context path.
+ */
+void processSummaryFrame(const struct programArgs *const args,
+                         struct processContext *ctx,
+                         struct traverseFrame *frame);
+/**
+ * Append the --rules states of the frame being pushed to the traversal
+ * stack, whose path is the context path, to the context.
+ */
+void processRulesFrame(const struct programArgs *const args,
+                       struct processContext *ctx,
+                       struct traverseFrame *frame);
+/**
+ * Pop the last directory of the traversal stack, closing it, and flush its
+ * changes if needed.
+ */
+void processFramePop(const struct programArgs *const args,
+                     struct processContext *ctx);
+/**
+ * Open again the directory of the last frame of the stack and its
+ * iterator, closed by processFreeFds, and the directories between it and
+ * its nearest open parent.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int processFrameOpen(struct processContext *ctx);
+/**
+ * Close the directory of the frame 'index' and its pending entries,
+ * remembering the position of its iterator.
+ */
+void processFrameClose(struct processContext *ctx, size_t index);
+/**
+ * Read the next entries of the directory of the last frame of the stack:
+ * one with the sync engine, a batch opened at once with the others.
+ */
+void processFrameRead(const struct programArgs *const args,
+                      struct processContext *ctx);
+/**
+ * Get the next entry of the directory of the last frame of the stack, from
+ * the directory or from the names of the task.
+ * Returns like dosfsDirNext.
+ */
+int processFrameNext(struct processContext *ctx, const char **name);
+/**
+ * Count the entry 'name' read from the first directory of a pool task:
+ * past the first SPLIT_ENTRIES ones the entries are added to the chunk of
+ * the next task of the directory, submitted when it's full.
+ * Returns !0 if the entry was added to the chunk.
+ */
+int processSplitEntry(struct processContext *ctx, const char *name);
+/**
+ * Submit the chunk of names of processSplitEntry, if any, as a task of the
+ * directory of the context path.
+ */
+void processSplitSubmit(struct processContext *ctx);
+/**
+ * Open the pending entries of the last frame of the stack in a batch, as
+ * many as the descriptor budget allows. Only with a batch engine.
+ */
+void processFrameOpenEntries(struct processContext *ctx);
+/**
+ * Close the entries of the frame 'index' from 'from' to 'to'.
+ */
+void processFrameCloseEntries(struct processContext *ctx, size_t index,
+                              size_t from, size_t to);
+/**
+ * Process the next pending entry of the last frame of the stack, pushing it
+ * if it's a directory to traverse.
+ */
+void processFrameEntry(const struct programArgs *const args,
+                       struct processContext *ctx);
+/**
+ * Close the descriptors of the frames nearest to the root, the last ones
+ * that will be needed again, until 'needed' more fit in the budget. The
+ * first directory, the last one and the frame 'keep' stay open.
+ * Returns the number of descriptors that can be opened, up to 'needed'.
+ */
+size_t processFreeFds(struct processContext *ctx, size_t needed, size_t keep);
+/**
+ * Process the entry 'name' of the directory of the context path, opened in
+ * 'dirFd', with the path of the entry already in the context.
+ * 'entryFd' is the entry already opened, or -1 to open it here.
+ * Returns the descriptor of the entry if it's a directory to traverse,
+ * which the caller must close, or -1.
+ * The errors are printed, not returned.
+ */
+int processDirEntry(const struct programArgs *const args,
+                    struct processContext *ctx,
+                    int dirFd,
+                    const char *name,
+                    int entryFd);
+/**
+ * Pool task that processes the entries of a directory, or a chunk of them
+ * when it's split, or a FILE given to the program.
+ * The output of the whole task is written at once when it's done, so the
+ * lines of different workers never get mixed.
+ */
+void processDirTask(void *task, void *userData);
+/**
+ * Parse the attribute letters of an attribute change argument like "+RH",
+ * skipping its first character.
+ * Exits the program if the argument doesn't contain valid attributes.
+ */
+uint32_t parseAttributes(const char *arg);
+/**
+ * If argv[*i] is the option 'option', either as "OPTION VALUE" or as
+ * "OPTION=VALUE", returns its value and advances '*i' past it.
+ * Returns NULL if argv[*i] is another option.
+ * Exits the program if the value is missing.
+ */
+char *optionValue(int argc, char **argv, int *i, const char *option);
+/**
+ * Parse the value of the numeric option 'option'.
+ * Exits the program if the value isn't a valid number.
+ */
+size_t parseCountOption(const char *option, const char *value);
+/**
+ * Add the rule 'value' of the option 'option' (--match or --prune) to the
+ * matcher of 'args', creating it if needed.
+ * Exits the program if the rule isn't valid.
+ */
+void addMatchRule(struct programArgs *args, const char *option,
+                  const char *value);
+/**
+ * Returns the current time of the monotonic clock, in seconds.
+ */
+double nowSeconds(void);
+/**
+ * Write the duration 'ns' in 'buf' (of 'size' bytes) with a readable unit.
+ */
+void formatDuration(uint64_t ns, char *buf, size_t size);
+/**
+ * Print the statistics of the dosfs operations, of the attribute cache and
+ * of the --adaptive limiter (if not NULL) in stderr, 'elapsed' is the run
+ * time of the program in seconds.
+ */
+void printStats(double elapsed, struct cache *cache, struct limiter *limiter);
+/**
+ * Finish 'summary' and print in the standard output the attribute
+ * combinations of every directory row and of all the entries.
+ */
+void printSummary(struct summary *summary);
+/**
+ * Print the line "TITLE: N entries" and the attribute combinations of
+ * 'counts' with their number of entries, the most frequent first.
+ */
+void printSummaryCounts(const char *title, const uint64_t *counts);
+/**
+ * Operations of the dosfs gate, over the limiter of --adaptive.
+ */
+void processGateEnter(void *data);
+void processGateLeave(void *data, uint64_t latencyNs);
 /**
  * Process the program's arguments and saved the readed values in 'result'.
  * Returns 0 on success, !0 if an error happens.
@@ -133,6 +942,15 @@ const char *mainGetError(int err)
 		         "Error allocating memory: %s",
 		         strerror(errno));
 		break;
+	case EFILES_FROM:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error reading the file list: %s",
+		         strerror(errno));
+		break;
+	case EDIFFERENT:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "The tree doesn't match the manifest");
+		break;
 	default:
 		snprintf(errmsg, ERRMSG_MAX,
 		         "Unknown error");
@@ -140,18 +958,6 @@ const char *mainGetError(int err)
 	return errmsg;
 }
 
-void printAttrs(uint32_t attrs)
-{
-	printf("%c%c%c%c%c%c",
-	       DOSFS_HAS_ATTR_RO(attrs) ? 'R' : '-',
-	       DOSFS_HAS_ATTR_HIDDEN(attrs) ? 'H' : '-',
-	       DOSFS_HAS_ATTR_SYS(attrs) ? 'S' : '-',
-	       DOSFS_HAS_ATTR_ARCH(attrs) ? 'A' : '-',
-	       DOSFS_HAS_ATTR_DIR(attrs) ? 'D' : '-',
-	       DOSFS_HAS_ATTR_VOLUME(attrs) ? 'V' : '-'
-	      );
-}
-
 void showVersion()
 {
 	printf("FAT attributes utility, version %s\n", VERSION_STRING);
@@ -181,8 +987,74 @@ void showHelp()
 	       "\t-D: Remove the directory attribute (warning! see below).\n"
 	       "\t+V: Sets the volume label attribute (warning! see below).\n"
 	       "\t-V: Remove the volume label attribute (warning! see below).\n"
+	       "\t^X: Toggles the attribute X, e.g. ^R.\n"
+	       "\t=XYZ: Sets exactly the attributes XYZ, e.g. =RHA clears S.\n"
+	       "\t      D and V are only changed if listed.\n"
 	       "\t--recursive: If FILE is a directory, process it recursively.\n"
 	       "\t--verbose: Verbose attribute changes.\n"
+	       "\t--image IMAGE: Work on the files of the FAT image IMAGE, "
+	       "without mounting it.\n"
+	       "\t--partition N: Use the MBR partition N (1-4) of the image.\n"
+	       "\t--mock SPEC: Work on a deterministic in-memory tree, e.g.\n"
+	       "\t      width=4,depth=3,files=16,namelen=32,longnames=50,\n"
+	       "\t      seed=1,latency=0,setlatency=0,synclatency=0,\n"
+	       "\t      seeklatency=0,devices=1,channels=0\n"
+	       "\t      (latencies in us).\n"
+	       "\t--jobs N: Process the FILEs and directories with N worker\n"
+	       "\t      threads (0: one per CPU).\n"
+	       "\t--max-fds N: Keep at most N descriptors open while\n"
+	       "\t      processing a tree (default: half the open files\n"
+	       "\t      limit), closing and resuming directories.\n"
+	       "\t--engine ENGINE: Open and close the files with 'sync' (one\n"
+	       "\t      call per file, the default) or 'uring' (io_uring\n"
+	       "\t      batches per directory, falls back to sync).\n"
+	       "\t--format FORMAT: Output format: 'text' (default), 'nul'\n"
+	       "\t      (entries end with NUL), 'jsonl' or 'bin' (records).\n"
+	       "\t--files-from FILE: Also process the files listed in FILE,\n"
+	       "\t      one per line ('-' reads the standard input).\n"
+	       "\t-0: The --files-from list is NUL separated, e.g. for\n"
+	       "\t      find -print0.\n"
+	       "\t--match EXPR: Only show or change the entries matching EXPR,\n"
+	       "\t      comma separated terms +XYZ, -XYZ and name=GLOB, e.g.\n"
+	       "\t      +H-S,name=*.tmp. Repeat it to match any of several.\n"
+	       "\t--prune GLOB: Skip the entries named GLOB and their contents.\n"
+	      );
+	printf("\t--save-manifest MANIFEST: Save the attributes of the tree\n"
+	       "\t      below the directory FILE in MANIFEST.\n"
+	       "\t--diff-manifest MANIFEST: Show the differences between\n"
+	       "\t      MANIFEST and the tree (exit status 1 if any).\n"
+	       "\t--restore-manifest MANIFEST: Restore the R, H, S and A\n"
+	       "\t      attributes saved in MANIFEST.\n"
+	       "\t--serve SOCKET: Serve attribute requests on the Unix socket\n"
+	       "\t      SOCKET until interrupted, keeping directories open.\n"
+	       "\t--client SOCKET: Send the files and changes to the server\n"
+	       "\t      of SOCKET instead of processing them.\n"
+	       "\t--watch: After processing the FILE directories, keep\n"
+	       "\t      processing the entries created, moved into or written\n"
+	       "\t      in them (and their subdirectories with --recursive)\n"
+	       "\t      until interrupted.\n"
+	       "\t--plan: Collect the attribute changes first, then apply\n"
+	       "\t      them one directory after the other, in the order of\n"
+	       "\t      their directory entries.\n"
+	       "\t--dry-run: Like --plan, but only print the changes in the\n"
+	       "\t      order they would be applied.\n"
+	       "\t--cache FILE: Keep the attributes read in FILE, and answer\n"
+	       "\t      from it the files whose ctime didn't change since.\n"
+	       "\t--durability MODE: When the attribute changes are flushed to\n"
+	       "\t      the medium: 'none' (default), 'end' (once per file\n"
+	       "\t      system), 'per-dir' or 'per-file'.\n"
+	       "\t--rules FILE: Apply the rules of FILE, lines 'GLOB CHANGES'\n"
+	       "\t      like '*.sys +H' or 'config/?* +R-A', instead of\n"
+	       "\t      attribute changes, all of them in one traversal.\n"
+	       "\t--summary[=DEPTH]: Instead of listing the entries, count\n"
+	       "\t      their attribute combinations per directory, down to\n"
+	       "\t      DEPTH levels below FILE (default: 0), and in total.\n"
+	       "\t--adaptive: Tune the attribute operations in flight, up to\n"
+	       "\t      --jobs (default: 32), for the maximum throughput.\n"
+	       "\t--latency-target US: Like --adaptive, keeping the latency of\n"
+	       "\t      the attribute operations under US microseconds.\n"
+	       "\t--stats: Print the count, throughput and latency histogram\n"
+	       "\t      of every file system operation in stderr at exit.\n"
 	       "\t--help: Show this help.\n"
 	       "\t--version: Show only the program name, version and credits.\n"
 	       "\t--: Forces all arguments past this one to be interpreted as "
@@ -196,143 +1068,1967 @@ void showHelp()
 
 int appendFileToList(struct programArgs *args, char *file)
 {
-	args->fileList = realloc(args->fileList,
-	                         sizeof(char *) * (++(args->fileListSize)));
-	if (args->fileList == NULL) {
-		return EALLOC;
+	if (args->fileListSize == args->fileListCapacity) {
+		size_t newCapacity = args->fileListCapacity > 0 ?
+		                     args->fileListCapacity * 2 :
+		                     FILE_LIST_INITIAL_CAPACITY;
+		char **newList = realloc(args->fileList, sizeof(char *) * newCapacity);
+		if (newList == NULL) {
+			return EALLOC;
+		}
+		args->fileList = newList;
+		args->fileListCapacity = newCapacity;
 	}
-	args->fileList[args->fileListSize - 1] = file;
+	args->fileList[args->fileListSize++] = file;
 	return ENOERR;
 }
 
-int processPrintAttributes(const struct programArgs *const args,
-                           char *file,
-                           int processDir)
+int processFile(const struct programArgs *const args,
+                struct processContext *ctx,
+                char *file)
 {
-	int fd = 0;
-	int dosfsErrno = dosfsOpen(file, &fd);
-	if (dosfsErrno) {
+	int dosfsErrno = 0;
+	if (ctx->client != NULL) {
+		dosfsErrno = !hasAttributeChanges(args) ?
+		             serverClientGet(ctx->client, file) :
+		             serverClientModify(ctx->client, file, args->attrsToAdd,
+		                                args->attrsToRemove,
+		                                args->attrsToToggle);
+		if (dosfsErrno) {
+			fprintf(stderr, "Error sending file '%s': %s\n",
+			        file, serverGetError(dosfsErrno));
+		}
 		return dosfsErrno;
 	}
-	dosfsErrno = processPrintAttributesFd(args, file, fd, processDir);
-	dosfsClose(fd);
+	if (!hasAttributeChanges(args)) {
+		dosfsErrno = processPrintAttributes(args, ctx, file, TRUE);
+	} else {
+		dosfsErrno = processModifyAttributes(args, ctx, file,
+		                                     args->flags & FLAG_RECURSIVE);
+	}
+	if (dosfsErrno) {
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        file, dosfsGetError(dosfsErrno));
+	}
 	return dosfsErrno;
 }
 
-int processPrintAttributesFd(const struct programArgs *const args,
-                             char *file,
-                             int fd,
-                             int processDir)
+int processFileList(const struct programArgs *const args,
+                    struct processContext *ctx)
 {
-	uint32_t fileAttrs = 0;
-	int dosfsErrno = dosfsGetAttributes(fd, &fileAttrs);
-	if (dosfsErrno) {
+	size_t size = args->fileListSize;
+	struct deviceFile *files = NULL;
+	int *results = NULL;
+	struct deviceTask *tasks = NULL;
+	struct output **outs = NULL;
+	int *done = NULL;
+	size_t devices = 0;
+	size_t known = 0;
+	if (size > 0 && ctx->pool != NULL &&
+	        (results = calloc(size, sizeof(int))) != NULL) {
+		for (size_t i = 0; i < size; i++) {
+			processSubmitFile(ctx, args->fileList[i], &results[i]);
+		}
+		int poolErrno = processRunPool(ctx);
+		if (poolErrno) {
+			/* The tasks left in the pool still use 'results'. */
+			return poolErrno;
+		}
+		int dosfsErrno = results[size - 1];
+		free(results);
 		return dosfsErrno;
 	}
-	printAttrs(fileAttrs);
-	printf("  %s\n", file);
-	if (DOSFS_HAS_ATTR_DIR(fileAttrs) && processDir) {
-		char dirEntry[DIR_ENTRY_SIZE] = {0};
-		char realDirEntry[REAL_DIR_ENTRY_SIZE] = {0};
-		while (!(dosfsErrno = dosfsReadDir(fd, dirEntry, DIR_ENTRY_SIZE)) &&
-		        strlen(dirEntry) > 0) {
-			snprintf(realDirEntry, REAL_DIR_ENTRY_SIZE,
-			         "%s/%s",
-			         file, dirEntry);
-			int recursive = (args->flags & FLAG_RECURSIVE) &&
-			                strcmp(dirEntry, ".") != 0 &&
-			                strcmp(dirEntry, "..") != 0;
-			dosfsErrno = processPrintAttributes(args, realDirEntry, recursive);
-			if (dosfsErrno) {
-				fprintf(stderr, "Error processing file '%s': %s\n",
-				        realDirEntry, dosfsGetError(dosfsErrno));
-			}
+	/* The workers pool and the server client already have their own
+	   order. */
+	if (size > 1 && ctx->pool == NULL && ctx->client == NULL) {
+		files = malloc(size * sizeof(struct deviceFile));
+		results = calloc(size, sizeof(int));
+	}
+	if (files != NULL && results != NULL) {
+		struct dosfsStat st;
+		for (size_t i = 0; i < size; i++) {
+			files[i].dev = dosfsStatAt(DOSFS_AT_CWD, args->fileList[i], &st) ?
+			               UNKNOWN_DEVICE : st.dev;
+			files[i].index = i;
+		}
+		qsort(files, size, sizeof(struct deviceFile), compareDeviceFiles);
+		/* UNKNOWN_DEVICE sorts last, those files aren't a device. */
+		while (known < size && files[known].dev != UNKNOWN_DEVICE) {
+			known++;
+		}
+		for (size_t i = 0; i < known; i++) {
+			devices += i == 0 || files[i].dev != files[i - 1].dev;
+		}
+		if (devices > 1) {
+			tasks = malloc(devices * sizeof(struct deviceTask));
+			outs = calloc(size, sizeof(struct output *));
+			done = calloc(size, sizeof(int));
 		}
 	}
-	return ENOERR;
+	if (tasks == NULL || outs == NULL || done == NULL) {
+		free(tasks);
+		free(outs);
+		free(done);
+		free(files);
+		free(results);
+		int dosfsErrno = ENOERR;
+		for (size_t i = 0; i < size; i++) {
+			dosfsErrno = processFile(args, ctx, args->fileList[i]);
+		}
+		return dosfsErrno;
+	}
+	/* The descriptor budget is shared by the devices. */
+	struct deviceData data = {args, ctx->out, ctx->plan, ctx->summary, files,
+		       results, args->maxFds / devices, outs, done, 0, size,
+		       PTHREAD_MUTEX_INITIALIZER
+	};
+	data.maxFds = data.maxFds < MIN_FDS ? MIN_FDS : data.maxFds;
+	/* The files whose device is unknown likely fail anyway, they are
+	   processed here in order, with their output kept until its turn. */
+	if (known < size) {
+		struct deviceTask unknown = {known, size};
+		processDeviceTask(&unknown, &data);
+	}
+	struct workPool *pool = NULL;
+	int poolErrno = workPoolCreate(&pool, devices, processDeviceTask, &data);
+	size_t task = 0;
+	for (size_t i = 0; i < known && !poolErrno; i++) {
+		if (i == 0 || files[i].dev != files[i - 1].dev) {
+			tasks[task].first = i;
+			task++;
+		}
+		tasks[task - 1].last = i + 1;
+	}
+	for (size_t i = 0; i < devices && !poolErrno; i++) {
+		poolErrno = workPoolSubmit(pool, &tasks[i]);
+	}
+	if (!poolErrno) {
+		poolErrno = workPoolRun(pool);
+	}
+	if (poolErrno) {
+		fprintf(stderr, "Error running the device pool: %s\n",
+		        workPoolGetError(poolErrno));
+	}
+	workPoolDestroy(pool);
+	/* Left behind only if the pool failed. */
+	for (size_t i = data.next; i < size; i++) {
+		outputDestroy(outs[i]);
+	}
+	pthread_mutex_destroy(&data.lock);
+	int dosfsErrno = poolErrno ? poolErrno : results[size - 1];
+	free(done);
+	free(outs);
+	free(tasks);
+	free(files);
+	free(results);
+	return dosfsErrno;
 }
 
-int processModifyAttributes(const struct programArgs *const args,
-                            char *file,
-                            int processDir)
+int compareDeviceFiles(const void *a, const void *b)
 {
-	int fd = 0;
-	int dosfsErrno = dosfsOpen(file, &fd);
-	if (dosfsErrno) {
-		return dosfsErrno;
+	const struct deviceFile *fileA = a;
+	const struct deviceFile *fileB = b;
+	if (fileA->dev != fileB->dev) {
+		return fileA->dev < fileB->dev ? -1 : 1;
 	}
-	dosfsErrno = processModifyAttributesFd(args, file, fd, processDir);
-	dosfsClose(fd);
-	return dosfsErrno;
+	return fileA->index < fileB->index ? -1 : fileA->index > fileB->index;
 }
 
-int processModifyAttributesFd(const struct programArgs *const args,
-                              char *file,
-                              int fd,
-                              int processDir)
+void processDeviceTask(void *task, void *userData)
+{
+	struct deviceData *data = userData;
+	struct deviceTask *device = task;
+	const struct programArgs *args = data->args;
+	struct processContext ctx = {NULL, NULL, NULL, {NULL, 0, 0},
+		{NULL, 0, 0}, {NULL, 0, 0, 0, FALSE, -1, data->maxFds}, NULL,
+		NULL, NULL, 0, 0, 0, {NULL, 0, 0}, 0, {NULL, 0, 0}, 0, NULL, 0
+	};
+	int planErrno = data->plan != NULL ? planCreate(&ctx.plan) : ENOERR;
+	int summaryErrno = !planErrno && data->summary != NULL ?
+	                   summaryCreate(&ctx.summary) : ENOERR;
+	for (size_t i = device->first; i < device->last; i++) {
+		size_t index = data->files[i].index;
+		char *file = args->fileList[index];
+		ctx.out = NULL;
+		int mainErrno = planErrno || summaryErrno ? ENOERR :
+		                outputCreate(&ctx.out, args->format, -1);
+		if (mainErrno || planErrno || summaryErrno) {
+			fprintf(stderr, "Error processing file '%s': %s\n", file,
+			        mainErrno ? outputGetError(mainErrno) :
+			        planErrno ? planGetError(planErrno) :
+			        summaryGetError(summaryErrno));
+			data->results[index] = mainErrno ? mainErrno :
+			                       planErrno ? planErrno : summaryErrno;
+			processDeviceOutput(data, index, NULL);
+			continue;
+		}
+		/* The file whose turn it is writes every directory as it's done,
+		   the others wait until the files before them are written. */
+		pthread_mutex_lock(&data->lock);
+		ctx.shared = data->next == index ? data->out : NULL;
+		pthread_mutex_unlock(&data->lock);
+		data->results[index] = processFile(args, &ctx, file);
+		processDeviceOutput(data, index, ctx.out);
+	}
+	if (ctx.plan != NULL && (planErrno = planMerge(data->plan, ctx.plan))) {
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        args->fileList[data->files[device->first].index],
+		        planGetError(planErrno));
+	}
+	if (ctx.summary != NULL &&
+	        (summaryErrno = summaryMerge(data->summary, ctx.summary))) {
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        args->fileList[data->files[device->first].index],
+		        summaryGetError(summaryErrno));
+	}
+	summaryDestroy(ctx.summary);
+	planDestroy(ctx.plan);
+	rulesStatesFree(&ctx.rules);
+	pathFree(&ctx.path);
+	pathArenaFree(&ctx.names);
+	free(ctx.stack.frames);
+}
+
+void processDeviceOutput(struct deviceData *data, size_t index,
+                         struct output *out)
+{
+	pthread_mutex_lock(&data->lock);
+	data->outs[index] = out;
+	data->done[index] = TRUE;
+	while (data->next < data->size && data->done[data->next]) {
+		if (data->outs[data->next] != NULL) {
+			outputMerge(data->out, data->outs[data->next]);
+			outputDestroy(data->outs[data->next]);
+		}
+		data->next++;
+	}
+	pthread_mutex_unlock(&data->lock);
+}
+
+int processFilesFrom(const struct programArgs *const args,
+                     struct processContext *ctx)
+{
+	FILE *list = stdin;
+	if (strcmp(args->filesFrom, "-") != 0) {
+		list = fopen(args->filesFrom, "r");
+		if (list == NULL) {
+			return EFILES_FROM;
+		}
+	}
+	int delim = (args->flags & FLAG_NUL_DELIM) ? '\0' : '\n';
+	char *line = NULL;
+	size_t lineSize = 0;
+	ssize_t lineLen = 0;
+	int lastErrno = ENOERR;
+	/* Only one line, or one batch of them queued in the pool, is kept in
+	   memory at a time. */
+	int *results = ctx->pool != NULL ?
+	               calloc(FILES_FROM_BATCH, sizeof(int)) : NULL;
+	size_t queued = 0;
+	int poolErrno = ENOERR;
+	while (!poolErrno &&
+	        (lineLen = getdelim(&line, &lineSize, delim, list)) != -1) {
+		if (lineLen > 0 && line[lineLen - 1] == delim) {
+			line[--lineLen] = '\0';
+		}
+		if (lineLen == 0) {
+			continue;
+		}
+		if (results == NULL) {
+			int dosfsErrno = processFile(args, ctx, line);
+			if (dosfsErrno) {
+				lastErrno = dosfsErrno;
+			}
+			continue;
+		}
+		processSubmitFile(ctx, line, &results[queued++]);
+		if (queued == FILES_FROM_BATCH) {
+			poolErrno = processFilesFromBatch(ctx, results, queued,
+			                                  &lastErrno);
+			queued = 0;
+		}
+	}
+	if (queued > 0) {
+		poolErrno = processFilesFromBatch(ctx, results, queued, &lastErrno);
+	}
+	if (ferror(list)) {
+		lastErrno = EFILES_FROM;
+	}
+	/* The tasks left in the pool still use 'results'. */
+	if (!poolErrno) {
+		free(results);
+	}
+	free(line);
+	if (list != stdin) {
+		fclose(list);
+	}
+	return lastErrno;
+}
+
+int processFilesFromBatch(struct processContext *ctx, const int *results,
+                          size_t count, int *lastErrno)
+{
+	int poolErrno = processRunPool(ctx);
+	if (poolErrno) {
+		*lastErrno = poolErrno;
+		return poolErrno;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (results[i]) {
+			*lastErrno = results[i];
+		}
+	}
+	return ENOERR;
+}
+
+int processManifest(const struct programArgs *const args,
+                    struct processContext *ctx)
+{
+	const char *root = args->fileList[0];
+	int manifestErrno = ENOERR;
+	if (args->manifestOp == MANIFEST_SAVE) {
+		struct manifestWriter *writer = NULL;
+		manifestErrno = manifestWriterOpen(args->manifest, &writer);
+		if (!manifestErrno) {
+			manifestErrno = manifestWalk(root, processManifestSave, writer);
+			int closeErrno = manifestWriterClose(writer);
+			manifestErrno = manifestErrno ? manifestErrno : closeErrno;
+		}
+	} else {
+		struct manifestMerge merge = {args, ctx, NULL, NULL, 0, 0};
+		manifestErrno = manifestReaderOpen(args->manifest, &merge.reader);
+		if (!manifestErrno) {
+			manifestErrno = processManifestNext(&merge);
+		}
+		if (!manifestErrno) {
+			manifestErrno = manifestWalk(root, processManifestMerge, &merge);
+		}
+		/* The rest of the manifest isn't in the tree. */
+		while (!manifestErrno && merge.path != NULL) {
+			processManifestReport(&merge, '-', merge.path, merge.attrs, 0);
+			manifestErrno = processManifestNext(&merge);
+		}
+		manifestReaderClose(merge.reader);
+		if (!manifestErrno && args->manifestOp == MANIFEST_DIFF &&
+		        merge.differences > 0) {
+			return EDIFFERENT;
+		}
+	}
+	if (manifestErrno) {
+		fprintf(stderr, "Error processing manifest '%s' of '%s': %s\n",
+		        args->manifest, root, manifestGetError(manifestErrno));
+	}
+	return manifestErrno;
+}
+
+int processManifestSave(const char *path, int fd, uint32_t attrs,
+                        void *data)
+{
+	(void)fd;
+	return manifestWriterAdd(data, path, attrs);
+}
+
+int processManifestMerge(const char *path, int fd, uint32_t attrs,
+                         void *data)
+{
+	struct manifestMerge *merge = data;
+	int manifestErrno = ENOERR;
+	while (!manifestErrno && merge->path != NULL &&
+	        manifestComparePaths(merge->path, path) < 0) {
+		processManifestReport(merge, '-', merge->path, merge->attrs, 0);
+		manifestErrno = processManifestNext(merge);
+	}
+	if (manifestErrno) {
+		return manifestErrno;
+	}
+	if (merge->path == NULL || manifestComparePaths(merge->path, path) > 0) {
+		processManifestReport(merge, '+', path, 0, attrs);
+		return ENOERR;
+	}
+	if (merge->attrs != attrs) {
+		if (merge->args->manifestOp == MANIFEST_DIFF) {
+			processManifestReport(merge, '~', path, merge->attrs, attrs);
+		} else if (((merge->attrs ^ attrs) & EXACT_ATTRS) != 0) {
+			/* Only the attributes that '=' changes are restored. */
+			uint32_t before = 0;
+			uint32_t after = 0;
+			int dosfsErrno = dosfsApplyMask(fd,
+			                                merge->attrs & ~attrs & EXACT_ATTRS,
+			                                attrs & ~merge->attrs & EXACT_ATTRS,
+			                                0, &before, &after);
+			/* The context path isn't used by the manifest walk, it only
+			   builds the full path of the entry. */
+			struct pathBuilder *file = &merge->ctx->path;
+			size_t mark = 0;
+			int pathErrno = pathSet(file, merge->args->fileList[0]);
+			if (!pathErrno) {
+				pathErrno = pathPush(file, path, &mark);
+			}
+			if (pathErrno) {
+				fprintf(stderr, "Error processing file '%s': %s\n",
+				        path, pathGetError(pathErrno));
+			} else if (dosfsErrno) {
+				fprintf(stderr, "Error processing file '%s': %s\n",
+				        file->buffer, dosfsGetError(dosfsErrno));
+			} else if (merge->args->flags & FLAG_VERBOSE) {
+				outputChange(merge->ctx->out, file->buffer, before, after);
+			}
+			pathPop(file, 0);
+			merge->differences++;
+		}
+	}
+	return processManifestNext(merge);
+}
+
+int processManifestNext(struct manifestMerge *merge)
+{
+	return manifestReaderNext(merge->reader, &merge->path, &merge->attrs);
+}
+
+void processManifestReport(struct manifestMerge *merge, char mark,
+                           const char *path, uint32_t before, uint32_t after)
+{
+	merge->differences++;
+	if (merge->args->manifestOp != MANIFEST_DIFF) {
+		if (mark == '-') {
+			fprintf(stderr, "Warning: '%s/%s' is not in the tree\n",
+			        merge->args->fileList[0], path);
+		}
+		return;
+	}
+	if (mark == '~') {
+		printf("~ %s => %s  %s/%s\n", outputAttrString(before),
+		       outputAttrString(after), merge->args->fileList[0], path);
+	} else {
+		printf("%c %s  %s/%s\n", mark,
+		       outputAttrString(mark == '-' ? before : after),
+		       merge->args->fileList[0], path);
+	}
+}
+
+int processWatch(const struct programArgs *const args,
+                 struct processContext *ctx)
+{
+	struct watcher *watcher = NULL;
+	int watchErrno = watchCreate(&watcher, args->flags & FLAG_RECURSIVE);
+	if (watchErrno) {
+		fprintf(stderr, "Error watching: %s\n", watchGetError(watchErrno));
+		return watchErrno;
+	}
+	for (size_t i = 0; i < args->fileListSize; i++) {
+		watchErrno = watchAdd(watcher, args->fileList[i]);
+		if (watchErrno) {
+			fprintf(stderr, "Error watching '%s': %s\n",
+			        args->fileList[i], watchGetError(watchErrno));
+			watchDestroy(watcher);
+			return watchErrno;
+		}
+	}
+	/* The output of the first pass is shown before waiting for events. */
+	outputFlush(ctx->out);
+	struct watchData data = {args, ctx};
+	watchErrno = watchRun(watcher, processWatchEvent, &data);
+	if (watchErrno) {
+		fprintf(stderr, "Error watching: %s\n", watchGetError(watchErrno));
+	}
+	watchDestroy(watcher);
+	return watchErrno;
+}
+
+void processWatchEvent(const char *path, int isDir, void *data)
+{
+	struct watchData *watch = data;
+	const struct programArgs *args = watch->args;
+	/* The processing functions take the file as modifiable. */
+	char *file = strdup(path);
+	if (file == NULL) {
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        path, mainGetError(EALLOC));
+		return;
+	}
+	int processDir = isDir && (args->flags & FLAG_RECURSIVE);
+	int dosfsErrno = hasAttributeChanges(args) ?
+	                 processModifyAttributes(args, watch->ctx, file,
+	                                         processDir) :
+	                 processPrintAttributes(args, watch->ctx, file,
+	                                        processDir);
+	/* Short lived files can be gone before they are processed, but not
+	   their directory: that means a stale path. */
+	struct dosfsError error;
+	dosfsGetLastError(&error);
+	if (dosfsErrno && (error.errnum != ENOENT || !processParentExists(file))) {
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        file, dosfsGetError(dosfsErrno));
+	}
+	free(file);
+	outputFlush(watch->ctx->out);
+}
+
+int processParentExists(const char *file)
+{
+	const char *slash = strrchr(file, '/');
+	if (slash == NULL) {
+		return TRUE;
+	}
+	/* The parent of "/name" is "/". */
+	size_t length = slash == file ? 1 : (size_t)(slash - file);
+	char *parent = strndup(file, length);
+	struct dosfsStat st;
+	int exists = parent == NULL || dosfsStatAt(DOSFS_AT_CWD, parent, &st) == 0;
+	free(parent);
+	return exists;
+}
+
+void processEntryChanges(const struct programArgs *const args,
+                         struct processContext *ctx,
+                         const char *file,
+                         uint32_t *add,
+                         uint32_t *remove,
+                         uint32_t *toggle)
+{
+	*add = args->attrsToAdd;
+	*remove = args->attrsToRemove;
+	*toggle = args->attrsToToggle;
+	if (args->rules == NULL) {
+		return;
+	}
+	/* The "." and ".." entries are their directory and its parent, whose
+	   rules are the ones of their own names. */
+	const char *name = entryName(file);
+	struct traverseStack *stack = &ctx->stack;
+	if (stack->size > 0 &&
+	        (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)) {
+		return;
+	}
+	struct traverseFrame *frame = stack->size > 0 ?
+	                              &stack->frames[stack->size - 1] : NULL;
+	struct rulesChange change;
+	rulesMatch(args->rules, &ctx->rules, frame != NULL ? frame->rulesMark : 0,
+	           frame != NULL ? frame->rulesCount : 0, name, &change);
+	*add = change.add;
+	*remove = change.remove;
+}
+
+int hasAttributeChanges(const struct programArgs *const args)
+{
+	return args->attrsToAdd != 0 || args->attrsToRemove != 0 ||
+	       args->attrsToToggle != 0 || args->rulesFile != NULL;
+}
+
+int processPrintAttributes(const struct programArgs *const args,
+                           struct processContext *ctx,
+                           char *file,
+                           int processDir)
+{
+	return processPrintAttributesAt(args, ctx, DOSFS_AT_CWD, file, file,
+	                                processDir);
+}
+
+int processPrintAttributesAt(const struct programArgs *const args,
+                             struct processContext *ctx,
+                             int dirFd,
+                             const char *name,
+                             char *file,
+                             int processDir)
 {
 	uint32_t fileAttrs = 0;
-	int dosfsErrno = dosfsGetAttributes(fd, &fileAttrs);
+	if (processCacheLookup(args, dirFd, name, file, processDir,
+	                       &fileAttrs)) {
+		processShowAttributes(args, ctx, file, fileAttrs);
+		return ENOERR;
+	}
+	int fd = 0;
+	int dosfsErrno = dosfsOpenAt(dirFd, name, &fd);
+	if (dosfsErrno) {
+		return dosfsErrno;
+	}
+	dosfsErrno = processPrintAttributesFd(args, ctx, file, fd, processDir);
+	dosfsClose(fd);
+	return dosfsErrno;
+}
+
+int processPrintAttributesFd(const struct programArgs *const args,
+                             struct processContext *ctx,
+                             char *file,
+                             int fd,
+                             int processDir)
+{
+	uint32_t fileAttrs = 0;
+	int dosfsErrno = processGetAttributes(args, file, fd, &fileAttrs);
+	if (dosfsErrno) {
+		return dosfsErrno;
+	}
+	processShowAttributes(args, ctx, file, fileAttrs);
+	if (DOSFS_HAS_ATTR_DIR(fileAttrs) && processDir) {
+		return processDirectory(args, ctx, file, fd);
+	}
+	return ENOERR;
+}
+
+int processCacheLookup(const struct programArgs *const args,
+                       int dirFd,
+                       const char *name,
+                       const char *file,
+                       int processDir,
+                       uint32_t *attrs)
+{
+	struct dosfsStat st;
+	if (args->cache == NULL || hasAttributeChanges(args) ||
+	        dosfsStatAt(dirFd, name, &st)) {
+		return FALSE;
+	}
+	if (st.isDir && processDir) {
+		return FALSE;
+	}
+	return cacheLookup(args->cache, file, &st, attrs);
+}
+
+void processCacheStore(const struct programArgs *const args,
+                       const char *file,
+                       const struct dosfsStat *st,
+                       uint32_t attrs)
+{
+	int cacheErrno = cacheStore(args->cache, file, st, attrs);
+	if (cacheErrno) {
+		fprintf(stderr, "Error updating the cache '%s': %s\n",
+		        args->cacheFile, cacheGetError(cacheErrno));
+	}
+}
+
+int processGetAttributes(const struct programArgs *const args,
+                         const char *file,
+                         int fd,
+                         uint32_t *attrs)
+{
+	/* The status is taken first: a change after it changes the ctime, so
+	   the entry saved is never newer than the file. */
+	struct dosfsStat st;
+	int cache = args->cache != NULL && dosfsStat(fd, &st) == ENOERR;
+	int dosfsErrno = dosfsGetAttributes(fd, attrs);
+	if (!dosfsErrno && cache) {
+		processCacheStore(args, file, &st, *attrs);
+	}
+	return dosfsErrno;
+}
+
+void processShowAttributes(const struct programArgs *const args,
+                           struct processContext *ctx,
+                           const char *file,
+                           uint32_t attrs)
+{
+	if (args->matcher != NULL &&
+	        !matchEntry(args->matcher, entryName(file), attrs)) {
+		return;
+	}
+	if (ctx->summary != NULL) {
+		processSummaryCount(ctx, file, attrs);
+	} else {
+		outputAttrs(ctx->out, file, attrs);
+	}
+}
+
+void processSummaryCount(struct processContext *ctx,
+                         const char *file,
+                         uint32_t attrs)
+{
+	struct traverseStack *stack = &ctx->stack;
+	if (stack->size == 0) {
+		summaryCount(ctx->summary, SUMMARY_NO_DIR, attrs);
+		return;
+	}
+	const char *name = entryName(file);
+	if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+		summaryCount(ctx->summary, stack->frames[stack->size - 1].row, attrs);
+	}
+}
+
+int processModifyAttributes(const struct programArgs *const args,
+                            struct processContext *ctx,
+                            char *file,
+                            int processDir)
+{
+	return processModifyAttributesAt(args, ctx, DOSFS_AT_CWD, file, file,
+	                                 processDir);
+}
+
+int processModifyAttributesAt(const struct programArgs *const args,
+                              struct processContext *ctx,
+                              int dirFd,
+                              const char *name,
+                              char *file,
+                              int processDir)
+{
+	int fd = 0;
+	int dosfsErrno = dosfsOpenAt(dirFd, name, &fd);
+	if (dosfsErrno) {
+		return dosfsErrno;
+	}
+	dosfsErrno = processModifyAttributesFd(args, ctx, file, fd, processDir);
+	dosfsClose(fd);
+	return dosfsErrno;
+}
+
+int processModifyAttributesFd(const struct programArgs *const args,
+                              struct processContext *ctx,
+                              char *file,
+                              int fd,
+                              int processDir)
+{
+	uint32_t fileAttrs = 0;
+	uint32_t newAttrs = 0;
+	if (ctx->plan != NULL) {
+		int dosfsErrno = dosfsGetAttributes(fd, &fileAttrs);
+		if (dosfsErrno) {
+			return dosfsErrno;
+		}
+		/* The plan keeps the error, processPlan fails with it once the
+		   other changes are applied. */
+		int planErrno = processPlanChange(args, ctx, file, fileAttrs,
+		                                  &newAttrs);
+		if (planErrno) {
+			fprintf(stderr, "Error processing file '%s': %s\n",
+			        file, planGetError(planErrno));
+		}
+		if (DOSFS_HAS_ATTR_DIR(newAttrs) && processDir) {
+			return processDirectory(args, ctx, file, fd);
+		}
+		return ENOERR;
+	}
+	uint32_t add = 0;
+	uint32_t remove = 0;
+	uint32_t toggle = 0;
+	processEntryChanges(args, ctx, file, &add, &remove, &toggle);
+	struct matchFilter filter = {args->matcher, entryName(file), TRUE};
+	int dosfsErrno = dosfsApplyMaskIf(fd,
+	                                  args->matcher != NULL ?
+	                                  processMatchFilter : NULL,
+	                                  &filter, add, remove, toggle,
+	                                  &fileAttrs, &newAttrs);
+	if (dosfsErrno) {
+		return dosfsErrno;
+	}
+	if (newAttrs != fileAttrs &&
+	        (dosfsErrno = processSyncChange(args, ctx, file, fd))) {
+		return dosfsErrno;
+	}
+	struct dosfsStat st;
+	if (args->cache != NULL && newAttrs != fileAttrs &&
+	        dosfsStat(fd, &st) == ENOERR) {
+		processCacheStore(args, file, &st, newAttrs);
+	}
+	if ((args->flags & FLAG_VERBOSE) && filter.matched) {
+		outputChange(ctx->out, file, fileAttrs, newAttrs);
+	}
+	if (DOSFS_HAS_ATTR_DIR(newAttrs) && processDir) {
+		return processDirectory(args, ctx, file, fd);
+	}
+	return ENOERR;
+}
+
+int processSyncChange(const struct programArgs *const args,
+                      struct processContext *ctx,
+                      const char *file,
+                      int fd)
+{
+	struct traverseStack *stack = &ctx->stack;
+	if (args->durability == DURABILITY_NONE) {
+		return ENOERR;
+	}
+	/* The files outside a traversal don't have a directory to flush. */
+	if (args->durability == DURABILITY_PER_FILE ||
+	        (args->durability == DURABILITY_PER_DIR && stack->size == 0)) {
+		return dosfsSync(fd, DOSFS_SYNC_FILE);
+	}
+	if (stack->size > 0) {
+		stack->frames[stack->size - 1].changed = TRUE;
+		return ENOERR;
+	}
+	processTouch(args, file, fd);
+	return ENOERR;
+}
+
+int processSyncDirectory(const struct programArgs *const args,
+                         const char *dir,
+                         int fd)
+{
+	if (args->durability != DURABILITY_PER_DIR &&
+	        args->durability != DURABILITY_END) {
+		return ENOERR;
+	}
+	int dirFd = fd;
+	if (dirFd == -1) {
+		int dosfsErrno = dosfsOpen(dir, &dirFd);
+		if (dosfsErrno) {
+			return dosfsErrno;
+		}
+	}
+	int dosfsErrno = ENOERR;
+	if (args->durability == DURABILITY_PER_DIR) {
+		dosfsErrno = dosfsSync(dirFd, DOSFS_SYNC_DIR);
+	} else {
+		processTouch(args, dir, dirFd);
+	}
+	if (dirFd != fd) {
+		dosfsClose(dirFd);
+	}
+	return dosfsErrno;
+}
+
+void processTouch(const struct programArgs *const args,
+                  const char *file,
+                  int fd)
+{
+	struct touchedList *touched = args->touched;
+	struct dosfsStat st;
+	uint64_t dev = dosfsStat(fd, &st) == ENOERR ? st.dev : UNKNOWN_DEVICE;
+	pthread_mutex_lock(&touched->lock);
+	size_t i = 0;
+	while (i < touched->size && touched->items[i].dev != dev) {
+		i++;
+	}
+	if (i == touched->size) {
+		if (touched->size == touched->capacity) {
+			size_t newCapacity = touched->capacity > 0 ?
+			                     touched->capacity * 2 : 4;
+			struct touchedFs *newItems =
+			    realloc(touched->items, newCapacity * sizeof(struct touchedFs));
+			if (newItems != NULL) {
+				touched->items = newItems;
+				touched->capacity = newCapacity;
+			}
+		}
+		char *path = strdup(file);
+		if (path == NULL || touched->size == touched->capacity) {
+			free(path);
+			fprintf(stderr, "Error processing file '%s': %s\n",
+			        file, mainGetError(EALLOC));
+		} else {
+			touched->items[touched->size].dev = dev;
+			touched->items[touched->size].path = path;
+			touched->size++;
+		}
+	}
+	pthread_mutex_unlock(&touched->lock);
+}
+
+int processSyncTouched(const struct programArgs *const args)
+{
+	struct touchedList *touched = args->touched;
+	int dosfsErrno = ENOERR;
+	for (size_t i = 0; touched != NULL && i < touched->size; i++) {
+		int fd = -1;
+		int syncErrno = dosfsOpen(touched->items[i].path, &fd);
+		if (!syncErrno) {
+			syncErrno = dosfsSync(fd, DOSFS_SYNC_FS);
+			dosfsClose(fd);
+		}
+		if (syncErrno) {
+			fprintf(stderr, "Error processing file '%s': %s\n",
+			        touched->items[i].path, dosfsGetError(syncErrno));
+			dosfsErrno = syncErrno;
+		}
+	}
+	return dosfsErrno;
+}
+
+const char *entryName(const char *file)
+{
+	const char *slash = strrchr(file, '/');
+	return slash != NULL ? slash + 1 : file;
+}
+
+int processMatchFilter(uint32_t attrs, void *data)
+{
+	struct matchFilter *filter = data;
+	filter->matched = matchEntry(filter->matcher, filter->name, attrs);
+	return filter->matched;
+}
+
+int processPlanChange(const struct programArgs *const args,
+                      struct processContext *ctx,
+                      char *file,
+                      uint32_t fileAttrs,
+                      uint32_t *newAttrs)
+{
+	*newAttrs = fileAttrs;
+	uint32_t add = 0;
+	uint32_t remove = 0;
+	uint32_t toggle = 0;
+	processEntryChanges(args, ctx, file, &add, &remove, &toggle);
+	struct matchFilter filter = {args->matcher, entryName(file), TRUE};
+	if (args->matcher == NULL || processMatchFilter(fileAttrs, &filter)) {
+		*newAttrs = ((fileAttrs | add) & ~remove) ^ toggle;
+	}
+	if (*newAttrs == fileAttrs) {
+		return ENOERR;
+	}
+	return planAdd(ctx->plan, file, fileAttrs, *newAttrs);
+}
+
+int processPlan(const struct programArgs *const args,
+                struct processContext *ctx)
+{
+	planSort(ctx->plan);
+	size_t size = planSize(ctx->plan);
+	if (args->flags & FLAG_DRY_RUN) {
+		struct planEntry entry;
+		for (size_t i = 0; i < size; i++) {
+			planGet(ctx->plan, i, &entry);
+			outputChange(ctx->out, entry.path, entry.before, entry.after);
+		}
+		return planGetStatus(ctx->plan);
+	}
+	int dosfsErrno = planGetStatus(ctx->plan);
+	size_t first = 0;
+	while (first < size) {
+		size_t last = first + 1;
+		while (last < size && planSameParent(ctx->plan, first, last)) {
+			last++;
+		}
+		int dirErrno = processPlanDirectory(args, ctx, first, last);
+		dosfsErrno = dirErrno ? dirErrno : dosfsErrno;
+		first = last;
+	}
+	return dosfsErrno;
+}
+
+int processPlanDirectory(const struct programArgs *const args,
+                         struct processContext *ctx,
+                         size_t first,
+                         size_t last)
+{
+	struct planEntry entry;
+	planGet(ctx->plan, first, &entry);
+	int dirFd = DOSFS_AT_CWD;
+	if (entry.nameOffset > 0) {
+		int pathErrno = pathSet(&ctx->path, entry.path);
+		if (pathErrno) {
+			fprintf(stderr, "Error processing file '%s': %s\n",
+			        entry.path, pathGetError(pathErrno));
+			return pathErrno;
+		}
+		pathPop(&ctx->path, entry.nameOffset);
+		int dosfsErrno = dosfsOpen(ctx->path.buffer, &dirFd);
+		if (dosfsErrno) {
+			fprintf(stderr, "Error processing file '%s': %s\n",
+			        ctx->path.buffer, dosfsGetError(dosfsErrno));
+			pathPop(&ctx->path, 0);
+			return dosfsErrno;
+		}
+	}
+	/* The changes were computed when planning, only the attributes that
+	   differ are set or cleared. */
+	int dosfsErrno = ENOERR;
+	struct dosfsBatchOp ops[DOSFS_BATCH_MAX];
+	struct dosfsBatchResult results[DOSFS_BATCH_MAX];
+	char message[ERRMSG_MAX];
+	int changed = FALSE;
+	struct dosfsStat st;
+	for (size_t base = first; base < last; base += DOSFS_BATCH_MAX) {
+		size_t batchSize = last - base < DOSFS_BATCH_MAX ?
+		                   last - base : DOSFS_BATCH_MAX;
+		for (size_t i = 0; i < batchSize; i++) {
+			planGet(ctx->plan, base + i, &entry);
+			ops[i].path = entry.path + entry.nameOffset;
+			ops[i].set = entry.after & ~entry.before;
+			ops[i].clear = entry.before & ~entry.after;
+			ops[i].sync = args->durability == DURABILITY_PER_FILE;
+		}
+		dosfsApplyBatch(dirFd, ops, batchSize, results);
+		for (size_t i = 0; i < batchSize; i++) {
+			planGet(ctx->plan, base + i, &entry);
+			if (results[i].error.code) {
+				fprintf(stderr, "Error processing file '%s': %s\n",
+				        entry.path,
+				        dosfsFormatError(&results[i].error, message,
+				                         ERRMSG_MAX));
+				dosfsErrno = results[i].error.code;
+				continue;
+			}
+			changed = TRUE;
+			if (args->cache != NULL &&
+			        dosfsStatAt(dirFd, ops[i].path, &st) == ENOERR) {
+				processCacheStore(args, entry.path, &st,
+				                  results[i].after);
+			}
+			if (args->flags & FLAG_VERBOSE) {
+				outputChange(ctx->out, entry.path, results[i].before,
+				             results[i].after);
+			}
+		}
+	}
+	/* The entries given without a directory are in the current one. */
+	const char *dir = entry.nameOffset > 0 ? ctx->path.buffer : ".";
+	int syncErrno = ENOERR;
+	if (changed && args->durability != DURABILITY_PER_FILE &&
+	        (syncErrno = processSyncDirectory(args, dir,
+	                                          dirFd != DOSFS_AT_CWD ? dirFd :
+	                                          -1))) {
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        dir, dosfsGetError(syncErrno));
+		dosfsErrno = syncErrno;
+	}
+	pathPop(&ctx->path, 0);
+	if (dirFd != DOSFS_AT_CWD) {
+		dosfsClose(dirFd);
+	}
+	return dosfsErrno;
+}
+
+int processRecursesInto(const struct programArgs *const args,
+                        const char *name)
+{
+	return (args->flags & FLAG_RECURSIVE) &&
+	       strcmp(name, ".") != 0 &&
+	       strcmp(name, "..") != 0;
+}
+
+int processSkipEntry(const struct programArgs *const args,
+                     const char *name)
+{
+	if (args->matcher == NULL) {
+		return FALSE;
+	}
+	return matchPruned(args->matcher, name) ||
+	       (!processRecursesInto(args, name) &&
+	        !matchName(args->matcher, name));
+}
+
+int processDirectory(const struct programArgs *const args,
+                     struct processContext *ctx,
+                     char *dir,
+                     int fd)
+{
+	if (ctx->pool == NULL) {
+		/* Inside a traversal 'dir' is the entry being processed, it's
+		   pushed to the stack by processFrameEntry. */
+		if (ctx->stack.size > 0) {
+			ctx->stack.descend = TRUE;
+			ctx->stack.descendFd = fd;
+			return ENOERR;
+		}
+		int pathErrno = pathSet(&ctx->path, dir);
+		if (pathErrno) {
+			fprintf(stderr, "Error processing file '%s': %s\n",
+			        dir, pathGetError(pathErrno));
+			return ENOERR;
+		}
+		int dosfsErrno = processTraverse(args, ctx, fd);
+		pathPop(&ctx->path, 0);
+		return dosfsErrno;
+	}
+	struct dirTask *task = processNewTask(dir, 0);
+	if (task == NULL) {
+		return ENOERR;
+	}
+	/* The directory is an entry of the current one, if any. */
+	task->depth = ctx->depth + ctx->stack.size;
+	task->rowLength = ctx->stack.size > 0 ?
+	                  ctx->stack.frames[ctx->stack.size - 1].rowLength : 0;
+	task->rootLength = ctx->rootLength;
+	processSubmitTask(ctx, task);
+	return ENOERR;
+}
+
+struct dirTask *processNewTask(const char *path, size_t extra)
+{
+	size_t pathLength = strlen(path);
+	struct dirTask *task = malloc(sizeof(struct dirTask) + pathLength + 1 +
+	                              extra);
+	if (task == NULL) {
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        path, mainGetError(EALLOC));
+		return NULL;
+	}
+	task->depth = 0;
+	task->rowLength = 0;
+	task->rootLength = 0;
+	task->names = 0;
+	task->result = NULL;
+	memcpy(task->path, path, pathLength + 1);
+	return task;
+}
+
+int processSubmitTask(struct processContext *ctx, struct dirTask *task)
+{
+	int poolErrno = workPoolSubmit(ctx->pool, task);
+	if (poolErrno) {
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        task->path, workPoolGetError(poolErrno));
+		free(task);
+	}
+	return poolErrno;
+}
+
+void processSubmitFile(struct processContext *ctx, const char *file,
+                       int *result)
+{
+	struct dirTask *task = processNewTask(file, 0);
+	if (task == NULL) {
+		*result = EALLOC;
+		return;
+	}
+	/* Set before the task can run. */
+	*result = ENOERR;
+	task->result = result;
+	int poolErrno = processSubmitTask(ctx, task);
+	if (poolErrno) {
+		*result = poolErrno;
+	}
+}
+
+int processRunPool(struct processContext *ctx)
+{
+	int poolErrno = workPoolRun(ctx->pool);
+	if (poolErrno) {
+		fprintf(stderr, "Error running the worker pool: %s\n",
+		        workPoolGetError(poolErrno));
+	}
+	return poolErrno;
+}
+
+int processTraverse(const struct programArgs *const args,
+                    struct processContext *ctx,
+                    int fd)
+{
+	struct traverseStack *stack = &ctx->stack;
+	int mainErrno = processStackReserve(ctx);
+	if (mainErrno) {
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        ctx->path.buffer, mainGetError(mainErrno));
+		return ENOERR;
+	}
+	/* The errors of the first directory are returned, like the ones of any
+	   other file given to the program. */
+	int dosfsErrno = processFramePush(args, ctx, fd, ctx->path.length);
+	if (dosfsErrno) {
+		return dosfsErrno;
+	}
+	while (stack->size > 0) {
+		struct traverseFrame *frame = &stack->frames[stack->size - 1];
+		if (frame->next == frame->size && frame->done) {
+			processFramePop(args, ctx);
+		} else if ((frame->fd == -1 ||
+		            (frame->dir == NULL && !frame->done)) &&
+		           (dosfsErrno = processFrameOpen(ctx))) {
+			fprintf(stderr, "Error processing file '%s': %s\n",
+			        ctx->path.buffer, dosfsGetError(dosfsErrno));
+			processFramePop(args, ctx);
+		} else if (frame->next == frame->size) {
+			processFrameRead(args, ctx);
+		} else {
+			processFrameEntry(args, ctx);
+		}
+	}
+	return ENOERR;
+}
+
+int processStackReserve(struct processContext *ctx)
+{
+	struct traverseStack *stack = &ctx->stack;
+	if (stack->size < stack->capacity) {
+		return ENOERR;
+	}
+	size_t newCapacity = stack->capacity > 0 ? stack->capacity * 2 :
+	                     STACK_INITIAL_CAPACITY;
+	struct traverseFrame *newFrames =
+	    realloc(stack->frames, newCapacity * sizeof(struct traverseFrame));
+	if (newFrames == NULL) {
+		return EALLOC;
+	}
+	stack->frames = newFrames;
+	stack->capacity = newCapacity;
+	return ENOERR;
+}
+
+int processFramePush(const struct programArgs *const args,
+                     struct processContext *ctx,
+                     int fd,
+                     size_t pathMark)
+{
+	struct traverseStack *stack = &ctx->stack;
+	struct traverseFrame *frame = &stack->frames[stack->size];
+	int dosfsErrno = dosfsDirOpen(fd, &frame->dir);
+	if (dosfsErrno) {
+		return dosfsErrno;
+	}
+	frame->fd = fd;
+	frame->done = FALSE;
+	frame->pos.index = 0;
+	frame->pos.offset = 0;
+	frame->pathMark = pathMark;
+	frame->namesMark = ctx->names.used;
+	frame->next = 0;
+	frame->size = 0;
+	frame->changed = FALSE;
+	if (stack->size == 0 && ctx->depth == 0) {
+		ctx->rootLength = ctx->path.length;
+	}
+	if (ctx->summary != NULL) {
+		processSummaryFrame(args, ctx, frame);
+	}
+	if (args->rules != NULL) {
+		processRulesFrame(args, ctx, frame);
+	}
+	stack->size++;
+	stack->openFds++;
+	return ENOERR;
+}
+
+void processSummaryFrame(const struct programArgs *const args,
+                         struct processContext *ctx,
+                         struct traverseFrame *frame)
+{
+	struct traverseStack *stack = &ctx->stack;
+	size_t depth = ctx->depth + stack->size;
+	if (depth > args->summaryDepth && stack->size > 0) {
+		frame->row = stack->frames[stack->size - 1].row;
+		frame->rowLength = stack->frames[stack->size - 1].rowLength;
+		return;
+	}
+	/* The first directory of a worker can be below the deepest rows, its
+	   entries go to the row of its ancestor. */
+	frame->rowLength = depth > args->summaryDepth ? ctx->rowLength :
+	                   ctx->path.length;
+	char saved = ctx->path.buffer[frame->rowLength];
+	ctx->path.buffer[frame->rowLength] = '\0';
+	int summaryErrno = summaryDir(ctx->summary, ctx->path.buffer,
+	                              depth > args->summaryDepth ?
+	                              args->summaryDepth : depth, &frame->row);
+	if (summaryErrno) {
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        ctx->path.buffer, summaryGetError(summaryErrno));
+		frame->row = SUMMARY_NO_DIR;
+	}
+	ctx->path.buffer[frame->rowLength] = saved;
+}
+
+void processRulesFrame(const struct programArgs *const args,
+                       struct processContext *ctx,
+                       struct traverseFrame *frame)
+{
+	struct traverseStack *stack = &ctx->stack;
+	frame->rulesMark = ctx->rules.size;
+	int rulesErrno = ENOERR;
+	if (stack->size > 0) {
+		const struct traverseFrame *parent = &stack->frames[stack->size - 1];
+		rulesErrno = rulesDescend(args->rules, &ctx->rules, parent->rulesMark,
+		                          parent->rulesCount,
+		                          ctx->path.buffer + frame->pathMark + 1);
+	} else if (ctx->depth == 0) {
+		rulesErrno = rulesRoot(args->rules, &ctx->rules);
+	} else {
+		/* The first directory of a worker, walked from its FILE. */
+		rulesErrno = rulesWalk(args->rules,
+		                       ctx->path.buffer + ctx->rootLength,
+		                       &ctx->rules);
+	}
+	if (rulesErrno) {
+		/* Only the rules of names apply below it. */
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        ctx->path.buffer, rulesGetError(rulesErrno));
+		ctx->rules.size = frame->rulesMark;
+	}
+	frame->rulesCount = ctx->rules.size - frame->rulesMark;
+}
+
+void processFramePop(const struct programArgs *const args,
+                     struct processContext *ctx)
+{
+	struct traverseStack *stack = &ctx->stack;
+	struct traverseFrame *frame = &stack->frames[stack->size - 1];
+	processFrameCloseEntries(ctx, stack->size - 1, frame->next, frame->size);
+	dosfsDirClose(frame->dir);
+	if (frame->changed) {
+		int dosfsErrno = processSyncDirectory(args, ctx->path.buffer,
+		                                      frame->fd);
+		if (dosfsErrno) {
+			fprintf(stderr, "Error processing file '%s': %s\n",
+			        ctx->path.buffer, dosfsGetError(dosfsErrno));
+		}
+	}
+	/* The descriptor of the first directory belongs to the caller. */
+	if (frame->fd != -1) {
+		if (stack->size > 1) {
+			dosfsClose(frame->fd);
+		}
+		stack->openFds--;
+	}
+	pathPop(&ctx->path, frame->pathMark);
+	pathArenaReset(&ctx->names, frame->namesMark);
+	if (args->rules != NULL) {
+		ctx->rules.size = frame->rulesMark;
+	}
+	stack->size--;
+	if (ctx->shared != NULL) {
+		outputMerge(ctx->shared, ctx->out);
+	}
+}
+
+int processFrameOpen(struct processContext *ctx)
+{
+	struct traverseStack *stack = &ctx->stack;
+	size_t last = stack->size - 1;
+	/* The directories opened again on the way keep their descriptor, but
+	   their iterators are only resumed when they are the last one. The
+	   first directory is never closed. */
+	size_t first = last + 1;
+	while (stack->frames[first - 1].fd == -1) {
+		first--;
+	}
+	for (size_t i = first; i <= last; i++) {
+		processFreeFds(ctx, 1, i - 1);
+		/* The name of the directory is the component of the path after its
+		   mark, terminated in place while it's opened. */
+		struct traverseFrame *frame = &stack->frames[i];
+		size_t end = i < last ? stack->frames[i + 1].pathMark :
+		             ctx->path.length;
+		char saved = ctx->path.buffer[end];
+		ctx->path.buffer[end] = '\0';
+		int dosfsErrno = dosfsOpenAt(stack->frames[i - 1].fd,
+		                             ctx->path.buffer + frame->pathMark + 1,
+		                             &frame->fd);
+		ctx->path.buffer[end] = saved;
+		if (dosfsErrno) {
+			frame->fd = -1;
+			return dosfsErrno;
+		}
+		stack->openFds++;
+	}
+	struct traverseFrame *frame = &stack->frames[last];
+	if (!frame->done) {
+		int dosfsErrno = dosfsDirOpen(frame->fd, &frame->dir);
+		if (!dosfsErrno) {
+			dosfsErrno = dosfsDirSeek(frame->dir, &frame->pos);
+		}
+		if (dosfsErrno) {
+			return dosfsErrno;
+		}
+	}
+	processFrameOpenEntries(ctx);
+	return ENOERR;
+}
+
+void processFrameClose(struct processContext *ctx, size_t index)
+{
+	struct traverseStack *stack = &ctx->stack;
+	struct traverseFrame *frame = &stack->frames[index];
+	processFrameCloseEntries(ctx, index, frame->next, frame->size);
+	if (frame->dir != NULL) {
+		dosfsDirTell(frame->dir, &frame->pos);
+		dosfsDirClose(frame->dir);
+		frame->dir = NULL;
+	}
+	dosfsClose(frame->fd);
+	frame->fd = -1;
+	stack->openFds--;
+}
+
+void processFrameRead(const struct programArgs *const args,
+                      struct processContext *ctx)
+{
+	struct traverseFrame *frame = &ctx->stack.frames[ctx->stack.size - 1];
+	size_t batchSize = dosfsGetEngine() != DOSFS_ENGINE_SYNC ?
+	                   DOSFS_BATCH_MAX : 1;
+	pathArenaReset(&ctx->names, frame->namesMark);
+	frame->next = 0;
+	frame->size = 0;
+	const char *dirEntry = NULL;
+	while (frame->size < batchSize) {
+		int dosfsErrno = processFrameNext(ctx, &dirEntry);
+		if (dosfsErrno || dirEntry == NULL) {
+			frame->done = TRUE;
+			dosfsDirClose(frame->dir);
+			frame->dir = NULL;
+			processSplitSubmit(ctx);
+			break;
+		}
+		if (processSkipEntry(args, dirEntry) ||
+		        processSplitEntry(ctx, dirEntry)) {
+			continue;
+		}
+		int pathErrno = pathArenaCopy(&ctx->names, dirEntry,
+		                              &frame->offsets[frame->size]);
+		if (pathErrno) {
+			fprintf(stderr, "Error processing file '%s/%s': %s\n",
+			        ctx->path.buffer, dirEntry, pathGetError(pathErrno));
+			continue;
+		}
+		frame->fds[frame->size] = -1;
+		frame->cached[frame->size] = FALSE;
+		/* The cache is keyed by the path printed for the entry. */
+		size_t mark = 0;
+		if (args->cache != NULL &&
+		        pathPush(&ctx->path, dirEntry, &mark) == ENOERR) {
+			frame->cached[frame->size] =
+			    processCacheLookup(args, frame->fd, dirEntry,
+			                       ctx->path.buffer,
+			                       processRecursesInto(args, dirEntry),
+			                       &frame->attrs[frame->size]);
+			pathPop(&ctx->path, mark);
+		}
+		frame->size++;
+	}
+	processFrameOpenEntries(ctx);
+}
+
+int processFrameNext(struct processContext *ctx, const char **name)
+{
+	struct traverseFrame *frame = &ctx->stack.frames[ctx->stack.size - 1];
+	if (ctx->taskNames == NULL || ctx->stack.size != 1) {
+		return dosfsDirNext(frame->dir, name);
+	}
+	*name = NULL;
+	if (ctx->taskNamesLeft > 0) {
+		*name = ctx->taskNames;
+		ctx->taskNames += strlen(ctx->taskNames) + 1;
+		ctx->taskNamesLeft--;
+	}
+	return ENOERR;
+}
+
+int processSplitEntry(struct processContext *ctx, const char *name)
+{
+	/* With a pool the subdirectories are tasks of their own, the first
+	   directory is the only one of the stack. */
+	if (ctx->pool == NULL || ctx->stack.size != 1 ||
+	        ctx->taskNames != NULL) {
+		return FALSE;
+	}
+	if (ctx->position < SPLIT_ENTRIES) {
+		ctx->position++;
+		return FALSE;
+	}
+	size_t offset = 0;
+	/* Processed here instead. */
+	if (pathArenaCopy(&ctx->split, name, &offset)) {
+		return FALSE;
+	}
+	if (++ctx->splitSize == SPLIT_CHUNK) {
+		processSplitSubmit(ctx);
+	}
+	return TRUE;
+}
+
+void processSplitSubmit(struct processContext *ctx)
+{
+	if (ctx->splitSize == 0) {
+		return;
+	}
+	struct dirTask *task = processNewTask(ctx->path.buffer, ctx->split.used);
+	if (task != NULL) {
+		memcpy(task->path + ctx->path.length + 1, ctx->split.buffer,
+		       ctx->split.used);
+		task->depth = ctx->depth;
+		task->rowLength = ctx->rowLength;
+		task->rootLength = ctx->rootLength;
+		task->names = ctx->splitSize;
+		processSubmitTask(ctx, task);
+	}
+	pathArenaReset(&ctx->split, 0);
+	ctx->splitSize = 0;
+}
+
+void processFrameOpenEntries(struct processContext *ctx)
+{
+	struct traverseStack *stack = &ctx->stack;
+	struct traverseFrame *frame = &stack->frames[stack->size - 1];
+	if (dosfsGetEngine() == DOSFS_ENGINE_SYNC || frame->next == frame->size) {
+		return;
+	}
+	size_t pending[DOSFS_BATCH_MAX];
+	size_t count = 0;
+	for (size_t i = frame->next; i < frame->size; i++) {
+		if (!frame->cached[i]) {
+			pending[count++] = i;
+		}
+	}
+	/* The entries that don't fit in the budget are opened on their own when
+	   they are processed. */
+	size_t size = count > 0 ? processFreeFds(ctx, count,
+	                                         stack->size - 1) : 0;
+	if (size == 0) {
+		return;
+	}
+	const char *batch[DOSFS_BATCH_MAX];
+	int fds[DOSFS_BATCH_MAX];
+	for (size_t i = 0; i < size; i++) {
+		batch[i] = pathArenaGet(&ctx->names, frame->offsets[pending[i]]);
+	}
+	dosfsOpenAtBatch(frame->fd, batch, size, fds);
+	for (size_t i = 0; i < size; i++) {
+		frame->fds[pending[i]] = fds[i];
+		stack->openFds += fds[i] != -1;
+	}
+}
+
+void processFrameCloseEntries(struct processContext *ctx, size_t index,
+                              size_t from, size_t to)
+{
+	struct traverseFrame *frame = &ctx->stack.frames[index];
+	size_t count = 0;
+	for (size_t i = from; i < to; i++) {
+		count += frame->fds[i] != -1;
+	}
+	if (count == 0) {
+		return;
+	}
+	dosfsCloseBatch(frame->fds + from, to - from);
+	for (size_t i = from; i < to; i++) {
+		frame->fds[i] = -1;
+	}
+	ctx->stack.openFds -= count;
+}
+
+void processFrameEntry(const struct programArgs *const args,
+                       struct processContext *ctx)
+{
+	struct traverseStack *stack = &ctx->stack;
+	size_t index = stack->size - 1;
+	struct traverseFrame *frame = &stack->frames[index];
+	size_t entry = frame->next++;
+	const char *name = pathArenaGet(&ctx->names, frame->offsets[entry]);
+	int entryFd = frame->fds[entry];
+	int cached = frame->cached[entry];
+	if (entryFd == -1 && !cached) {
+		processFreeFds(ctx, 1, index);
+	}
+	size_t mark = 0;
+	int pathErrno = pathPush(&ctx->path, name, &mark);
+	if (pathErrno) {
+		fprintf(stderr, "Error processing file '%s/%s': %s\n",
+		        ctx->path.buffer, name, pathGetError(pathErrno));
+		return;
+	}
+	int fd = -1;
+	if (cached) {
+		processShowAttributes(args, ctx, ctx->path.buffer, frame->attrs[entry]);
+	} else {
+		fd = processDirEntry(args, ctx, frame->fd, name, entryFd);
+	}
+	if (fd != -1 && fd == entryFd) {
+		/* The descriptor now belongs to the new frame. */
+		frame->fds[entry] = -1;
+		stack->openFds--;
+	}
+	/* The processed entries are closed before going down, where they could
+	   stay open for a long time, or at the end of the batch. */
+	if (fd != -1 || frame->next == frame->size) {
+		processFrameCloseEntries(ctx, index, 0, frame->next);
+	}
+	if (fd == -1) {
+		pathPop(&ctx->path, mark);
+		return;
+	}
+	int mainErrno = processStackReserve(ctx);
+	int dosfsErrno = mainErrno ? ENOERR :
+	                 processFramePush(args, ctx, fd, mark);
+	if (mainErrno || dosfsErrno) {
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        ctx->path.buffer, mainErrno ? mainGetError(mainErrno) :
+		        dosfsGetError(dosfsErrno));
+		dosfsClose(fd);
+		pathPop(&ctx->path, mark);
+	}
+}
+
+size_t processFreeFds(struct processContext *ctx, size_t needed, size_t keep)
+{
+	struct traverseStack *stack = &ctx->stack;
+	size_t last = stack->size - 1;
+	for (size_t i = 0; i < last &&
+	        stack->openFds + needed > stack->maxFds; i++) {
+		struct traverseFrame *frame = &stack->frames[i];
+		processFrameCloseEntries(ctx, i, frame->next, frame->size);
+		if (i > 0 && i != keep && frame->fd != -1 &&
+		        stack->openFds + needed > stack->maxFds) {
+			processFrameClose(ctx, i);
+		}
+	}
+	if (stack->openFds + needed <= stack->maxFds) {
+		return needed;
+	}
+	return stack->openFds < stack->maxFds ? stack->maxFds - stack->openFds : 0;
+}
+
+int processDirEntry(const struct programArgs *const args,
+                    struct processContext *ctx,
+                    int dirFd,
+                    const char *name,
+                    int entryFd)
+{
+	int recursive = processRecursesInto(args, name);
+	int fd = entryFd;
+	int dosfsErrno = ENOERR;
+	/* The entry is opened relative to 'dirFd', the full path is only
+	   needed for the output. */
+	if (fd == -1) {
+		dosfsErrno = dosfsOpenAt(dirFd, name, &fd);
+	}
+	if (!dosfsErrno) {
+		dosfsErrno = hasAttributeChanges(args) ?
+		             processModifyAttributesFd(args, ctx, ctx->path.buffer,
+		                                       fd, recursive) :
+		             processPrintAttributesFd(args, ctx, ctx->path.buffer,
+		                                      fd, recursive);
+	}
 	if (dosfsErrno) {
-		return dosfsErrno;
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        ctx->path.buffer, dosfsGetError(dosfsErrno));
 	}
-	if (args->attrsToAdd != 0 &&
-	        (args->attrsToAdd & fileAttrs) != args->attrsToAdd) {
-		dosfsErrno = dosfsAddAttributes(fd, args->attrsToAdd);
-		if (dosfsErrno) {
-			return dosfsErrno;
+	if (ctx->stack.descend) {
+		ctx->stack.descend = FALSE;
+		return ctx->stack.descendFd;
+	}
+	if (entryFd == -1 && fd != -1) {
+		dosfsClose(fd);
+	}
+	return -1;
+}
+
+void processDirTask(void *task, void *userData)
+{
+	struct poolData *data = userData;
+	struct dirTask *dirTask = task;
+	char *dir = dirTask->path;
+	struct processContext ctx = {NULL, data->pool, NULL, {NULL, 0, 0},
+		{NULL, 0, 0}, {NULL, 0, 0, 0, FALSE, -1, data->args->maxFds}, NULL,
+		NULL, NULL, dirTask->depth, dirTask->rowLength, dirTask->rootLength,
+		{NULL, 0, 0}, 0, {NULL, 0, 0}, 0,
+		dirTask->names > 0 ? dir + strlen(dir) + 1 : NULL, dirTask->names
+	};
+	int outputErrno = outputCreate(&ctx.out, data->args->format, -1);
+	if (outputErrno) {
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        dir, outputGetError(outputErrno));
+		if (dirTask->result != NULL) {
+			*dirTask->result = outputErrno;
+		}
+		free(dirTask);
+		return;
+	}
+	int planErrno = data->plan != NULL ? planCreate(&ctx.plan) : ENOERR;
+	int summaryErrno = !planErrno && data->summary != NULL ?
+	                   summaryCreate(&ctx.summary) : ENOERR;
+	if (planErrno || summaryErrno) {
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        dir, planErrno ? planGetError(planErrno) :
+		        summaryGetError(summaryErrno));
+		if (dirTask->result != NULL) {
+			*dirTask->result = planErrno ? planErrno : summaryErrno;
 		}
+		planDestroy(ctx.plan);
+		outputDestroy(ctx.out);
+		free(dirTask);
+		return;
 	}
-	if (args->attrsToRemove != 0 &&
-	        (args->attrsToRemove & fileAttrs) != 0) {
-		dosfsErrno = dosfsRemoveAttributes(fd, args->attrsToRemove);
+	int fd = 0;
+	int dosfsErrno = ENOERR;
+	int pathErrno = 0;
+	if (dirTask->result != NULL) {
+		*dirTask->result = processFile(data->args, &ctx, dir);
+	} else if ((dosfsErrno = dosfsOpen(dir, &fd))) {
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        dir, dosfsGetError(dosfsErrno));
+	} else if ((pathErrno = pathSet(&ctx.path, dir))) {
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        dir, pathGetError(pathErrno));
+		dosfsClose(fd);
+	} else {
+		dosfsErrno = processTraverse(data->args, &ctx, fd);
 		if (dosfsErrno) {
-			return dosfsErrno;
+			fprintf(stderr, "Error processing file '%s': %s\n",
+			        dir, dosfsGetError(dosfsErrno));
 		}
+		dosfsClose(fd);
 	}
-	uint32_t newAttrs = 0;
-	dosfsErrno = dosfsGetAttributes(fd, &newAttrs);
-	if (dosfsErrno) {
-		return dosfsErrno;
+	outputMerge(data->out, ctx.out);
+	outputDestroy(ctx.out);
+	if (ctx.plan != NULL && (planErrno = planMerge(data->plan, ctx.plan))) {
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        dir, planGetError(planErrno));
 	}
-	if (args->flags & FLAG_VERBOSE) {
-		printAttrs(fileAttrs);
-		printf(" => ");
-		printAttrs(newAttrs);
-		printf("  %s\n", file);
+	planDestroy(ctx.plan);
+	if (ctx.summary != NULL &&
+	        (summaryErrno = summaryMerge(data->summary, ctx.summary))) {
+		fprintf(stderr, "Error processing file '%s': %s\n",
+		        dir, summaryGetError(summaryErrno));
 	}
-	if (DOSFS_HAS_ATTR_DIR(newAttrs) && processDir) {
-		char dirEntry[DIR_ENTRY_SIZE] = {0};
-		char realDirEntry[REAL_DIR_ENTRY_SIZE] = {0};
-		while (!(dosfsErrno = dosfsReadDir(fd, dirEntry, DIR_ENTRY_SIZE)) &&
-		        strlen(dirEntry) > 0) {
-			snprintf(realDirEntry, REAL_DIR_ENTRY_SIZE,
-			         "%s/%s",
-			         file, dirEntry);
-			int recursive = (args->flags & FLAG_RECURSIVE) &&
-			                strcmp(dirEntry, ".") != 0 &&
-			                strcmp(dirEntry, "..") != 0;
-			dosfsErrno = processModifyAttributes(args, realDirEntry, recursive);
-			if (dosfsErrno) {
-				fprintf(stderr, "Error processing file '%s': %s\n",
-				        realDirEntry, dosfsGetError(dosfsErrno));
+	summaryDestroy(ctx.summary);
+	rulesStatesFree(&ctx.rules);
+	pathFree(&ctx.path);
+	pathArenaFree(&ctx.names);
+	pathArenaFree(&ctx.split);
+	free(ctx.stack.frames);
+	free(dirTask);
+}
+
+uint32_t parseAttributes(const char *arg)
+{
+	if (arg[1] == '\0') {
+		fprintf(stderr, "Missing attribute in argument '%s'\n", arg);
+		exit(1);
+	}
+	uint32_t attrs = 0;
+	size_t argLen = strlen(arg);
+	for (size_t j = 1; j < argLen; j++) {
+		switch (arg[j]) {
+		case 'R':
+			attrs |= DOSFS_ATTR_RO;
+			break;
+		case 'A':
+			attrs |= DOSFS_ATTR_ARCH;
+			break;
+		case 'S':
+			attrs |= DOSFS_ATTR_SYS;
+			break;
+		case 'H':
+			attrs |= DOSFS_ATTR_HIDDEN;
+			break;
+		case 'D':
+			attrs |= DOSFS_ATTR_DIR;
+			break;
+		case 'V':
+			attrs |= DOSFS_ATTR_VOLUME;
+			break;
+		default:
+			fprintf(stderr, "Invalid attribute '%c' in '%s'\n",
+			        arg[j], arg);
+			exit(1);
+		}
+	}
+	return attrs;
+}
+
+char *optionValue(int argc, char **argv, int *i, const char *option)
+{
+	size_t optionLen = strlen(option);
+	if (strncmp(argv[*i], option, optionLen) != 0) {
+		return NULL;
+	}
+	if (argv[*i][optionLen] == '=') {
+		return argv[*i] + optionLen + 1;
+	}
+	if (argv[*i][optionLen] != '\0') {
+		return NULL;
+	}
+	if (*i + 1 >= argc) {
+		fprintf(stderr, "Missing value for option '%s'\n", option);
+		exit(1);
+	}
+	(*i)++;
+	return argv[*i];
+}
+
+size_t parseCountOption(const char *option, const char *value)
+{
+	char *end = NULL;
+	errno = 0;
+	unsigned long count = strtoul(value, &end, 10);
+	if (value[0] == '\0' || value[0] == '-' || *end != '\0' || errno != 0) {
+		fprintf(stderr, "Invalid value '%s' for option '%s'\n",
+		        value, option);
+		exit(1);
+	}
+	return count;
+}
+
+void addMatchRule(struct programArgs *args, const char *option,
+                  const char *value)
+{
+	int matchErrno = ENOERR;
+	if (args->matcher == NULL) {
+		matchErrno = matchCreate(&args->matcher);
+	}
+	if (!matchErrno) {
+		matchErrno = strcmp(option, "--prune") == 0 ?
+		             matchAddPrune(args->matcher, value) :
+		             matchAddExpr(args->matcher, value);
+	}
+	if (matchErrno) {
+		fprintf(stderr, "Invalid value '%s' for option '%s': %s\n",
+		        value, option, matchGetError(matchErrno));
+		exit(1);
+	}
+}
+
+double nowSeconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void formatDuration(uint64_t ns, char *buf, size_t size)
+{
+	if (ns < 1000) {
+		snprintf(buf, size, "%luns", (unsigned long)ns);
+	} else if (ns < 1000000) {
+		snprintf(buf, size, "%.1fus", ns / 1e3);
+	} else if (ns < 1000000000) {
+		snprintf(buf, size, "%.1fms", ns / 1e6);
+	} else {
+		snprintf(buf, size, "%.2fs", ns / 1e9);
+	}
+}
+
+void printStats(double elapsed, struct cache *cache, struct limiter *limiter)
+{
+	struct dosfsOpStats stats[DOSFS_OP_COUNT];
+	dosfsGetStats(stats);
+	char avg[16], p50[16], p99[16], max[16];
+	fprintf(stderr, "Statistics (%.3f s):\n", elapsed);
+	fprintf(stderr, "%-15s %10s %8s %10s %9s %9s %9s %9s\n", "operation",
+	        "count", "errors", "ops/s", "avg", "p50", "p99", "max");
+	for (int op = 0; op < DOSFS_OP_COUNT; op++) {
+		const struct dosfsOpStats *opStats = &stats[op];
+		formatDuration(opStats->count > 0 ?
+		               opStats->totalNs / opStats->count : 0, avg, 16);
+		formatDuration(dosfsStatsPercentile(opStats, 50), p50, 16);
+		formatDuration(dosfsStatsPercentile(opStats, 99), p99, 16);
+		formatDuration(opStats->maxNs, max, 16);
+		fprintf(stderr, "%-15s %10lu %8lu %10.0f %9s %9s %9s %9s\n",
+		        dosfsOpName(op), (unsigned long)opStats->count,
+		        (unsigned long)opStats->errors,
+		        elapsed > 0 ? opStats->count / elapsed : 0.0,
+		        avg, p50, p99, max);
+	}
+	for (int op = 0; op < DOSFS_OP_COUNT; op++) {
+		const struct dosfsOpStats *opStats = &stats[op];
+		if (opStats->count == 0) {
+			continue;
+		}
+		fprintf(stderr, "Latency of %s:\n", dosfsOpName(op));
+		for (int bucket = 0; bucket < DOSFS_STATS_BUCKETS; bucket++) {
+			if (opStats->buckets[bucket] == 0) {
+				continue;
 			}
+			/* Bucket N holds [2^(N-1), 2^N) ns. */
+			formatDuration(bucket == 0 ? 0 : (uint64_t)1 << (bucket - 1),
+			               p50, 16);
+			formatDuration((uint64_t)1 << bucket, p99, 16);
+			int bar = (int)(opStats->buckets[bucket] * 40 / opStats->count);
+			fprintf(stderr, "  %9s - %-9s %10lu%s%.*s\n", p50, p99,
+			        (unsigned long)opStats->buckets[bucket],
+			        bar > 0 ? " " : "", bar,
+			        "########################################");
 		}
 	}
-	return ENOERR;
+	if (cache != NULL) {
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		cacheGetCounts(cache, &hits, &misses);
+		fprintf(stderr, "Cache: %lu hits, %lu misses (%.1f%% hits)\n",
+		        (unsigned long)hits, (unsigned long)misses,
+		        hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0);
+	}
+	if (limiter != NULL) {
+		struct limiterReport report;
+		limiterGetReport(limiter, &report);
+		formatDuration(report.averageLatencyNs, avg, 16);
+		if (report.peakInFlight <= 1) {
+			fprintf(stderr, "Concurrency: 1, the attribute operations ran "
+			        "one at a time and there was nothing to tune, %.0f "
+			        "attribute ops/s, %s average latency\n",
+			        report.throughput, avg);
+		} else {
+			fprintf(stderr, "Concurrency: %.1f on average, %lu at most; "
+			        "limit %lu at exit (%lu-%lu, %lu increases, %lu "
+			        "decreases), %.0f attribute ops/s, %s average latency\n",
+			        report.averageInFlight,
+			        (unsigned long)report.peakInFlight,
+			        (unsigned long)report.limit,
+			        (unsigned long)report.minLimit,
+			        (unsigned long)report.maxLimit,
+			        (unsigned long)report.increases,
+			        (unsigned long)report.decreases, report.throughput, avg);
+		}
+	}
+}
+
+void printSummary(struct summary *summary)
+{
+	summaryFinish(summary);
+	struct summaryDir dir;
+	for (size_t i = 0; i < summarySize(summary); i++) {
+		summaryGet(summary, i, &dir);
+		printSummaryCounts(dir.path, dir.counts);
+	}
+	printSummaryCounts("Total", summaryTotal(summary));
+}
+
+void printSummaryCounts(const char *title, const uint64_t *counts)
+{
+	uint64_t entries = 0;
+	size_t order[SUMMARY_BINS];
+	size_t size = 0;
+	for (size_t bin = 0; bin < SUMMARY_BINS; bin++) {
+		entries += counts[bin];
+		if (counts[bin] == 0) {
+			continue;
+		}
+		/* Insertion sort, by count and then by attributes. */
+		size_t j = size++;
+		for (; j > 0 && counts[order[j - 1]] < counts[bin]; j--) {
+			order[j] = order[j - 1];
+		}
+		order[j] = bin;
+	}
+	printf("%s: %lu entries\n", title, (unsigned long)entries);
+	for (size_t i = 0; i < size; i++) {
+		printf("  %s %10lu\n", outputAttrString((uint32_t)order[i]),
+		       (unsigned long)counts[order[i]]);
+	}
+}
+
+void processGateEnter(void *data)
+{
+	limiterEnter(data);
+}
+
+void processGateLeave(void *data, uint64_t latencyNs)
+{
+	limiterLeave(data, latencyNs);
 }
 
 int processArgs(int argc, char **argv, struct programArgs *result)
 {
 	result->fileList = NULL;
 	result->fileListSize = 0;
+	result->fileListCapacity = 0;
+	result->filesFrom = NULL;
 	result->attrsToAdd = 0;
 	result->attrsToRemove = 0;
+	result->attrsToToggle = 0;
+	result->attrsExact = 0;
 	result->flags = 0;
+	result->jobs = 1;
+	result->maxFds = 0;
+	result->image = NULL;
+	result->partition = 0;
+	result->mock = NULL;
+	result->engine = DOSFS_ENGINE_SYNC;
+	result->matcher = NULL;
+	result->manifest = NULL;
+	result->manifestOp = MANIFEST_NONE;
+	result->serve = NULL;
+	result->client = NULL;
+	result->cacheFile = NULL;
+	result->cache = NULL;
+	result->latencyTarget = 0;
+	result->limiter = NULL;
+	result->durability = DURABILITY_NONE;
+	result->touched = NULL;
+	result->summaryDepth = 0;
+	result->rulesFile = NULL;
+	result->rules = NULL;
+	result->format = OUTPUT_FORMAT_TEXT;
 	int skipArgs = FALSE;
 	int mainErrno = 0;
+	char *value = NULL;
 	for (int i = 1; i < argc; i++) {
-		if (skipArgs || (argv[i][0] != '-' && argv[i][0] != '+')) {
+		if (skipArgs || (argv[i][0] != '-' && argv[i][0] != '+' &&
+		                 argv[i][0] != '^' && argv[i][0] != '=')) {
 			mainErrno = appendFileToList(result, argv[i]);
 			if (mainErrno) {
 				return mainErrno;
@@ -351,6 +3047,153 @@ int processArgs(int argc, char **argv, struct programArgs *result)
 				} else if (strcmp(argv[i], "--verbose") == 0) {
 					result->flags |= FLAG_VERBOSE;
 					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--jobs")) != NULL) {
+					result->jobs = parseCountOption("--jobs", value);
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--max-fds")) != NULL) {
+					result->maxFds = parseCountOption("--max-fds", value);
+					if (result->maxFds < MIN_FDS) {
+						fprintf(stderr, "Invalid value '%s' for option '%s'\n",
+						        value, "--max-fds");
+						exit(1);
+					}
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--image")) != NULL) {
+					result->image = value;
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--partition")) != NULL) {
+					size_t partition = parseCountOption("--partition", value);
+					if (partition > 4) {
+						fprintf(stderr, "Invalid value '%s' for option '%s'\n",
+						        value, "--partition");
+						exit(1);
+					}
+					result->partition = (unsigned int)partition;
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--mock")) != NULL) {
+					result->mock = value;
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--engine")) != NULL) {
+					if (strcmp(value, "sync") == 0) {
+						result->engine = DOSFS_ENGINE_SYNC;
+					} else if (strcmp(value, "uring") == 0) {
+						result->engine = DOSFS_ENGINE_URING;
+					} else {
+						fprintf(stderr, "Invalid value '%s' for option '%s'\n",
+						        value, "--engine");
+						exit(1);
+					}
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--format")) != NULL) {
+					if (outputParseFormat(value, &result->format)) {
+						fprintf(stderr, "Invalid value '%s' for option '%s'\n",
+						        value, "--format");
+						exit(1);
+					}
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--files-from")) != NULL) {
+					result->filesFrom = value;
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--match")) != NULL) {
+					addMatchRule(result, "--match", value);
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--prune")) != NULL) {
+					addMatchRule(result, "--prune", value);
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--save-manifest")) != NULL) {
+					result->manifest = value;
+					result->manifestOp = MANIFEST_SAVE;
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--diff-manifest")) != NULL) {
+					result->manifest = value;
+					result->manifestOp = MANIFEST_DIFF;
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--restore-manifest")) != NULL) {
+					result->manifest = value;
+					result->manifestOp = MANIFEST_RESTORE;
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--serve")) != NULL) {
+					result->serve = value;
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--client")) != NULL) {
+					result->client = value;
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--cache")) != NULL) {
+					result->cacheFile = value;
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--rules")) != NULL) {
+					result->rulesFile = value;
+					continue;
+				} else if (strcmp(argv[i], "--plan") == 0) {
+					result->flags |= FLAG_PLAN;
+					continue;
+				} else if (strcmp(argv[i], "--dry-run") == 0) {
+					result->flags |= FLAG_PLAN | FLAG_DRY_RUN;
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--durability")) != NULL) {
+					if (strcmp(value, "none") == 0) {
+						result->durability = DURABILITY_NONE;
+					} else if (strcmp(value, "end") == 0) {
+						result->durability = DURABILITY_END;
+					} else if (strcmp(value, "per-dir") == 0) {
+						result->durability = DURABILITY_PER_DIR;
+					} else if (strcmp(value, "per-file") == 0) {
+						result->durability = DURABILITY_PER_FILE;
+					} else {
+						fprintf(stderr, "Invalid value '%s' for option '%s'\n",
+						        value, "--durability");
+						exit(1);
+					}
+					continue;
+				} else if (strcmp(argv[i], "--adaptive") == 0) {
+					result->flags |= FLAG_ADAPTIVE;
+					continue;
+				} else if ((value = optionValue(argc, argv, &i,
+				                                "--latency-target")) != NULL) {
+					size_t target = parseCountOption("--latency-target", value);
+					if (target == 0) {
+						fprintf(stderr, "Invalid value '%s' for option '%s'\n",
+						        value, "--latency-target");
+						exit(1);
+					}
+					result->latencyTarget = (uint64_t)target * 1000;
+					result->flags |= FLAG_ADAPTIVE;
+					continue;
+				} else if (strcmp(argv[i], "--summary") == 0) {
+					/* The depth is optional, so it's never taken from the
+					   next argument. */
+					result->summaryDepth = 0;
+					result->flags |= FLAG_SUMMARY;
+					continue;
+				} else if (strncmp(argv[i], "--summary=", 10) == 0) {
+					result->summaryDepth = parseCountOption("--summary",
+					                                        argv[i] + 10);
+					result->flags |= FLAG_SUMMARY;
+					continue;
+				} else if (strcmp(argv[i], "--stats") == 0) {
+					result->flags |= FLAG_STATS;
+					continue;
+				} else if (strcmp(argv[i], "--watch") == 0) {
+					result->flags |= FLAG_WATCH;
+					continue;
 				} else if (strcmp(argv[i], "--help") == 0) {
 					result->flags |= FLAG_HELP;
 					continue;
@@ -361,69 +3204,24 @@ int processArgs(int argc, char **argv, struct programArgs *result)
 					fprintf(stderr, "Invalid option '%s'\n", argv[i]);
 					exit(1);
 				}
+			} else if (strcmp(argv[i], "-0") == 0) {
+				result->flags |= FLAG_NUL_DELIM;
 			} else {
-				size_t argLen = strlen(argv[i]);
-				for (size_t j = 1; j < argLen; j++) {
-					switch (argv[i][j]) {
-					case 'R':
-						result->attrsToRemove |= DOSFS_ATTR_RO;
-						break;
-					case 'A':
-						result->attrsToRemove |= DOSFS_ATTR_ARCH;
-						break;
-					case 'S':
-						result->attrsToRemove |= DOSFS_ATTR_SYS;
-						break;
-					case 'H':
-						result->attrsToRemove |= DOSFS_ATTR_HIDDEN;
-						break;
-					case 'D':
-						result->attrsToRemove |= DOSFS_ATTR_DIR;
-						break;
-					case 'V':
-						result->attrsToRemove |= DOSFS_ATTR_VOLUME;
-						break;
-					default:
-						fprintf(stderr, "Invalid attribute '%c' in '%s'\n",
-						        argv[i][j], argv[i]);
-						exit(1);
-					}
-				}
+				result->attrsToRemove |= parseAttributes(argv[i]);
 			}
 		} else if (argv[i][0] == '+') {
-			if (argv[i][1] == '\0') {
-				fprintf(stderr, "Missing attribute in argument '%s'\n", argv[i]);
-				exit(1);
-			}
-			size_t argLen = strlen(argv[i]);
-			for (size_t j = 1; j < argLen; j++) {
-				switch (argv[i][j]) {
-				case 'R':
-					result->attrsToAdd |= DOSFS_ATTR_RO;
-					break;
-				case 'A':
-					result->attrsToAdd |= DOSFS_ATTR_ARCH;
-					break;
-				case 'S':
-					result->attrsToAdd |= DOSFS_ATTR_SYS;
-					break;
-				case 'H':
-					result->attrsToAdd |= DOSFS_ATTR_HIDDEN;
-					break;
-				case 'D':
-					result->attrsToAdd |= DOSFS_ATTR_DIR;
-					break;
-				case 'V':
-					result->attrsToAdd |= DOSFS_ATTR_VOLUME;
-					break;
-				default:
-					fprintf(stderr, "Invalid attribute '%c' in '%s'\n",
-					        argv[i][j], argv[i]);
-					exit(1);
-				}
-			}
+			result->attrsToAdd |= parseAttributes(argv[i]);
+		} else if (argv[i][0] == '^') {
+			result->attrsToToggle |= parseAttributes(argv[i]);
+		} else if (argv[i][0] == '=') {
+			result->attrsExact |= parseAttributes(argv[i]);
+			result->flags |= FLAG_EXACT;
 		}
 	}
+	if (result->flags & FLAG_EXACT) {
+		result->attrsToAdd |= result->attrsExact;
+		result->attrsToRemove |= EXACT_ATTRS & ~result->attrsExact;
+	}
 	return ENOERR;
 }
 
@@ -448,35 +3246,378 @@ int main(int argc, char **argv)
 		showVersion();
 		exit(0);
 	}
-	if (args.fileListSize == 0) {
+	if (args.fileListSize == 0 && args.filesFrom == NULL &&
+	        args.serve == NULL) {
 		fprintf(stderr, "Error processing arguments: No file(s) specified\n");
 		showHelp();
 		exit(1);
 	}
-	if ((args.attrsToAdd & args.attrsToRemove) != 0) {
+	if ((args.attrsToAdd & args.attrsToRemove) != 0 ||
+	        (args.attrsToToggle & (args.attrsToAdd | args.attrsToRemove)) != 0) {
 		fprintf(stderr,
 		        "Error processing arguments: Overlapping attribute changes\n");
 		exit(1);
 	}
+	if (args.manifestOp != MANIFEST_NONE &&
+	        (args.fileListSize != 1 || args.filesFrom != NULL ||
+	         hasAttributeChanges(&args))) {
+		fprintf(stderr,
+		        "Error processing arguments: The manifest options take one "
+		        "directory and no attribute changes\n");
+		exit(1);
+	}
+	/* The differences are printed in their own format, not by an output. */
+	if (args.manifestOp == MANIFEST_DIFF &&
+	        args.format != OUTPUT_FORMAT_TEXT) {
+		fprintf(stderr,
+		        "Error processing arguments: --diff-manifest takes no "
+		        "--format\n");
+		exit(1);
+	}
+	/* The manifest walk visits the whole tree: a filtered manifest would
+	   report every skipped entry as missing. */
+	if (args.manifestOp != MANIFEST_NONE && args.matcher != NULL) {
+		fprintf(stderr,
+		        "Error processing arguments: The manifest options take no "
+		        "--match or --prune\n");
+		exit(1);
+	}
+	if (args.serve != NULL &&
+	        (args.fileListSize != 0 || args.filesFrom != NULL ||
+	         hasAttributeChanges(&args) || args.client != NULL)) {
+		fprintf(stderr,
+		        "Error processing arguments: --serve takes no files, no "
+		        "attribute changes and no --client\n");
+		exit(1);
+	}
+	if (args.client != NULL &&
+	        ((args.flags & FLAG_RECURSIVE) || args.matcher != NULL ||
+	         args.manifestOp != MANIFEST_NONE ||
+	         args.format != OUTPUT_FORMAT_TEXT)) {
+		fprintf(stderr,
+		        "Error processing arguments: --client only takes files, "
+		        "attribute changes and --files-from\n");
+		exit(1);
+	}
+	if ((args.flags & FLAG_WATCH) &&
+	        (args.filesFrom != NULL || args.manifestOp != MANIFEST_NONE ||
+	         args.image != NULL || args.mock != NULL || args.client != NULL ||
+	         args.serve != NULL)) {
+		fprintf(stderr,
+		        "Error processing arguments: --watch only works on mounted "
+		        "directories given as FILE\n");
+		exit(1);
+	}
+	if ((args.flags & FLAG_PLAN) &&
+	        (!hasAttributeChanges(&args) || args.client != NULL ||
+	         (args.flags & FLAG_WATCH))) {
+		fprintf(stderr,
+		        "Error processing arguments: --plan and --dry-run need "
+		        "attribute changes, and no --client or --watch\n");
+		exit(1);
+	}
+	if (args.cacheFile != NULL &&
+	        (args.image != NULL || args.serve != NULL || args.client != NULL ||
+	         args.manifestOp != MANIFEST_NONE)) {
+		fprintf(stderr,
+		        "Error processing arguments: --cache needs mounted files or "
+		        "--mock, and no --serve, --client or manifest options\n");
+		exit(1);
+	}
+	/* None of them has more than one attribute operation in flight, the
+	   --watch events are processed one at a time too. */
+	if ((args.flags & FLAG_ADAPTIVE) &&
+	        (args.serve != NULL || args.client != NULL ||
+	         args.manifestOp != MANIFEST_NONE || (args.flags & FLAG_WATCH))) {
+		fprintf(stderr,
+		        "Error processing arguments: --adaptive and --latency-target "
+		        "can't be used with --serve, --client, --watch or manifest "
+		        "options\n");
+		exit(1);
+	}
+	if (args.durability != DURABILITY_NONE &&
+	        (args.serve != NULL || args.client != NULL ||
+	         args.manifestOp != MANIFEST_NONE)) {
+		fprintf(stderr,
+		        "Error processing arguments: --durability can't be used with "
+		        "--serve, --client or manifest options\n");
+		exit(1);
+	}
+	if (args.rulesFile != NULL &&
+	        ((args.attrsToAdd | args.attrsToRemove | args.attrsToToggle) != 0 ||
+	         args.client != NULL || (args.flags & FLAG_WATCH))) {
+		fprintf(stderr,
+		        "Error processing arguments: --rules takes no attribute "
+		        "changes, --client or --watch\n");
+		exit(1);
+	}
+	if ((args.flags & FLAG_SUMMARY) &&
+	        (hasAttributeChanges(&args) || args.format != OUTPUT_FORMAT_TEXT ||
+	         args.serve != NULL || args.client != NULL ||
+	         args.manifestOp != MANIFEST_NONE || (args.flags & FLAG_WATCH))) {
+		fprintf(stderr,
+		        "Error processing arguments: --summary takes no attribute "
+		        "changes, --format, --serve, --client, --watch or manifest "
+		        "options\n");
+		exit(1);
+	}
+	if ((args.flags & FLAG_ADAPTIVE) && args.jobs == 1) {
+		args.jobs = ADAPTIVE_JOBS;
+	}
+	if (args.jobs == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		args.jobs = cpus > 0 ? (size_t)cpus : 1;
+	}
+	if (args.maxFds == 0) {
+		/* The other half is left for the outputs, the workers and the
+		   rest of the program. */
+		struct rlimit limit;
+		args.maxFds = getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+		              limit.rlim_cur != RLIM_INFINITY ?
+		              (size_t)limit.rlim_cur / 2 : DEFAULT_MAX_FDS;
+		args.maxFds = args.maxFds < MIN_FDS ? MIN_FDS : args.maxFds;
+	}
+	if (args.image != NULL && args.mock != NULL) {
+		fprintf(stderr,
+		        "Error processing arguments: --image and --mock are exclusive\n");
+		exit(1);
+	}
+	double start = nowSeconds();
+	dosfsSetStats(args.flags & FLAG_STATS);
+	struct dosfsBackend backend;
+	struct fatImage *image = NULL;
+	struct mockFs *mock = NULL;
+	if (args.image != NULL) {
+		int imageErrno = fatImageOpen(args.image, args.partition, &image);
+		if (imageErrno) {
+			fprintf(stderr, "Error opening image '%s': %s\n",
+			        args.image, fatImageGetError(imageErrno));
+			exit(1);
+		}
+		fatImageGetBackend(image, &backend);
+		dosfsSetBackend(&backend);
+	} else if (args.mock != NULL) {
+		int mockErrno = mockFsCreate(args.mock, &mock);
+		if (mockErrno) {
+			fprintf(stderr, "Error creating mock tree '%s': %s\n",
+			        args.mock, mockFsGetError(mockErrno));
+			exit(1);
+		}
+		mockFsGetBackend(mock, &backend);
+		dosfsSetBackend(&backend);
+	}
+	if (args.engine != DOSFS_ENGINE_SYNC) {
+		int engineErrno = dosfsSetEngine(args.engine);
+		if (engineErrno) {
+			fprintf(stderr, "Warning: using the sync engine: %s\n",
+			        dosfsGetError(engineErrno));
+		}
+	}
+	if (args.serve != NULL) {
+		int imageErrno = 0;
+		int serverErrno = serverRun(args.serve);
+		if (serverErrno) {
+			fprintf(stderr, "Error serving on '%s': %s\n",
+			        args.serve, serverGetError(serverErrno));
+		}
+		dosfsSetBackend(NULL);
+		mockFsDestroy(mock);
+		if (image != NULL && (imageErrno = fatImageClose(image))) {
+			fprintf(stderr, "Error closing image '%s': %s\n",
+			        args.image, fatImageGetError(imageErrno));
+			serverErrno = imageErrno;
+		}
+		if (args.flags & FLAG_STATS) {
+			printStats(nowSeconds() - start, NULL, NULL);
+		}
+		matchDestroy(args.matcher);
+		exit(serverErrno ? 1 : 0);
+	}
+	if (args.cacheFile != NULL) {
+		int cacheErrno = cacheOpen(args.cacheFile, &args.cache);
+		if (cacheErrno) {
+			fprintf(stderr, "Error opening the cache '%s': %s\n",
+			        args.cacheFile, cacheGetError(cacheErrno));
+			exit(1);
+		}
+	}
+	if (args.rulesFile != NULL) {
+		size_t line = 0;
+		int rulesErrno = rulesLoad(args.rulesFile, &args.rules, &line);
+		if (rulesErrno && line > 0) {
+			fprintf(stderr, "Error loading the rules '%s': %s in line %lu\n",
+			        args.rulesFile, rulesGetError(rulesErrno),
+			        (unsigned long)line);
+			exit(1);
+		} else if (rulesErrno) {
+			fprintf(stderr, "Error loading the rules '%s': %s\n",
+			        args.rulesFile, rulesGetError(rulesErrno));
+			exit(1);
+		}
+	}
+	struct touchedList touched = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+	args.touched = &touched;
+	struct dosfsGate gate = {NULL, processGateEnter, processGateLeave};
+	if (args.flags & FLAG_ADAPTIVE) {
+		int limiterErrno = limiterCreate(&args.limiter, args.jobs,
+		                                 args.latencyTarget);
+		if (limiterErrno) {
+			fprintf(stderr, "Error creating the limiter: %s\n",
+			        limiterGetError(limiterErrno));
+			exit(1);
+		}
+		gate.data = args.limiter;
+		dosfsSetGate(&gate);
+	}
+	struct processContext ctx = {NULL, NULL, NULL, {NULL, 0, 0},
+		{NULL, 0, 0}, {NULL, 0, 0, 0, FALSE, -1, args.maxFds}, NULL, NULL,
+		NULL, 0, 0, 0, {NULL, 0, 0}, 0, {NULL, 0, 0}, 0, NULL, 0
+	};
+	if (args.client != NULL) {
+		int serverErrno = serverClientOpen(args.client,
+		                                   (args.flags & FLAG_VERBOSE) != 0,
+		                                   &ctx.client);
+		if (serverErrno) {
+			fprintf(stderr, "Error connecting to '%s': %s\n",
+			        args.client, serverGetError(serverErrno));
+			exit(1);
+		}
+		/* The requests are sent from this thread, no workers needed. */
+		args.jobs = 1;
+	}
+	int outputErrno = outputCreate(&ctx.out, args.format, STDOUT_FILENO);
+	if (outputErrno) {
+		fprintf(stderr, "Error creating the output: %s\n",
+		        outputGetError(outputErrno));
+		exit(1);
+	}
+	if (args.flags & FLAG_PLAN) {
+		int planErrno = planCreate(&ctx.plan);
+		if (planErrno) {
+			fprintf(stderr, "Error creating the plan: %s\n",
+			        planGetError(planErrno));
+			exit(1);
+		}
+	}
+	if (args.flags & FLAG_SUMMARY) {
+		int summaryErrno = summaryCreate(&ctx.summary);
+		if (summaryErrno) {
+			fprintf(stderr, "Error creating the summary: %s\n",
+			        summaryGetError(summaryErrno));
+			exit(1);
+		}
+	}
+	struct poolData poolData = {&args, NULL, ctx.out, ctx.plan, ctx.summary};
+	if (args.jobs > 1 && args.manifestOp == MANIFEST_NONE) {
+		int poolErrno = workPoolCreate(&ctx.pool, args.jobs,
+		                               processDirTask, &poolData);
+		if (poolErrno) {
+			fprintf(stderr, "Error creating the worker pool: %s\n",
+			        workPoolGetError(poolErrno));
+			exit(1);
+		}
+		poolData.pool = ctx.pool;
+	}
 	int dosfsErrno = 0;
-	if (args.attrsToRemove == 0 && args.attrsToAdd == 0) {
-		for (size_t i = 0; i < args.fileListSize; i++) {
-			dosfsErrno = processPrintAttributes(&args, args.fileList[i], TRUE);
-			if (dosfsErrno) {
-				fprintf(stderr, "Error processing file '%s': %s\n",
-				        args.fileList[i], dosfsGetError(dosfsErrno));
-			}
+	if (args.manifestOp != MANIFEST_NONE) {
+		dosfsErrno = processManifest(&args, &ctx);
+		/* Like diff(1), differences exit with 1. */
+		dosfsErrno = dosfsErrno == EDIFFERENT ? 1 : dosfsErrno;
+	}
+	if (args.manifestOp == MANIFEST_NONE) {
+		dosfsErrno = processFileList(&args, &ctx);
+	}
+	if (args.filesFrom != NULL) {
+		int filesErrno = processFilesFrom(&args, &ctx);
+		if (filesErrno == EFILES_FROM) {
+			fprintf(stderr, "Error processing '%s': %s\n",
+			        args.filesFrom, mainGetError(filesErrno));
 		}
-	} else {
-		for (size_t i = 0; i < args.fileListSize; i++) {
-			dosfsErrno = processModifyAttributes(&args, args.fileList[i],
-			                                     args.flags & FLAG_RECURSIVE);
-			if (dosfsErrno) {
-				fprintf(stderr, "Error processing file '%s': %s\n",
-				        args.fileList[i], dosfsGetError(dosfsErrno));
-			}
+		if (filesErrno) {
+			dosfsErrno = filesErrno;
 		}
 	}
+	if (ctx.client != NULL) {
+		unsigned long failed = 0;
+		int serverErrno = serverClientClose(ctx.client, &failed);
+		if (serverErrno) {
+			fprintf(stderr, "Error talking to '%s': %s\n",
+			        args.client, serverGetError(serverErrno));
+			dosfsErrno = serverErrno;
+		} else if (failed > 0) {
+			dosfsErrno = 1;
+		}
+	}
+	if (ctx.pool != NULL) {
+		/* The directories queued by the FILEs processed in this thread. */
+		processRunPool(&ctx);
+		workPoolDestroy(ctx.pool);
+		ctx.pool = NULL;
+	}
+	if (ctx.plan != NULL) {
+		int planErrno = processPlan(&args, &ctx);
+		if (planErrno) {
+			dosfsErrno = planErrno;
+		}
+		planDestroy(ctx.plan);
+		ctx.plan = NULL;
+	}
+	int syncErrno = processSyncTouched(&args);
+	if (syncErrno) {
+		dosfsErrno = syncErrno;
+	}
+	if (args.flags & FLAG_WATCH) {
+		int watchErrno = processWatch(&args, &ctx);
+		if (watchErrno) {
+			dosfsErrno = watchErrno;
+		}
+		syncErrno = processSyncTouched(&args);
+		if (syncErrno) {
+			dosfsErrno = syncErrno;
+		}
+	}
+	outputErrno = outputFinish(ctx.out);
+	if (outputErrno) {
+		fprintf(stderr, "%s\n", outputGetError(outputErrno));
+		dosfsErrno = outputErrno;
+	}
+	outputDestroy(ctx.out);
+	if (ctx.summary != NULL) {
+		printSummary(ctx.summary);
+		summaryDestroy(ctx.summary);
+	}
+	rulesStatesFree(&ctx.rules);
+	rulesDestroy(args.rules);
+	pathFree(&ctx.path);
+	pathArenaFree(&ctx.names);
+	free(ctx.stack.frames);
+	dosfsSetGate(NULL);
+	dosfsSetBackend(NULL);
+	mockFsDestroy(mock);
+	if (image != NULL) {
+		int imageErrno = fatImageClose(image);
+		if (imageErrno) {
+			fprintf(stderr, "Error closing image '%s': %s\n",
+			        args.image, fatImageGetError(imageErrno));
+			dosfsErrno = imageErrno;
+		}
+	}
+	if (args.flags & FLAG_STATS) {
+		printStats(nowSeconds() - start, args.cache, args.limiter);
+	}
+	int cacheErrno = cacheClose(args.cache);
+	if (cacheErrno) {
+		fprintf(stderr, "Error closing the cache '%s': %s\n",
+		        args.cacheFile, cacheGetError(cacheErrno));
+		dosfsErrno = cacheErrno;
+	}
+	limiterDestroy(args.limiter);
+	for (size_t i = 0; i < touched.size; i++) {
+		free(touched.items[i].path);
+	}
+	free(touched.items);
+	pthread_mutex_destroy(&touched.lock);
+	matchDestroy(args.matcher);
 	free(args.fileList);
 	exit(dosfsErrno);
 }
@@ -0,0 +1,435 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "manifest.h"
+#include "dosfs.h"
+#include "bool.h"
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define ERRMSG_MAX 1025
+#define MANIFEST_MAGIC "FATMANIF"
+#define MANIFEST_MAGIC_SIZE 8
+#define MANIFEST_VERSION 1
+#define MANIFEST_END 0xffff
+#define RECORD_HEADER_SIZE 5
+#define FILE_BUFFER_SIZE (1024 * 1024)
+#define NAMES_INITIAL_CAPACITY 64
+
+enum {
+    ENOERR = 0,
+    EALLOC,
+    EOPEN,
+    EWRITE,
+    EREAD,
+    EFORMAT,
+    EVERSION,
+    EPATH,
+    EWALK
+};
+
+struct manifestWriter {
+	FILE *file;
+	char path[MANIFEST_PATH_MAX];
+};
+
+struct manifestReader {
+	FILE *file;
+	char path[MANIFEST_PATH_MAX];
+	int done;
+};
+
+/* State of a manifestWalk. */
+struct manifestWalkState {
+	const char *root;
+	tManifestWalkFn fn;
+	void *data;
+	char path[MANIFEST_PATH_MAX];
+};
+
+static _Thread_local char errmsg[ERRMSG_MAX] = {0};
+
+/**
+ * qsort comparator of the names of a directory.
+ */
+int manifestCompareNames(const void *a, const void *b);
+/**
+ * Read all the entry names of the directory 'fd' of a walk, except "." and
+ * "..", sorted, in a new array of 'size' names. The errors are reported.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int manifestReadNames(const struct manifestWalkState *state, int fd,
+                      char ***names, size_t *size);
+/**
+ * Walk the entries of the directory 'fd', whose path is in state->path
+ * with 'pathLen' characters.
+ * Returns 0 on success, the value of the walk function if it stops it.
+ */
+int manifestWalkDir(struct manifestWalkState *state, int fd, size_t pathLen);
+/**
+ * Report an error with the entry 'path' of a walk.
+ */
+void manifestWalkError(const struct manifestWalkState *state,
+                       const char *path, const char *error);
+
+
+int manifestCompareNames(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int manifestReadNames(const struct manifestWalkState *state, int fd,
+                      char ***names, size_t *size)
+{
+	struct dosfsDir *dirIt = NULL;
+	int dosfsErrno = dosfsDirOpen(fd, &dirIt);
+	if (dosfsErrno) {
+		manifestWalkError(state, state->path, dosfsGetError(dosfsErrno));
+		return dosfsErrno;
+	}
+	char **list = NULL;
+	size_t listSize = 0;
+	size_t listCapacity = 0;
+	const char *name = NULL;
+	while (!(dosfsErrno = dosfsDirNext(dirIt, &name)) && name != NULL) {
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+			continue;
+		}
+		if (listSize == listCapacity) {
+			listCapacity = listCapacity > 0 ? listCapacity * 2 :
+			               NAMES_INITIAL_CAPACITY;
+			char **newList = realloc(list, sizeof(char *) * listCapacity);
+			if (newList == NULL) {
+				break;
+			}
+			list = newList;
+		}
+		list[listSize] = strdup(name);
+		if (list[listSize] == NULL) {
+			break;
+		}
+		listSize++;
+	}
+	dosfsDirClose(dirIt);
+	if (dosfsErrno || name != NULL) {
+		manifestWalkError(state, state->path,
+		                  dosfsErrno ? dosfsGetError(dosfsErrno) :
+		                  manifestGetError(EALLOC));
+		for (size_t i = 0; i < listSize; i++) {
+			free(list[i]);
+		}
+		free(list);
+		return EWALK;
+	}
+	qsort(list, listSize, sizeof(char *), manifestCompareNames);
+	*names = list;
+	*size = listSize;
+	return ENOERR;
+}
+
+int manifestWalkDir(struct manifestWalkState *state, int fd, size_t pathLen)
+{
+	char **names = NULL;
+	size_t size = 0;
+	if (manifestReadNames(state, fd, &names, &size)) {
+		return ENOERR;
+	}
+	int walkErrno = ENOERR;
+	for (size_t i = 0; i < size && !walkErrno; i++) {
+		size_t nameLen = strlen(names[i]);
+		size_t sep = pathLen > 0 ? 1 : 0;
+		if (pathLen + sep + nameLen >= MANIFEST_PATH_MAX) {
+			manifestWalkError(state, names[i], manifestGetError(EPATH));
+			continue;
+		}
+		if (sep) {
+			state->path[pathLen] = '/';
+		}
+		memcpy(state->path + pathLen + sep, names[i], nameLen + 1);
+		int entryFd = -1;
+		uint32_t attrs = 0;
+		int dosfsErrno = dosfsOpenAt(fd, names[i], &entryFd);
+		if (!dosfsErrno) {
+			dosfsErrno = dosfsGetAttributes(entryFd, &attrs);
+		}
+		if (dosfsErrno) {
+			manifestWalkError(state, state->path, dosfsGetError(dosfsErrno));
+		} else {
+			walkErrno = state->fn(state->path, entryFd, attrs, state->data);
+			if (!walkErrno && DOSFS_HAS_ATTR_DIR(attrs)) {
+				walkErrno = manifestWalkDir(state, entryFd,
+				                            pathLen + sep + nameLen);
+			}
+		}
+		if (entryFd != -1) {
+			dosfsClose(entryFd);
+		}
+		state->path[pathLen] = '\0';
+	}
+	for (size_t i = 0; i < size; i++) {
+		free(names[i]);
+	}
+	free(names);
+	return walkErrno;
+}
+
+void manifestWalkError(const struct manifestWalkState *state,
+                       const char *path, const char *error)
+{
+	fprintf(stderr, "Error processing file '%s/%s': %s\n",
+	        state->root, path, error);
+}
+
+
+const char *manifestGetError(int err)
+{
+	switch (err) {
+	case ENOERR:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "No error occurred");
+		break;
+	case EALLOC:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error allocating memory: %s",
+		         strerror(errno));
+		break;
+	case EOPEN:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error opening the manifest: %s",
+		         strerror(errno));
+		break;
+	case EWRITE:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error writing the manifest: %s",
+		         strerror(errno));
+		break;
+	case EREAD:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error reading the manifest: %s",
+		         strerror(errno));
+		break;
+	case EFORMAT:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "The file isn't a manifest or it's truncated");
+		break;
+	case EVERSION:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Unsupported manifest version");
+		break;
+	case EPATH:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "The path is too long for a manifest");
+		break;
+	case EWALK:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error reading the root directory");
+		break;
+	default:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Unknown error");
+	}
+	return errmsg;
+}
+
+int manifestComparePaths(const char *a, const char *b)
+{
+	const unsigned char *charA = (const unsigned char *)a;
+	const unsigned char *charB = (const unsigned char *)b;
+	while (*charA != '\0' && *charA == *charB) {
+		charA++;
+		charB++;
+	}
+	/* '\0' < '/' < any other character. */
+	int rankA = *charA == '/' ? 1 : *charA == '\0' ? 0 : *charA + 1;
+	int rankB = *charB == '/' ? 1 : *charB == '\0' ? 0 : *charB + 1;
+	return rankA - rankB;
+}
+
+int manifestWalk(const char *root, tManifestWalkFn fn, void *data)
+{
+	assert(root != NULL);
+	assert(fn != NULL);
+	struct manifestWalkState *state = malloc(sizeof(struct manifestWalkState));
+	if (state == NULL) {
+		return EALLOC;
+	}
+	state->root = root;
+	state->fn = fn;
+	state->data = data;
+	state->path[0] = '\0';
+	int fd = -1;
+	int walkErrno = EWALK;
+	if (!dosfsOpen(root, &fd)) {
+		walkErrno = manifestWalkDir(state, fd, 0);
+		dosfsClose(fd);
+	}
+	free(state);
+	return walkErrno;
+}
+
+int manifestWriterOpen(const char *file, struct manifestWriter **writer)
+{
+	assert(file != NULL);
+	assert(writer != NULL);
+	struct manifestWriter *newWriter = malloc(sizeof(struct manifestWriter));
+	if (newWriter == NULL) {
+		return EALLOC;
+	}
+	newWriter->file = fopen(file, "wb");
+	if (newWriter->file == NULL) {
+		free(newWriter);
+		return EOPEN;
+	}
+	setvbuf(newWriter->file, NULL, _IOFBF, FILE_BUFFER_SIZE);
+	newWriter->path[0] = '\0';
+	unsigned char version[4] = {MANIFEST_VERSION, 0, 0, 0};
+	fwrite(MANIFEST_MAGIC, 1, MANIFEST_MAGIC_SIZE, newWriter->file);
+	fwrite(version, 1, sizeof(version), newWriter->file);
+	*writer = newWriter;
+	return ENOERR;
+}
+
+int manifestWriterAdd(struct manifestWriter *writer, const char *path,
+                      uint32_t attrs)
+{
+	assert(writer != NULL);
+	assert(path != NULL);
+	size_t pathLen = strlen(path);
+	if (pathLen >= MANIFEST_PATH_MAX) {
+		return EPATH;
+	}
+	assert(manifestComparePaths(writer->path, path) < 0 ||
+	       writer->path[0] == '\0');
+	size_t prefix = 0;
+	while (prefix < pathLen && writer->path[prefix] == path[prefix]) {
+		prefix++;
+	}
+	size_t suffix = pathLen - prefix;
+	unsigned char header[RECORD_HEADER_SIZE] = {
+		prefix & 0xff, prefix >> 8, suffix & 0xff, suffix >> 8, attrs & 0xff
+	};
+	if (fwrite(header, 1, RECORD_HEADER_SIZE, writer->file) !=
+	        RECORD_HEADER_SIZE ||
+	        fwrite(path + prefix, 1, suffix, writer->file) != suffix) {
+		return EWRITE;
+	}
+	memcpy(writer->path + prefix, path + prefix, suffix + 1);
+	return ENOERR;
+}
+
+int manifestWriterClose(struct manifestWriter *writer)
+{
+	assert(writer != NULL);
+	unsigned char end[RECORD_HEADER_SIZE] = {
+		MANIFEST_END & 0xff, MANIFEST_END >> 8, 0, 0, 0
+	};
+	int writeErrno = ENOERR;
+	if (fwrite(end, 1, RECORD_HEADER_SIZE, writer->file) !=
+	        RECORD_HEADER_SIZE || ferror(writer->file)) {
+		writeErrno = EWRITE;
+	}
+	if (fclose(writer->file) != 0) {
+		writeErrno = EWRITE;
+	}
+	free(writer);
+	return writeErrno;
+}
+
+int manifestReaderOpen(const char *file, struct manifestReader **reader)
+{
+	assert(file != NULL);
+	assert(reader != NULL);
+	struct manifestReader *newReader = malloc(sizeof(struct manifestReader));
+	if (newReader == NULL) {
+		return EALLOC;
+	}
+	newReader->file = fopen(file, "rb");
+	if (newReader->file == NULL) {
+		free(newReader);
+		return EOPEN;
+	}
+	setvbuf(newReader->file, NULL, _IOFBF, FILE_BUFFER_SIZE);
+	newReader->path[0] = '\0';
+	newReader->done = FALSE;
+	char magic[MANIFEST_MAGIC_SIZE];
+	unsigned char version[4];
+	if (fread(magic, 1, MANIFEST_MAGIC_SIZE, newReader->file) !=
+	        MANIFEST_MAGIC_SIZE ||
+	        fread(version, 1, sizeof(version), newReader->file) !=
+	        sizeof(version) ||
+	        memcmp(magic, MANIFEST_MAGIC, MANIFEST_MAGIC_SIZE) != 0) {
+		manifestReaderClose(newReader);
+		return EFORMAT;
+	}
+	if (version[0] != MANIFEST_VERSION || version[1] != 0 ||
+	        version[2] != 0 || version[3] != 0) {
+		manifestReaderClose(newReader);
+		return EVERSION;
+	}
+	*reader = newReader;
+	return ENOERR;
+}
+
+int manifestReaderNext(struct manifestReader *reader, const char **path,
+                       uint32_t *attrs)
+{
+	assert(reader != NULL);
+	assert(path != NULL);
+	assert(attrs != NULL);
+	*path = NULL;
+	if (reader->done) {
+		return ENOERR;
+	}
+	unsigned char header[RECORD_HEADER_SIZE];
+	if (fread(header, 1, RECORD_HEADER_SIZE, reader->file) !=
+	        RECORD_HEADER_SIZE) {
+		return ferror(reader->file) ? EREAD : EFORMAT;
+	}
+	size_t prefix = header[0] | (size_t)header[1] << 8;
+	size_t suffix = header[2] | (size_t)header[3] << 8;
+	if (prefix == MANIFEST_END) {
+		reader->done = TRUE;
+		return ENOERR;
+	}
+	if (prefix > strlen(reader->path) ||
+	        prefix + suffix >= MANIFEST_PATH_MAX) {
+		return EFORMAT;
+	}
+	if (fread(reader->path + prefix, 1, suffix, reader->file) != suffix) {
+		return ferror(reader->file) ? EREAD : EFORMAT;
+	}
+	reader->path[prefix + suffix] = '\0';
+	*path = reader->path;
+	*attrs = header[4];
+	return ENOERR;
+}
+
+void manifestReaderClose(struct manifestReader *reader)
+{
+	if (reader == NULL) {
+		return;
+	}
+	fclose(reader->file);
+	free(reader);
+}
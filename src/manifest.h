@@ -0,0 +1,108 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+#include <stdint.h>
+
+/**
+ * Manifests: sorted lists of (path, attributes) pairs of a tree.
+ *
+ * The paths are relative to the root of the tree and sorted component by
+ * component (see manifestComparePaths), the order in which manifestWalk
+ * visits a tree, so a manifest and a live tree can be compared with a
+ * single merge walk without loading either of them in memory.
+ *
+ * File format, all integers little endian:
+ * - Header: "FATMANIF" and the version as a 32 bit integer.
+ * - Records: length of the prefix shared with the previous path (16 bits),
+ *   length of the rest of the path (16 bits), attributes (8 bits) and the
+ *   rest of the path.
+ * - End: a record with a prefix length of 0xffff and no path.
+ */
+struct manifestWriter;
+struct manifestReader;
+
+/* Longest path of a manifest, including the '\0'. */
+#define MANIFEST_PATH_MAX 4096
+
+/**
+ * Function called by manifestWalk for every entry: 'path' is relative to
+ * the root of the walk, 'fd' is the open entry and 'attrs' its attributes.
+ * Returns 0 to continue the walk, !0 to stop it.
+ */
+typedef int (*tManifestWalkFn)(const char *path, int fd, uint32_t attrs,
+                               void *data);
+
+/**
+ * Returns a descriptive message associated with an error code.
+ */
+const char *manifestGetError(int err);
+/**
+ * Compare two paths in the order of the manifests: like strcmp, but '/'
+ * sorts before any other character, so a directory is followed by its
+ * whole subtree.
+ */
+int manifestComparePaths(const char *a, const char *b);
+/**
+ * Visit, with the dosfs functions, every entry below the directory 'root'
+ * in the order of the manifests, depth first with the entries of each
+ * directory sorted by name. Only one directory per level is kept in memory,
+ * and open: one descriptor per level. The entries that can't be read, or
+ * whose path doesn't fit in MANIFEST_PATH_MAX, are reported in stderr and
+ * skipped.
+ * Returns 0 on success, !0 if the root can't be read or 'fn' stops the walk
+ * (then its value is returned).
+ */
+int manifestWalk(const char *root, tManifestWalkFn fn, void *data);
+/**
+ * Create the manifest 'file' to be written.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int manifestWriterOpen(const char *file, struct manifestWriter **writer);
+/**
+ * Append an entry, 'path' must sort after the previous one.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int manifestWriterAdd(struct manifestWriter *writer, const char *path,
+                      uint32_t attrs);
+/**
+ * Write the end of the manifest and close it.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int manifestWriterClose(struct manifestWriter *writer);
+/**
+ * Open the manifest 'file' to be read.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int manifestReaderOpen(const char *file, struct manifestReader **reader);
+/**
+ * Read the next entry of a manifest, 'path' is NULL at the end. The path is
+ * valid until the next call.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int manifestReaderNext(struct manifestReader *reader, const char **path,
+                       uint32_t *attrs);
+/**
+ * Close a manifest.
+ */
+void manifestReaderClose(struct manifestReader *reader);
+
+#endif /* __MANIFEST_H__ */
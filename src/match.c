@@ -0,0 +1,244 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "match.h"
+#include "dosfs.h"
+#include "bool.h"
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <fnmatch.h>
+
+#define ERRMSG_MAX 1025
+#define NAME_TERM "name="
+
+enum {
+    ENOERR = 0,
+    EALLOC,
+    EEXPR
+};
+
+/* A compiled expression: (attrs & mask) == value and the name matches
+   'glob' (if not NULL). */
+struct matchExpr {
+	uint32_t mask;
+	uint32_t value;
+	char *glob;
+};
+
+struct matcher {
+	struct matchExpr *exprs;
+	size_t exprsSize;
+	char **prunes;
+	size_t prunesSize;
+};
+
+static _Thread_local char errmsg[ERRMSG_MAX] = {0};
+
+/**
+ * Compile the term 'term' of 'termLen' characters into 'expr'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int matchParseTerm(const char *term, size_t termLen, struct matchExpr *expr);
+/**
+ * Returns !0 if 'name' matches the glob of 'expr'.
+ */
+int matchExprName(const struct matchExpr *expr, const char *name);
+
+
+int matchParseTerm(const char *term, size_t termLen, struct matchExpr *expr)
+{
+	if (term[0] == '+' || term[0] == '-') {
+		/* Groups of letters, each one after its sign, e.g. "+HA-S". */
+		uint32_t value = 0;
+		for (size_t i = 0; i < termLen; i++) {
+			if (term[i] == '+' || term[i] == '-') {
+				if (i + 1 >= termLen || term[i + 1] == '+' ||
+				        term[i + 1] == '-') {
+					return EEXPR;
+				}
+				value = term[i] == '+' ? ~(uint32_t)0 : 0;
+				continue;
+			}
+			uint32_t attr = dosfsParseAttr(term[i]);
+			/* The same attribute required set and clear never matches. */
+			if (attr == 0 || ((expr->mask & attr) != 0 &&
+			                  (expr->value & attr) != (value & attr))) {
+				return EEXPR;
+			}
+			expr->mask |= attr;
+			expr->value |= value & attr;
+		}
+		return ENOERR;
+	}
+	size_t prefixLen = strlen(NAME_TERM);
+	if (termLen > prefixLen && strncmp(term, NAME_TERM, prefixLen) == 0 &&
+	        expr->glob == NULL) {
+		expr->glob = strndup(term + prefixLen, termLen - prefixLen);
+		return expr->glob == NULL ? EALLOC : ENOERR;
+	}
+	return EEXPR;
+}
+
+int matchExprName(const struct matchExpr *expr, const char *name)
+{
+	return expr->glob == NULL ||
+	       fnmatch(expr->glob, name, FNM_CASEFOLD) == 0;
+}
+
+
+const char *matchGetError(int err)
+{
+	switch (err) {
+	case ENOERR:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "No error occurred");
+		break;
+	case EALLOC:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error allocating memory: %s",
+		         strerror(errno));
+		break;
+	case EEXPR:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Invalid match expression");
+		break;
+	default:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Unknown error");
+	}
+	return errmsg;
+}
+
+int matchCreate(struct matcher **matcher)
+{
+	assert(matcher != NULL);
+	*matcher = calloc(1, sizeof(struct matcher));
+	if (*matcher == NULL) {
+		return EALLOC;
+	}
+	return ENOERR;
+}
+
+void matchDestroy(struct matcher *matcher)
+{
+	if (matcher == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < matcher->exprsSize; i++) {
+		free(matcher->exprs[i].glob);
+	}
+	for (size_t i = 0; i < matcher->prunesSize; i++) {
+		free(matcher->prunes[i]);
+	}
+	free(matcher->exprs);
+	free(matcher->prunes);
+	free(matcher);
+}
+
+int matchAddExpr(struct matcher *matcher, const char *expr)
+{
+	assert(matcher != NULL);
+	assert(expr != NULL);
+	struct matchExpr newExpr = {0, 0, NULL};
+	const char *term = expr;
+	while (TRUE) {
+		size_t termLen = strcspn(term, ",");
+		int matchErrno = matchParseTerm(term, termLen, &newExpr);
+		if (matchErrno) {
+			free(newExpr.glob);
+			return matchErrno;
+		}
+		if (term[termLen] == '\0') {
+			break;
+		}
+		term += termLen + 1;
+	}
+	struct matchExpr *newExprs = realloc(matcher->exprs,
+	                                     sizeof(struct matchExpr) *
+	                                     (matcher->exprsSize + 1));
+	if (newExprs == NULL) {
+		free(newExpr.glob);
+		return EALLOC;
+	}
+	matcher->exprs = newExprs;
+	matcher->exprs[matcher->exprsSize++] = newExpr;
+	return ENOERR;
+}
+
+int matchAddPrune(struct matcher *matcher, const char *glob)
+{
+	assert(matcher != NULL);
+	assert(glob != NULL);
+	char **newPrunes = realloc(matcher->prunes,
+	                           sizeof(char *) * (matcher->prunesSize + 1));
+	if (newPrunes == NULL) {
+		return EALLOC;
+	}
+	matcher->prunes = newPrunes;
+	matcher->prunes[matcher->prunesSize] = strdup(glob);
+	if (matcher->prunes[matcher->prunesSize] == NULL) {
+		return EALLOC;
+	}
+	matcher->prunesSize++;
+	return ENOERR;
+}
+
+int matchPruned(const struct matcher *matcher, const char *name)
+{
+	for (size_t i = 0; i < matcher->prunesSize; i++) {
+		if (fnmatch(matcher->prunes[i], name, FNM_CASEFOLD) == 0) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+int matchName(const struct matcher *matcher, const char *name)
+{
+	if (matcher->exprsSize == 0) {
+		return TRUE;
+	}
+	for (size_t i = 0; i < matcher->exprsSize; i++) {
+		if (matchExprName(&matcher->exprs[i], name)) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+int matchEntry(const struct matcher *matcher, const char *name,
+               uint32_t attrs)
+{
+	if (matcher->exprsSize == 0) {
+		return TRUE;
+	}
+	for (size_t i = 0; i < matcher->exprsSize; i++) {
+		const struct matchExpr *expr = &matcher->exprs[i];
+		if ((attrs & expr->mask) == expr->value &&
+		        matchExprName(expr, name)) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
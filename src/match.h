@@ -0,0 +1,81 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MATCH_H__
+#define __MATCH_H__
+
+#include <stdint.h>
+
+/**
+ * Predicates over the attributes and names of the entries.
+ *
+ * An expression is a comma separated list of terms that must all be true:
+ * - +XYZ: the attributes X, Y and Z are set.
+ * - -XYZ: the attributes X, Y and Z are clear.
+ * - name=GLOB: the entry name (not its path) matches the shell pattern GLOB,
+ *   which can't contain commas.
+ * e.g. "+H-S,name=*.tmp". An entry matches if any expression is true, every
+ * expression is compiled to a single mask/value test plus its glob.
+ * The prune patterns select the entries that are skipped, with everything
+ * below them, before they are opened. The globs ignore case, like the FAT
+ * names they match.
+ */
+struct matcher;
+
+/**
+ * Returns a descriptive message associated with an error code.
+ */
+const char *matchGetError(int err);
+/**
+ * Create a matcher without expressions, which matches every entry.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int matchCreate(struct matcher **matcher);
+/**
+ * Free a matcher.
+ */
+void matchDestroy(struct matcher *matcher);
+/**
+ * Compile the expression 'expr' and add it to the matcher.
+ * Returns 0 on success, !0 if the expression isn't valid or an error
+ * happens.
+ */
+int matchAddExpr(struct matcher *matcher, const char *expr);
+/**
+ * Add the prune pattern 'glob'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int matchAddPrune(struct matcher *matcher, const char *glob);
+/**
+ * Returns !0 if the entry 'name' must be skipped with its subtree.
+ */
+int matchPruned(const struct matcher *matcher, const char *name);
+/**
+ * Returns !0 if the entry 'name' can match some expression, whatever its
+ * attributes are, so the entries that can't be skipped without opening
+ * them.
+ */
+int matchName(const struct matcher *matcher, const char *name);
+/**
+ * Returns !0 if the entry 'name' with the attributes 'attrs' matches.
+ */
+int matchEntry(const struct matcher *matcher, const char *name,
+               uint32_t attrs);
+
+#endif /* __MATCH_H__ */
@@ -0,0 +1,711 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "mockfs.h"
+#include "bool.h"
+#include "path.h"
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define ERRMSG_MAX 1025
+#define NAME_MAX_SIZE 256
+/* Every name starts with a unique prefix like "d0000012", so the children of
+   a directory are sorted by it. */
+#define NAME_PREFIX_SIZE 8
+#define NODES_MAX (1UL << 31)
+#define HANDLES_INITIAL_SIZE 64
+
+enum {
+    ENOERR = 0,
+    ESPEC,
+    ESIZE,
+    EALLOC
+};
+
+struct mockNode {
+	uint32_t parent;
+	uint32_t firstChild;
+	uint32_t childrenSize;
+	uint32_t nameOffset;
+	int isDir;
+	_Atomic uint32_t attrs;
+	/* Number of attribute changes, the change time of the node. */
+	_Atomic uint32_t changes;
+	/* Device of the node, added to the device number of the tree. */
+	uint32_t device;
+};
+
+struct mockHandle {
+	uint32_t node;
+	/* Next entry returned by readdir: 0 ".", 1 "..", then the children. */
+	uint32_t readPos;
+};
+
+struct mockFs {
+	unsigned long width;
+	unsigned long depth;
+	unsigned long files;
+	unsigned long nameLen;
+	unsigned long longNames;
+	unsigned long seed;
+	unsigned long latency;
+	unsigned long setLatency;
+	unsigned long syncLatency;
+	/* Extra latency of a change in another directory than the previous
+	   change, like a head seek or a new erase block on real media. */
+	unsigned long seekLatency;
+	unsigned long devices;
+	/* Operations that can sleep at the same time, 0 for no limit; the rest
+	   wait for a free channel, like the queue of a slow device. */
+	unsigned long channels;
+	/* Channels in use, protected by 'channelLock'. */
+	unsigned long busyChannels;
+	pthread_mutex_t channelLock;
+	pthread_cond_t channelFree;
+	/* Device number of the tree, a hash of its specification, so the
+	   trees of different specifications don't share inode numbers. */
+	uint64_t dev;
+	/* Parent directory of the previous change, UINT32_MAX before the first
+	   one. */
+	_Atomic uint32_t lastDir;
+	struct mockNode *nodes;
+	size_t nodesSize;
+	char *names;
+	size_t namesSize;
+	/* Protects 'handles' and 'handlesSize'. */
+	pthread_mutex_t lock;
+	struct mockHandle **handles;
+	size_t handlesSize;
+};
+
+static _Thread_local char errmsg[ERRMSG_MAX] = {0};
+
+/**
+ * Parse a specification string into 'fs'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int mockFsParseSpec(struct mockFs *fs, const char *spec);
+/**
+ * Write the name of the child 'index' of a directory in 'name'.
+ */
+void mockFsMakeName(struct mockFs *fs, int isDir, uint32_t index,
+                    uint32_t nodeIndex, char *name);
+/**
+ * Returns a deterministic pseudo random number for a node.
+ */
+uint32_t mockFsHash(struct mockFs *fs, uint32_t nodeIndex);
+/**
+ * Build the tree nodes.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int mockFsBuild(struct mockFs *fs);
+/**
+ * Sleep 'us' microseconds, in one of the channels of 'fs'.
+ */
+void mockFsSleep(struct mockFs *fs, unsigned long us);
+/**
+ * Returns the child of 'dir' called 'name', or -1 if there isn't any.
+ */
+long mockFsLookup(struct mockFs *fs, uint32_t dir, const char *name);
+/**
+ * Returns the handle structure of 'handle', or NULL and sets errno if it
+ * isn't a valid handle.
+ */
+struct mockHandle *mockFsGetHandle(struct mockFs *fs, int handle);
+/**
+ * Returns the node of 'name' relative to the directory handle 'dirFd', or
+ * -1 and sets errno if it doesn't exist.
+ */
+long mockFsResolve(struct mockFs *fs, int dirFd, const char *name);
+/**
+ * Operations of the dosfs backend.
+ */
+int mockFsOpenAt(void *data, int dirFd, const char *name);
+int mockFsClose(void *data, int fd);
+int mockFsGetAttributes(void *data, int fd, uint32_t *attrs);
+int mockFsSetAttributes(void *data, int fd, uint32_t attrs);
+int mockFsReadDir(void *data, int fd, char *name, size_t nameSize);
+int mockFsSeekDir(void *data, int fd, int64_t offset);
+int mockFsStat(void *data, int dirFd, const char *name,
+               struct dosfsStat *st);
+int mockFsSync(void *data, int fd, int scope);
+
+
+int mockFsParseSpec(struct mockFs *fs, const char *spec)
+{
+	const char *next = spec;
+	while (*next != '\0') {
+		size_t len = strcspn(next, ",");
+		const char *equal = memchr(next, '=', len);
+		if (equal == NULL) {
+			return ESPEC;
+		}
+		size_t keyLen = (size_t)(equal - next);
+		char *end = NULL;
+		errno = 0;
+		unsigned long value = strtoul(equal + 1, &end, 10);
+		if (end == equal + 1 || end != next + len || errno != 0 ||
+		        equal[1] == '-') {
+			return ESPEC;
+		}
+		if (keyLen == 5 && strncmp(next, "width", keyLen) == 0) {
+			fs->width = value;
+		} else if (keyLen == 5 && strncmp(next, "depth", keyLen) == 0) {
+			fs->depth = value;
+		} else if (keyLen == 5 && strncmp(next, "files", keyLen) == 0) {
+			fs->files = value;
+		} else if (keyLen == 7 && strncmp(next, "namelen", keyLen) == 0) {
+			fs->nameLen = value;
+		} else if (keyLen == 9 && strncmp(next, "longnames", keyLen) == 0) {
+			fs->longNames = value;
+		} else if (keyLen == 4 && strncmp(next, "seed", keyLen) == 0) {
+			fs->seed = value;
+		} else if (keyLen == 7 && strncmp(next, "latency", keyLen) == 0) {
+			fs->latency = value;
+		} else if (keyLen == 10 && strncmp(next, "setlatency", keyLen) == 0) {
+			fs->setLatency = value;
+		} else if (keyLen == 11 && strncmp(next, "synclatency", keyLen) == 0) {
+			fs->syncLatency = value;
+		} else if (keyLen == 11 && strncmp(next, "seeklatency", keyLen) == 0) {
+			fs->seekLatency = value;
+		} else if (keyLen == 7 && strncmp(next, "devices", keyLen) == 0) {
+			fs->devices = value;
+		} else if (keyLen == 8 && strncmp(next, "channels", keyLen) == 0) {
+			fs->channels = value;
+		} else {
+			return ESPEC;
+		}
+		next += len;
+		if (*next == ',') {
+			next++;
+		}
+	}
+	if (fs->nameLen < NAME_PREFIX_SIZE + 4 || fs->nameLen >= NAME_MAX_SIZE ||
+	        fs->longNames > 100 || fs->devices == 0) {
+		return ESPEC;
+	}
+	return ENOERR;
+}
+
+uint32_t mockFsHash(struct mockFs *fs, uint32_t nodeIndex)
+{
+	uint64_t x = nodeIndex + fs->seed * 0x9E3779B97F4A7C15ULL;
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDULL;
+	x ^= x >> 33;
+	x *= 0xC4CEB9FE1A85EC53ULL;
+	x ^= x >> 33;
+	return (uint32_t)x;
+}
+
+void mockFsMakeName(struct mockFs *fs, int isDir, uint32_t index,
+                    uint32_t nodeIndex, char *name)
+{
+	int len = snprintf(name, NAME_MAX_SIZE, "%c%07u", isDir ? 'd' : 'f',
+	                   (unsigned int)index);
+	if (mockFsHash(fs, nodeIndex) % 100 < fs->longNames) {
+		/* Long name: pad to 'nameLen' characters, extension included. */
+		while ((unsigned long)len + 4 < fs->nameLen) {
+			name[len] = len % 8 == 0 ? ' ' : 'x';
+			len++;
+		}
+	}
+	if (!isDir) {
+		memcpy(name + len, ".txt", 4);
+		len += 4;
+	}
+	name[len] = '\0';
+}
+
+int mockFsBuild(struct mockFs *fs)
+{
+	/* Count the nodes first: every level has 'width' times the directories
+	   of the previous one, and every directory has 'files' files. */
+	unsigned long dirs = 1;
+	unsigned long levelDirs = 1;
+	for (unsigned long d = 0; d < fs->depth; d++) {
+		levelDirs *= fs->width;
+		dirs += levelDirs;
+		if (levelDirs > NODES_MAX || dirs > NODES_MAX) {
+			return ESIZE;
+		}
+	}
+	if (fs->files > NODES_MAX / dirs) {
+		return ESIZE;
+	}
+	fs->nodesSize = dirs + dirs * fs->files;
+	if (fs->nodesSize > NODES_MAX) {
+		return ESIZE;
+	}
+	fs->nodes = calloc(fs->nodesSize, sizeof(struct mockNode));
+	fs->namesSize = fs->nodesSize * (fs->nameLen + 1);
+	fs->names = malloc(fs->namesSize);
+	if (fs->nodes == NULL || fs->names == NULL) {
+		return EALLOC;
+	}
+	/* Breadth first, so the children of each directory are contiguous. */
+	size_t namesUsed = 0;
+	fs->names[namesUsed++] = '\0';
+	fs->nodes[0].isDir = TRUE;
+	atomic_init(&fs->nodes[0].attrs, DOSFS_ATTR_DIR);
+	size_t used = 1;
+	unsigned long levelStart = 0;
+	unsigned long levelEnd = 1;
+	for (unsigned long d = 0; d <= fs->depth; d++) {
+		for (unsigned long n = levelStart; n < levelEnd; n++) {
+			struct mockNode *dir = &fs->nodes[n];
+			if (!dir->isDir) {
+				continue;
+			}
+			unsigned long subdirs = d < fs->depth ? fs->width : 0;
+			dir->firstChild = (uint32_t)used;
+			dir->childrenSize = (uint32_t)(subdirs + fs->files);
+			for (uint32_t i = 0; i < dir->childrenSize; i++) {
+				struct mockNode *child = &fs->nodes[used];
+				int isDir = i < subdirs;
+				child->parent = (uint32_t)n;
+				child->isDir = isDir;
+				/* Every subdirectory of the root is like a mount point. */
+				child->device = n > 0 ? dir->device :
+				                isDir ? i % (uint32_t)fs->devices : 0;
+				child->nameOffset = (uint32_t)namesUsed;
+				mockFsMakeName(fs, isDir, isDir ? i : i - (uint32_t)subdirs,
+				               (uint32_t)used, fs->names + namesUsed);
+				namesUsed += strlen(fs->names + namesUsed) + 1;
+				uint32_t hash = mockFsHash(fs, (uint32_t)used) >> 8;
+				uint32_t attrs = isDir ? DOSFS_ATTR_DIR : 0;
+				attrs |= hash % 10 == 0 ? DOSFS_ATTR_RO : 0;
+				attrs |= (hash / 10) % 10 == 0 ? DOSFS_ATTR_HIDDEN : 0;
+				attrs |= (hash / 100) % 20 == 0 ? DOSFS_ATTR_SYS : 0;
+				attrs |= (hash / 2000) % 10 < 7 ? DOSFS_ATTR_ARCH : 0;
+				atomic_init(&child->attrs, attrs);
+				used++;
+			}
+		}
+		levelStart = levelEnd;
+		levelEnd = used;
+	}
+	return ENOERR;
+}
+
+void mockFsSleep(struct mockFs *fs, unsigned long us)
+{
+	if (us == 0) {
+		return;
+	}
+	if (fs->channels > 0) {
+		pthread_mutex_lock(&fs->channelLock);
+		while (fs->busyChannels >= fs->channels) {
+			pthread_cond_wait(&fs->channelFree, &fs->channelLock);
+		}
+		fs->busyChannels++;
+		pthread_mutex_unlock(&fs->channelLock);
+	}
+	struct timespec ts = {(time_t)(us / 1000000),
+		       (long)(us % 1000000) * 1000
+	};
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+	}
+	if (fs->channels > 0) {
+		pthread_mutex_lock(&fs->channelLock);
+		fs->busyChannels--;
+		pthread_cond_signal(&fs->channelFree);
+		pthread_mutex_unlock(&fs->channelLock);
+	}
+}
+
+long mockFsLookup(struct mockFs *fs, uint32_t dir, const char *name)
+{
+	const struct mockNode *node = &fs->nodes[dir];
+	if (!node->isDir) {
+		return -1;
+	}
+	/* The unique prefixes keep the children sorted. */
+	size_t low = node->firstChild;
+	size_t high = (size_t)node->firstChild + node->childrenSize;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		const char *midName = fs->names + fs->nodes[mid].nameOffset;
+		int cmp = strncmp(name, midName, NAME_PREFIX_SIZE);
+		if (cmp == 0) {
+			return strcmp(name, midName) == 0 ? (long)mid : -1;
+		} else if (cmp < 0) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+	return -1;
+}
+
+struct mockHandle *mockFsGetHandle(struct mockFs *fs, int handle)
+{
+	struct mockHandle *result = NULL;
+	pthread_mutex_lock(&fs->lock);
+	if (handle >= 0 && (size_t)handle < fs->handlesSize) {
+		result = fs->handles[handle];
+	}
+	pthread_mutex_unlock(&fs->lock);
+	if (result == NULL) {
+		errno = EBADF;
+	}
+	return result;
+}
+
+long mockFsResolve(struct mockFs *fs, int dirFd, const char *name)
+{
+	uint32_t node = 0;
+	if (dirFd >= 0 && name[0] != '/') {
+		struct mockHandle *dir = mockFsGetHandle(fs, dirFd);
+		if (dir == NULL) {
+			return -1;
+		}
+		node = dir->node;
+	}
+	char component[NAME_MAX_SIZE];
+	const char *next = name;
+	while (*next != '\0') {
+		while (*next == '/') {
+			next++;
+		}
+		size_t len = strcspn(next, "/");
+		if (len == 0) {
+			break;
+		}
+		if (len >= NAME_MAX_SIZE) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memcpy(component, next, len);
+		component[len] = '\0';
+		next += len;
+		if (!fs->nodes[node].isDir) {
+			errno = ENOTDIR;
+			return -1;
+		}
+		if (strcmp(component, ".") == 0) {
+			continue;
+		} else if (strcmp(component, "..") == 0) {
+			node = fs->nodes[node].parent;
+			continue;
+		}
+		long child = mockFsLookup(fs, node, component);
+		if (child < 0) {
+			errno = ENOENT;
+			return -1;
+		}
+		node = (uint32_t)child;
+	}
+	return (long)node;
+}
+
+int mockFsOpenAt(void *data, int dirFd, const char *name)
+{
+	struct mockFs *fs = data;
+	mockFsSleep(fs, fs->latency);
+	long node = mockFsResolve(fs, dirFd, name);
+	if (node < 0) {
+		return -1;
+	}
+	struct mockHandle *handle = calloc(1, sizeof(struct mockHandle));
+	if (handle == NULL) {
+		return -1;
+	}
+	handle->node = (uint32_t)node;
+	pthread_mutex_lock(&fs->lock);
+	size_t index = 0;
+	while (index < fs->handlesSize && fs->handles[index] != NULL) {
+		index++;
+	}
+	if (index == fs->handlesSize) {
+		struct mockHandle **newHandles = realloc(fs->handles,
+		                                         sizeof(struct mockHandle *) *
+		                                         fs->handlesSize * 2);
+		if (newHandles == NULL) {
+			pthread_mutex_unlock(&fs->lock);
+			free(handle);
+			return -1;
+		}
+		memset(newHandles + fs->handlesSize, 0,
+		       sizeof(struct mockHandle *) * fs->handlesSize);
+		fs->handles = newHandles;
+		fs->handlesSize *= 2;
+	}
+	fs->handles[index] = handle;
+	pthread_mutex_unlock(&fs->lock);
+	return (int)index;
+}
+
+int mockFsClose(void *data, int fd)
+{
+	struct mockFs *fs = data;
+	mockFsSleep(fs, fs->latency);
+	struct mockHandle *handle = NULL;
+	pthread_mutex_lock(&fs->lock);
+	if (fd >= 0 && (size_t)fd < fs->handlesSize) {
+		handle = fs->handles[fd];
+		fs->handles[fd] = NULL;
+	}
+	pthread_mutex_unlock(&fs->lock);
+	if (handle == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	free(handle);
+	return 0;
+}
+
+int mockFsGetAttributes(void *data, int fd, uint32_t *attrs)
+{
+	struct mockFs *fs = data;
+	mockFsSleep(fs, fs->latency);
+	struct mockHandle *handle = mockFsGetHandle(fs, fd);
+	if (handle == NULL) {
+		return -1;
+	}
+	*attrs = atomic_load(&fs->nodes[handle->node].attrs);
+	return 0;
+}
+
+int mockFsSetAttributes(void *data, int fd, uint32_t attrs)
+{
+	struct mockFs *fs = data;
+	mockFsSleep(fs, fs->setLatency);
+	struct mockHandle *handle = mockFsGetHandle(fs, fd);
+	if (handle == NULL) {
+		return -1;
+	}
+	/* Like the vfat driver, the directory and volume label attributes
+	   can't change. */
+	struct mockNode *node = &fs->nodes[handle->node];
+	if (atomic_exchange(&fs->lastDir, node->parent) != node->parent) {
+		mockFsSleep(fs, fs->seekLatency);
+	}
+	uint32_t fixed = DOSFS_ATTR_DIR | DOSFS_ATTR_VOLUME;
+	uint32_t current = atomic_load(&node->attrs);
+	atomic_store(&node->attrs, (attrs & ~fixed) | (current & fixed));
+	atomic_fetch_add(&node->changes, 1);
+	return 0;
+}
+
+int mockFsReadDir(void *data, int fd, char *name, size_t nameSize)
+{
+	struct mockFs *fs = data;
+	mockFsSleep(fs, fs->latency);
+	struct mockHandle *handle = mockFsGetHandle(fs, fd);
+	if (handle == NULL) {
+		return -1;
+	}
+	const struct mockNode *node = &fs->nodes[handle->node];
+	if (!node->isDir) {
+		errno = ENOTDIR;
+		return -1;
+	}
+	const char *entry = NULL;
+	if (handle->readPos == 0) {
+		entry = ".";
+	} else if (handle->readPos == 1) {
+		entry = "..";
+	} else if (handle->readPos - 2 < node->childrenSize) {
+		entry = fs->names +
+		        fs->nodes[node->firstChild + handle->readPos - 2].nameOffset;
+	} else {
+		return 0;
+	}
+	if (strlen(entry) >= nameSize) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(name, entry);
+	handle->readPos++;
+	return 1;
+}
+
+int mockFsSeekDir(void *data, int fd, int64_t offset)
+{
+	struct mockFs *fs = data;
+	struct mockHandle *handle = mockFsGetHandle(fs, fd);
+	if (handle == NULL) {
+		return -1;
+	}
+	if (!fs->nodes[handle->node].isDir) {
+		errno = ENOTDIR;
+		return -1;
+	}
+	if (offset < 0 || offset > UINT32_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	handle->readPos = (uint32_t)offset;
+	return 0;
+}
+
+int mockFsStat(void *data, int dirFd, const char *name,
+               struct dosfsStat *st)
+{
+	struct mockFs *fs = data;
+	mockFsSleep(fs, fs->latency);
+	long node = 0;
+	if (name == NULL) {
+		struct mockHandle *handle = mockFsGetHandle(fs, dirFd);
+		if (handle == NULL) {
+			return -1;
+		}
+		node = handle->node;
+	} else if ((node = mockFsResolve(fs, dirFd, name)) < 0) {
+		return -1;
+	}
+	/* Inode 0 isn't valid. */
+	st->dev = fs->dev + fs->nodes[node].device;
+	st->ino = (uint64_t)node + 1;
+	st->mount = 0;
+	st->ctimeSec = atomic_load(&fs->nodes[node].changes);
+	st->ctimeNsec = 0;
+	st->isDir = fs->nodes[node].isDir;
+	return 0;
+}
+
+int mockFsSync(void *data, int fd, int scope)
+{
+	(void)scope;
+	struct mockFs *fs = data;
+	if (mockFsGetHandle(fs, fd) == NULL) {
+		return -1;
+	}
+	mockFsSleep(fs, fs->syncLatency);
+	return 0;
+}
+
+
+const char *mockFsGetError(int err)
+{
+	switch (err) {
+	case ENOERR:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "No error occurred");
+		break;
+	case ESPEC:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Invalid mock tree specification");
+		break;
+	case ESIZE:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "The mock tree is too big");
+		break;
+	case EALLOC:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error allocating memory: %s",
+		         strerror(errno));
+		break;
+	default:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Unknown error");
+	}
+	return errmsg;
+}
+
+int mockFsCreate(const char *spec, struct mockFs **fs)
+{
+	assert(spec != NULL);
+	assert(fs != NULL);
+	struct mockFs *newFs = calloc(1, sizeof(struct mockFs));
+	if (newFs == NULL) {
+		return EALLOC;
+	}
+	newFs->width = 4;
+	newFs->depth = 3;
+	newFs->files = 16;
+	newFs->nameLen = 32;
+	newFs->longNames = 50;
+	newFs->seed = 1;
+	newFs->devices = 1;
+	newFs->setLatency = (unsigned long) -1;
+	newFs->syncLatency = (unsigned long) -1;
+	newFs->dev = pathHash(spec, strlen(spec));
+	atomic_init(&newFs->lastDir, UINT32_MAX);
+	pthread_mutex_init(&newFs->lock, NULL);
+	pthread_mutex_init(&newFs->channelLock, NULL);
+	pthread_cond_init(&newFs->channelFree, NULL);
+	int mockErrno = mockFsParseSpec(newFs, spec);
+	if (newFs->setLatency == (unsigned long) -1) {
+		newFs->setLatency = newFs->latency;
+	}
+	if (newFs->syncLatency == (unsigned long) -1) {
+		newFs->syncLatency = newFs->latency;
+	}
+	if (!mockErrno) {
+		mockErrno = mockFsBuild(newFs);
+	}
+	if (!mockErrno) {
+		newFs->handles = calloc(HANDLES_INITIAL_SIZE,
+		                        sizeof(struct mockHandle *));
+		newFs->handlesSize = HANDLES_INITIAL_SIZE;
+		if (newFs->handles == NULL) {
+			mockErrno = EALLOC;
+		}
+	}
+	if (mockErrno) {
+		mockFsDestroy(newFs);
+		return mockErrno;
+	}
+	*fs = newFs;
+	return ENOERR;
+}
+
+void mockFsDestroy(struct mockFs *fs)
+{
+	if (fs == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < fs->handlesSize; i++) {
+		free(fs->handles[i]);
+	}
+	free(fs->handles);
+	free(fs->nodes);
+	free(fs->names);
+	pthread_mutex_destroy(&fs->lock);
+	pthread_mutex_destroy(&fs->channelLock);
+	pthread_cond_destroy(&fs->channelFree);
+	free(fs);
+}
+
+void mockFsGetBackend(struct mockFs *fs, struct dosfsBackend *backend)
+{
+	assert(fs != NULL);
+	assert(backend != NULL);
+	backend->name = "mock";
+	backend->data = fs;
+	backend->openAt = mockFsOpenAt;
+	backend->close = mockFsClose;
+	backend->getAttributes = mockFsGetAttributes;
+	backend->setAttributes = mockFsSetAttributes;
+	backend->readDir = mockFsReadDir;
+	backend->getDents = NULL;
+	backend->seekDir = mockFsSeekDir;
+	backend->stat = mockFsStat;
+	backend->sync = mockFsSync;
+}
@@ -0,0 +1,73 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MOCKFS_H__
+#define __MOCKFS_H__
+
+#include "dosfs.h"
+
+/**
+ * Deterministic in-memory file tree, used to test and profile the traversal
+ * without a mounted vfat file system.
+ *
+ * The tree is described by a specification string of comma separated
+ * KEY=VALUE pairs:
+ * - width: subdirectories of each directory (default: 4).
+ * - depth: levels of subdirectories below the root (default: 3).
+ * - files: files in each directory (default: 16).
+ * - namelen: length of the long names (default: 32).
+ * - longnames: percentage of entries with a long name instead of an 8.3
+ *   name (default: 50).
+ * - seed: seed of the initial attributes (default: 1).
+ * - latency: microseconds every operation sleeps, to simulate a slow
+ *   device (default: 0).
+ * - setlatency: microseconds a set attributes operation sleeps (default:
+ *   the same as latency).
+ * - synclatency: microseconds a sync operation sleeps (default: the same
+ *   as latency).
+ * - seeklatency: extra microseconds a set attributes operation sleeps when
+ *   its file isn't in the same directory as the previous one (default: 0).
+ * - devices: number of devices; the subdirectories of the root are spread
+ *   over them, like mount points, and stat reports their device (default:
+ *   1).
+ * - channels: operations that can sleep at the same time, the rest wait
+ *   for one of them to end, 0 for no limit (default: 0).
+ * The same specification always produces the same tree and attributes.
+ */
+struct mockFs;
+
+/**
+ * Returns a descriptive message associated with an error code.
+ */
+const char *mockFsGetError(int err);
+/**
+ * Create the tree described by 'spec'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int mockFsCreate(const char *spec, struct mockFs **fs);
+/**
+ * Free a tree and all its resources.
+ */
+void mockFsDestroy(struct mockFs *fs);
+/**
+ * Fill 'backend' with the dosfs backend that works on the files of 'fs'.
+ */
+void mockFsGetBackend(struct mockFs *fs, struct dosfsBackend *backend);
+
+#endif /* __MOCKFS_H__ */
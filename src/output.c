@@ -0,0 +1,439 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "output.h"
+#include "dosfs.h"
+#include "bool.h"
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+#define ERRMSG_MAX 1025
+/* The buffer is written when it reaches this size. */
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+#define OUTPUT_INITIAL_CAPACITY 4096
+/* Bits of the attributes rendered by outputAttrString. */
+#define ATTR_STRING_MASK 0x3f
+
+enum {
+    ENOERR = 0,
+    EALLOC,
+    EWRITE,
+    EFORMAT
+};
+
+struct output {
+	pthread_mutex_t lock;
+	int format;
+	/* -1 for the outputs that are only merged into others. */
+	int fd;
+	/* Terminals get every entry as soon as it's added. */
+	int tty;
+	/* Rendered entries, or the records in the binary format. */
+	char *data;
+	size_t size;
+	size_t capacity;
+	/* Paths table of the binary format. */
+	char *paths;
+	size_t pathsSize;
+	size_t pathsCapacity;
+	uint64_t records;
+	/* First error, and its errno, reported by outputFinish. */
+	int error;
+	int errorErrno;
+};
+
+/* "RHSADV" renderings of the 64 combinations of the attribute bits. */
+#define ATTR_STRING(a) { \
+	DOSFS_HAS_ATTR_RO(a) ? 'R' : '-', \
+	DOSFS_HAS_ATTR_HIDDEN(a) ? 'H' : '-', \
+	DOSFS_HAS_ATTR_SYS(a) ? 'S' : '-', \
+	DOSFS_HAS_ATTR_ARCH(a) ? 'A' : '-', \
+	DOSFS_HAS_ATTR_DIR(a) ? 'D' : '-', \
+	DOSFS_HAS_ATTR_VOLUME(a) ? 'V' : '-', \
+	'\0' }
+#define ATTR_STRING4(a) ATTR_STRING(a), ATTR_STRING((a) + 1), \
+                        ATTR_STRING((a) + 2), ATTR_STRING((a) + 3)
+#define ATTR_STRING16(a) ATTR_STRING4(a), ATTR_STRING4((a) + 4), \
+                         ATTR_STRING4((a) + 8), ATTR_STRING4((a) + 12)
+
+static _Thread_local char errmsg[ERRMSG_MAX] = {0};
+static const char attrStrings[ATTR_STRING_MASK + 1][7] = {
+	ATTR_STRING16(0), ATTR_STRING16(16), ATTR_STRING16(32), ATTR_STRING16(48)
+};
+static const char *const formatNames[] = {"text", "nul", "jsonl", "bin"};
+
+/**
+ * Save the first error of 'out'.
+ */
+void outputSetError(struct output *out, int err);
+/**
+ * Make room for 'size' more bytes in the buffer '*buffer'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int outputReserve(char **buffer, size_t *capacity, size_t used, size_t size);
+/**
+ * Append 'size' bytes to the data of 'out'.
+ */
+void outputAppend(struct output *out, const void *bytes, size_t size);
+/**
+ * Append 'str' as a JSON string, with its quotes.
+ */
+void outputAppendJson(struct output *out, const char *str);
+/**
+ * Add an entry in the format of 'out'. Called with the lock held.
+ */
+void outputEntry(struct output *out, const char *path, uint32_t before,
+                 uint32_t after, int change);
+/**
+ * Write 'size' bytes to 'fd', retrying the partial writes.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int outputWrite(int fd, const void *bytes, size_t size);
+/**
+ * Write the data of 'out' if it reached 'threshold' bytes. Called with the
+ * lock held.
+ */
+void outputFlushLocked(struct output *out, size_t threshold);
+
+
+void outputSetError(struct output *out, int err)
+{
+	if (out->error == ENOERR) {
+		out->error = err;
+		out->errorErrno = errno;
+	}
+}
+
+int outputReserve(char **buffer, size_t *capacity, size_t used, size_t size)
+{
+	if (used + size <= *capacity) {
+		return ENOERR;
+	}
+	size_t newCapacity = *capacity > 0 ? *capacity : OUTPUT_INITIAL_CAPACITY;
+	while (newCapacity < used + size) {
+		newCapacity *= 2;
+	}
+	char *newBuffer = realloc(*buffer, newCapacity);
+	if (newBuffer == NULL) {
+		return EALLOC;
+	}
+	*buffer = newBuffer;
+	*capacity = newCapacity;
+	return ENOERR;
+}
+
+void outputAppend(struct output *out, const void *bytes, size_t size)
+{
+	if (outputReserve(&out->data, &out->capacity, out->size, size)) {
+		outputSetError(out, EALLOC);
+		return;
+	}
+	memcpy(out->data + out->size, bytes, size);
+	out->size += size;
+}
+
+void outputAppendJson(struct output *out, const char *str)
+{
+	outputAppend(out, "\"", 1);
+	const char *start = str;
+	for (const char *c = str; *c != '\0'; c++) {
+		unsigned char byte = (unsigned char)*c;
+		if (byte >= 0x20 && byte != '"' && byte != '\\') {
+			continue;
+		}
+		outputAppend(out, start, (size_t)(c - start));
+		char escape[7];
+		if (byte == '"' || byte == '\\') {
+			escape[0] = '\\';
+			escape[1] = (char)byte;
+			outputAppend(out, escape, 2);
+		} else {
+			snprintf(escape, sizeof(escape), "\\u%04x", byte);
+			outputAppend(out, escape, 6);
+		}
+		start = c + 1;
+	}
+	outputAppend(out, start, strlen(start));
+	outputAppend(out, "\"", 1);
+}
+
+void outputEntry(struct output *out, const char *path, uint32_t before,
+                 uint32_t after, int change)
+{
+	const char *afterString = outputAttrString(after);
+	size_t pathLength = strlen(path);
+	switch (out->format) {
+	case OUTPUT_FORMAT_TEXT:
+	case OUTPUT_FORMAT_NUL:
+		if (change) {
+			outputAppend(out, outputAttrString(before), 6);
+			outputAppend(out, " => ", 4);
+		}
+		outputAppend(out, afterString, 6);
+		outputAppend(out, "  ", 2);
+		outputAppend(out, path, pathLength);
+		outputAppend(out, out->format == OUTPUT_FORMAT_NUL ? "" : "\n", 1);
+		break;
+	case OUTPUT_FORMAT_JSONL:
+		outputAppend(out, "{\"path\":", 8);
+		outputAppendJson(out, path);
+		if (change) {
+			outputAppend(out, ",\"before\":\"", 11);
+			outputAppend(out, outputAttrString(before), 6);
+			outputAppend(out, "\",\"after\":\"", 11);
+		} else {
+			outputAppend(out, ",\"attrs\":\"", 10);
+		}
+		outputAppend(out, afterString, 6);
+		outputAppend(out, "\"}\n", 3);
+		break;
+	case OUTPUT_FORMAT_BIN: {
+		if (outputReserve(&out->paths, &out->pathsCapacity, out->pathsSize,
+		                  pathLength + 1)) {
+			outputSetError(out, EALLOC);
+			return;
+		}
+		struct outputBinRecord record;
+		memset(&record, 0, sizeof(record));
+		record.pathOffset = out->pathsSize;
+		record.pathLength = (uint32_t)pathLength;
+		record.before = (uint8_t)before;
+		record.after = (uint8_t)after;
+		record.flags = change ? OUTPUT_BIN_CHANGE : 0;
+		memcpy(out->paths + out->pathsSize, path, pathLength + 1);
+		out->pathsSize += pathLength + 1;
+		outputAppend(out, &record, sizeof(record));
+		out->records++;
+		break;
+	}
+	default:
+		assert(FALSE);
+	}
+}
+
+int outputWrite(int fd, const void *bytes, size_t size)
+{
+	const char *pos = bytes;
+	while (size > 0) {
+		ssize_t written = write(fd, pos, size);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return EWRITE;
+		}
+		pos += written;
+		size -= (size_t)written;
+	}
+	return ENOERR;
+}
+
+void outputFlushLocked(struct output *out, size_t threshold)
+{
+	if (out->fd == -1 || out->format == OUTPUT_FORMAT_BIN ||
+	        out->size == 0 || out->size < threshold) {
+		return;
+	}
+	if (outputWrite(out->fd, out->data, out->size)) {
+		outputSetError(out, EWRITE);
+	}
+	out->size = 0;
+}
+
+
+const char *outputGetError(int err)
+{
+	switch (err) {
+	case ENOERR:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "No error occurred");
+		break;
+	case EALLOC:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error allocating memory: %s",
+		         strerror(errno));
+		break;
+	case EWRITE:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error writing the output: %s",
+		         strerror(errno));
+		break;
+	case EFORMAT:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Unknown output format");
+		break;
+	default:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Unknown error");
+	}
+	return errmsg;
+}
+
+int outputParseFormat(const char *name, int *format)
+{
+	assert(name != NULL);
+	assert(format != NULL);
+	for (size_t i = 0; i < sizeof(formatNames) / sizeof(formatNames[0]); i++) {
+		if (strcmp(name, formatNames[i]) == 0) {
+			*format = (int)i;
+			return ENOERR;
+		}
+	}
+	return EFORMAT;
+}
+
+const char *outputAttrString(uint32_t attrs)
+{
+	return attrStrings[attrs & ATTR_STRING_MASK];
+}
+
+int outputCreate(struct output **out, int format, int fd)
+{
+	assert(out != NULL);
+	assert(format >= OUTPUT_FORMAT_TEXT && format <= OUTPUT_FORMAT_BIN);
+	struct output *newOut = calloc(1, sizeof(struct output));
+	if (newOut == NULL) {
+		return EALLOC;
+	}
+	pthread_mutex_init(&newOut->lock, NULL);
+	newOut->format = format;
+	newOut->fd = fd;
+	newOut->tty = fd != -1 && isatty(fd);
+	*out = newOut;
+	return ENOERR;
+}
+
+void outputDestroy(struct output *out)
+{
+	if (out == NULL) {
+		return;
+	}
+	pthread_mutex_destroy(&out->lock);
+	free(out->data);
+	free(out->paths);
+	free(out);
+}
+
+void outputAttrs(struct output *out, const char *path, uint32_t attrs)
+{
+	assert(out != NULL);
+	assert(path != NULL);
+	pthread_mutex_lock(&out->lock);
+	outputEntry(out, path, attrs, attrs, FALSE);
+	outputFlushLocked(out, out->tty ? 0 : OUTPUT_BUFFER_SIZE);
+	pthread_mutex_unlock(&out->lock);
+}
+
+void outputChange(struct output *out, const char *path, uint32_t before,
+                  uint32_t after)
+{
+	assert(out != NULL);
+	assert(path != NULL);
+	pthread_mutex_lock(&out->lock);
+	outputEntry(out, path, before, after, TRUE);
+	outputFlushLocked(out, out->tty ? 0 : OUTPUT_BUFFER_SIZE);
+	pthread_mutex_unlock(&out->lock);
+}
+
+void outputMerge(struct output *dst, struct output *src)
+{
+	assert(dst != NULL);
+	assert(src != NULL);
+	assert(dst->format == src->format);
+	pthread_mutex_lock(&dst->lock);
+	pthread_mutex_lock(&src->lock);
+	if (dst->format == OUTPUT_FORMAT_BIN) {
+		/* The paths of 'src' go after the ones of 'dst'. */
+		struct outputBinRecord *records = (struct outputBinRecord *)src->data;
+		for (uint64_t i = 0; i < src->records; i++) {
+			records[i].pathOffset += dst->pathsSize;
+		}
+		if (outputReserve(&dst->paths, &dst->pathsCapacity, dst->pathsSize,
+		                  src->pathsSize)) {
+			outputSetError(dst, EALLOC);
+		} else {
+			if (src->pathsSize > 0) {
+				memcpy(dst->paths + dst->pathsSize, src->paths,
+				       src->pathsSize);
+			}
+			dst->pathsSize += src->pathsSize;
+			dst->records += src->records;
+			outputAppend(dst, src->data, src->size);
+		}
+	} else if (src->size > 0) {
+		outputAppend(dst, src->data, src->size);
+	}
+	if (src->error != ENOERR && dst->error == ENOERR) {
+		dst->error = src->error;
+		dst->errorErrno = src->errorErrno;
+	}
+	src->size = 0;
+	src->pathsSize = 0;
+	src->records = 0;
+	outputFlushLocked(dst, dst->tty ? 0 : OUTPUT_BUFFER_SIZE);
+	pthread_mutex_unlock(&src->lock);
+	pthread_mutex_unlock(&dst->lock);
+}
+
+int outputFlush(struct output *out)
+{
+	assert(out != NULL);
+	pthread_mutex_lock(&out->lock);
+	outputFlushLocked(out, 0);
+	int err = out->error;
+	pthread_mutex_unlock(&out->lock);
+	return err;
+}
+
+int outputFinish(struct output *out)
+{
+	assert(out != NULL);
+	pthread_mutex_lock(&out->lock);
+	if (out->format == OUTPUT_FORMAT_BIN && out->fd != -1 &&
+	        out->error == ENOERR) {
+		struct outputBinHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, OUTPUT_BIN_MAGIC, sizeof(header.magic));
+		header.version = OUTPUT_BIN_VERSION;
+		header.recordSize = sizeof(struct outputBinRecord);
+		header.recordCount = out->records;
+		header.pathsOffset = sizeof(header) + out->size;
+		if (outputWrite(out->fd, &header, sizeof(header)) ||
+		        outputWrite(out->fd, out->data, out->size) ||
+		        outputWrite(out->fd, out->paths, out->pathsSize)) {
+			outputSetError(out, EWRITE);
+		}
+		out->size = 0;
+		out->pathsSize = 0;
+		out->records = 0;
+	} else {
+		outputFlushLocked(out, 0);
+	}
+	int err = out->error;
+	errno = out->errorErrno;
+	pthread_mutex_unlock(&out->lock);
+	return err;
+}
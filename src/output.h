@@ -0,0 +1,136 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Buffered writer of the attribute listings.
+ * The entries are rendered in a large memory buffer that is written to its
+ * file descriptor only when it's full or when it's flushed explicitly.
+ * All the functions are thread safe.
+ */
+struct output;
+
+/* Output formats. */
+enum {
+	/* "RHSADV  path" lines. */
+	OUTPUT_FORMAT_TEXT = 0,
+	/* The same as text, but every entry ends with '\0' instead of '\n'. */
+	OUTPUT_FORMAT_NUL,
+	/* One JSON object per line. */
+	OUTPUT_FORMAT_JSONL,
+	/* Fixed width records, see struct outputBinHeader. */
+	OUTPUT_FORMAT_BIN
+};
+
+/* Magic number at the start of the binary output. */
+#define OUTPUT_BIN_MAGIC "FATATTR\0"
+#define OUTPUT_BIN_VERSION 1
+/* outputBinRecord.flags: the record is an attribute change. */
+#define OUTPUT_BIN_CHANGE 0x01
+
+/**
+ * Header of the binary output, all the integers in host byte order.
+ * The header is followed by 'recordCount' records of 'recordSize' bytes,
+ * and the records by the table of paths, starting at 'pathsOffset'.
+ */
+struct outputBinHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	uint64_t recordCount;
+	/* Offset of the paths table from the start of the output. */
+	uint64_t pathsOffset;
+};
+
+/**
+ * Record of the binary output, one per entry.
+ */
+struct outputBinRecord {
+	/* Offset of the path from the start of the paths table, the paths are
+	   '\0' terminated. */
+	uint64_t pathOffset;
+	/* Length of the path, without the '\0'. */
+	uint32_t pathLength;
+	/* Attributes before and after a change, the same if it isn't a
+	   change. */
+	uint8_t before;
+	uint8_t after;
+	uint8_t flags;
+	uint8_t reserved;
+};
+
+/**
+ * Returns a descriptive message associated with an error code.
+ */
+const char *outputGetError(int err);
+/**
+ * Parse the format name 'name' ("text", "nul", "jsonl" or "bin") and save
+ * the format in 'format'.
+ * Returns 0 on success, !0 if the name is unknown.
+ */
+int outputParseFormat(const char *name, int *format);
+/**
+ * Returns the "RHSADV" rendering of 'attrs', '-' for the missing attributes.
+ */
+const char *outputAttrString(uint32_t attrs);
+/**
+ * Create an output of the format 'format' that writes to the file
+ * descriptor 'fd', or -1 for an output that only accumulates its entries to
+ * be merged into another one later.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int outputCreate(struct output **out, int format, int fd);
+/**
+ * Free an output, the pending entries are discarded.
+ */
+void outputDestroy(struct output *out);
+/**
+ * Add the attributes of a file.
+ * The write errors are kept until outputFinish.
+ */
+void outputAttrs(struct output *out, const char *path, uint32_t attrs);
+/**
+ * Add an attribute change of a file.
+ * The write errors are kept until outputFinish.
+ */
+void outputChange(struct output *out, const char *path, uint32_t before,
+                  uint32_t after);
+/**
+ * Move all the entries of 'src' to the end of 'dst', the entries of 'src'
+ * are kept together.
+ */
+void outputMerge(struct output *dst, struct output *src);
+/**
+ * Write the pending entries. The binary format can only be written at once
+ * by outputFinish, so this does nothing with it.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int outputFlush(struct output *out);
+/**
+ * Write all the pending entries, including the binary header and records.
+ * Returns 0 on success, !0 if an error happened in this or a previous write.
+ */
+int outputFinish(struct output *out);
+
+#endif /* __OUTPUT_H__ */
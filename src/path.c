@@ -0,0 +1,195 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "path.h"
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define ERRMSG_MAX 1025
+#define PATH_INITIAL_CAPACITY 256
+#define ARENA_INITIAL_CAPACITY 4096
+
+enum {
+    ENOERR = 0,
+    EALLOC
+};
+
+static _Thread_local char errmsg[ERRMSG_MAX] = {0};
+
+/**
+ * Make room for at least 'size' bytes in 'buffer', of capacity 'capacity',
+ * doubling it as needed. 'initial' is the capacity of an empty buffer.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int pathReserve(char **buffer, size_t *capacity, size_t size, size_t initial);
+
+
+int pathReserve(char **buffer, size_t *capacity, size_t size, size_t initial)
+{
+	if (size <= *capacity) {
+		return ENOERR;
+	}
+	size_t newCapacity = *capacity > 0 ? *capacity : initial;
+	while (newCapacity < size) {
+		newCapacity *= 2;
+	}
+	char *newBuffer = realloc(*buffer, newCapacity);
+	if (newBuffer == NULL) {
+		return EALLOC;
+	}
+	*buffer = newBuffer;
+	*capacity = newCapacity;
+	return ENOERR;
+}
+
+
+const char *pathGetError(int err)
+{
+	switch (err) {
+	case ENOERR:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "No error occurred");
+		break;
+	case EALLOC:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error allocating memory: %s",
+		         strerror(errno));
+		break;
+	default:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Unknown error");
+	}
+	return errmsg;
+}
+
+uint64_t pathHash(const char *path, size_t length)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ (unsigned char)path[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+void pathFree(struct pathBuilder *path)
+{
+	assert(path != NULL);
+	free(path->buffer);
+	path->buffer = NULL;
+	path->length = 0;
+	path->capacity = 0;
+}
+
+int pathSet(struct pathBuilder *path, const char *newPath)
+{
+	assert(path != NULL);
+	assert(newPath != NULL);
+	size_t length = strlen(newPath);
+	if (pathReserve(&path->buffer, &path->capacity, length + 1,
+	                PATH_INITIAL_CAPACITY)) {
+		return EALLOC;
+	}
+	memcpy(path->buffer, newPath, length + 1);
+	path->length = length;
+	return ENOERR;
+}
+
+int pathPush(struct pathBuilder *path, const char *name, size_t *mark)
+{
+	assert(path != NULL);
+	assert(name != NULL);
+	assert(mark != NULL);
+	size_t nameLength = strlen(name);
+	if (pathReserve(&path->buffer, &path->capacity,
+	                path->length + nameLength + 2, PATH_INITIAL_CAPACITY)) {
+		return EALLOC;
+	}
+	*mark = path->length;
+	path->buffer[path->length++] = '/';
+	memcpy(path->buffer + path->length, name, nameLength + 1);
+	path->length += nameLength;
+	return ENOERR;
+}
+
+void pathPop(struct pathBuilder *path, size_t mark)
+{
+	assert(path != NULL);
+	assert(mark <= path->length);
+	path->length = mark;
+	if (path->buffer != NULL) {
+		path->buffer[mark] = '\0';
+	}
+}
+
+void pathArenaFree(struct pathArena *arena)
+{
+	assert(arena != NULL);
+	free(arena->buffer);
+	arena->buffer = NULL;
+	arena->used = 0;
+	arena->capacity = 0;
+}
+
+int pathArenaCopy(struct pathArena *arena, const char *name, size_t *offset)
+{
+	assert(arena != NULL);
+	assert(name != NULL);
+	assert(offset != NULL);
+	size_t size = strlen(name) + 1;
+	if (pathReserve(&arena->buffer, &arena->capacity, arena->used + size,
+	                ARENA_INITIAL_CAPACITY)) {
+		return EALLOC;
+	}
+	memcpy(arena->buffer + arena->used, name, size);
+	*offset = arena->used;
+	arena->used += size;
+	return ENOERR;
+}
+
+const char *pathArenaGet(const struct pathArena *arena, size_t offset)
+{
+	assert(arena != NULL);
+	assert(offset < arena->used);
+	return arena->buffer + offset;
+}
+
+void pathArenaReset(struct pathArena *arena, size_t mark)
+{
+	assert(arena != NULL);
+	assert(mark <= arena->used);
+	arena->used = mark;
+}
+
+void pathArenaResolve(const struct pathArena *arena, void *records,
+                      size_t count, size_t size, size_t offsetField,
+                      size_t nameField)
+{
+	assert(arena != NULL);
+	assert(records != NULL || count == 0);
+	for (size_t i = 0; i < count; i++) {
+		char *record = (char *)records + i * size;
+		size_t offset;
+		memcpy(&offset, record + offsetField, sizeof(offset));
+		const char *name = pathArenaGet(arena, offset);
+		memcpy(record + nameField, &name, sizeof(name));
+	}
+}
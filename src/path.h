@@ -0,0 +1,114 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PATH_H__
+#define __PATH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Paths of the entries of a traversal, without length limits.
+ *
+ * A path builder keeps the path of the current entry in a single buffer:
+ * descending into an entry appends its name and ascending pops it, so the
+ * path of a child is never rebuilt from scratch. The buffer only grows, once
+ * it's big enough for the deepest path no more memory is allocated.
+ *
+ * A name arena keeps copies of names that must outlive the directory
+ * iterator. It's used as a stack: the names copied after a mark are released
+ * at once by going back to it. Its buffer can move when it grows, so the
+ * names are referenced by offset and resolved with pathArenaGet.
+ *
+ * The records that keep names in an arena, like the changes of a plan,
+ * store their offsets while names can still be copied, and resolve them to
+ * pointers at once with pathArenaResolve when the arena is complete.
+ *
+ * A zeroed structure is a valid empty builder or arena.
+ */
+struct pathBuilder {
+	/* Current path, always NUL terminated once something is set. */
+	char *buffer;
+	size_t length;
+	size_t capacity;
+};
+
+struct pathArena {
+	char *buffer;
+	size_t used;
+	size_t capacity;
+};
+
+/**
+ * Returns a descriptive message associated with an error code.
+ */
+const char *pathGetError(int err);
+/**
+ * Returns the 64 bit FNV-1a hash of the first 'length' characters of
+ * 'path', the hash of the paths and names of the hash tables.
+ */
+uint64_t pathHash(const char *path, size_t length);
+/**
+ * Free the memory of a builder, which is left empty.
+ */
+void pathFree(struct pathBuilder *path);
+/**
+ * Replace the path of the builder with 'path'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int pathSet(struct pathBuilder *path, const char *newPath);
+/**
+ * Append the component 'name', separated by a slash. 'mark' receives the
+ * previous length, to restore it with pathPop.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int pathPush(struct pathBuilder *path, const char *name, size_t *mark);
+/**
+ * Remove the components appended since 'mark' was taken.
+ */
+void pathPop(struct pathBuilder *path, size_t mark);
+/**
+ * Free the memory of an arena, which is left empty.
+ */
+void pathArenaFree(struct pathArena *arena);
+/**
+ * Copy 'name' into the arena, 'offset' receives its position.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int pathArenaCopy(struct pathArena *arena, const char *name, size_t *offset);
+/**
+ * Returns the name copied at 'offset'. The pointer is only valid until the
+ * next copy.
+ */
+const char *pathArenaGet(const struct pathArena *arena, size_t offset);
+/**
+ * Release the names copied since the arena had 'mark' bytes used.
+ */
+void pathArenaReset(struct pathArena *arena, size_t mark);
+/**
+ * Set the name pointers of the 'count' records of 'size' bytes at
+ * 'records': the name offset of each one is the size_t at 'offsetField'
+ * and its pointer the const char * at 'nameField' (as given by offsetof).
+ * The pointers are valid until the next copy into the arena.
+ */
+void pathArenaResolve(const struct pathArena *arena, void *records,
+                      size_t count, size_t size, size_t offsetField,
+                      size_t nameField);
+
+#endif /* __PATH_H__ */
@@ -0,0 +1,264 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "plan.h"
+#include "path.h"
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+#define ERRMSG_MAX 1025
+#define ENTRIES_INITIAL_CAPACITY 64
+
+enum {
+    ENOERR = 0,
+    EALLOC
+};
+
+struct planChange {
+	/* Offset of the path in the arena until the plan is sorted, then its
+	   position among the changes of its directory. */
+	size_t pathOffset;
+	size_t nameOffset;
+	size_t order;
+	/* Path, only set by planSort. */
+	const char *path;
+	uint32_t before;
+	uint32_t after;
+};
+
+struct plan {
+	struct planChange *changes;
+	size_t size;
+	size_t capacity;
+	struct pathArena paths;
+	/* First error adding changes, the plan misses them. */
+	int error;
+	/* Protects the plan while others are merged into it. */
+	pthread_mutex_t lock;
+};
+
+static _Thread_local char errmsg[ERRMSG_MAX] = {0};
+
+/**
+ * Returns the position of the name in 'path': after its last slash,
+ * ignoring the trailing ones, or 0 if it has no parent directory.
+ */
+size_t planNameOffset(const char *path);
+/**
+ * Make room for 'size' more changes.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int planReserve(struct plan *plan, size_t size);
+/**
+ * qsort comparison of two changes, by parent directory and then by order.
+ */
+int planCompare(const void *a, const void *b);
+
+
+size_t planNameOffset(const char *path)
+{
+	size_t end = strlen(path);
+	while (end > 1 && path[end - 1] == '/') {
+		end--;
+	}
+	size_t offset = end;
+	while (offset > 0 && path[offset - 1] != '/') {
+		offset--;
+	}
+	/* A path without a name, like "/", is opened as a whole. */
+	return offset == end ? 0 : offset;
+}
+
+int planReserve(struct plan *plan, size_t size)
+{
+	if (plan->size + size <= plan->capacity) {
+		return ENOERR;
+	}
+	size_t newCapacity = plan->capacity > 0 ? plan->capacity :
+	                     ENTRIES_INITIAL_CAPACITY;
+	while (newCapacity < plan->size + size) {
+		newCapacity *= 2;
+	}
+	struct planChange *newChanges = realloc(plan->changes,
+	                                        newCapacity *
+	                                        sizeof(struct planChange));
+	if (newChanges == NULL) {
+		return EALLOC;
+	}
+	plan->changes = newChanges;
+	plan->capacity = newCapacity;
+	return ENOERR;
+}
+
+int planCompare(const void *a, const void *b)
+{
+	const struct planChange *changeA = a;
+	const struct planChange *changeB = b;
+	size_t len = changeA->nameOffset < changeB->nameOffset ?
+	             changeA->nameOffset : changeB->nameOffset;
+	int cmp = memcmp(changeA->path, changeB->path, len);
+	if (cmp == 0 && changeA->nameOffset != changeB->nameOffset) {
+		cmp = changeA->nameOffset < changeB->nameOffset ? -1 : 1;
+	}
+	if (cmp == 0 && changeA->order != changeB->order) {
+		cmp = changeA->order < changeB->order ? -1 : 1;
+	}
+	return cmp;
+}
+
+
+const char *planGetError(int err)
+{
+	switch (err) {
+	case ENOERR:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "No error occurred");
+		break;
+	case EALLOC:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error allocating memory: %s",
+		         strerror(errno));
+		break;
+	default:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Unknown error");
+	}
+	return errmsg;
+}
+
+int planCreate(struct plan **plan)
+{
+	assert(plan != NULL);
+	*plan = calloc(1, sizeof(struct plan));
+	if (*plan == NULL) {
+		return EALLOC;
+	}
+	pthread_mutex_init(&(*plan)->lock, NULL);
+	return ENOERR;
+}
+
+void planDestroy(struct plan *plan)
+{
+	if (plan == NULL) {
+		return;
+	}
+	free(plan->changes);
+	pathArenaFree(&plan->paths);
+	pthread_mutex_destroy(&plan->lock);
+	free(plan);
+}
+
+int planAdd(struct plan *plan, const char *path, uint32_t before,
+            uint32_t after)
+{
+	assert(plan != NULL);
+	assert(path != NULL);
+	if (planReserve(plan, 1)) {
+		plan->error = plan->error ? plan->error : EALLOC;
+		return EALLOC;
+	}
+	struct planChange *change = &plan->changes[plan->size];
+	if (pathArenaCopy(&plan->paths, path, &change->pathOffset)) {
+		plan->error = plan->error ? plan->error : EALLOC;
+		return EALLOC;
+	}
+	change->nameOffset = planNameOffset(path);
+	change->order = plan->size;
+	change->path = NULL;
+	change->before = before;
+	change->after = after;
+	plan->size++;
+	return ENOERR;
+}
+
+int planMerge(struct plan *dst, struct plan *src)
+{
+	assert(dst != NULL);
+	assert(src != NULL);
+	pthread_mutex_lock(&dst->lock);
+	int planErrno = planReserve(dst, src->size);
+	for (size_t i = 0; i < src->size && !planErrno; i++) {
+		struct planChange *change = &dst->changes[dst->size];
+		*change = src->changes[i];
+		planErrno = pathArenaCopy(&dst->paths,
+		                          pathArenaGet(&src->paths,
+		                                       src->changes[i].pathOffset),
+		                          &change->pathOffset);
+		change->order = dst->size;
+		dst->size += !planErrno;
+	}
+	planErrno = planErrno ? EALLOC : ENOERR;
+	dst->error = dst->error ? dst->error :
+	             src->error ? src->error : planErrno;
+	pthread_mutex_unlock(&dst->lock);
+	src->size = 0;
+	src->error = ENOERR;
+	pathArenaReset(&src->paths, 0);
+	return planErrno;
+}
+
+int planGetStatus(const struct plan *plan)
+{
+	assert(plan != NULL);
+	return plan->error;
+}
+
+void planSort(struct plan *plan)
+{
+	assert(plan != NULL);
+	/* Nothing else is copied into the arena. */
+	pathArenaResolve(&plan->paths, plan->changes, plan->size,
+	                 sizeof(struct planChange),
+	                 offsetof(struct planChange, pathOffset),
+	                 offsetof(struct planChange, path));
+	qsort(plan->changes, plan->size, sizeof(struct planChange), planCompare);
+}
+
+size_t planSize(const struct plan *plan)
+{
+	assert(plan != NULL);
+	return plan->size;
+}
+
+void planGet(const struct plan *plan, size_t index, struct planEntry *entry)
+{
+	assert(plan != NULL);
+	assert(index < plan->size);
+	assert(entry != NULL);
+	const struct planChange *change = &plan->changes[index];
+	entry->path = change->path;
+	entry->nameOffset = change->nameOffset;
+	entry->before = change->before;
+	entry->after = change->after;
+}
+
+int planSameParent(const struct plan *plan, size_t a, size_t b)
+{
+	assert(plan != NULL);
+	assert(a < plan->size && b < plan->size);
+	const struct planChange *changeA = &plan->changes[a];
+	const struct planChange *changeB = &plan->changes[b];
+	return changeA->nameOffset == changeB->nameOffset &&
+	       memcmp(changeA->path, changeB->path, changeA->nameOffset) == 0;
+}
@@ -0,0 +1,104 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PLAN_H__
+#define __PLAN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Attribute changes collected by a traversal to be applied later, in the
+ * order of the directory entries they rewrite.
+ *
+ * The attributes of a file are stored in its directory entry, in the
+ * sectors of its parent directory. Once sorted, the changes are grouped by
+ * parent directory, and the changes of a directory keep the order they
+ * were added in, which for a traversal is the order of the entries on
+ * disk. Each directory is then written in a single sequential pass,
+ * instead of interleaving its writes with the ones of its subdirectories.
+ */
+struct plan;
+
+/**
+ * A planned change.
+ */
+struct planEntry {
+	const char *path;
+	/* Position of the name in 'path', the parent directory is the part
+	   before it ("" for the current directory). */
+	size_t nameOffset;
+	/* Attributes read when the change was planned, and the ones wanted. */
+	uint32_t before;
+	uint32_t after;
+};
+
+/**
+ * Returns a descriptive message associated with an error code.
+ */
+const char *planGetError(int err);
+/**
+ * Create an empty plan.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int planCreate(struct plan **plan);
+/**
+ * Free a plan.
+ */
+void planDestroy(struct plan *plan);
+/**
+ * Add the change of the attributes of 'path' from 'before' to 'after'.
+ * The errors are kept until planGetStatus.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int planAdd(struct plan *plan, const char *path, uint32_t before,
+            uint32_t after);
+/**
+ * Move the changes of 'src' after the ones of 'dst', leaving 'src' empty.
+ * Several threads can merge into the same plan at once. The errors, and
+ * the ones kept by 'src', are kept by 'dst' until planGetStatus.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int planMerge(struct plan *dst, struct plan *src);
+/**
+ * Returns 0 if every change was added to the plan, the first error of
+ * planAdd or planMerge otherwise.
+ */
+int planGetStatus(const struct plan *plan);
+/**
+ * Sort the changes by parent directory, keeping the order they were added
+ * in for the changes of the same directory.
+ */
+void planSort(struct plan *plan);
+/**
+ * Returns the number of changes.
+ */
+size_t planSize(const struct plan *plan);
+/**
+ * Fill 'entry' with the change 'index' of a sorted plan. The path is valid
+ * until the plan changes.
+ */
+void planGet(const struct plan *plan, size_t index, struct planEntry *entry);
+/**
+ * Returns !0 if the changes 'a' and 'b' of a sorted plan have the same
+ * parent directory.
+ */
+int planSameParent(const struct plan *plan, size_t a, size_t b);
+
+#endif /* __PLAN_H__ */
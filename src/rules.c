@@ -0,0 +1,484 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include "rules.h"
+#include "dosfs.h"
+#include "bool.h"
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <ctype.h>
+#include <fnmatch.h>
+
+#define ERRMSG_MAX 1025
+#define STATES_INITIAL_CAPACITY 16
+/* Node of the anchored rules, the state of the FILE directories. */
+#define RULES_ROOT 0
+/* Node whose children are the rules of names, tried at any depth. */
+#define RULES_NAMES 1
+/* Attribute bits a rule can change. */
+#define RULES_ATTR_BITS 32
+
+enum {
+    ENOERR = 0,
+    EALLOC,
+    EREAD,
+    ERULE
+};
+
+/* Path component of the trie, reached from its parent by 'glob'. */
+struct rulesNode {
+	/* Pattern of the component, NULL for RULES_ROOT and RULES_NAMES. */
+	char *glob;
+	/* The pattern has no wildcards, it's compared with strcasecmp. */
+	int literal;
+	size_t *children;
+	size_t childrenSize;
+	/* Rules whose GLOB ends in this node, by their position in the file. */
+	size_t *rules;
+	size_t rulesSize;
+};
+
+struct rules {
+	struct rulesNode *nodes;
+	size_t nodesSize;
+	struct rulesChange *changes;
+	size_t changesSize;
+};
+
+static _Thread_local char errmsg[ERRMSG_MAX] = {0};
+
+/**
+ * Parse the changes 'text', like "+H-A", into 'change'.
+ * Returns 0 on success, !0 if they aren't valid.
+ */
+int rulesParseChanges(const char *text, struct rulesChange *change);
+/**
+ * Add the rule 'glob' with the change 'change', 'glob' is modified.
+ * Returns 0 on success, !0 if the rule isn't valid or an error happens.
+ */
+int rulesAdd(struct rules *rules, char *glob,
+             const struct rulesChange *change);
+/**
+ * Returns the child of the node 'parent' with the pattern 'glob', adding it
+ * if there isn't one, or SIZE_MAX if there is no memory.
+ */
+size_t rulesChild(struct rules *rules, size_t parent, const char *glob);
+/**
+ * Append 'item' to the array 'items' of 'size' elements.
+ * Returns 0 on success, !0 if there is no memory.
+ */
+int rulesAppend(size_t **items, size_t *size, size_t item);
+/**
+ * Returns !0 if the pattern of 'node' matches 'name'.
+ */
+int rulesNodeMatches(const struct rulesNode *node, const char *name);
+/**
+ * Add to 'change' the rules of the children of 'node' that match 'name',
+ * 'owners' has the position + 1 of the rule that decided each attribute.
+ */
+void rulesMatchNode(const struct rules *rules, size_t node, const char *name,
+                    struct rulesChange *change, size_t *owners);
+/**
+ * Append 'node' to 'states'.
+ * Returns 0 on success, !0 if there is no memory.
+ */
+int rulesStatesPush(struct rulesStates *states, size_t node);
+
+
+int rulesParseChanges(const char *text, struct rulesChange *change)
+{
+	change->add = 0;
+	change->remove = 0;
+	char sign = '\0';
+	for (const char *c = text; *c != '\0'; c++) {
+		if (*c == '+' || *c == '-') {
+			if (c[1] == '\0' || c[1] == '+' || c[1] == '-') {
+				return ERULE;
+			}
+			sign = *c;
+			continue;
+		}
+		uint32_t attr = dosfsParseAttr(*c);
+		if (sign == '\0' || attr == 0) {
+			return ERULE;
+		}
+		if (sign == '+') {
+			change->add |= attr;
+		} else {
+			change->remove |= attr;
+		}
+	}
+	/* The same attribute set and cleared by one rule. */
+	return (change->add & change->remove) != 0 ? ERULE : ENOERR;
+}
+
+int rulesAdd(struct rules *rules, char *glob,
+             const struct rulesChange *change)
+{
+	size_t node = RULES_NAMES;
+	char *component = glob;
+	if (strchr(glob, '/') != NULL) {
+		node = RULES_ROOT;
+		component += glob[0] == '/';
+	}
+	while (TRUE) {
+		char *slash = strchr(component, '/');
+		if (slash != NULL) {
+			*slash = '\0';
+		}
+		if (component[0] == '\0') {
+			return ERULE;
+		}
+		node = rulesChild(rules, node, component);
+		if (node == SIZE_MAX) {
+			return EALLOC;
+		}
+		if (slash == NULL) {
+			break;
+		}
+		component = slash + 1;
+	}
+	struct rulesChange *newChanges = realloc(rules->changes,
+	                                         sizeof(struct rulesChange) *
+	                                         (rules->changesSize + 1));
+	if (newChanges == NULL) {
+		return EALLOC;
+	}
+	rules->changes = newChanges;
+	struct rulesNode *last = &rules->nodes[node];
+	if (rulesAppend(&last->rules, &last->rulesSize, rules->changesSize)) {
+		return EALLOC;
+	}
+	rules->changes[rules->changesSize++] = *change;
+	return ENOERR;
+}
+
+size_t rulesChild(struct rules *rules, size_t parent, const char *glob)
+{
+	const struct rulesNode *node = &rules->nodes[parent];
+	for (size_t i = 0; i < node->childrenSize; i++) {
+		if (strcasecmp(rules->nodes[node->children[i]].glob, glob) == 0) {
+			return node->children[i];
+		}
+	}
+	struct rulesNode *newNodes = realloc(rules->nodes,
+	                                     sizeof(struct rulesNode) *
+	                                     (rules->nodesSize + 1));
+	if (newNodes == NULL) {
+		return SIZE_MAX;
+	}
+	rules->nodes = newNodes;
+	struct rulesNode *child = &rules->nodes[rules->nodesSize];
+	memset(child, 0, sizeof(struct rulesNode));
+	child->glob = strdup(glob);
+	if (child->glob == NULL) {
+		return SIZE_MAX;
+	}
+	child->literal = strpbrk(glob, "*?[\\") == NULL;
+	struct rulesNode *parentNode = &rules->nodes[parent];
+	if (rulesAppend(&parentNode->children, &parentNode->childrenSize,
+	                rules->nodesSize)) {
+		free(child->glob);
+		return SIZE_MAX;
+	}
+	return rules->nodesSize++;
+}
+
+int rulesAppend(size_t **items, size_t *size, size_t item)
+{
+	size_t *newItems = realloc(*items, sizeof(size_t) * (*size + 1));
+	if (newItems == NULL) {
+		return EALLOC;
+	}
+	*items = newItems;
+	(*items)[(*size)++] = item;
+	return ENOERR;
+}
+
+int rulesNodeMatches(const struct rulesNode *node, const char *name)
+{
+	/* FAT names don't have case, and the short ones are upper case. */
+	return node->literal ? strcasecmp(node->glob, name) == 0 :
+	       fnmatch(node->glob, name, FNM_CASEFOLD) == 0;
+}
+
+void rulesMatchNode(const struct rules *rules, size_t node, const char *name,
+                    struct rulesChange *change, size_t *owners)
+{
+	const struct rulesNode *parent = &rules->nodes[node];
+	for (size_t i = 0; i < parent->childrenSize; i++) {
+		const struct rulesNode *child = &rules->nodes[parent->children[i]];
+		if (child->rulesSize == 0 || !rulesNodeMatches(child, name)) {
+			continue;
+		}
+		for (size_t j = 0; j < child->rulesSize; j++) {
+			size_t rule = child->rules[j];
+			const struct rulesChange *ruleChange = &rules->changes[rule];
+			uint32_t attrs = ruleChange->add | ruleChange->remove;
+			for (size_t bit = 0; bit < RULES_ATTR_BITS; bit++) {
+				uint32_t attr = (uint32_t)1 << bit;
+				if ((attrs & attr) == 0 || owners[bit] > rule) {
+					continue;
+				}
+				owners[bit] = rule + 1;
+				change->add = (change->add & ~attr) | (ruleChange->add & attr);
+				change->remove = (change->remove & ~attr) |
+				                 (ruleChange->remove & attr);
+			}
+		}
+	}
+}
+
+int rulesStatesPush(struct rulesStates *states, size_t node)
+{
+	if (states->size == states->capacity) {
+		size_t newCapacity = states->capacity > 0 ? states->capacity * 2 :
+		                     STATES_INITIAL_CAPACITY;
+		size_t *newItems = realloc(states->items, sizeof(size_t) * newCapacity);
+		if (newItems == NULL) {
+			return EALLOC;
+		}
+		states->items = newItems;
+		states->capacity = newCapacity;
+	}
+	states->items[states->size++] = node;
+	return ENOERR;
+}
+
+
+const char *rulesGetError(int err)
+{
+	switch (err) {
+	case ENOERR:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "No error occurred");
+		break;
+	case EALLOC:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error allocating memory: %s",
+		         strerror(errno));
+		break;
+	case EREAD:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error reading the rules: %s",
+		         strerror(errno));
+		break;
+	case ERULE:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Invalid rule");
+		break;
+	default:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Unknown error");
+	}
+	return errmsg;
+}
+
+int rulesLoad(const char *path, struct rules **rules, size_t *line)
+{
+	assert(path != NULL);
+	assert(rules != NULL);
+	assert(line != NULL);
+	*line = 0;
+	*rules = calloc(1, sizeof(struct rules));
+	if (*rules == NULL) {
+		return EALLOC;
+	}
+	/* RULES_ROOT and RULES_NAMES. */
+	(*rules)->nodes = calloc(2, sizeof(struct rulesNode));
+	if ((*rules)->nodes == NULL) {
+		rulesDestroy(*rules);
+		*rules = NULL;
+		return EALLOC;
+	}
+	(*rules)->nodesSize = 2;
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		rulesDestroy(*rules);
+		*rules = NULL;
+		return EREAD;
+	}
+	char *text = NULL;
+	size_t textSize = 0;
+	int rulesErrno = ENOERR;
+	while (!rulesErrno && getline(&text, &textSize, file) != -1) {
+		(*line)++;
+		char *start = text;
+		while (isspace((unsigned char)*start)) {
+			start++;
+		}
+		char *end = start + strlen(start);
+		while (end > start && isspace((unsigned char)end[-1])) {
+			end--;
+		}
+		*end = '\0';
+		if (*start == '\0' || *start == '#') {
+			continue;
+		}
+		/* The changes are the last field, the rest is the glob. */
+		char *changes = end;
+		while (changes > start && !isspace((unsigned char)changes[-1])) {
+			changes--;
+		}
+		char *globEnd = changes;
+		while (globEnd > start && isspace((unsigned char)globEnd[-1])) {
+			globEnd--;
+		}
+		if (globEnd == start) {
+			rulesErrno = ERULE;
+			break;
+		}
+		*globEnd = '\0';
+		struct rulesChange change;
+		rulesErrno = rulesParseChanges(changes, &change);
+		if (!rulesErrno) {
+			rulesErrno = rulesAdd(*rules, start, &change);
+		}
+	}
+	if (!rulesErrno && ferror(file)) {
+		rulesErrno = EREAD;
+	}
+	free(text);
+	fclose(file);
+	if (rulesErrno) {
+		rulesDestroy(*rules);
+		*rules = NULL;
+		return rulesErrno;
+	}
+	*line = 0;
+	return ENOERR;
+}
+
+void rulesDestroy(struct rules *rules)
+{
+	if (rules == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < rules->nodesSize; i++) {
+		free(rules->nodes[i].glob);
+		free(rules->nodes[i].children);
+		free(rules->nodes[i].rules);
+	}
+	free(rules->nodes);
+	free(rules->changes);
+	free(rules);
+}
+
+int rulesRoot(const struct rules *rules, struct rulesStates *states)
+{
+	assert(rules != NULL);
+	assert(states != NULL);
+	return rulesStatesPush(states, RULES_ROOT);
+}
+
+int rulesWalk(const struct rules *rules, const char *path,
+              struct rulesStates *states)
+{
+	assert(rules != NULL);
+	assert(path != NULL);
+	assert(states != NULL);
+	size_t first = states->size;
+	if (rulesStatesPush(states, RULES_ROOT)) {
+		return EALLOC;
+	}
+	char *name = NULL;
+	const char *component = path;
+	while (*component != '\0' && states->size > first) {
+		size_t length = strcspn(component, "/");
+		if (length > 0) {
+			char *newName = realloc(name, length + 1);
+			if (newName == NULL) {
+				free(name);
+				return EALLOC;
+			}
+			name = newName;
+			memcpy(name, component, length);
+			name[length] = '\0';
+			size_t count = states->size - first;
+			if (rulesDescend(rules, states, first, count, name)) {
+				free(name);
+				return EALLOC;
+			}
+			/* The states of the component replace the ones of its parent. */
+			size_t newCount = states->size - first - count;
+			memmove(states->items + first, states->items + first + count,
+			        sizeof(size_t) * newCount);
+			states->size = first + newCount;
+		}
+		component += length + (component[length] == '/');
+	}
+	free(name);
+	return ENOERR;
+}
+
+int rulesDescend(const struct rules *rules, struct rulesStates *states,
+                 size_t first, size_t count, const char *name)
+{
+	assert(rules != NULL);
+	assert(states != NULL);
+	assert(first + count <= states->size);
+	assert(name != NULL);
+	for (size_t i = first; i < first + count; i++) {
+		/* The items can move while the states are appended. */
+		const struct rulesNode *node = &rules->nodes[states->items[i]];
+		for (size_t j = 0; j < node->childrenSize; j++) {
+			size_t child = node->children[j];
+			if (rules->nodes[child].childrenSize > 0 &&
+			        rulesNodeMatches(&rules->nodes[child], name) &&
+			        rulesStatesPush(states, child)) {
+				return EALLOC;
+			}
+		}
+	}
+	return ENOERR;
+}
+
+void rulesMatch(const struct rules *rules, const struct rulesStates *states,
+                size_t first, size_t count, const char *name,
+                struct rulesChange *change)
+{
+	assert(rules != NULL);
+	assert(states != NULL);
+	assert(first + count <= states->size);
+	assert(name != NULL);
+	assert(change != NULL);
+	size_t owners[RULES_ATTR_BITS] = {0};
+	change->add = 0;
+	change->remove = 0;
+	rulesMatchNode(rules, RULES_NAMES, name, change, owners);
+	for (size_t i = first; i < first + count; i++) {
+		rulesMatchNode(rules, states->items[i], name, change, owners);
+	}
+}
+
+void rulesStatesFree(struct rulesStates *states)
+{
+	assert(states != NULL);
+	free(states->items);
+	states->items = NULL;
+	states->size = 0;
+	states->capacity = 0;
+}
@@ -0,0 +1,112 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __RULES_H__
+#define __RULES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Ordered attribute policies of a rules file, applied to a whole tree in a
+ * single traversal.
+ *
+ * Every line of the file is a rule "GLOB CHANGES", CHANGES like "+H" or
+ * "+R-A" (the last field of the line, so GLOB can contain spaces). Empty
+ * lines and lines starting with '#' are ignored. A GLOB without '/'
+ * matches the entry name at any depth, like "*.sys"; a GLOB with '/'
+ * matches the path relative to FILE one component at a time, like
+ * "config/?*.ini", and a leading '/' anchors a single name to FILE, like
+ * "/autorun.inf". The names are compared ignoring case, as FAT does. When
+ * several rules match an entry the later ones win for the attributes they
+ * change.
+ *
+ * The anchored rules are compiled into a trie of path components: a
+ * directory is described by the trie nodes its path reached, its states, so
+ * each entry is only compared with the children of those nodes and with
+ * the name rules, never with the whole list.
+ */
+struct rules;
+
+/**
+ * Attributes to set and to clear in an entry.
+ */
+struct rulesChange {
+	uint32_t add;
+	uint32_t remove;
+};
+
+/**
+ * Stack of state sets of the directories of a traversal: the states of a
+ * directory are a range of 'items', appended after the ones of its parent.
+ */
+struct rulesStates {
+	size_t *items;
+	size_t size;
+	size_t capacity;
+};
+
+/**
+ * Returns a descriptive message associated with an error code.
+ */
+const char *rulesGetError(int err);
+/**
+ * Read and compile the rules file 'path'. If a rule isn't valid 'line'
+ * receives its line number.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int rulesLoad(const char *path, struct rules **rules, size_t *line);
+/**
+ * Free the rules.
+ */
+void rulesDestroy(struct rules *rules);
+/**
+ * Append to 'states' the states of the FILE directories.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int rulesRoot(const struct rules *rules, struct rulesStates *states);
+/**
+ * Append to 'states' the states of the directory 'path', relative to its
+ * FILE directory ("" for the FILE directory itself).
+ * Returns 0 on success, !0 if an error happens.
+ */
+int rulesWalk(const struct rules *rules, const char *path,
+              struct rulesStates *states);
+/**
+ * Append to 'states' the states of the subdirectory 'name' of the directory
+ * whose states are the 'count' items of 'states' from 'first'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int rulesDescend(const struct rules *rules, struct rulesStates *states,
+                 size_t first, size_t count, const char *name);
+/**
+ * Fill 'change' with the combined change of the rules that match the entry
+ * 'name' of the directory whose states are the 'count' items of 'states'
+ * from 'first'. Without states only the rules of names are tried.
+ */
+void rulesMatch(const struct rules *rules, const struct rulesStates *states,
+                size_t first, size_t count, const char *name,
+                struct rulesChange *change);
+/**
+ * Free the memory of a stack of states.
+ */
+void rulesStatesFree(struct rulesStates *states);
+
+#endif /* __RULES_H__ */
@@ -0,0 +1,844 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "server.h"
+#include "dosfs.h"
+#include "output.h"
+#include "bool.h"
+#include "path.h"
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+
+#define ERRMSG_MAX 1025
+/* Maximum simultaneous clients. */
+#define SERVER_CLIENTS_MAX 64
+/* Directories kept open between requests. */
+#define SERVER_DIR_CACHE_SIZE 64
+/* Time a directory is kept open without requests, in ms, so the file
+   systems of idle directories can be unmounted. */
+#define SERVER_DIR_IDLE 2000
+/* Longest request line, including the '\n'. */
+#define SERVER_LINE_MAX 8192
+/* Size of the reads of the requests. */
+#define SERVER_READ_SIZE 65536
+/* Longest response line, without the path. */
+#define SERVER_RESPONSE_MAX (ERRMSG_MAX + 64)
+/* Responses queued for a connection above which its requests aren't read
+   until the client reads them. */
+#define SERVER_OUT_MAX (SERVER_READ_SIZE * 16)
+
+enum {
+    ENOERR = 0,
+    EALLOC,
+    ESOCKET,
+    ECONNECT,
+    EWRITE,
+    EREAD,
+    ETHREAD,
+    EREQUEST
+};
+
+/* A connection: the requests not processed yet and the responses not
+   written yet, from 'outSent', both buffers are reused for the whole
+   connection. 'closing' is set when the client ends its requests, the
+   connection is closed once its responses are written. */
+struct serverConn {
+	int fd;
+	char *in;
+	size_t inSize;
+	char *out;
+	size_t outSize;
+	size_t outSent;
+	size_t outCapacity;
+	int closing;
+};
+
+/* An open directory of the cache, 'used' is the last request that used it,
+   at the time 'usedAt', and 'fd' is -1 if the entry is free. */
+struct serverDir {
+	char *path;
+	uint64_t hash;
+	int fd;
+	unsigned long used;
+	long usedAt;
+};
+
+struct serverClient {
+	int fd;
+	int verbose;
+	pthread_t reader;
+	char *out;
+	size_t outSize;
+	size_t outCapacity;
+	/* Written by the reader, read after joining it. */
+	unsigned long failed;
+	int readerErrno;
+};
+
+static _Thread_local char errmsg[ERRMSG_MAX] = {0};
+static volatile sig_atomic_t serverStop = FALSE;
+static struct serverDir serverDirs[SERVER_DIR_CACHE_SIZE];
+static unsigned long serverRequests = 0;
+
+/**
+ * Fill the address of the socket 'socketPath'.
+ * Returns 0 on success, !0 if the path is too long.
+ */
+int serverAddress(const char *socketPath, struct sockaddr_un *addr);
+/**
+ * Signal handler that stops the server loop.
+ */
+void serverSignal(int signum);
+/**
+ * Returns the monotonic time in ms.
+ */
+long serverNow(void);
+/**
+ * Get an open descriptor of the directory of the first 'size' characters of
+ * 'path' from the cache, opening it if it isn't in the cache. 'dir' is NULL
+ * if there isn't memory to cache the directory.
+ * Returns 0 on success, !0 (a dosfs error) if the directory can't be opened.
+ */
+int serverDirGet(const char *path, size_t size, struct serverDir **dir);
+/**
+ * Close the directory 'dir' of the cache and free its entry.
+ */
+void serverDirDrop(struct serverDir *dir);
+/**
+ * Close every directory of the cache.
+ */
+void serverDirClear(void);
+/**
+ * Close the directories of the cache not used since SERVER_DIR_IDLE ms
+ * before 'now'.
+ * Returns the time in ms until the next one expires, -1 if the cache is
+ * empty.
+ */
+int serverDirExpire(long now);
+/**
+ * Open the file 'path', the directory of the file is opened through the
+ * cache.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int serverOpen(const char *path, int *fd);
+/**
+ * Parse the attribute changes 'changes', like "+RH-S^A".
+ * Returns 0 on success, !0 if they aren't valid.
+ */
+int serverParseChanges(const char *changes, uint32_t *set, uint32_t *clear,
+                       uint32_t *toggle);
+/**
+ * Append 'size' bytes of 'data' to the buffer 'buf'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int serverAppend(char **buf, size_t *bufSize, size_t *bufCapacity,
+                 const char *data, size_t size);
+/**
+ * Process the request 'line' and append its response to the output
+ * buffer of 'conn'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int serverRequest(struct serverConn *conn, char *line);
+/**
+ * Write the whole 'size' bytes of 'data' to the socket 'fd'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int serverWrite(int fd, const char *data, size_t size);
+/**
+ * Read the available requests of 'conn', process the complete ones and
+ * queue their responses.
+ * Returns 0 if the connection stays open, !0 if it must be closed.
+ */
+int serverConnRead(struct serverConn *conn);
+/**
+ * Write the queued responses of 'conn' until the socket is full.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int serverConnFlush(struct serverConn *conn);
+/**
+ * Close a connection and free its buffers.
+ */
+void serverConnClose(struct serverConn *conn);
+/**
+ * Thread of the client that prints the responses of the server.
+ */
+void *serverClientReader(void *data);
+/**
+ * Send the request 'line' of 'size' bytes, the requests are sent in
+ * batches.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int serverClientSend(struct serverClient *client, const char *line,
+                     size_t size);
+
+
+int serverAddress(const char *socketPath, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return ESOCKET;
+	}
+	strcpy(addr->sun_path, socketPath);
+	return ENOERR;
+}
+
+void serverSignal(int signum)
+{
+	(void)signum;
+	serverStop = TRUE;
+}
+
+long serverNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int serverDirGet(const char *path, size_t size, struct serverDir **dir)
+{
+	uint64_t hash = pathHash(path, size);
+	struct serverDir *victim = &serverDirs[0];
+	for (size_t i = 0; i < SERVER_DIR_CACHE_SIZE; i++) {
+		struct serverDir *entry = &serverDirs[i];
+		if (entry->fd != -1 && entry->hash == hash &&
+		        strncmp(entry->path, path, size) == 0 &&
+		        entry->path[size] == '\0') {
+			entry->used = serverRequests;
+			entry->usedAt = serverNow();
+			*dir = entry;
+			return ENOERR;
+		}
+		if (victim->fd != -1 &&
+		        (entry->fd == -1 || entry->used < victim->used)) {
+			victim = entry;
+		}
+	}
+	char *newPath = strndup(path, size);
+	if (newPath == NULL) {
+		*dir = NULL;
+		return ENOERR;
+	}
+	int fd = -1;
+	int dosfsErrno = dosfsOpen(newPath, &fd);
+	if (dosfsErrno) {
+		free(newPath);
+		return dosfsErrno;
+	}
+	if (victim->fd != -1) {
+		serverDirDrop(victim);
+	}
+	victim->path = newPath;
+	victim->hash = hash;
+	victim->fd = fd;
+	victim->used = serverRequests;
+	victim->usedAt = serverNow();
+	*dir = victim;
+	return ENOERR;
+}
+
+void serverDirDrop(struct serverDir *dir)
+{
+	dosfsClose(dir->fd);
+	free(dir->path);
+	dir->path = NULL;
+	dir->fd = -1;
+}
+
+void serverDirClear(void)
+{
+	for (size_t i = 0; i < SERVER_DIR_CACHE_SIZE; i++) {
+		if (serverDirs[i].fd != -1) {
+			serverDirDrop(&serverDirs[i]);
+		}
+	}
+}
+
+int serverDirExpire(long now)
+{
+	long next = -1;
+	for (size_t i = 0; i < SERVER_DIR_CACHE_SIZE; i++) {
+		if (serverDirs[i].fd == -1) {
+			continue;
+		}
+		long left = serverDirs[i].usedAt + SERVER_DIR_IDLE - now;
+		if (left <= 0) {
+			serverDirDrop(&serverDirs[i]);
+		} else if (next == -1 || left < next) {
+			next = left;
+		}
+	}
+	return (int)next;
+}
+
+int serverOpen(const char *path, int *fd)
+{
+	const char *slash = strrchr(path, '/');
+	if (slash == NULL || slash[1] == '\0') {
+		/* Files of the working directory and paths ending in '/' aren't
+		   worth caching. */
+		return dosfsOpen(path, fd);
+	}
+	size_t dirSize = slash == path ? 1 : (size_t)(slash - path);
+	struct serverDir *dir = NULL;
+	int dosfsErrno = serverDirGet(path, dirSize, &dir);
+	if (dosfsErrno || dir == NULL) {
+		return dosfsErrno ? dosfsErrno : dosfsOpen(path, fd);
+	}
+	dosfsErrno = dosfsOpenAt(dir->fd, slash + 1, fd);
+	if (dosfsErrno) {
+		/* The directory could have been replaced since it was cached,
+		   retry once with the current one. */
+		serverDirDrop(dir);
+		dosfsErrno = serverDirGet(path, dirSize, &dir);
+		if (dosfsErrno || dir == NULL) {
+			return dosfsErrno ? dosfsErrno : dosfsOpen(path, fd);
+		}
+		dosfsErrno = dosfsOpenAt(dir->fd, slash + 1, fd);
+	}
+	return dosfsErrno;
+}
+
+int serverParseChanges(const char *changes, uint32_t *set, uint32_t *clear,
+                       uint32_t *toggle)
+{
+	*set = *clear = *toggle = 0;
+	uint32_t *current = NULL;
+	for (const char *c = changes; *c != '\0'; c++) {
+		if (*c == '+') {
+			current = set;
+			continue;
+		}
+		if (*c == '-') {
+			current = clear;
+			continue;
+		}
+		if (*c == '^') {
+			current = toggle;
+			continue;
+		}
+		uint32_t attr = dosfsParseAttr(*c);
+		if (current == NULL || attr == 0) {
+			return EREQUEST;
+		}
+		*current |= attr;
+	}
+	return (*set | *clear | *toggle) == 0 ? EREQUEST : ENOERR;
+}
+
+int serverAppend(char **buf, size_t *bufSize, size_t *bufCapacity,
+                 const char *data, size_t size)
+{
+	if (*bufSize + size > *bufCapacity) {
+		size_t newCapacity = *bufCapacity > 0 ? *bufCapacity : 4096;
+		while (*bufSize + size > newCapacity) {
+			newCapacity *= 2;
+		}
+		char *newBuf = realloc(*buf, newCapacity);
+		if (newBuf == NULL) {
+			return EALLOC;
+		}
+		*buf = newBuf;
+		*bufCapacity = newCapacity;
+	}
+	memcpy(*buf + *bufSize, data, size);
+	*bufSize += size;
+	return ENOERR;
+}
+
+int serverRequest(struct serverConn *conn, char *line)
+{
+	char response[SERVER_RESPONSE_MAX];
+	int responseLen = 0;
+	const char *path = NULL;
+	uint32_t set = 0;
+	uint32_t clear = 0;
+	uint32_t toggle = 0;
+	int modify = FALSE;
+	int requestErrno = ENOERR;
+	serverRequests++;
+	if (strncmp(line, "GET ", 4) == 0) {
+		path = line + 4;
+	} else if (strncmp(line, "MOD ", 4) == 0) {
+		char *changes = line + 4;
+		char *space = strchr(changes, ' ');
+		if (space != NULL) {
+			*space = '\0';
+			path = space + 1;
+			modify = TRUE;
+			requestErrno = serverParseChanges(changes, &set, &clear, &toggle);
+		}
+	}
+	if (path == NULL || *path == '\0') {
+		responseLen = snprintf(response, SERVER_RESPONSE_MAX,
+		                       "ERR %s\n", serverGetError(EREQUEST));
+		return serverAppend(&conn->out, &conn->outSize, &conn->outCapacity,
+		                    response, responseLen);
+	}
+	int dosfsErrno = ENOERR;
+	uint32_t before = 0;
+	uint32_t after = 0;
+	if (!requestErrno) {
+		int fd = -1;
+		dosfsErrno = serverOpen(path, &fd);
+		if (!dosfsErrno) {
+			if (modify) {
+				dosfsErrno = dosfsApplyMask(fd, set, clear, toggle,
+				                            &before, &after);
+			} else {
+				dosfsErrno = dosfsGetAttributes(fd, &before);
+			}
+			dosfsClose(fd);
+		}
+	}
+	if (requestErrno || dosfsErrno) {
+		responseLen = snprintf(response, SERVER_RESPONSE_MAX,
+		                       "ERR Error processing file '%s': %s\n", path,
+		                       requestErrno ? serverGetError(requestErrno) :
+		                       dosfsGetError(dosfsErrno));
+		if (responseLen >= SERVER_RESPONSE_MAX) {
+			/* Long paths are cut, the response still ends the line. */
+			responseLen = SERVER_RESPONSE_MAX - 1;
+			response[responseLen - 1] = '\n';
+		}
+		return serverAppend(&conn->out, &conn->outSize, &conn->outCapacity,
+		                    response, responseLen);
+	}
+	if (modify) {
+		responseLen = snprintf(response, SERVER_RESPONSE_MAX, "OK %s => ",
+		                       outputAttrString(before));
+		responseLen += snprintf(response + responseLen,
+		                        SERVER_RESPONSE_MAX - responseLen, "%s  ",
+		                        outputAttrString(after));
+	} else {
+		responseLen = snprintf(response, SERVER_RESPONSE_MAX, "OK %s  ",
+		                       outputAttrString(before));
+	}
+	if (serverAppend(&conn->out, &conn->outSize, &conn->outCapacity,
+	                 response, responseLen) ||
+	        serverAppend(&conn->out, &conn->outSize, &conn->outCapacity,
+	                     path, strlen(path)) ||
+	        serverAppend(&conn->out, &conn->outSize, &conn->outCapacity,
+	                     "\n", 1)) {
+		return EALLOC;
+	}
+	return ENOERR;
+}
+
+int serverWrite(int fd, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+		if (written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return EWRITE;
+		}
+		data += written;
+		size -= written;
+	}
+	return ENOERR;
+}
+
+int serverConnRead(struct serverConn *conn)
+{
+	ssize_t readSize = recv(conn->fd, conn->in + conn->inSize,
+	                        SERVER_READ_SIZE + SERVER_LINE_MAX - conn->inSize,
+	                        0);
+	if (readSize == -1 && (errno == EINTR || errno == EAGAIN ||
+	                       errno == EWOULDBLOCK)) {
+		return ENOERR;
+	}
+	if (readSize == -1) {
+		return ESOCKET;
+	}
+	if (readSize == 0) {
+		conn->closing = TRUE;
+		return ENOERR;
+	}
+	conn->inSize += readSize;
+	char *line = conn->in;
+	char *end = conn->in + conn->inSize;
+	char *newline = NULL;
+	while ((newline = memchr(line, '\n', end - line)) != NULL) {
+		*newline = '\0';
+		if (serverRequest(conn, line)) {
+			return EALLOC;
+		}
+		line = newline + 1;
+	}
+	conn->inSize = end - line;
+	memmove(conn->in, line, conn->inSize);
+	return conn->inSize >= SERVER_LINE_MAX ? EREQUEST : ENOERR;
+}
+
+int serverConnFlush(struct serverConn *conn)
+{
+	/* Every response queued in a single write, as far as the socket
+	   takes them without blocking. */
+	while (conn->outSent < conn->outSize) {
+		ssize_t written = send(conn->fd, conn->out + conn->outSent,
+		                       conn->outSize - conn->outSent, MSG_NOSIGNAL);
+		if (written == -1 && errno == EINTR) {
+			continue;
+		}
+		if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
+		if (written == -1) {
+			return EWRITE;
+		}
+		conn->outSent += written;
+	}
+	conn->outSize -= conn->outSent;
+	memmove(conn->out, conn->out + conn->outSent, conn->outSize);
+	conn->outSent = 0;
+	return ENOERR;
+}
+
+void serverConnClose(struct serverConn *conn)
+{
+	close(conn->fd);
+	free(conn->in);
+	free(conn->out);
+	memset(conn, 0, sizeof(struct serverConn));
+	conn->fd = -1;
+}
+
+void *serverClientReader(void *data)
+{
+	struct serverClient *client = data;
+	int fd = dup(client->fd);
+	FILE *responses = fd == -1 ? NULL : fdopen(fd, "r");
+	if (responses == NULL) {
+		if (fd != -1) {
+			close(fd);
+		}
+		client->readerErrno = EREAD;
+		return NULL;
+	}
+	char *line = NULL;
+	size_t lineSize = 0;
+	size_t attrsLen = strlen(outputAttrString(0));
+	while (getline(&line, &lineSize, responses) != -1) {
+		if (strncmp(line, "OK ", 3) == 0) {
+			/* Like the local changes, only printed with --verbose. */
+			int change = strlen(line) > 3 + attrsLen &&
+			             strncmp(line + 3 + attrsLen, " => ", 4) == 0;
+			if (!change || client->verbose) {
+				fputs(line + 3, stdout);
+			}
+		} else {
+			fputs(strncmp(line, "ERR ", 4) == 0 ? line + 4 : line, stderr);
+			client->failed++;
+		}
+	}
+	if (ferror(responses)) {
+		client->readerErrno = EREAD;
+	}
+	free(line);
+	fclose(responses);
+	return NULL;
+}
+
+int serverClientSend(struct serverClient *client, const char *line,
+                     size_t size)
+{
+	if (client->outSize + size > SERVER_READ_SIZE) {
+		int serverErrno = serverWrite(client->fd, client->out,
+		                              client->outSize);
+		client->outSize = 0;
+		if (serverErrno) {
+			return serverErrno;
+		}
+	}
+	return serverAppend(&client->out, &client->outSize, &client->outCapacity,
+	                    line, size);
+}
+
+
+const char *serverGetError(int err)
+{
+	switch (err) {
+	case ENOERR:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "No error occurred");
+		break;
+	case EALLOC:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error allocating memory: %s",
+		         strerror(errno));
+		break;
+	case ESOCKET:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error creating the socket: %s",
+		         strerror(errno));
+		break;
+	case ECONNECT:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error connecting to the server: %s",
+		         strerror(errno));
+		break;
+	case EWRITE:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error writing to the socket: %s",
+		         strerror(errno));
+		break;
+	case EREAD:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error reading from the socket: %s",
+		         strerror(errno));
+		break;
+	case ETHREAD:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error creating the response reader");
+		break;
+	case EREQUEST:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Invalid request");
+		break;
+	default:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Unknown error");
+	}
+	return errmsg;
+}
+
+int serverRun(const char *socketPath)
+{
+	assert(socketPath != NULL);
+	struct sockaddr_un addr;
+	if (serverAddress(socketPath, &addr)) {
+		return ESOCKET;
+	}
+	/* A socket left by a previous server is replaced, other files aren't. */
+	struct stat st;
+	if (lstat(socketPath, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(socketPath);
+	}
+	int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenFd == -1) {
+		return ESOCKET;
+	}
+	if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	        listen(listenFd, SOMAXCONN) == -1) {
+		int savedErrno = errno;
+		close(listenFd);
+		errno = savedErrno;
+		return ESOCKET;
+	}
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = serverSignal;
+	sigemptyset(&action.sa_mask);
+	/* No SA_RESTART, so poll returns when the server must stop. */
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	for (size_t i = 0; i < SERVER_DIR_CACHE_SIZE; i++) {
+		serverDirs[i].fd = -1;
+	}
+	struct serverConn conns[SERVER_CLIENTS_MAX];
+	struct pollfd fds[SERVER_CLIENTS_MAX + 1];
+	size_t connsSize = 0;
+	int serverErrno = ENOERR;
+	while (!serverStop) {
+		fds[0].fd = listenFd;
+		fds[0].events = connsSize < SERVER_CLIENTS_MAX ? POLLIN : 0;
+		/* A client that doesn't read its responses only stops its own
+		   requests, the sockets never block. */
+		for (size_t i = 0; i < connsSize; i++) {
+			fds[i + 1].fd = conns[i].fd;
+			fds[i + 1].events = 0;
+			if (!conns[i].closing && conns[i].outSize < SERVER_OUT_MAX) {
+				fds[i + 1].events |= POLLIN;
+			}
+			if (conns[i].outSize > 0) {
+				fds[i + 1].events |= POLLOUT;
+			}
+		}
+		int timeout = serverDirExpire(serverNow());
+		if (poll(fds, connsSize + 1, timeout) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			serverErrno = ESOCKET;
+			break;
+		}
+		/* Backwards, so closed connections can be replaced by the last. */
+		for (size_t i = connsSize; i > 0; i--) {
+			if (fds[i].revents == 0) {
+				continue;
+			}
+			struct serverConn *conn = &conns[i - 1];
+			int connErrno = ENOERR;
+			if ((fds[i].revents & ~POLLOUT) != 0 && !conn->closing) {
+				connErrno = serverConnRead(conn);
+			}
+			if (!connErrno) {
+				connErrno = serverConnFlush(conn);
+			}
+			if (connErrno || (conn->closing && conn->outSize == 0)) {
+				serverConnClose(conn);
+				*conn = conns[--connsSize];
+			}
+		}
+		if (fds[0].revents & POLLIN) {
+			int fd = accept4(listenFd, NULL, NULL,
+			                 SOCK_CLOEXEC | SOCK_NONBLOCK);
+			if (fd == -1) {
+				continue;
+			}
+			struct serverConn *conn = &conns[connsSize];
+			memset(conn, 0, sizeof(struct serverConn));
+			conn->fd = fd;
+			conn->in = malloc(SERVER_READ_SIZE + SERVER_LINE_MAX);
+			if (conn->in == NULL) {
+				close(fd);
+				continue;
+			}
+			connsSize++;
+		}
+	}
+	for (size_t i = 0; i < connsSize; i++) {
+		serverConnClose(&conns[i]);
+	}
+	serverDirClear();
+	close(listenFd);
+	unlink(socketPath);
+	return serverErrno;
+}
+
+int serverClientOpen(const char *socketPath, int verbose,
+                     struct serverClient **client)
+{
+	assert(socketPath != NULL);
+	assert(client != NULL);
+	struct sockaddr_un addr;
+	if (serverAddress(socketPath, &addr)) {
+		return ECONNECT;
+	}
+	*client = calloc(1, sizeof(struct serverClient));
+	if (*client == NULL) {
+		return EALLOC;
+	}
+	(*client)->verbose = verbose;
+	(*client)->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if ((*client)->fd == -1) {
+		free(*client);
+		return ESOCKET;
+	}
+	if (connect((*client)->fd, (struct sockaddr *)&addr,
+	            sizeof(addr)) == -1) {
+		int savedErrno = errno;
+		close((*client)->fd);
+		free(*client);
+		errno = savedErrno;
+		return ECONNECT;
+	}
+	/* The responses are read while the requests are written, otherwise
+	   both sides could block writing with full socket buffers. */
+	if (pthread_create(&(*client)->reader, NULL, serverClientReader,
+	                   *client)) {
+		close((*client)->fd);
+		free(*client);
+		return ETHREAD;
+	}
+	return ENOERR;
+}
+
+int serverClientGet(struct serverClient *client, const char *path)
+{
+	assert(client != NULL);
+	assert(path != NULL);
+	int serverErrno = serverClientSend(client, "GET ", 4);
+	if (!serverErrno) {
+		serverErrno = serverClientSend(client, path, strlen(path));
+	}
+	if (!serverErrno) {
+		serverErrno = serverClientSend(client, "\n", 1);
+	}
+	return serverErrno;
+}
+
+int serverClientModify(struct serverClient *client, const char *path,
+                       uint32_t set, uint32_t clear, uint32_t toggle)
+{
+	assert(client != NULL);
+	assert(path != NULL);
+	static const char attrLetters[] = "RHSVDA";
+	static const char signs[] = "+-^";
+	const uint32_t changes[] = {set, clear, toggle};
+	char request[32] = "MOD ";
+	size_t requestLen = 4;
+	for (size_t i = 0; i < 3; i++) {
+		if (changes[i] == 0) {
+			continue;
+		}
+		request[requestLen++] = signs[i];
+		for (size_t j = 0; j < sizeof(attrLetters) - 1; j++) {
+			if (changes[i] & dosfsParseAttr(attrLetters[j])) {
+				request[requestLen++] = attrLetters[j];
+			}
+		}
+	}
+	request[requestLen++] = ' ';
+	int serverErrno = serverClientSend(client, request, requestLen);
+	if (!serverErrno) {
+		serverErrno = serverClientSend(client, path, strlen(path));
+	}
+	if (!serverErrno) {
+		serverErrno = serverClientSend(client, "\n", 1);
+	}
+	return serverErrno;
+}
+
+int serverClientClose(struct serverClient *client, unsigned long *failed)
+{
+	assert(client != NULL);
+	int serverErrno = serverWrite(client->fd, client->out, client->outSize);
+	/* The end of the requests, the server closes after the responses. */
+	shutdown(client->fd, SHUT_WR);
+	pthread_join(client->reader, NULL);
+	if (!serverErrno) {
+		serverErrno = client->readerErrno;
+	}
+	if (failed != NULL) {
+		*failed = client->failed;
+	}
+	close(client->fd);
+	free(client->out);
+	free(client);
+	return serverErrno;
+}
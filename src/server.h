@@ -0,0 +1,81 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <stdint.h>
+
+/**
+ * Daemon that serves attribute requests over a Unix domain socket, and its
+ * client.
+ *
+ * The protocol is line based, a client sends any number of requests and
+ * gets one response per request, in the same order:
+ * - "GET PATH": the response is "OK RHSADV  PATH".
+ * - "MOD CHANGES PATH", CHANGES like "+RH-S^A" (at least one change): the
+ *   response is "OK RHSADV => RHSADV  PATH" with the attributes before and
+ *   after the change.
+ * Failed requests get "ERR MESSAGE", the message names the path. Paths
+ * can't contain newlines.
+ * The responses to all the requests available in a read are written at
+ * once, so batches of requests cost a few system calls. The sockets of the
+ * server never block: the responses a client doesn't read yet are queued,
+ * and its requests wait while too many are.
+ */
+struct serverClient;
+
+/**
+ * Returns a descriptive message associated with an error code.
+ */
+const char *serverGetError(int err);
+/**
+ * Serve the requests of the clients of the socket 'socketPath' with the
+ * current dosfs backend, until SIGINT or SIGTERM is received.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int serverRun(const char *socketPath);
+/**
+ * Connect to the server of 'socketPath'. The responses are printed while
+ * the requests are sent: the attributes in the standard output, as the
+ * text output of the program, the changes only if 'verbose' != 0, and the
+ * errors in the standard error.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int serverClientOpen(const char *socketPath, int verbose,
+                     struct serverClient **client);
+/**
+ * Send the request of the attributes of 'path'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int serverClientGet(struct serverClient *client, const char *path);
+/**
+ * Send the request of an attribute change of 'path'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int serverClientModify(struct serverClient *client, const char *path,
+                       uint32_t set, uint32_t clear, uint32_t toggle);
+/**
+ * Wait for the pending responses and close the connection.
+ * 'failed' receives the number of requests that failed.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int serverClientClose(struct serverClient *client, unsigned long *failed);
+
+#endif /* __SERVER_H__ */
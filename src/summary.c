@@ -0,0 +1,337 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "summary.h"
+#include "path.h"
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+#define ERRMSG_MAX 1025
+#define ROWS_INITIAL_CAPACITY 16
+
+enum {
+    ENOERR = 0,
+    EALLOC
+};
+
+struct summaryRow {
+	/* Offset of the path in the arena until the summary is finished. */
+	size_t pathOffset;
+	/* Path, only set by summaryFinish. */
+	const char *path;
+	size_t depth;
+	uint64_t counts[SUMMARY_BINS];
+};
+
+struct summary {
+	struct summaryRow *rows;
+	size_t size;
+	size_t capacity;
+	struct pathArena paths;
+	/* Hash table of the rows by path, open addressing with linear probing:
+	   the row + 1, 0 for an empty slot. Twice as big as 'capacity'. */
+	size_t *slots;
+	/* Entries counted outside any row, and after summaryFinish the total. */
+	uint64_t total[SUMMARY_BINS];
+	/* Taken by summaryMerge, so the workers can merge at once. */
+	pthread_mutex_t lock;
+};
+
+static _Thread_local char errmsg[ERRMSG_MAX] = {0};
+
+/**
+ * Returns the slot of the row of 'path' in the hash table, or of the empty
+ * slot where it must be added.
+ */
+size_t summaryFind(const struct summary *summary, const char *path);
+/**
+ * Make room for one more row, growing the hash table with the rows.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int summaryReserve(struct summary *summary);
+/**
+ * qsort comparison of two rows, by path.
+ */
+int summaryCompare(const void *a, const void *b);
+/**
+ * Returns the row of the parent directory of the row 'index' of a sorted
+ * summary, or NULL if it isn't there.
+ */
+struct summaryRow *summaryParent(struct summary *summary, size_t index);
+
+
+size_t summaryFind(const struct summary *summary, const char *path)
+{
+	size_t mask = summary->capacity * 2 - 1;
+	size_t slot = (size_t)pathHash(path, strlen(path)) & mask;
+	while (summary->slots[slot] != 0) {
+		const struct summaryRow *row = &summary->rows[summary->slots[slot] - 1];
+		if (strcmp(pathArenaGet(&summary->paths, row->pathOffset), path) == 0) {
+			break;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+int summaryReserve(struct summary *summary)
+{
+	if (summary->size < summary->capacity) {
+		return ENOERR;
+	}
+	size_t newCapacity = summary->capacity > 0 ? summary->capacity * 2 :
+	                     ROWS_INITIAL_CAPACITY;
+	struct summaryRow *newRows = realloc(summary->rows,
+	                                     newCapacity *
+	                                     sizeof(struct summaryRow));
+	if (newRows == NULL) {
+		return EALLOC;
+	}
+	summary->rows = newRows;
+	size_t *newSlots = calloc(newCapacity * 2, sizeof(size_t));
+	if (newSlots == NULL) {
+		return EALLOC;
+	}
+	free(summary->slots);
+	summary->slots = newSlots;
+	summary->capacity = newCapacity;
+	for (size_t i = 0; i < summary->size; i++) {
+		const char *path = pathArenaGet(&summary->paths,
+		                                summary->rows[i].pathOffset);
+		summary->slots[summaryFind(summary, path)] = i + 1;
+	}
+	return ENOERR;
+}
+
+int summaryCompare(const void *a, const void *b)
+{
+	const struct summaryRow *rowA = a;
+	const struct summaryRow *rowB = b;
+	return strcmp(rowA->path, rowB->path);
+}
+
+struct summaryRow *summaryParent(struct summary *summary, size_t index)
+{
+	const char *path = summary->rows[index].path;
+	const char *slash = strrchr(path, '/');
+	if (slash == NULL) {
+		return NULL;
+	}
+	/* The parent of "/name" is "/". */
+	size_t len = slash == path ? 1 : (size_t)(slash - path);
+	size_t low = 0;
+	size_t high = index;
+	/* The parent sorts before its children. */
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		const char *candidate = summary->rows[middle].path;
+		int cmp = strncmp(candidate, path, len);
+		if (cmp == 0 && candidate[len] != '\0') {
+			cmp = 1;
+		}
+		if (cmp == 0) {
+			return &summary->rows[middle];
+		} else if (cmp < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return NULL;
+}
+
+
+const char *summaryGetError(int err)
+{
+	switch (err) {
+	case ENOERR:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "No error occurred");
+		break;
+	case EALLOC:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error allocating memory: %s",
+		         strerror(errno));
+		break;
+	default:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Unknown error");
+	}
+	return errmsg;
+}
+
+int summaryCreate(struct summary **summary)
+{
+	assert(summary != NULL);
+	*summary = calloc(1, sizeof(struct summary));
+	if (*summary == NULL) {
+		return EALLOC;
+	}
+	pthread_mutex_init(&(*summary)->lock, NULL);
+	return ENOERR;
+}
+
+void summaryDestroy(struct summary *summary)
+{
+	if (summary == NULL) {
+		return;
+	}
+	free(summary->rows);
+	free(summary->slots);
+	pathArenaFree(&summary->paths);
+	pthread_mutex_destroy(&summary->lock);
+	free(summary);
+}
+
+int summaryDir(struct summary *summary, const char *path, size_t depth,
+               size_t *row)
+{
+	assert(summary != NULL);
+	assert(path != NULL);
+	assert(row != NULL);
+	if (summaryReserve(summary)) {
+		return EALLOC;
+	}
+	size_t slot = summaryFind(summary, path);
+	if (summary->slots[slot] != 0) {
+		*row = summary->slots[slot] - 1;
+		/* A directory given as FILE and also reached from another one is
+		   kept at the smallest depth, whatever the order. */
+		if (depth < summary->rows[*row].depth) {
+			summary->rows[*row].depth = depth;
+		}
+		return ENOERR;
+	}
+	struct summaryRow *newRow = &summary->rows[summary->size];
+	if (pathArenaCopy(&summary->paths, path, &newRow->pathOffset)) {
+		return EALLOC;
+	}
+	newRow->path = NULL;
+	newRow->depth = depth;
+	memset(newRow->counts, 0, sizeof(newRow->counts));
+	summary->slots[slot] = summary->size + 1;
+	*row = summary->size;
+	summary->size++;
+	return ENOERR;
+}
+
+void summaryCount(struct summary *summary, size_t row, uint32_t attrs)
+{
+	assert(summary != NULL);
+	assert(row == SUMMARY_NO_DIR || row < summary->size);
+	uint64_t *counts = row == SUMMARY_NO_DIR ? summary->total :
+	                   summary->rows[row].counts;
+	counts[attrs % SUMMARY_BINS]++;
+}
+
+int summaryMerge(struct summary *dst, struct summary *src)
+{
+	assert(dst != NULL);
+	assert(src != NULL);
+	int summaryErrno = ENOERR;
+	pthread_mutex_lock(&dst->lock);
+	for (size_t i = 0; i < src->size && !summaryErrno; i++) {
+		const struct summaryRow *srcRow = &src->rows[i];
+		size_t row = 0;
+		summaryErrno = summaryDir(dst,
+		                          pathArenaGet(&src->paths, srcRow->pathOffset),
+		                          srcRow->depth, &row);
+		for (size_t bin = 0; bin < SUMMARY_BINS && !summaryErrno; bin++) {
+			dst->rows[row].counts[bin] += srcRow->counts[bin];
+		}
+	}
+	for (size_t bin = 0; bin < SUMMARY_BINS; bin++) {
+		dst->total[bin] += src->total[bin];
+	}
+	pthread_mutex_unlock(&dst->lock);
+	src->size = 0;
+	memset(src->total, 0, sizeof(src->total));
+	if (src->slots != NULL) {
+		memset(src->slots, 0, src->capacity * 2 * sizeof(size_t));
+	}
+	pathArenaReset(&src->paths, 0);
+	return summaryErrno;
+}
+
+void summaryFinish(struct summary *summary)
+{
+	assert(summary != NULL);
+	pathArenaResolve(&summary->paths, summary->rows, summary->size,
+	                 sizeof(struct summaryRow),
+	                 offsetof(struct summaryRow, pathOffset),
+	                 offsetof(struct summaryRow, path));
+	size_t maxDepth = 0;
+	for (size_t i = 0; i < summary->size; i++) {
+		if (summary->rows[i].depth > maxDepth) {
+			maxDepth = summary->rows[i].depth;
+		}
+	}
+	qsort(summary->rows, summary->size, sizeof(struct summaryRow),
+	      summaryCompare);
+	/* The deepest rows first, so every row is complete when it's added to
+	   its parent. */
+	for (size_t depth = maxDepth + 1; depth-- > 0;) {
+		for (size_t i = 0; i < summary->size; i++) {
+			struct summaryRow *row = &summary->rows[i];
+			if (row->depth != depth) {
+				continue;
+			}
+			struct summaryRow *parent = depth > 0 ?
+			                            summaryParent(summary, i) : NULL;
+			uint64_t *counts = parent != NULL ? parent->counts :
+			                   summary->total;
+			for (size_t bin = 0; bin < SUMMARY_BINS; bin++) {
+				counts[bin] += row->counts[bin];
+			}
+		}
+	}
+	/* The hash table doesn't match the sorted rows. */
+	free(summary->slots);
+	summary->slots = NULL;
+}
+
+size_t summarySize(const struct summary *summary)
+{
+	assert(summary != NULL);
+	return summary->size;
+}
+
+void summaryGet(const struct summary *summary, size_t index,
+                struct summaryDir *dir)
+{
+	assert(summary != NULL);
+	assert(index < summary->size);
+	assert(dir != NULL);
+	const struct summaryRow *row = &summary->rows[index];
+	dir->path = row->path;
+	dir->depth = row->depth;
+	dir->counts = row->counts;
+}
+
+const uint64_t *summaryTotal(const struct summary *summary)
+{
+	assert(summary != NULL);
+	return summary->total;
+}
@@ -0,0 +1,110 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __SUMMARY_H__
+#define __SUMMARY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Attribute combinations counted, one per value of the 6 attribute bits. */
+#define SUMMARY_BINS 64
+/* Row of summaryCount for the entries outside any directory row. */
+#define SUMMARY_NO_DIR ((size_t) -1)
+
+/**
+ * Census of the attributes of a set of files: how many entries have each
+ * attribute combination, per directory and in total.
+ *
+ * While counting, the row of a directory only has the entries counted
+ * directly in it, so a traversal can count the entries below the deepest
+ * directory of interest into its row, and different threads can count
+ * different subtrees into their own summaries and merge them later.
+ * summaryFinish adds the rows into their parents, after that every row
+ * counts its whole subtree. The directory itself isn't counted in its own
+ * row but in the row of its parent, or only in the total.
+ */
+struct summary;
+
+/**
+ * A directory of a finished summary.
+ */
+struct summaryDir {
+	const char *path;
+	/* Depth given to summaryDir. */
+	size_t depth;
+	const uint64_t *counts;
+};
+
+/**
+ * Returns a descriptive message associated with an error code.
+ */
+const char *summaryGetError(int err);
+/**
+ * Create an empty summary.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int summaryCreate(struct summary **summary);
+/**
+ * Free a summary.
+ */
+void summaryDestroy(struct summary *summary);
+/**
+ * Find or add the row of the directory 'path', at 'depth' levels below the
+ * directories of depth 0. Its parent is the path without its last
+ * component, and must have a row too unless 'depth' is 0. 'row' receives
+ * the row for summaryCount, valid until the summary is merged. A row found
+ * again keeps the smallest of its depths.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int summaryDir(struct summary *summary, const char *path, size_t depth,
+               size_t *row);
+/**
+ * Count an entry with the attributes 'attrs' in 'row', or only in the
+ * total with SUMMARY_NO_DIR.
+ */
+void summaryCount(struct summary *summary, size_t row, uint32_t attrs);
+/**
+ * Add the rows and the counts of 'src' to 'dst', leaving 'src' empty.
+ * Several threads can merge into the same summary at once.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int summaryMerge(struct summary *dst, struct summary *src);
+/**
+ * Sort the rows by path and add every row to its parent and the rows of
+ * depth 0 to the total. Nothing can be counted after this.
+ */
+void summaryFinish(struct summary *summary);
+/**
+ * Returns the number of directory rows.
+ */
+size_t summarySize(const struct summary *summary);
+/**
+ * Fill 'dir' with the row 'index' of a finished summary. It's valid until
+ * the summary is freed.
+ */
+void summaryGet(const struct summary *summary, size_t index,
+                struct summaryDir *dir);
+/**
+ * Returns the total counts of a finished summary, SUMMARY_BINS of them.
+ */
+const uint64_t *summaryTotal(const struct summary *summary);
+
+#endif /* __SUMMARY_H__ */
@@ -0,0 +1,350 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include "bool.h"
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define ERRMSG_MAX 1025
+#define RING_ENTRIES URING_BATCH_MAX
+
+enum {
+    ENOERR = 0,
+    ESETUP,
+    EMAP,
+    EPROBE,
+    EALLOC,
+    EENTER
+};
+
+struct uring {
+	int fd;
+	void *sqRing;
+	size_t sqRingSize;
+	void *cqRing;
+	size_t cqRingSize;
+	struct io_uring_sqe *sqes;
+	size_t sqesSize;
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	struct io_uring_cqe *cqes;
+};
+
+static _Thread_local char errmsg[ERRMSG_MAX] = {0};
+
+/**
+ * Returns a free submission entry, cleared, or NULL if the ring is full.
+ */
+struct io_uring_sqe *uringGetSqe(struct uring *ring);
+/**
+ * Submit the 'size' queued entries and wait until their completions arrive,
+ * saving the result of each one in results[user_data], of 'resultsSize'.
+ * Returns 0 on success, !0 if an error happens: then the entries not taken
+ * by the kernel are withdrawn, with URING_NOT_SUBMITTED as their result,
+ * and the ones taken keep -ECANCELED unless they completed already.
+ */
+int uringSubmitAndWait(struct uring *ring, int *results, size_t resultsSize,
+                       size_t size);
+/**
+ * Save the results of the completions that arrived, see uringSubmitAndWait.
+ * Returns the number of completions.
+ */
+size_t uringReap(struct uring *ring, int *results, size_t resultsSize);
+/**
+ * Returns !0 if the kernel supports all the operations used.
+ */
+int uringProbe(struct uring *ring);
+
+
+struct io_uring_sqe *uringGetSqe(struct uring *ring)
+{
+	unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring->sqTail;
+	if (tail - head >= RING_ENTRIES) {
+		return NULL;
+	}
+	unsigned index = tail & *ring->sqMask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sqArray[index] = index;
+	/* Only visible to the kernel after the tail is stored. */
+	__atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+int uringSubmitAndWait(struct uring *ring, int *results, size_t resultsSize,
+                       size_t size)
+{
+	for (size_t i = 0; i < resultsSize; i++) {
+		results[i] = -ECANCELED;
+	}
+	size_t toSubmit = size;
+	size_t completed = 0;
+	while (completed < size) {
+		long ret = syscall(SYS_io_uring_enter, ring->fd, toSubmit,
+		                   size - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret < 0) {
+			int enterErrno = errno;
+			/* Without SQPOLL the kernel only takes entries inside the
+			   call, the ones after its head are still ours: withdraw
+			   them, or the next batch would submit them. */
+			unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+			unsigned tail = *ring->sqTail;
+			for (unsigned i = head; i != tail; i++) {
+				unsigned index = ring->sqArray[i & *ring->sqMask];
+				uint64_t userData = ring->sqes[index].user_data;
+				if (userData < resultsSize) {
+					results[userData] = URING_NOT_SUBMITTED;
+				}
+			}
+			__atomic_store_n(ring->sqTail, head, __ATOMIC_RELEASE);
+			uringReap(ring, results, resultsSize);
+			errno = enterErrno;
+			return EENTER;
+		}
+		toSubmit -= (size_t)ret < toSubmit ? (size_t)ret : toSubmit;
+		completed += uringReap(ring, results, resultsSize);
+	}
+	return ENOERR;
+}
+
+size_t uringReap(struct uring *ring, int *results, size_t resultsSize)
+{
+	size_t completed = 0;
+	unsigned head = *ring->cqHead;
+	unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+		if (cqe->user_data < resultsSize) {
+			results[cqe->user_data] = cqe->res;
+		}
+		completed++;
+	}
+	__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+	return completed;
+}
+
+int uringProbe(struct uring *ring)
+{
+	size_t probeSize = sizeof(struct io_uring_probe) +
+	                   IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, probeSize);
+	if (probe == NULL) {
+		return FALSE;
+	}
+	int supported = FALSE;
+	if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+	            probe, IORING_OP_LAST) == 0) {
+		supported = probe->last_op >= IORING_OP_CLOSE &&
+		            (probe->ops[IORING_OP_OPENAT].flags &
+		             IO_URING_OP_SUPPORTED) &&
+		            (probe->ops[IORING_OP_CLOSE].flags &
+		             IO_URING_OP_SUPPORTED);
+	}
+	free(probe);
+	return supported;
+}
+
+
+const char *uringGetError(int err)
+{
+	switch (err) {
+	case ENOERR:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "No error occurred");
+		break;
+	case ESETUP:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error in call 'io_uring_setup': %s",
+		         strerror(errno));
+		break;
+	case EMAP:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error mapping the io_uring rings: %s",
+		         strerror(errno));
+		break;
+	case EPROBE:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "The kernel doesn't support io_uring open and close: %s",
+		         strerror(errno));
+		break;
+	case EALLOC:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error allocating memory: %s",
+		         strerror(errno));
+		break;
+	case EENTER:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error in call 'io_uring_enter': %s",
+		         strerror(errno));
+		break;
+	default:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Unknown error");
+	}
+	return errmsg;
+}
+
+int uringCreate(struct uring **ring)
+{
+	assert(ring != NULL);
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = (int)syscall(SYS_io_uring_setup, RING_ENTRIES, &params);
+	if (fd < 0) {
+		return ESETUP;
+	}
+	struct uring *newRing = calloc(1, sizeof(struct uring));
+	if (newRing == NULL) {
+		close(fd);
+		return EALLOC;
+	}
+	newRing->fd = fd;
+	newRing->sqRingSize = params.sq_off.array +
+	                      params.sq_entries * sizeof(unsigned);
+	newRing->cqRingSize = params.cq_off.cqes +
+	                      params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (newRing->cqRingSize > newRing->sqRingSize) {
+			newRing->sqRingSize = newRing->cqRingSize;
+		}
+		newRing->cqRingSize = newRing->sqRingSize;
+	}
+	newRing->sqRing = mmap(NULL, newRing->sqRingSize,
+	                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                       fd, IORING_OFF_SQ_RING);
+	if (newRing->sqRing == MAP_FAILED) {
+		close(fd);
+		free(newRing);
+		return EMAP;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		newRing->cqRing = newRing->sqRing;
+	} else {
+		newRing->cqRing = mmap(NULL, newRing->cqRingSize,
+		                       PROT_READ | PROT_WRITE,
+		                       MAP_SHARED | MAP_POPULATE,
+		                       fd, IORING_OFF_CQ_RING);
+	}
+	newRing->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	newRing->sqes = mmap(NULL, newRing->sqesSize,
+	                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                     fd, IORING_OFF_SQES);
+	if (newRing->cqRing == MAP_FAILED || newRing->sqes == MAP_FAILED) {
+		int mapErrno = errno;
+		if (newRing->sqes == MAP_FAILED) {
+			newRing->sqes = NULL;
+		}
+		if (newRing->cqRing == MAP_FAILED) {
+			newRing->cqRing = NULL;
+		}
+		uringDestroy(newRing);
+		errno = mapErrno;
+		return EMAP;
+	}
+	uint8_t *sq = newRing->sqRing;
+	uint8_t *cq = newRing->cqRing;
+	newRing->sqHead = (unsigned *)(sq + params.sq_off.head);
+	newRing->sqTail = (unsigned *)(sq + params.sq_off.tail);
+	newRing->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+	newRing->sqArray = (unsigned *)(sq + params.sq_off.array);
+	newRing->cqHead = (unsigned *)(cq + params.cq_off.head);
+	newRing->cqTail = (unsigned *)(cq + params.cq_off.tail);
+	newRing->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+	newRing->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	if (!uringProbe(newRing)) {
+		uringDestroy(newRing);
+		errno = EOPNOTSUPP;
+		return EPROBE;
+	}
+	*ring = newRing;
+	return ENOERR;
+}
+
+void uringDestroy(struct uring *ring)
+{
+	if (ring == NULL) {
+		return;
+	}
+	if (ring->sqes != NULL) {
+		munmap(ring->sqes, ring->sqesSize);
+	}
+	if (ring->cqRing != NULL && ring->cqRing != ring->sqRing) {
+		munmap(ring->cqRing, ring->cqRingSize);
+	}
+	munmap(ring->sqRing, ring->sqRingSize);
+	close(ring->fd);
+	free(ring);
+}
+
+int uringOpenAtBatch(struct uring *ring, int dirFd, const char *const *names,
+                     int flags, int *results, size_t size)
+{
+	assert(ring != NULL);
+	assert(size <= URING_BATCH_MAX);
+	for (size_t i = 0; i < size; i++) {
+		struct io_uring_sqe *sqe = uringGetSqe(ring);
+		assert(sqe != NULL);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = dirFd;
+		sqe->addr = (uint64_t)(uintptr_t)names[i];
+		sqe->open_flags = (uint32_t)flags;
+		sqe->user_data = i;
+	}
+	return uringSubmitAndWait(ring, results, size, size);
+}
+
+int uringCloseBatch(struct uring *ring, const int *fds, int *results,
+                    size_t size)
+{
+	assert(ring != NULL);
+	assert(size <= URING_BATCH_MAX);
+	size_t queued = 0;
+	for (size_t i = 0; i < size; i++) {
+		if (fds[i] < 0) {
+			continue;
+		}
+		struct io_uring_sqe *sqe = uringGetSqe(ring);
+		assert(sqe != NULL);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = fds[i];
+		sqe->user_data = i;
+		queued++;
+	}
+	return uringSubmitAndWait(ring, results, size, queued);
+}
@@ -0,0 +1,73 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdlib.h>
+#include <limits.h>
+
+/**
+ * Minimal io_uring wrapper, on top of the raw system calls, to open and
+ * close batches of files with a single system call per batch.
+ * A ring must only be used by one thread at a time.
+ */
+struct uring;
+
+/* Maximum files of a batch. */
+#define URING_BATCH_MAX 64
+/* Result of an operation of a failed batch that never reached the kernel,
+   it can be done again some other way. */
+#define URING_NOT_SUBMITTED INT_MIN
+
+/**
+ * Returns a descriptive message associated with an error code.
+ */
+const char *uringGetError(int err);
+/**
+ * Create a ring, checking that the kernel supports the operations used.
+ * Returns 0 on success, !0 if an error happens or io_uring isn't available.
+ */
+int uringCreate(struct uring **ring);
+/**
+ * Free a ring.
+ */
+void uringDestroy(struct uring *ring);
+/**
+ * Open 'size' (at most URING_BATCH_MAX) files relative to 'dirFd' with the
+ * open flags 'flags'. 'results' receives the file descriptor of each file,
+ * or -errno if it couldn't be opened.
+ * Returns 0 on success, !0 if the batch couldn't be submitted. Then the
+ * files never submitted get URING_NOT_SUBMITTED, and the ones submitted
+ * without a completion -ECANCELED, as they may still be opened: the ring
+ * must be destroyed.
+ */
+int uringOpenAtBatch(struct uring *ring, int dirFd, const char *const *names,
+                     int flags, int *results, size_t size);
+/**
+ * Close the 'size' (at most URING_BATCH_MAX) file descriptors 'fds' that
+ * aren't negative. 'results' receives 0 for each one closed, or -errno.
+ * Returns 0 on success, !0 if the batch couldn't be submitted, with the
+ * results of uringOpenAtBatch: the descriptors with -ECANCELED may have
+ * been closed already, and must not be closed again.
+ */
+int uringCloseBatch(struct uring *ring, const int *fds, int *results,
+                    size_t size);
+
+#endif /* __URING_H__ */
@@ -0,0 +1,693 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "watch.h"
+#include "bool.h"
+#include "path.h"
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <assert.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+
+#define ERRMSG_MAX 1025
+/* Events of the watched directories: entries created, moved in or closed
+   after being written, and the directories moved away, whose paths are no
+   longer valid. IN_ATTRIB is left out, the attribute changes would report
+   the entries again. */
+#define WATCH_EVENTS (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | \
+                      IN_MOVED_FROM | IN_MOVE_SELF | IN_ONLYDIR | \
+                      IN_EXCL_UNLINK)
+/* Time without events of an entry before it's reported. */
+#define WATCH_QUIET_MS 10
+/* Longest time an entry is kept pending under a continuous stream of
+   events. */
+#define WATCH_DELAY_MAX_MS 100
+/* Pending entries that force a report, whatever their age. */
+#define WATCH_PENDING_MAX 4096
+/* Size of the reads of the inotify descriptor. */
+#define WATCH_READ_SIZE 65536
+/* Initial capacity of the pending entries. */
+#define WATCH_PENDING_INITIAL_CAPACITY 64
+/* Spreads the watch descriptors over the hash table of the pending entries,
+   so the same name in several directories doesn't probe the same slots. */
+#define WATCH_WD_MIX 0x9e3779b97f4a7c15ULL
+
+enum {
+    ENOERR = 0,
+    EALLOC,
+    EINOTIFY,
+    EADD,
+    EREAD
+};
+
+/* A watched directory, 'path' is NULL if the slot is free. */
+struct watchDir {
+	char *path;
+};
+
+/* An entry with events not reported yet. */
+struct watchPending {
+	int wd;
+	uint64_t hash;
+	int isDir;
+	/* Times of its first and last events. */
+	long firstMs;
+	long lastMs;
+	char *name;
+};
+
+struct watcher {
+	int fd;
+	int recursive;
+	/* Watched directories, indexed by watch descriptor. */
+	struct watchDir *dirs;
+	size_t dirsSize;
+	/* Directories given to watchAdd. */
+	char **roots;
+	size_t rootsSize;
+	struct watchPending *pending;
+	size_t pendingSize;
+	size_t pendingCapacity;
+	/* Hash table of the pending entries by watch and name, open addressing
+	   with linear probing: the entry + 1, 0 for an empty slot. Twice as big
+	   as 'pendingCapacity'. */
+	size_t *slots;
+	/* Path of the entry being processed. */
+	struct pathBuilder path;
+};
+
+static _Thread_local char errmsg[ERRMSG_MAX] = {0};
+static volatile sig_atomic_t watchStop = FALSE;
+
+/**
+ * Signal handler that stops the watch loop.
+ */
+void watchSignal(int signum);
+/**
+ * Returns the current time of the monotonic clock, in milliseconds.
+ */
+long watchNow(void);
+/**
+ * Append 'name' to the path of the watcher like pathPush, without doubling
+ * the slash of a directory that ends with one, like "/".
+ * Returns 0 on success, !0 if an error happens.
+ */
+int watchPush(struct watcher *watcher, const char *name, size_t *mark);
+/**
+ * Set the path of the watcher to the path of the entry 'name' of the
+ * directory 'dir'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int watchJoin(struct watcher *watcher, const char *dir, const char *name);
+/**
+ * Watch the directory in the path of the watcher and, if the watcher is
+ * recursive, its whole subtree. The subdirectories that can't be watched
+ * are skipped. The path is left as it was.
+ * Returns 0 on success, !0 if the directory can't be watched.
+ */
+int watchAddTree(struct watcher *watcher);
+/**
+ * Returns !0 if 'path' is 'dir' or an entry below it.
+ */
+int watchIsBelow(const char *path, const char *dir);
+/**
+ * Replace the prefix 'oldPath' of the paths of the watched directories
+ * below it, included, by 'newPath'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int watchRename(struct watcher *watcher, const char *oldPath,
+                const char *newPath);
+/**
+ * Stop watching the directory 'path' and the watched directories below it,
+ * after it has been moved away. If it's moved to a watched directory it's
+ * watched again from its new path, as a new directory.
+ */
+void watchRemoveTree(struct watcher *watcher, const char *path);
+/**
+ * Returns the slot of the pending entry 'name' of the watch 'wd', whose
+ * hash is 'hash', or of the empty slot where it must be added.
+ */
+size_t watchFind(const struct watcher *watcher, int wd, uint64_t hash,
+                 const char *name);
+/**
+ * Rebuild the hash table of the pending entries.
+ */
+void watchIndex(struct watcher *watcher);
+/**
+ * Add the event of the entry 'name' of the watch 'wd' to the pending
+ * entries, merging it with a previous one of the same entry.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int watchQueue(struct watcher *watcher, int wd, const char *name, int isDir,
+               long now);
+/**
+ * Process the events of a read of the inotify descriptor.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int watchEvents(struct watcher *watcher, const char *buf, size_t size,
+                tWatchFn fn, void *data);
+/**
+ * Report the pending entries quiet since 'now - WATCH_QUIET_MS' or pending
+ * for WATCH_DELAY_MAX_MS, or all of them if 'all' is !0.
+ * Returns 0 on success, !0 if an error happens, the entries not reported
+ * are kept.
+ */
+int watchReport(struct watcher *watcher, long now, int all, tWatchFn fn,
+                void *data);
+/**
+ * Returns the milliseconds poll must wait for the next report, -1 if there
+ * are no pending entries.
+ */
+int watchTimeout(const struct watcher *watcher, long now);
+
+
+void watchSignal(int signum)
+{
+	(void)signum;
+	watchStop = TRUE;
+}
+
+long watchNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int watchPush(struct watcher *watcher, const char *name, size_t *mark)
+{
+	struct pathBuilder *path = &watcher->path;
+	size_t length = path->length;
+	/* The slash pathPush appends replaces the one already there. */
+	if (length > 0 && path->buffer[length - 1] == '/') {
+		path->length--;
+	}
+	int pathErrno = pathPush(path, name, mark);
+	if (pathErrno) {
+		path->length = length;
+		return EALLOC;
+	}
+	*mark = length;
+	return ENOERR;
+}
+
+int watchJoin(struct watcher *watcher, const char *dir, const char *name)
+{
+	size_t mark = 0;
+	if (pathSet(&watcher->path, dir)) {
+		return EALLOC;
+	}
+	return watchPush(watcher, name, &mark);
+}
+
+int watchAddTree(struct watcher *watcher)
+{
+	/* The buffer of the path moves when it grows, it's only taken before
+	   anything is pushed. */
+	const char *path = watcher->path.buffer;
+	int wd = inotify_add_watch(watcher->fd, path, WATCH_EVENTS);
+	if (wd == -1) {
+		return EADD;
+	}
+	if ((size_t)wd >= watcher->dirsSize) {
+		size_t newSize = watcher->dirsSize > 0 ? watcher->dirsSize : 16;
+		while ((size_t)wd >= newSize) {
+			newSize *= 2;
+		}
+		struct watchDir *newDirs = realloc(watcher->dirs,
+		                                   sizeof(struct watchDir) * newSize);
+		if (newDirs == NULL) {
+			inotify_rm_watch(watcher->fd, wd);
+			return EALLOC;
+		}
+		memset(newDirs + watcher->dirsSize, 0,
+		       sizeof(struct watchDir) * (newSize - watcher->dirsSize));
+		watcher->dirs = newDirs;
+		watcher->dirsSize = newSize;
+	}
+	/* The same directory watched twice gets the same descriptor, with a
+	   different path if it has been moved since. */
+	if (watcher->dirs[wd].path == NULL) {
+		watcher->dirs[wd].path = strdup(path);
+		if (watcher->dirs[wd].path == NULL) {
+			inotify_rm_watch(watcher->fd, wd);
+			return EALLOC;
+		}
+	} else if (strcmp(watcher->dirs[wd].path, path) != 0) {
+		char *oldPath = strdup(watcher->dirs[wd].path);
+		int watchErrno = oldPath != NULL ?
+		                 watchRename(watcher, oldPath, path) : EALLOC;
+		free(oldPath);
+		if (watchErrno) {
+			return watchErrno;
+		}
+	}
+	if (!watcher->recursive) {
+		return ENOERR;
+	}
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		return ENOERR;
+	}
+	struct dirent *entry = NULL;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) {
+			continue;
+		}
+		if (strcmp(entry->d_name, ".") == 0 ||
+		        strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		size_t mark = 0;
+		int watchErrno = watchPush(watcher, entry->d_name, &mark);
+		if (!watchErrno) {
+			/* Plain files of DT_UNKNOWN file systems fail with ENOTDIR. */
+			watchErrno = watchAddTree(watcher);
+			pathPop(&watcher->path, mark);
+		}
+		if (watchErrno == EALLOC) {
+			closedir(dir);
+			return EALLOC;
+		}
+	}
+	closedir(dir);
+	return ENOERR;
+}
+
+int watchIsBelow(const char *path, const char *dir)
+{
+	size_t dirLen = strlen(dir);
+	if (strncmp(path, dir, dirLen) != 0) {
+		return FALSE;
+	}
+	return path[dirLen] == '\0' || path[dirLen] == '/' ||
+	       (dirLen > 0 && dir[dirLen - 1] == '/');
+}
+
+int watchRename(struct watcher *watcher, const char *oldPath,
+                const char *newPath)
+{
+	size_t oldLen = strlen(oldPath);
+	size_t newLen = strlen(newPath);
+	for (size_t i = 0; i < watcher->dirsSize; i++) {
+		char *path = watcher->dirs[i].path;
+		if (path == NULL || !watchIsBelow(path, oldPath)) {
+			continue;
+		}
+		size_t restLen = strlen(path + oldLen);
+		char *renamed = malloc(newLen + restLen + 1);
+		if (renamed == NULL) {
+			return EALLOC;
+		}
+		memcpy(renamed, newPath, newLen);
+		memcpy(renamed + newLen, path + oldLen, restLen + 1);
+		free(path);
+		watcher->dirs[i].path = renamed;
+	}
+	return ENOERR;
+}
+
+void watchRemoveTree(struct watcher *watcher, const char *path)
+{
+	/* 'path' can be the path of one of the directories. */
+	char *removed = strdup(path);
+	for (size_t i = 0; i < watcher->dirsSize && removed != NULL; i++) {
+		if (watcher->dirs[i].path != NULL &&
+		        watchIsBelow(watcher->dirs[i].path, removed)) {
+			/* Its IN_IGNORED finds the slot already free. */
+			inotify_rm_watch(watcher->fd, (int)i);
+			free(watcher->dirs[i].path);
+			watcher->dirs[i].path = NULL;
+		}
+	}
+	free(removed);
+}
+
+size_t watchFind(const struct watcher *watcher, int wd, uint64_t hash,
+                 const char *name)
+{
+	size_t mask = watcher->pendingCapacity * 2 - 1;
+	size_t slot = (size_t)(hash + (uint64_t)wd * WATCH_WD_MIX) & mask;
+	while (watcher->slots[slot] != 0) {
+		const struct watchPending *pending =
+		    &watcher->pending[watcher->slots[slot] - 1];
+		if (pending->wd == wd && pending->hash == hash &&
+		        strcmp(pending->name, name) == 0) {
+			break;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+void watchIndex(struct watcher *watcher)
+{
+	memset(watcher->slots, 0,
+	       watcher->pendingCapacity * 2 * sizeof(size_t));
+	for (size_t i = 0; i < watcher->pendingSize; i++) {
+		const struct watchPending *pending = &watcher->pending[i];
+		watcher->slots[watchFind(watcher, pending->wd, pending->hash,
+		                         pending->name)] = i + 1;
+	}
+}
+
+int watchQueue(struct watcher *watcher, int wd, const char *name, int isDir,
+               long now)
+{
+	uint64_t hash = pathHash(name, strlen(name));
+	if (watcher->pendingCapacity > 0) {
+		size_t slot = watchFind(watcher, wd, hash, name);
+		if (watcher->slots[slot] != 0) {
+			struct watchPending *pending =
+			    &watcher->pending[watcher->slots[slot] - 1];
+			pending->isDir = isDir;
+			pending->lastMs = now;
+			return ENOERR;
+		}
+	}
+	if (watcher->pendingSize == watcher->pendingCapacity) {
+		size_t newCapacity = watcher->pendingCapacity > 0 ?
+		                     watcher->pendingCapacity * 2 :
+		                     WATCH_PENDING_INITIAL_CAPACITY;
+		struct watchPending *newPending = realloc(watcher->pending,
+		                                          sizeof(struct watchPending) *
+		                                          newCapacity);
+		if (newPending == NULL) {
+			return EALLOC;
+		}
+		watcher->pending = newPending;
+		size_t *newSlots = calloc(newCapacity * 2, sizeof(size_t));
+		if (newSlots == NULL) {
+			return EALLOC;
+		}
+		free(watcher->slots);
+		watcher->slots = newSlots;
+		watcher->pendingCapacity = newCapacity;
+		watchIndex(watcher);
+	}
+	char *newName = strdup(name);
+	if (newName == NULL) {
+		return EALLOC;
+	}
+	struct watchPending *pending = &watcher->pending[watcher->pendingSize++];
+	pending->wd = wd;
+	pending->hash = hash;
+	pending->isDir = isDir;
+	pending->firstMs = now;
+	pending->lastMs = now;
+	pending->name = newName;
+	watcher->slots[watchFind(watcher, wd, hash, newName)] =
+	    watcher->pendingSize;
+	return ENOERR;
+}
+
+int watchEvents(struct watcher *watcher, const char *buf, size_t size,
+                tWatchFn fn, void *data)
+{
+	long now = watchNow();
+	const char *end = buf + size;
+	while (buf < end) {
+		const struct inotify_event *event = (const void *)buf;
+		buf += sizeof(struct inotify_event) + event->len;
+		if (event->mask & IN_Q_OVERFLOW) {
+			/* Events lost, everything must be checked again. */
+			int watchErrno = watchReport(watcher, now, TRUE, fn, data);
+			if (watchErrno) {
+				return watchErrno;
+			}
+			for (size_t i = 0; i < watcher->rootsSize; i++) {
+				fn(watcher->roots[i], TRUE, data);
+			}
+			continue;
+		}
+		if (event->wd < 0 || (size_t)event->wd >= watcher->dirsSize ||
+		        watcher->dirs[event->wd].path == NULL) {
+			continue;
+		}
+		struct watchDir *dir = &watcher->dirs[event->wd];
+		if (event->mask & IN_IGNORED) {
+			/* The directory was removed or unmounted. */
+			free(dir->path);
+			dir->path = NULL;
+			continue;
+		}
+		if (event->mask & IN_MOVE_SELF) {
+			/* A watched directory moved by itself, like a root given to
+			   watchAdd, the ones moved from another watched directory were
+			   already removed by its IN_MOVED_FROM. */
+			watchRemoveTree(watcher, dir->path);
+			continue;
+		}
+		if (event->len == 0) {
+			continue;
+		}
+		int isDir = (event->mask & IN_ISDIR) != 0;
+		if (event->mask & IN_MOVED_FROM) {
+			/* Its subtree is watched again if it's moved to a watched
+			   directory, from the IN_MOVED_TO below. */
+			if (isDir) {
+				if (watchJoin(watcher, dir->path, event->name)) {
+					return EALLOC;
+				}
+				watchRemoveTree(watcher, watcher->path.buffer);
+			}
+			continue;
+		}
+		if (isDir && watcher->recursive &&
+		        (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+			/* Watched before it's reported, so the entries created in it
+			   meanwhile are either found by its report or notified. */
+			int watchErrno = watchJoin(watcher, dir->path, event->name);
+			if (!watchErrno) {
+				watchErrno = watchAddTree(watcher);
+			}
+			if (watchErrno == EALLOC) {
+				return EALLOC;
+			}
+		}
+		int watchErrno = watchQueue(watcher, event->wd, event->name, isDir,
+		                            now);
+		if (watchErrno) {
+			return watchErrno;
+		}
+	}
+	return ENOERR;
+}
+
+int watchReport(struct watcher *watcher, long now, int all, tWatchFn fn,
+                void *data)
+{
+	int watchErrno = ENOERR;
+	size_t kept = 0;
+	for (size_t i = 0; i < watcher->pendingSize; i++) {
+		struct watchPending *pending = &watcher->pending[i];
+		if (watchErrno || (!all && now - pending->lastMs < WATCH_QUIET_MS &&
+		                   now - pending->firstMs < WATCH_DELAY_MAX_MS)) {
+			watcher->pending[kept++] = *pending;
+			continue;
+		}
+		const char *dir = watcher->dirs[pending->wd].path;
+		if (dir != NULL) {
+			watchErrno = watchJoin(watcher, dir, pending->name);
+			if (watchErrno) {
+				watcher->pending[kept++] = *pending;
+				continue;
+			}
+			fn(watcher->path.buffer, pending->isDir, data);
+		}
+		free(pending->name);
+	}
+	if (kept < watcher->pendingSize) {
+		watcher->pendingSize = kept;
+		watchIndex(watcher);
+	}
+	return watchErrno;
+}
+
+int watchTimeout(const struct watcher *watcher, long now)
+{
+	if (watcher->pendingSize == 0) {
+		return -1;
+	}
+	long deadline = LONG_MAX;
+	for (size_t i = 0; i < watcher->pendingSize; i++) {
+		const struct watchPending *pending = &watcher->pending[i];
+		long quiet = pending->lastMs + WATCH_QUIET_MS;
+		long delayMax = pending->firstMs + WATCH_DELAY_MAX_MS;
+		long entryDeadline = quiet < delayMax ? quiet : delayMax;
+		if (entryDeadline < deadline) {
+			deadline = entryDeadline;
+		}
+	}
+	return deadline > now ? (int)(deadline - now) : 0;
+}
+
+
+const char *watchGetError(int err)
+{
+	switch (err) {
+	case ENOERR:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "No error occurred");
+		break;
+	case EALLOC:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error allocating memory: %s",
+		         strerror(errno));
+		break;
+	case EINOTIFY:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error creating the inotify instance: %s",
+		         strerror(errno));
+		break;
+	case EADD:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error watching the directory: %s",
+		         strerror(errno));
+		break;
+	case EREAD:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error reading the events: %s",
+		         strerror(errno));
+		break;
+	default:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Unknown error");
+	}
+	return errmsg;
+}
+
+int watchCreate(struct watcher **watcher, int recursive)
+{
+	assert(watcher != NULL);
+	*watcher = calloc(1, sizeof(struct watcher));
+	if (*watcher == NULL) {
+		return EALLOC;
+	}
+	(*watcher)->recursive = recursive;
+	(*watcher)->fd = inotify_init1(IN_CLOEXEC);
+	if ((*watcher)->fd == -1) {
+		free(*watcher);
+		return EINOTIFY;
+	}
+	return ENOERR;
+}
+
+void watchDestroy(struct watcher *watcher)
+{
+	if (watcher == NULL) {
+		return;
+	}
+	close(watcher->fd);
+	for (size_t i = 0; i < watcher->dirsSize; i++) {
+		free(watcher->dirs[i].path);
+	}
+	for (size_t i = 0; i < watcher->rootsSize; i++) {
+		free(watcher->roots[i]);
+	}
+	for (size_t i = 0; i < watcher->pendingSize; i++) {
+		free(watcher->pending[i].name);
+	}
+	free(watcher->dirs);
+	free(watcher->roots);
+	free(watcher->pending);
+	free(watcher->slots);
+	pathFree(&watcher->path);
+	free(watcher);
+}
+
+int watchAdd(struct watcher *watcher, const char *path)
+{
+	assert(watcher != NULL);
+	assert(path != NULL);
+	char **newRoots = realloc(watcher->roots,
+	                          sizeof(char *) * (watcher->rootsSize + 1));
+	if (newRoots == NULL) {
+		return EALLOC;
+	}
+	watcher->roots = newRoots;
+	watcher->roots[watcher->rootsSize] = strdup(path);
+	if (watcher->roots[watcher->rootsSize] == NULL) {
+		return EALLOC;
+	}
+	int watchErrno = pathSet(&watcher->path, path) ? EALLOC :
+	                 watchAddTree(watcher);
+	if (watchErrno) {
+		free(watcher->roots[watcher->rootsSize]);
+		return watchErrno;
+	}
+	watcher->rootsSize++;
+	return ENOERR;
+}
+
+int watchRun(struct watcher *watcher, tWatchFn fn, void *data)
+{
+	assert(watcher != NULL);
+	assert(fn != NULL);
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = watchSignal;
+	sigemptyset(&action.sa_mask);
+	/* No SA_RESTART, so poll returns when the watch must stop. */
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	char *buf = malloc(WATCH_READ_SIZE);
+	if (buf == NULL) {
+		return EALLOC;
+	}
+	int watchErrno = ENOERR;
+	struct pollfd pfd = {watcher->fd, POLLIN, 0};
+	while (!watchStop && !watchErrno) {
+		int ready = poll(&pfd, 1, watchTimeout(watcher, watchNow()));
+		if (ready == -1) {
+			if (errno != EINTR) {
+				watchErrno = EREAD;
+			}
+			continue;
+		}
+		if (ready > 0) {
+			ssize_t readSize = read(watcher->fd, buf, WATCH_READ_SIZE);
+			if (readSize == -1) {
+				if (errno != EINTR) {
+					watchErrno = EREAD;
+				}
+				continue;
+			}
+			watchErrno = watchEvents(watcher, buf, readSize, fn, data);
+		}
+		int reportErrno = watchReport(watcher, watchNow(),
+		                              watcher->pendingSize >= WATCH_PENDING_MAX,
+		                              fn, data);
+		watchErrno = watchErrno ? watchErrno : reportErrno;
+	}
+	free(buf);
+	return watchErrno;
+}
@@ -0,0 +1,71 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WATCH_H__
+#define __WATCH_H__
+
+/**
+ * Notifications of the entries created, moved into or written in a set of
+ * directories, with inotify.
+ *
+ * The events are coalesced: an entry is reported once after it has been
+ * quiet for a few milliseconds, whatever the number of events it got, so a
+ * burst of writes to a file ends up in a single report. Under a continuous
+ * stream of events the pending entries are reported anyway after a bounded
+ * delay.
+ */
+struct watcher;
+
+/**
+ * Function called by watchRun for every entry: 'path' is the path of the
+ * entry, built from the watched directory, and 'isDir' is !0 if it's a
+ * directory.
+ * If the kernel queue overflows and some events are lost, it's called for
+ * every directory given to watchAdd, so they can be processed again.
+ */
+typedef void (*tWatchFn)(const char *path, int isDir, void *data);
+
+/**
+ * Returns a descriptive message associated with an error code.
+ */
+const char *watchGetError(int err);
+/**
+ * Create a watcher without directories. If 'recursive' is !0 the
+ * subdirectories of the watched directories, including the ones created
+ * later, are watched too.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int watchCreate(struct watcher **watcher, int recursive);
+/**
+ * Free a watcher.
+ */
+void watchDestroy(struct watcher *watcher);
+/**
+ * Watch the directory 'path'.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int watchAdd(struct watcher *watcher, const char *path);
+/**
+ * Report the entries with events to 'fn' until SIGINT or SIGTERM is
+ * received.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int watchRun(struct watcher *watcher, tWatchFn fn, void *data);
+
+#endif /* __WATCH_H__ */
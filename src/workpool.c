@@ -0,0 +1,325 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "workpool.h"
+#include "bool.h"
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define ERRMSG_MAX 1025
+#define DEQUE_INITIAL_SIZE 64
+
+enum {
+    ENOERR = 0,
+    EALLOC,
+    ETHREAD
+};
+
+struct workDeque {
+	pthread_mutex_t lock;
+	void **tasks;
+	size_t capacity;
+	/* 'top' and 'bottom' grow without bound, the position in 'tasks' is
+	   taken modulo 'capacity'. */
+	size_t top;
+	size_t bottom;
+};
+
+struct workPool {
+	tWorkPoolFn fn;
+	void *userData;
+	size_t workersSize;
+	struct workDeque *deques;
+	pthread_t *threads;
+	size_t nextDeque;
+	/* Protects 'pending', 'queued' and 'nextDeque'. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Tasks submitted and not finished yet. */
+	size_t pending;
+	/* Tasks submitted and not taken by any worker yet. */
+	size_t queued;
+};
+
+struct workerArgs {
+	struct workPool *pool;
+	size_t index;
+};
+
+static _Thread_local char errmsg[ERRMSG_MAX] = {0};
+/* Index of the worker running in this thread, or -1 outside the pool. */
+static _Thread_local long currentWorker = -1;
+
+/**
+ * Push a task at the bottom of a deque.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int workDequePush(struct workDeque *deque, void *task);
+/**
+ * Pop a task from the bottom (owner side) or the top (thief side) of a deque.
+ * Returns the task or NULL if the deque is empty.
+ */
+void *workDequePop(struct workDeque *deque, int steal);
+/**
+ * Take the next task for the worker 'index', stealing it from other workers
+ * if its own deque is empty.
+ * Returns the task or NULL if there isn't any queued task.
+ */
+void *workPoolTake(struct workPool *pool, size_t index);
+/**
+ * Main loop of the worker threads.
+ */
+void *workPoolWorker(void *arg);
+
+
+int workDequePush(struct workDeque *deque, void *task)
+{
+	pthread_mutex_lock(&deque->lock);
+	if (deque->bottom - deque->top == deque->capacity) {
+		size_t newCapacity = deque->capacity * 2;
+		void **newTasks = malloc(sizeof(void *) * newCapacity);
+		if (newTasks == NULL) {
+			pthread_mutex_unlock(&deque->lock);
+			return EALLOC;
+		}
+		for (size_t i = deque->top; i < deque->bottom; i++) {
+			newTasks[i % newCapacity] = deque->tasks[i % deque->capacity];
+		}
+		free(deque->tasks);
+		deque->tasks = newTasks;
+		deque->capacity = newCapacity;
+	}
+	deque->tasks[deque->bottom % deque->capacity] = task;
+	deque->bottom++;
+	pthread_mutex_unlock(&deque->lock);
+	return ENOERR;
+}
+
+void *workDequePop(struct workDeque *deque, int steal)
+{
+	void *task = NULL;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->bottom != deque->top) {
+		if (steal) {
+			task = deque->tasks[deque->top % deque->capacity];
+			deque->top++;
+		} else {
+			deque->bottom--;
+			task = deque->tasks[deque->bottom % deque->capacity];
+		}
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return task;
+}
+
+void *workPoolTake(struct workPool *pool, size_t index)
+{
+	/* LIFO on the own deque keeps the traversal depth first and the cache
+	   warm, FIFO when stealing takes the oldest (usually biggest) subtrees. */
+	void *task = workDequePop(&pool->deques[index], FALSE);
+	for (size_t i = 1; task == NULL && i < pool->workersSize; i++) {
+		task = workDequePop(&pool->deques[(index + i) % pool->workersSize],
+		                    TRUE);
+	}
+	if (task != NULL) {
+		pthread_mutex_lock(&pool->lock);
+		pool->queued--;
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return task;
+}
+
+void *workPoolWorker(void *arg)
+{
+	struct workerArgs *wargs = arg;
+	struct workPool *pool = wargs->pool;
+	size_t index = wargs->index;
+	currentWorker = (long)index;
+	for (;;) {
+		void *task = workPoolTake(pool, index);
+		if (task != NULL) {
+			pool->fn(task, pool->userData);
+			pthread_mutex_lock(&pool->lock);
+			if (--pool->pending == 0) {
+				pthread_cond_broadcast(&pool->cond);
+			}
+			pthread_mutex_unlock(&pool->lock);
+			continue;
+		}
+		pthread_mutex_lock(&pool->lock);
+		while (pool->queued == 0 && pool->pending > 0) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		}
+		int done = pool->pending == 0;
+		pthread_mutex_unlock(&pool->lock);
+		if (done) {
+			break;
+		}
+	}
+	currentWorker = -1;
+	return NULL;
+}
+
+
+const char *workPoolGetError(int err)
+{
+	switch (err) {
+	case ENOERR:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "No error occurred");
+		break;
+	case EALLOC:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error allocating memory: %s",
+		         strerror(errno));
+		break;
+	case ETHREAD:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Error creating worker thread: %s",
+		         strerror(errno));
+		break;
+	default:
+		snprintf(errmsg, ERRMSG_MAX,
+		         "Unknown error");
+	}
+	return errmsg;
+}
+
+int workPoolCreate(struct workPool **pool, size_t workers,
+                   tWorkPoolFn fn, void *userData)
+{
+	assert(pool != NULL);
+	assert(workers > 0);
+	assert(fn != NULL);
+	struct workPool *newPool = calloc(1, sizeof(struct workPool));
+	if (newPool == NULL) {
+		return EALLOC;
+	}
+	newPool->deques = calloc(workers, sizeof(struct workDeque));
+	newPool->threads = calloc(workers, sizeof(pthread_t));
+	if (newPool->deques == NULL || newPool->threads == NULL) {
+		free(newPool->deques);
+		free(newPool->threads);
+		free(newPool);
+		return EALLOC;
+	}
+	pthread_mutex_init(&newPool->lock, NULL);
+	pthread_cond_init(&newPool->cond, NULL);
+	for (size_t i = 0; i < workers; i++) {
+		struct workDeque *deque = &newPool->deques[i];
+		deque->tasks = malloc(sizeof(void *) * DEQUE_INITIAL_SIZE);
+		if (deque->tasks == NULL) {
+			newPool->workersSize = i;
+			workPoolDestroy(newPool);
+			return EALLOC;
+		}
+		deque->capacity = DEQUE_INITIAL_SIZE;
+		pthread_mutex_init(&deque->lock, NULL);
+	}
+	newPool->workersSize = workers;
+	newPool->fn = fn;
+	newPool->userData = userData;
+	*pool = newPool;
+	return ENOERR;
+}
+
+int workPoolSubmit(struct workPool *pool, void *task)
+{
+	assert(pool != NULL);
+	assert(task != NULL);
+	size_t index = 0;
+	if (currentWorker >= 0) {
+		index = (size_t)currentWorker;
+	} else {
+		pthread_mutex_lock(&pool->lock);
+		index = pool->nextDeque++ % pool->workersSize;
+		pthread_mutex_unlock(&pool->lock);
+	}
+	/* Count the task before it is visible in the deque, otherwise a worker
+	   could finish it and see 'pending' drop to 0 too early. */
+	pthread_mutex_lock(&pool->lock);
+	pool->pending++;
+	pool->queued++;
+	pthread_mutex_unlock(&pool->lock);
+	int poolErrno = workDequePush(&pool->deques[index], task);
+	pthread_mutex_lock(&pool->lock);
+	if (poolErrno) {
+		pool->pending--;
+		pool->queued--;
+		pthread_cond_broadcast(&pool->cond);
+	} else {
+		pthread_cond_signal(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return poolErrno;
+}
+
+int workPoolRun(struct workPool *pool)
+{
+	assert(pool != NULL);
+	struct workerArgs *wargs = calloc(pool->workersSize,
+	                                  sizeof(struct workerArgs));
+	if (wargs == NULL) {
+		return EALLOC;
+	}
+	size_t started = 0;
+	int poolErrno = ENOERR;
+	for (; started < pool->workersSize; started++) {
+		wargs[started].pool = pool;
+		wargs[started].index = started;
+		int threadRet = pthread_create(&pool->threads[started], NULL,
+		                               workPoolWorker, &wargs[started]);
+		if (threadRet != 0) {
+			errno = threadRet;
+			poolErrno = ETHREAD;
+			break;
+		}
+	}
+	/* If some thread couldn't be created the ones already running will
+	   finish all the work anyway. */
+	if (started == 0 && poolErrno) {
+		free(wargs);
+		return poolErrno;
+	}
+	for (size_t i = 0; i < started; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	free(wargs);
+	return ENOERR;
+}
+
+void workPoolDestroy(struct workPool *pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < pool->workersSize; i++) {
+		pthread_mutex_destroy(&pool->deques[i].lock);
+		free(pool->deques[i].tasks);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+	free(pool->deques);
+	free(pool->threads);
+	free(pool);
+}
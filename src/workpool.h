@@ -0,0 +1,69 @@
+/**
+ * Copyright 2013 David Caro Martinez
+ *
+ * This file is part of fatattr.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WORKPOOL_H__
+#define __WORKPOOL_H__
+
+#include <stdlib.h>
+
+/**
+ * Work stealing thread pool.
+ * Every worker owns a deque of tasks: it pushes and pops its own tasks from
+ * the bottom and, when it runs out of work, steals from the top of the other
+ * workers' deques.
+ */
+struct workPool;
+
+/**
+ * Function called by the workers for each task.
+ * 'task' is the pointer passed to workPoolSubmit, 'userData' the one passed
+ * to workPoolCreate.
+ */
+typedef void (*tWorkPoolFn)(void *task, void *userData);
+
+/**
+ * Returns a descriptive message associated with an error code.
+ */
+const char *workPoolGetError(int err);
+/**
+ * Create a pool with 'workers' threads that will call 'fn' for each task.
+ * The threads aren't started until workPoolRun is called.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int workPoolCreate(struct workPool **pool, size_t workers,
+                   tWorkPoolFn fn, void *userData);
+/**
+ * Queue a task in the pool.
+ * When called from a worker the task goes to the worker's own deque,
+ * otherwise the tasks are spread among the workers.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int workPoolSubmit(struct workPool *pool, void *task);
+/**
+ * Start the workers and wait until all the tasks, including the ones
+ * submitted while running, are done.
+ * Returns 0 on success, !0 if an error happens.
+ */
+int workPoolRun(struct workPool *pool);
+/**
+ * Free a pool and all its resources.
+ */
+void workPoolDestroy(struct workPool *pool);
+
+#endif /* __WORKPOOL_H__ */